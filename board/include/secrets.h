@@ -1,5 +1,9 @@
 #define LONG_LIVED_ACCESS_TOKEN ""
-// must be of the form "http://<ha.local>" with no leading slash
+// must be of the form "http://<ha.local>" or "https://<ha.local>" with no leading slash
 #define HA_URL ""
 #define NETWORK_SSID ""
-#define NETWORK_PASSWORD ""
\ No newline at end of file
+#define NETWORK_PASSWORD ""
+#define MQTT_BROKER_URI ""
+#define MQTT_USERNAME ""
+#define MQTT_PASSWORD ""
+#define HA_CA_CERT ""
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <type_traits>
+
+namespace BatteryMonitor
+{
+
+// Bump allocator over a fixed buffer, for scratch memory that only lives for part of a wake. Allocations are released
+// together, back to a mark or all at once, so the buffer cannot fragment. Not thread safe: one task at a time.
+class Arena
+{
+      public:
+        explicit Arena(std::span<std::byte> buffer) : buffer{buffer} {}
+        Arena(Arena const &) = delete;
+        Arena &operator=(Arena const &) = delete;
+
+        // count default-initialized Ts, or an empty span if they do not fit.
+        template <typename T> std::span<T> allocate(std::size_t const count)
+        {
+                static_assert(std::is_trivially_destructible_v<T>, "Released without running destructors");
+                auto const start = (used + alignof(T) - 1) / alignof(T) * alignof(T);
+                if (start > buffer.size() || count > (buffer.size() - start) / sizeof(T)) {
+                        return {};
+                }
+                used = start + count * sizeof(T);
+                high_water = std::max(high_water, used);
+                auto *const first = reinterpret_cast<T *>(buffer.data() + start);
+                std::uninitialized_default_construct_n(first, count);
+                return {first, count};
+        }
+
+        std::size_t mark() const { return used; }
+        // Release everything allocated since mark.
+        void release(std::size_t const mark) { used = std::min(used, mark); }
+        void reset() { used = 0; }
+
+        std::size_t capacity() const { return buffer.size(); }
+        // Most bytes in use at once since the arena was created.
+        std::size_t peak() const { return high_water; }
+
+      private:
+        std::span<std::byte> buffer;
+        std::size_t used{0};
+        std::size_t high_water{0};
+};
+
+// Releases what was allocated from an arena in this scope when it ends.
+class ArenaScope
+{
+      public:
+        explicit ArenaScope(Arena &arena) : arena{arena}, mark{arena.mark()} {}
+        ~ArenaScope() { arena.release(mark); }
+        ArenaScope(ArenaScope const &) = delete;
+        ArenaScope &operator=(ArenaScope const &) = delete;
+
+      private:
+        Arena &arena;
+        std::size_t mark;
+};
+
+} // namespace BatteryMonitor
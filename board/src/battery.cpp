@@ -1,35 +1,44 @@
 extern "C" {
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
+#include "esp_adc/adc_continuous.h"
 #include "esp_adc/adc_oneshot.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "nvs.h"
 }
 
 #include "battery.hpp"
-#include "esp_ha_lib.hpp"
+#include "calibration.hpp"
+#include "deferred_log.hpp"
+#include "filter.hpp"
+#include "nvs_control.hpp"
+#include "sensors.hpp"
+#include <algorithm>
+#include <array>
 #include <cstdlib>
 #include <cstring>
-#include <memory>
-#include <string>
 
 namespace BatteryMonitor
 {
 
-#define BATT_VOLTAGE_ADC_CHANNEL ADC_CHANNEL_3
-#define BATT_VOLTAGE_ADC_ATTEN ADC_ATTEN_DB_11
-#define BATT_VOLTAGE_ADC_BITWIDTH ADC_BITWIDTH_12
+#define SENSOR_ADC_ATTEN ADC_ATTEN_DB_11
+#define SENSOR_ADC_BITWIDTH ADC_BITWIDTH_12
 #define ADC_UNIT ADC_UNIT_1
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define CAPTURE_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define CAPTURE_GET_CHANNEL(result) ((result)->type1.channel)
+#define CAPTURE_GET_DATA(result) ((result)->type1.data)
+#else
+#define CAPTURE_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define CAPTURE_GET_CHANNEL(result) ((result)->type2.channel)
+#define CAPTURE_GET_DATA(result) ((result)->type2.data)
+#endif
 constexpr int const ADC_VREF{1100};
-
-// Calibrate the battery voltage measurement
-// based on the resistor voltage divider
-constexpr float const VDIV_RATIO{5.02f};
+constexpr auto BATTERY_ADC_CHANNEL{static_cast<adc_channel_t>(Sensors::REGISTRY[Sensors::BATTERY].adc_channel)};
 
 static constexpr const char *TAG{"Battery"};
 
-adc_oneshot_unit_handle_t batt_voltage_adc_handle;
-adc_cali_handle_t batt_voltage_adc_cali_handle{nullptr};
-
 static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_atten_t atten, adc_bitwidth_t bitwidth,
                                  adc_cali_handle_t *out_handle)
 {
@@ -60,7 +69,7 @@ static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_att
 
         *out_handle = handle;
         if (ret == ESP_OK) {
-                ESP_LOGI(TAG, "Calibration Success");
+                DLOGI(TAG, "Calibration Success");
         } else if (ret == ESP_ERR_NOT_SUPPORTED || !calibrated) {
                 ESP_LOGW(TAG, "eFuse not burnt, skip software calibration");
         } else {
@@ -70,24 +79,6 @@ static bool adc_calibration_init(adc_unit_t unit, adc_channel_t channel, adc_att
         return calibrated;
 }
 
-// Configures the battery ADC
-static void config_batt_adc()
-{
-        ESP_LOGI(TAG, "Configuring ADC characteristics");
-
-        // ADC1 Init
-        adc_oneshot_unit_init_cfg_t init_config1;
-        init_config1.unit_id = ADC_UNIT;
-        init_config1.ulp_mode = ADC_ULP_MODE_DISABLE;
-        init_config1.clk_src = static_cast<adc_oneshot_clk_src_t>(ADC_DIGI_CLK_SRC_DEFAULT);
-        ESP_ERROR_CHECK_WITHOUT_ABORT(adc_oneshot_new_unit(&init_config1, &batt_voltage_adc_handle));
-
-        // ADC1 Config
-        adc_oneshot_chan_cfg_t const config{BATT_VOLTAGE_ADC_ATTEN, BATT_VOLTAGE_ADC_BITWIDTH};
-        ESP_ERROR_CHECK_WITHOUT_ABORT(
-            adc_oneshot_config_channel(batt_voltage_adc_handle, BATT_VOLTAGE_ADC_CHANNEL, &config));
-}
-
 // Deinitialize calibration of an ADC handle
 static void adc_calibration_deinit(adc_cali_handle_t handle)
 {
@@ -101,46 +92,349 @@ static void adc_calibration_deinit(adc_cali_handle_t handle)
 #endif
 }
 
-// Read ADC voltage from battery and return battery
-// voltage calculated from the ADC and voltage divider
-float get_battery_voltage()
+namespace
 {
-        int raw_adc_read{};
-        int voltage{};
+constexpr auto NVS_NAMESPACE{"calibration"};
+constexpr auto NVS_KEY{"adc"};
+// Bump when StoredCalibration or the way it is built changes.
+constexpr uint32_t CALIBRATION_FORMAT_VERSION{1};
 
-        config_batt_adc();
+// ADC table and battery divider of this unit.
+struct StoredCalibration {
+        uint32_t key;
+        Calibration::AdcTable table;
+        Sensors::Divider divider;
+};
 
-        // ADC1 Read
-        ESP_ERROR_CHECK(adc_oneshot_read(batt_voltage_adc_handle, BATT_VOLTAGE_ADC_CHANNEL, &raw_adc_read));
-        ESP_LOGI(TAG, "ADC%d Channel[%d] Raw Data: %d", ADC_UNIT + 1, BATT_VOLTAGE_ADC_CHANNEL, raw_adc_read);
+// FNV-1a over everything the stored calibration is built from, so that a stale one is rebuilt after an update.
+constexpr uint32_t CALIBRATION_KEY = [] {
+        uint32_t hash{2'166'136'261u};
+        auto const mix = [&hash](int32_t const value) {
+                for (int shift = 0; shift < 32; shift += 8) {
+                        hash = (hash ^ ((static_cast<uint32_t>(value) >> shift) & 0xff)) * 16'777'619u;
+                }
+        };
+        mix(CALIBRATION_FORMAT_VERSION);
+        mix(SENSOR_ADC_ATTEN);
+        mix(SENSOR_ADC_BITWIDTH);
+        mix(Calibration::AdcTable::STEP);
+        if (Sensors::BATTERY_FIELD_CALIBRATION) {
+                for (auto const &point : *Sensors::BATTERY_FIELD_CALIBRATION) {
+                        mix(point.reported_millivolts);
+                        mix(point.actual_millivolts);
+                }
+        }
+        // Zero means no calibration.
+        return hash == 0 ? 1 : hash;
+}();
 
-        // ADC1 Calibration
-        bool const do_calibration_batt_voltage{adc_calibration_init(ADC_UNIT, BATT_VOLTAGE_ADC_CHANNEL,
-                                                                    BATT_VOLTAGE_ADC_ATTEN, BATT_VOLTAGE_ADC_BITWIDTH,
-                                                                    &batt_voltage_adc_cali_handle)};
+// Kept in RTC slow memory so that only the first wake after power-on touches NVS. Zero-initialized on power-on.
+RTC_DATA_ATTR StoredCalibration s_calibration;
+
+bool load_calibration()
+{
+        nvs_handle_t handle{};
+        if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK) {
+                return false;
+        }
+        StoredCalibration stored{};
+        std::size_t size{sizeof(stored)};
+        auto const ret = nvs_get_blob(handle, NVS_KEY, &stored, &size);
+        nvs_close(handle);
+        if (ret != ESP_OK || size != sizeof(stored) || stored.key != CALIBRATION_KEY) {
+                return false;
+        }
+        s_calibration = stored;
+        return true;
+}
+
+void save_calibration()
+{
+        nvs_handle_t handle{};
+        auto const ret_open = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(ret_open);
+        if (ret_open != ESP_OK) {
+                return;
+        }
+        ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_set_blob(handle, NVS_KEY, &s_calibration, sizeof(s_calibration)));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(nvs_commit(handle));
+        nvs_close(handle);
+}
 
-        if (do_calibration_batt_voltage) {
-                ESP_ERROR_CHECK(adc_cali_raw_to_voltage(batt_voltage_adc_cali_handle, raw_adc_read, &voltage));
-                ESP_LOGI(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", ADC_UNIT + 1, BATT_VOLTAGE_ADC_CHANNEL, voltage);
+// Sample the driver's calibration scheme into a table and fit the field calibration, if any.
+bool build_calibration()
+{
+        adc_cali_handle_t cali_handle{nullptr};
+        if (!adc_calibration_init(ADC_UNIT, BATTERY_ADC_CHANNEL, SENSOR_ADC_ATTEN, SENSOR_ADC_BITWIDTH, &cali_handle)) {
+                return false;
+        }
+        auto const table = Calibration::build_table([cali_handle](int const raw) -> std::optional<int> {
+                int voltage{};
+                if (adc_cali_raw_to_voltage(cali_handle, raw, &voltage) != ESP_OK) {
+                        return std::nullopt;
+                }
+                return voltage;
+        });
+        adc_calibration_deinit(cali_handle);
+        if (!table) {
+                ESP_LOGE(TAG, "Calibration table build failed");
+                return false;
+        }
+
+        auto divider = Sensors::NOMINAL_BATTERY_DIVIDER;
+        if (auto const &points = Sensors::BATTERY_FIELD_CALIBRATION) {
+                if (auto const fitted = Sensors::field_calibrated_divider((*points)[0], (*points)[1])) {
+                        divider = *fitted;
+                } else {
+                        ESP_LOGW(TAG, "Field calibration points are too close together. Using the nominal divider.");
+                }
+        }
+        s_calibration = StoredCalibration{CALIBRATION_KEY, *table, divider};
+        return true;
+}
+
+// Make sure this unit's calibration is in RTC memory: from an earlier wake, from NVS, or built and stored now.
+bool ensure_calibration()
+{
+        if (s_calibration.key == CALIBRATION_KEY) {
+                return true;
+        }
+        auto const is_nvs_ready = Nvs::init_nvs();
+        if (is_nvs_ready && load_calibration()) {
+                DLOGI(TAG, "Loaded ADC calibration from NVS");
+                return true;
+        }
+        if (!build_calibration()) {
+                return false;
+        }
+        DLOGI(TAG, "Built ADC calibration table. Divider gain %ld/65536, offset %ld mV",
+              static_cast<long>(s_calibration.divider.gain_q16),
+              static_cast<long>(s_calibration.divider.offset_millivolts));
+        if (is_nvs_ready) {
+                save_calibration();
+        }
+        return true;
+}
+} // namespace
+
+// Configures the ADC unit. The calibration is only set up on the first wake after power-on.
+AdcSession::AdcSession()
+{
+        DLOGI(TAG, "Configuring ADC characteristics");
+
+        // ADC1 Init
+        adc_oneshot_unit_init_cfg_t init_config1;
+        init_config1.unit_id = ADC_UNIT;
+        init_config1.ulp_mode = ADC_ULP_MODE_DISABLE;
+        init_config1.clk_src = static_cast<adc_oneshot_clk_src_t>(ADC_DIGI_CLK_SRC_DEFAULT);
+        auto const ret_new_unit = adc_oneshot_new_unit(&init_config1, &unit_handle);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(ret_new_unit);
+        if (ret_new_unit != ESP_OK) {
+                unit_handle = nullptr;
+                return;
+        }
+
+        // ADC1 Calibration
+        is_calibration_ready = ensure_calibration();
+        if (is_calibration_ready) {
+                Sensors::set_battery_divider(s_calibration.divider);
         }
+}
 
+AdcSession::~AdcSession()
+{
         // ADC1 Teardown
-        ESP_ERROR_CHECK(adc_oneshot_del_unit(batt_voltage_adc_handle));
-        if (do_calibration_batt_voltage) {
-                adc_calibration_deinit(batt_voltage_adc_cali_handle);
+        if (unit_handle != nullptr) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(adc_oneshot_del_unit(unit_handle));
         }
+}
 
-        return (voltage / 1000.f) * VDIV_RATIO;
+bool AdcSession::configure_channel(uint8_t const channel)
+{
+        if ((configured_channels & (1u << channel)) != 0) {
+                return true;
+        }
+        adc_oneshot_chan_cfg_t const config{SENSOR_ADC_ATTEN, SENSOR_ADC_BITWIDTH};
+        auto const ret = adc_oneshot_config_channel(unit_handle, static_cast<adc_channel_t>(channel), &config);
+        ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+        if (ret != ESP_OK) {
+                return false;
+        }
+        configured_channels |= 1u << channel;
+        return true;
 }
 
-std::unique_ptr<HAEntity> create_battery_entity()
+bool AdcSession::read_raw_filtered(std::span<uint8_t const> const channels, std::span<int> const raw)
 {
-        auto entity = std::make_unique<HAEntity>();
-        entity->state = std::to_string(get_battery_voltage());
-        entity->entity_id = "sensor.car_battery";
-        entity->add_attribute("friendly_name", "Car Battery Voltage");
-        entity->add_attribute("unit_of_measurement", "Volts");
-        return entity;
+        if (!is_ready() || channels.size() > MAX_CHANNELS || raw.size() < channels.size()) {
+                return false;
+        }
+        for (auto const channel : channels) {
+                if (!configure_channel(channel)) {
+                        return false;
+                }
+        }
+
+        for (std::size_t sample = 0; sample < SAMPLE_COUNT; ++sample) {
+                for (std::size_t i = 0; i < channels.size(); ++i) {
+                        auto const ret =
+                            adc_oneshot_read(unit_handle, static_cast<adc_channel_t>(channels[i]), &samples[i][sample]);
+                        if (ret != ESP_OK) {
+                                ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+                                return false;
+                        }
+                }
+        }
+
+        for (std::size_t i = 0; i < channels.size(); ++i) {
+                raw[i] = filtered[i] = Filter::trimmed_mean(samples[i], TRIM_COUNT);
+                DLOGI(TAG, "ADC%d Channel[%d] Raw Data: %d (%zu samples)", ADC_UNIT + 1, channels[i], raw[i],
+                      SAMPLE_COUNT);
+        }
+        return true;
+}
+
+std::optional<int> AdcSession::raw_to_millivolts(int const raw) const
+{
+        if (!is_calibrated()) {
+                return std::nullopt;
+        }
+        return Calibration::to_millivolts(s_calibration.table, raw);
+}
+
+std::optional<int> AdcSession::millivolts_to_raw(int const millivolts) const
+{
+        if (!is_calibrated()) {
+                return std::nullopt;
+        }
+        return Calibration::to_raw(s_calibration.table, millivolts);
+}
+
+Calibration::AdcTable const &AdcSession::calibration_table() const { return s_calibration.table; }
+
+namespace
+{
+std::optional<AdcSession> s_adc_session;
+}
+
+AdcSession &get_adc_session()
+{
+        if (!s_adc_session) {
+                s_adc_session.emplace();
+        }
+        return *s_adc_session;
+}
+
+void release_adc_session() { s_adc_session.reset(); }
+
+bool rebuild_adc_calibration() { return build_calibration(); }
+
+std::optional<uint16_t> battery_millivolts_to_raw(uint16_t const battery_millivolts)
+{
+        // The session sets this unit's divider, so create it first.
+        auto &session = get_adc_session();
+        auto const raw = session.millivolts_to_raw(Sensors::battery_pin_millivolts(battery_millivolts));
+        if (!raw) {
+                return std::nullopt;
+        }
+        return static_cast<uint16_t>(*raw);
+}
+
+bool read_pin_millivolts(std::span<uint8_t const> const channels, std::span<int32_t> const pin_millivolts)
+{
+        auto &session = get_adc_session();
+        std::array<int, AdcSession::MAX_CHANNELS> raw{};
+        if (!session.read_raw_filtered(channels, raw)) {
+                return false;
+        }
+        for (std::size_t i = 0; i < channels.size(); ++i) {
+                auto const voltage = session.raw_to_millivolts(raw[i]);
+                if (!voltage) {
+                        return false;
+                }
+                DLOGI(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", ADC_UNIT + 1, channels[i], *voltage);
+                pin_millivolts[i] = *voltage;
+        }
+        return true;
+}
+
+std::size_t capture_pin_millivolts(uint8_t const channel, uint32_t const sample_rate_hz,
+                                   std::span<uint16_t> const pin_millivolts)
+{
+        if (sample_rate_hz == 0 || !get_adc_session().is_calibrated()) {
+                return 0;
+        }
+        // Averaging could not make up for a DMA slower than the requested rate.
+        if (sample_rate_hz > SOC_ADC_SAMPLE_FREQ_THRES_HIGH) {
+                ESP_LOGE(TAG, "Capture rate %lu Hz is above the ADC's %lu Hz",
+                         static_cast<unsigned long>(sample_rate_hz),
+                         static_cast<unsigned long>(SOC_ADC_SAMPLE_FREQ_THRES_HIGH));
+                return 0;
+        }
+        // The oneshot driver and the DMA cannot share ADC1.
+        release_adc_session();
+
+        // Average the DMA samples down to the requested rate. The DMA runs at an exact multiple of it, so the factor
+        // is capped by the fastest rate rather than the DMA rate clamped under it.
+        auto const factor =
+            std::clamp<uint32_t>((SOC_ADC_SAMPLE_FREQ_THRES_LOW + sample_rate_hz - 1) / sample_rate_hz, 1,
+                                 SOC_ADC_SAMPLE_FREQ_THRES_HIGH / sample_rate_hz);
+        auto const dma_rate_hz = sample_rate_hz * factor;
+
+        constexpr uint32_t frame_size{SOC_ADC_DIGI_RESULT_BYTES * 256};
+        adc_continuous_handle_t handle{nullptr};
+        adc_continuous_handle_cfg_t handle_config{};
+        handle_config.max_store_buf_size = frame_size * 4;
+        handle_config.conv_frame_size = frame_size;
+        if (ESP_ERROR_CHECK_WITHOUT_ABORT(adc_continuous_new_handle(&handle_config, &handle)) != ESP_OK) {
+                return 0;
+        }
+        adc_digi_pattern_config_t pattern{};
+        pattern.atten = SENSOR_ADC_ATTEN;
+        pattern.channel = channel;
+        pattern.unit = ADC_UNIT;
+        pattern.bit_width = SENSOR_ADC_BITWIDTH;
+        adc_continuous_config_t config{};
+        config.pattern_num = 1;
+        config.adc_pattern = &pattern;
+        config.sample_freq_hz = dma_rate_hz;
+        config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+        config.format = CAPTURE_OUTPUT_FORMAT;
+
+        std::size_t written{0};
+        if (ESP_ERROR_CHECK_WITHOUT_ABORT(adc_continuous_config(handle, &config)) == ESP_OK &&
+            ESP_ERROR_CHECK_WITHOUT_ABORT(adc_continuous_start(handle)) == ESP_OK) {
+                static std::array<uint8_t, frame_size> frame;
+                uint32_t sum{0};
+                uint32_t count{0};
+                while (written < pin_millivolts.size()) {
+                        uint32_t length{0};
+                        if (adc_continuous_read(handle, frame.data(), frame.size(), &length, 100) != ESP_OK) {
+                                ESP_LOGE(TAG, "Capture read failed after %zu samples", written);
+                                break;
+                        }
+                        for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length && written < pin_millivolts.size();
+                             i += SOC_ADC_DIGI_RESULT_BYTES) {
+                                auto const *result = reinterpret_cast<adc_digi_output_data_t const *>(&frame[i]);
+                                if (CAPTURE_GET_CHANNEL(result) != channel) {
+                                        continue;
+                                }
+                                sum += CAPTURE_GET_DATA(result);
+                                if (++count == factor) {
+                                        auto const raw = static_cast<int>(sum / factor);
+                                        pin_millivolts[written++] =
+                                            static_cast<uint16_t>(Calibration::to_millivolts(s_calibration.table, raw));
+                                        sum = 0;
+                                        count = 0;
+                                }
+                        }
+                }
+                ESP_ERROR_CHECK_WITHOUT_ABORT(adc_continuous_stop(handle));
+        }
+        ESP_ERROR_CHECK_WITHOUT_ABORT(adc_continuous_deinit(handle));
+        DLOGI(TAG, "Captured %zu samples at %lu Hz (DMA at %lu Hz)", written,
+              static_cast<unsigned long>(sample_rate_hz), static_cast<unsigned long>(dma_rate_hz));
+        return written;
 }
 
 } // namespace BatteryMonitor
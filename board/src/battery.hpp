@@ -1,14 +1,86 @@
 #pragma once
 
-#include "esp_ha_lib.hpp"
-#include <memory>
+extern "C" {
+#include "esp_adc/adc_oneshot.h"
+}
+
+#include "calibration.hpp"
+#include "filter.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
 
 namespace BatteryMonitor
 {
 
-using esphalib::state::HAEntity;
+// ADC1 unit, shared by every analog sensor. Set up once on construction and reused for every read. All channels use
+// the same attenuation, so one calibration covers them. It is built from the driver's calibration scheme on the first
+// wake after power-on, stored in NVS and converted with an integer table lookup on every read.
+class AdcSession
+{
+      public:
+        // Raw samples taken per channel per read.
+        static constexpr std::size_t SAMPLE_COUNT{Filter::READ_SAMPLES};
+        // Samples discarded from each end of the sorted burst before averaging.
+        static constexpr std::size_t TRIM_COUNT{Filter::READ_TRIM};
+        // Channels sampled together in one read.
+        static constexpr std::size_t MAX_CHANNELS{4};
+
+        AdcSession();
+        ~AdcSession();
+        AdcSession(AdcSession const &) = delete;
+        AdcSession &operator=(AdcSession const &) = delete;
+
+        bool is_ready() const { return unit_handle != nullptr; }
+        bool is_calibrated() const { return is_calibration_ready; }
+
+        // Take a burst of SAMPLE_COUNT raw samples per channel, interleaved so that every channel is sampled over the
+        // same window, and reduce each with a trimmed mean into raw. Channels are configured on first use.
+        bool read_raw_filtered(std::span<uint8_t const> channels, std::span<int> raw);
+        // Convert a raw code to calibrated millivolts at the ADC pin.
+        std::optional<int> raw_to_millivolts(int raw) const;
+        // Smallest raw code that converts to at least millivolts at the ADC pin.
+        std::optional<int> millivolts_to_raw(int millivolts) const;
+        // This unit's calibration table. Only valid if is_calibrated().
+        Calibration::AdcTable const &calibration_table() const;
+
+        // Burst and filtered code of the channel at index in the last read, for recording a raw trace. The burst is
+        // reordered by the filter.
+        std::span<int const> last_burst(std::size_t const index) const { return samples[index]; }
+        int last_raw(std::size_t const index) const { return filtered[index]; }
+
+      private:
+        bool configure_channel(uint8_t channel);
+
+        adc_oneshot_unit_handle_t unit_handle{nullptr};
+        bool is_calibration_ready{false};
+        uint32_t configured_channels{0};
+        // Kept off the stack of the calling task.
+        std::array<std::array<int, SAMPLE_COUNT>, MAX_CHANNELS> samples{};
+        std::array<int, MAX_CHANNELS> filtered{};
+};
+
+// ADC session for this wake. Created on first use and never torn down since deep sleep clears RAM.
+AdcSession &get_adc_session();
+// Tear down this wake's ADC session so the unit can be handed to the ULP. The next get_adc_session() starts a new one.
+void release_adc_session();
+
+// Build this unit's calibration from the driver's calibration scheme again, as on the first wake after power-on. The
+// result replaces the one in RTC memory but is not stored in NVS. Returns false if the scheme could not be set up.
+bool rebuild_adc_calibration();
+
+// Raw ADC code that the battery voltage divider produces for the given battery voltage.
+std::optional<uint16_t> battery_millivolts_to_raw(uint16_t battery_millivolts);
+
+// Sample the channels through this wake's ADC session and write calibrated millivolts at each pin.
+bool read_pin_millivolts(std::span<uint8_t const> channels, std::span<int32_t> pin_millivolts);
 
-float get_battery_voltage();
-std::unique_ptr<HAEntity> create_battery_entity();
+// Sample one channel with the ADC's continuous DMA mode at sample_rate_hz until pin_millivolts is full. The DMA runs
+// at a multiple of sample_rate_hz within the hardware's range and is averaged down to it. Rates above that range are
+// rejected. Releases this wake's ADC session.
+// Returns the number of calibrated samples written.
+std::size_t capture_pin_millivolts(uint8_t channel, uint32_t sample_rate_hz, std::span<uint16_t> pin_millivolts);
 
 }
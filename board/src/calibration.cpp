@@ -0,0 +1,45 @@
+#include "calibration.hpp"
+
+namespace BatteryMonitor
+{
+
+namespace Calibration
+{
+
+int32_t to_millivolts(AdcTable const &table, int const raw)
+{
+        auto const clamped = std::clamp(raw, 0, AdcTable::MAX_RAW);
+        // MAX_RAW falls in the last, shorter segment.
+        auto const knot = static_cast<std::size_t>(clamped / AdcTable::STEP);
+        auto const low_raw = knot_raw(knot);
+        auto const width = knot_raw(knot + 1) - low_raw;
+        int32_t const low = table.millivolts[knot];
+        int32_t const rise = table.millivolts[knot + 1] - low;
+        // Round to nearest. The curve is monotonic, so rise is not negative.
+        return low + (rise * (clamped - low_raw) + width / 2) / width;
+}
+
+int to_raw(AdcTable const &table, int32_t const millivolts)
+{
+        // Find the segment with a binary search over the knots, then invert its interpolation.
+        auto const upper = std::lower_bound(table.millivolts.begin(), table.millivolts.end(), millivolts);
+        if (upper == table.millivolts.begin()) {
+                return 0;
+        }
+        if (upper == table.millivolts.end()) {
+                return AdcTable::MAX_RAW;
+        }
+        auto const knot = static_cast<std::size_t>(upper - table.millivolts.begin()) - 1;
+        auto const low_raw = knot_raw(knot);
+        auto const width = knot_raw(knot + 1) - low_raw;
+        int32_t const low = table.millivolts[knot];
+        int32_t const rise = table.millivolts[knot + 1] - low;
+        // Smallest offset with rise * offset + width / 2 >= (millivolts - low) * width. rise is positive here, since
+        // the upper knot is at least millivolts and the lower one is below it.
+        auto const target = (millivolts - low) * width - width / 2;
+        return low_raw + (target <= 0 ? 0 : (target + rise - 1) / rise);
+}
+
+} // namespace Calibration
+
+} // namespace BatteryMonitor
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+
+namespace BatteryMonitor
+{
+
+// ADC calibration that is computed once per device and then applied with integer math only.
+namespace Calibration
+{
+
+// Calibrated millivolts at the ADC pin, sampled from the driver's calibration scheme every STEP raw codes. Every read
+// interpolates between two knots, so the scheme is only set up when the table is built.
+struct AdcTable {
+        static constexpr int MAX_RAW{4095};
+        static constexpr int STEP{32};
+        // Knots at 0, STEP, ... and a last one at MAX_RAW.
+        static constexpr std::size_t KNOTS{MAX_RAW / STEP + 2};
+
+        std::array<uint16_t, KNOTS> millivolts;
+};
+
+// Raw code of a table knot.
+constexpr int knot_raw(std::size_t const knot)
+{
+        return std::min(static_cast<int>(knot) * AdcTable::STEP, AdcTable::MAX_RAW);
+}
+
+// Sample convert, which maps a raw code to millivolts or std::nullopt, at every knot. Returns std::nullopt if any
+// conversion fails or is out of range.
+template <typename Convert> std::optional<AdcTable> build_table(Convert &&convert)
+{
+        AdcTable table{};
+        for (std::size_t knot = 0; knot < AdcTable::KNOTS; ++knot) {
+                std::optional<int> const millivolts = convert(knot_raw(knot));
+                if (!millivolts || *millivolts < 0 || *millivolts > UINT16_MAX) {
+                        return std::nullopt;
+                }
+                table.millivolts[knot] = static_cast<uint16_t>(*millivolts);
+        }
+        return table;
+}
+
+// Millivolts for a raw code, interpolated between the surrounding knots. raw is clamped to [0, MAX_RAW].
+int32_t to_millivolts(AdcTable const &table, int raw);
+// Smallest raw code that converts to at least millivolts. MAX_RAW if none does.
+int to_raw(AdcTable const &table, int32_t millivolts);
+
+} // namespace Calibration
+
+} // namespace BatteryMonitor
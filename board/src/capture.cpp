@@ -0,0 +1,122 @@
+#include "capture.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace BatteryMonitor
+{
+
+namespace Capture
+{
+
+uint16_t min_of(std::span<uint16_t const> const samples)
+{
+        uint16_t low{UINT16_MAX};
+        for (auto const sample : samples) {
+                low = std::min(low, sample);
+        }
+        return low;
+}
+
+uint16_t max_of(std::span<uint16_t const> const samples)
+{
+        uint16_t high{0};
+        for (auto const sample : samples) {
+                high = std::max(high, sample);
+        }
+        return high;
+}
+
+uint64_t sum_of(std::span<uint16_t const> const samples)
+{
+        uint64_t sum{0};
+        for (auto const sample : samples) {
+                sum += sample;
+        }
+        return sum;
+}
+
+std::size_t count_below(std::span<uint16_t const> const samples, uint16_t const threshold)
+{
+        std::size_t count{0};
+        for (auto const sample : samples) {
+                count += sample < threshold ? 1 : 0;
+        }
+        return count;
+}
+
+uint64_t squared_deviation(std::span<uint16_t const> const samples, uint16_t const mean)
+{
+        uint64_t sum{0};
+        for (auto const sample : samples) {
+                auto const deviation = static_cast<int32_t>(sample) - static_cast<int32_t>(mean);
+                sum += static_cast<uint64_t>(deviation * deviation);
+        }
+        return sum;
+}
+
+std::size_t smooth(std::span<uint16_t const> const samples, std::size_t const factor, std::span<uint16_t> const out)
+{
+        auto const count = std::min(samples.size() / factor, out.size());
+        for (std::size_t i = 0; i < count; ++i) {
+                uint32_t sum{0};
+                for (std::size_t j = 0; j < factor; ++j) {
+                        sum += samples[i * factor + j];
+                }
+                out[i] = static_cast<uint16_t>(sum / factor);
+        }
+        return count;
+}
+
+Features extract(Policy const &policy, Trigger const trigger, uint16_t const resting_millivolts,
+                 std::span<uint16_t const> const millivolts, std::span<uint16_t> const scratch)
+{
+        Features features{};
+        features.trigger = trigger;
+        features.resting_millivolts = resting_millivolts;
+        features.sample_rate_hz = policy.sample_rate_hz;
+        features.samples = static_cast<uint32_t>(millivolts.size());
+        if (millivolts.empty()) {
+                return features;
+        }
+
+        // Settled level and ripple on the raw samples, which keep the alternator's ripple frequency.
+        auto const tail = millivolts.subspan(millivolts.size() - std::max<std::size_t>(millivolts.size() / 4, 1));
+        features.settled_millivolts = static_cast<uint16_t>(sum_of(tail) / tail.size());
+        features.ripple_millivolts = static_cast<uint16_t>(max_of(tail) - min_of(tail));
+        features.ripple_rms_millivolts = static_cast<uint16_t>(
+            std::lround(std::sqrt(static_cast<double>(squared_deviation(tail, features.settled_millivolts)) /
+                                  static_cast<double>(tail.size()))));
+
+        // The dip on smoothed points, so that single noisy samples do not set the minimum.
+        auto const factor = std::max<std::size_t>(policy.smoothing_samples, 1);
+        auto const points = scratch.first(smooth(millivolts, factor, scratch));
+        if (points.empty()) {
+                return features;
+        }
+        auto const point_ms = [&](std::size_t const count) {
+                return static_cast<uint32_t>(static_cast<uint64_t>(count) * factor * 1000 / policy.sample_rate_hz);
+        };
+        features.min_millivolts = min_of(points);
+        auto const dip_threshold = resting_millivolts > policy.dip_millivolts
+                                       ? static_cast<uint16_t>(resting_millivolts - policy.dip_millivolts)
+                                       : uint16_t{0};
+        features.dip_ms = point_ms(count_below(points, dip_threshold));
+
+        auto const lowest = static_cast<std::size_t>(std::find(points.begin(), points.end(), features.min_millivolts) -
+                                                     points.begin());
+        auto const recovered_threshold = resting_millivolts > policy.recovery_millivolts
+                                             ? static_cast<uint16_t>(resting_millivolts - policy.recovery_millivolts)
+                                             : uint16_t{0};
+        auto const recovered =
+            std::find_if(points.begin() + static_cast<std::ptrdiff_t>(lowest), points.end(),
+                         [recovered_threshold](auto const point) { return point >= recovered_threshold; });
+        features.is_recovered = recovered != points.end();
+        if (features.is_recovered) {
+                features.recovery_ms = point_ms(static_cast<std::size_t>(recovered - points.begin()) - lowest);
+        }
+        return features;
+}
+
+} // namespace Capture
+
+} // namespace BatteryMonitor
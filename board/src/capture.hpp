@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace BatteryMonitor
+{
+
+// High-rate capture of the battery around an engine crank or the alternator kicking in, reduced to a few features
+// that are published instead of the samples.
+namespace Capture
+{
+
+// Longest capture in samples: 2 s at 4 kHz.
+constexpr std::size_t MAX_SAMPLES{8'000};
+
+enum class Trigger : uint8_t {
+        None,
+        // The reading fell by at least the step since the last one, e.g. a crank in progress.
+        Drop,
+        // The reading rose by at least the step, e.g. the alternator charging.
+        Rise,
+        // The wake came from the external threshold wake source.
+        External,
+};
+
+constexpr auto trigger_name(Trigger const trigger) -> char const *
+{
+        switch (trigger) {
+        case Trigger::None:
+                return "none";
+        case Trigger::Drop:
+                return "drop";
+        case Trigger::Rise:
+                return "rise";
+        case Trigger::External:
+                return "external";
+        }
+        return "unknown";
+}
+
+struct Policy {
+        uint32_t sample_rate_hz;
+        std::chrono::milliseconds duration;
+        // A change this large since the last reading starts a capture.
+        uint16_t step_millivolts;
+        // More than this below the resting voltage counts as the dip.
+        uint16_t dip_millivolts;
+        // Recovered once back within this of the resting voltage.
+        uint16_t recovery_millivolts;
+        // Samples averaged into one point before the dip is measured, to ride over starter motor commutation noise.
+        uint16_t smoothing_samples;
+};
+
+constexpr std::size_t sample_count(Policy const &policy)
+{
+        return static_cast<std::size_t>(policy.sample_rate_hz * policy.duration.count() / 1000);
+}
+
+// Whether a reading, compared with the one before it, should start a capture. previous_millivolts is zero after
+// power-on, which never triggers.
+constexpr auto trigger(Policy const &policy, uint16_t const previous_millivolts, uint16_t const millivolts,
+                       bool const is_external) -> Trigger
+{
+        if (is_external) {
+                return Trigger::External;
+        }
+        if (previous_millivolts == 0) {
+                return Trigger::None;
+        }
+        auto const delta = static_cast<int32_t>(millivolts) - static_cast<int32_t>(previous_millivolts);
+        if (-delta >= policy.step_millivolts) {
+                return Trigger::Drop;
+        }
+        if (delta >= policy.step_millivolts) {
+                return Trigger::Rise;
+        }
+        return Trigger::None;
+}
+
+struct Features {
+        Trigger trigger;
+        // The last reading before the capture.
+        uint16_t resting_millivolts;
+        // Lowest smoothed point, the cranking voltage.
+        uint16_t min_millivolts;
+        // Time spent more than dip_millivolts below resting.
+        uint32_t dip_ms;
+        // From the lowest point until back within recovery_millivolts of resting. Only valid if is_recovered.
+        uint32_t recovery_ms;
+        bool is_recovered;
+        // Mean and ripple over the last quarter of the capture. With the engine running this is the alternator's
+        // output, and the ripple shows a failing diode or regulator.
+        uint16_t settled_millivolts;
+        uint16_t ripple_millivolts;
+        uint16_t ripple_rms_millivolts;
+        uint32_t sample_rate_hz;
+        uint32_t samples;
+};
+
+// Kernels. Branch-free loops with no early exit, so that the compiler can vectorize them.
+uint16_t min_of(std::span<uint16_t const> samples);
+uint16_t max_of(std::span<uint16_t const> samples);
+uint64_t sum_of(std::span<uint16_t const> samples);
+// Samples strictly below threshold.
+std::size_t count_below(std::span<uint16_t const> samples, uint16_t threshold);
+// Sum of squared differences from mean.
+uint64_t squared_deviation(std::span<uint16_t const> samples, uint16_t mean);
+// Average every factor samples into one point of out. Returns the number of points written.
+std::size_t smooth(std::span<uint16_t const> samples, std::size_t factor, std::span<uint16_t> out);
+
+// Summarize a capture of battery millivolts taken at policy.sample_rate_hz. scratch holds the smoothed points and
+// needs samples.size() / policy.smoothing_samples entries.
+Features extract(Policy const &policy, Trigger trigger, uint16_t resting_millivolts,
+                 std::span<uint16_t const> millivolts, std::span<uint16_t> scratch);
+
+} // namespace Capture
+
+} // namespace BatteryMonitor
@@ -0,0 +1,109 @@
+#include "charge_estimator.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace BatteryMonitor
+{
+
+namespace Charge
+{
+
+namespace
+{
+constexpr float SECONDS_PER_HOUR{3600.f};
+constexpr int32_t REFERENCE_CENTIDEGREES{2'500};
+
+float compensated_millivolts(Policy const &policy, uint16_t const millivolts,
+                             std::optional<int32_t> const temperature_centidegrees)
+{
+        if (!temperature_centidegrees) {
+                return millivolts;
+        }
+        // A cold battery rests lower. Lift it to what it would read at 25 C.
+        auto const delta_centidegrees = static_cast<float>(REFERENCE_CENTIDEGREES - *temperature_centidegrees);
+        return millivolts +
+               static_cast<float>(policy.temperature_microvolts_per_degree) * delta_centidegrees / 100'000.f;
+}
+
+uint16_t to_millivolts(float const millivolts)
+{
+        return static_cast<uint16_t>(std::clamp(std::lround(millivolts), 0L, static_cast<long>(UINT16_MAX)));
+}
+
+// Drain rate fitted over the rest period, in mV per hour with a rising voltage negative.
+std::optional<float> fitted_slope(EstimatorState const &state, Policy const &policy, int64_t const now_s)
+{
+        if (now_s - state.rest_start_s < policy.drain_window.count() || state.samples < 3 || state.m2_hours <= 0.f) {
+                return std::nullopt;
+        }
+        return state.co_moment / state.m2_hours;
+}
+} // namespace
+
+void update(EstimatorState &state, Policy const &policy, Reading const reading,
+            std::optional<int32_t> const temperature_centidegrees)
+{
+        if (reading.millivolts >= policy.charging_millivolts) {
+                state.is_charging = true;
+                state.has_charged = true;
+                state.last_charge_s = reading.timestamp_s;
+                state.samples = 0;
+                return;
+        }
+        state.is_charging = false;
+        if (state.has_charged && reading.timestamp_s - state.last_charge_s < policy.rest_delay.count()) {
+                return;
+        }
+
+        if (state.samples == 0) {
+                state = EstimatorState{
+                    state.has_charged, state.last_charge_s, reading.timestamp_s, false, 0, 0.f, 0.f, 0.f, 0.f, 0.f};
+        }
+        auto const hours = static_cast<float>(reading.timestamp_s - state.rest_start_s) / SECONDS_PER_HOUR;
+        auto const millivolts = compensated_millivolts(policy, reading.millivolts, temperature_centidegrees);
+
+        ++state.samples;
+        auto const n = static_cast<float>(state.samples);
+        auto const delta_hours = hours - state.mean_hours;
+        auto const delta_millivolts = millivolts - state.mean_millivolts;
+        state.mean_hours += delta_hours / n;
+        state.mean_millivolts += delta_millivolts / n;
+        state.m2_hours += delta_hours * (hours - state.mean_hours);
+        state.m2_millivolts += delta_millivolts * (millivolts - state.mean_millivolts);
+        state.co_moment += delta_hours * (millivolts - state.mean_millivolts);
+}
+
+std::optional<Estimate> estimate(EstimatorState const &state, Policy const &policy, int64_t const now_s)
+{
+        if (state.is_charging || state.samples == 0) {
+                return std::nullopt;
+        }
+
+        Estimate estimate{};
+        auto resting = state.mean_millivolts;
+        auto unexplained = state.m2_millivolts;
+        auto const slope = fitted_slope(state, policy, now_s);
+        if (slope) {
+                auto const hours = static_cast<float>(now_s - state.rest_start_s) / SECONDS_PER_HOUR;
+                resting += *slope * (hours - state.mean_hours);
+                unexplained -= *slope * state.co_moment;
+                estimate.drain_millivolts_per_hour = -*slope;
+                if (*slope < 0.f) {
+                        estimate.hours_to_cutoff = std::max(0.f, (resting - policy.cutoff_millivolts) / -*slope);
+                }
+        }
+        estimate.resting_millivolts = to_millivolts(resting);
+        estimate.soc_percent = soc_percent(estimate.resting_millivolts);
+        estimate.noise_millivolts = std::sqrt(std::max(0.f, unexplained) / static_cast<float>(state.samples));
+        if (state.has_charged) {
+                estimate.hours_since_charge = static_cast<float>(now_s - state.last_charge_s) / SECONDS_PER_HOUR;
+                auto const intercept =
+                    slope ? state.mean_millivolts - *slope * state.mean_hours : state.mean_millivolts;
+                estimate.charged_millivolts = to_millivolts(intercept);
+        }
+        return estimate;
+}
+
+} // namespace Charge
+
+} // namespace BatteryMonitor
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "reading_ring.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace BatteryMonitor
+{
+
+// State of charge and drain of a 12 V lead-acid battery from its resting voltage. Updated in O(1) per wake from
+// running statistics, so that no history is kept.
+namespace Charge
+{
+
+struct Policy {
+        // At or above this the alternator or a charger is on, and the statistics start over.
+        uint16_t charging_millivolts;
+        // After charging, surface charge holds the voltage up for a while. Readings count as resting after this.
+        std::chrono::seconds rest_delay;
+        // Resting voltage change per degree C, in microvolts. Readings are compensated to 25 C.
+        int32_t temperature_microvolts_per_degree;
+        // Projected time left runs until the resting voltage reaches this.
+        uint16_t cutoff_millivolts;
+        // Drain is only estimated over at least this much rest, since it is a few mV per hour at most.
+        std::chrono::seconds drain_window;
+};
+
+// Resting voltage at 25 C against state of charge, for a flooded or AGM battery.
+struct SocPoint {
+        uint16_t millivolts;
+        uint8_t percent;
+};
+inline constexpr std::array SOC_CURVE{
+    SocPoint{11'310, 0},  SocPoint{11'510, 10}, SocPoint{11'660, 20}, SocPoint{11'810, 30},
+    SocPoint{11'960, 40}, SocPoint{12'100, 50}, SocPoint{12'240, 60}, SocPoint{12'370, 70},
+    SocPoint{12'500, 80}, SocPoint{12'620, 90}, SocPoint{12'730, 100},
+};
+
+constexpr uint8_t soc_percent(uint16_t const resting_millivolts)
+{
+        if (resting_millivolts <= SOC_CURVE.front().millivolts) {
+                return SOC_CURVE.front().percent;
+        }
+        for (std::size_t i = 1; i < SOC_CURVE.size(); ++i) {
+                auto const &low = SOC_CURVE[i - 1];
+                auto const &high = SOC_CURVE[i];
+                if (resting_millivolts < high.millivolts) {
+                        auto const span = high.millivolts - low.millivolts;
+                        auto const offset = (resting_millivolts - low.millivolts) * (high.percent - low.percent);
+                        return static_cast<uint8_t>(low.percent + (offset + span / 2) / span);
+                }
+        }
+        return SOC_CURVE.back().percent;
+}
+
+// Running statistics of the current rest period.
+// Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero on power-on, which counts as
+// rested.
+struct EstimatorState {
+        // Whether a charge has been seen since power-on, and when the last one ended.
+        bool has_charged;
+        int64_t last_charge_s;
+        // First resting reading of this rest period.
+        int64_t rest_start_s;
+        bool is_charging;
+        // Welford's mean and co-moments of (hours since rest_start_s, compensated millivolts). Single precision, which
+        // the ESP32 has in hardware.
+        uint32_t samples;
+        float mean_hours;
+        float mean_millivolts;
+        float m2_hours;
+        float m2_millivolts;
+        float co_moment;
+};
+
+// Add this wake's battery reading, and the board temperature if it was read.
+void update(EstimatorState &state, Policy const &policy, Reading reading,
+            std::optional<int32_t> temperature_centidegrees);
+
+struct Estimate {
+        uint8_t soc_percent;
+        // Compensated resting voltage now, from the fitted line once there is a drain estimate.
+        uint16_t resting_millivolts;
+        // Spread of the readings around the fitted line.
+        float noise_millivolts;
+        // Positive while discharging. std::nullopt until drain_window has passed.
+        std::optional<float> drain_millivolts_per_hour;
+        // Until the resting voltage reaches the cutoff. std::nullopt if not draining.
+        std::optional<float> hours_to_cutoff;
+        std::optional<float> hours_since_charge;
+        // Resting voltage at the start of this rest period. Well below 12.6 V right after a charge points to a
+        // sulfated or worn battery.
+        std::optional<uint16_t> charged_millivolts;
+};
+
+// std::nullopt while charging or before the battery has rested.
+std::optional<Estimate> estimate(EstimatorState const &state, Policy const &policy, int64_t now_s);
+
+} // namespace Charge
+
+} // namespace BatteryMonitor
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+// How hard a wake tries to join the network, and how long the radio stays off after it keeps failing.
+struct ConnectPolicy {
+        // An association that has not got an IP by then is abandoned and retried.
+        std::chrono::milliseconds attempt_timeout;
+        // Pause before the first retry of a wake. Doubled after every further failed attempt, up to max_backoff.
+        std::chrono::milliseconds initial_backoff;
+        std::chrono::milliseconds max_backoff;
+        // Failed wakes in a row before wakes are skipped without trying.
+        uint16_t failures_before_skip;
+        // Wakes skipped after the first failed wake past failures_before_skip. Doubled for every further one, up to
+        // max_skip_wakes.
+        uint16_t initial_skip_wakes;
+        uint16_t max_skip_wakes;
+};
+
+// Connection history, kept across deep sleep.
+// Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero on power-on.
+struct ConnectState {
+        // Wakes in a row that tried to connect and could not.
+        uint16_t consecutive_failures;
+        // Wakes left to skip before trying again.
+        uint16_t wakes_to_skip;
+};
+
+// Pause before the next attempt, after failed_attempts attempts of this wake have failed.
+constexpr auto backoff_delay(ConnectPolicy const &policy, uint32_t const failed_attempts) -> std::chrono::milliseconds
+{
+        auto delay = policy.initial_backoff;
+        for (uint32_t i = 1; i < failed_attempts && delay < policy.max_backoff; ++i) {
+                delay *= 2;
+        }
+        return std::min(delay, policy.max_backoff);
+}
+
+// Whether the backoff and one more full attempt still fit in what is left of the wake's connect budget.
+constexpr bool fits_another_attempt(ConnectPolicy const &policy, uint32_t const failed_attempts,
+                                    std::chrono::milliseconds const remaining)
+{
+        return backoff_delay(policy, failed_attempts) + policy.attempt_timeout <= remaining;
+}
+
+// Whether this wake may try to connect at all. A skipped wake uses up one of wakes_to_skip.
+constexpr bool take_connect_turn(ConnectState &state)
+{
+        if (state.wakes_to_skip == 0) {
+                return true;
+        }
+        --state.wakes_to_skip;
+        return false;
+}
+
+// Record how this wake's connection went, and skip the coming wakes if it keeps failing.
+constexpr void record_connect(ConnectPolicy const &policy, ConnectState &state, bool const is_connected)
+{
+        if (is_connected) {
+                state = ConnectState{};
+                return;
+        }
+        if (state.consecutive_failures < UINT16_MAX) {
+                ++state.consecutive_failures;
+        }
+        if (state.consecutive_failures < policy.failures_before_skip) {
+                return;
+        }
+        uint32_t skip = policy.initial_skip_wakes;
+        for (uint32_t i = policy.failures_before_skip; i < state.consecutive_failures && skip < policy.max_skip_wakes;
+             ++i) {
+                skip *= 2;
+        }
+        state.wakes_to_skip = static_cast<uint16_t>(std::min<uint32_t>(skip, policy.max_skip_wakes));
+}
+
+} // namespace BatteryMonitor
@@ -0,0 +1,391 @@
+#include "deferred_log.hpp"
+#include "hal.hpp"
+#include <array>
+#include <cinttypes>
+#include <mutex>
+#include <optional>
+
+namespace BatteryMonitor
+{
+
+namespace Log
+{
+
+namespace
+{
+
+constexpr uint32_t RING_MAGIC{0x444c'4f47};
+// More than the DLOG call sites in the firmware. Later registrations are dropped and print as unknown IDs.
+constexpr std::size_t MAX_FORMATS{96};
+
+struct Ring {
+        uint32_t magic;
+        uint16_t wake;
+        // Next byte to write, and bytes in use before it. Both only change after the bytes they cover are written.
+        uint16_t head;
+        uint16_t used;
+        std::array<uint8_t, RING_BYTES> bytes;
+};
+static_assert(RING_BYTES <= UINT16_MAX && HEADER_BYTES + MAX_ARG_BYTES <= RING_BYTES);
+
+// Not zeroed on a reset or a panic, unlike RTC_DATA_ATTR, so it is checked by begin_wake() instead.
+RTC_NOINIT_ATTR Ring s_ring;
+// The wake path logs from app_main, the upload task and the Wi-Fi event task.
+std::mutex s_mutex;
+
+struct Format {
+        uint32_t id;
+        char const *tag;
+        char const *format;
+};
+// Constant-initialized, so it is ready before the registrations that run during static initialization.
+std::array<Format, MAX_FORMATS> s_formats{};
+std::size_t s_format_count{0};
+
+bool is_valid(Ring const &ring)
+{
+        return ring.magic == RING_MAGIC && ring.head < RING_BYTES && ring.used <= RING_BYTES;
+}
+
+void reset(Ring &ring)
+{
+        ring.magic = RING_MAGIC;
+        ring.head = 0;
+        ring.used = 0;
+}
+
+std::size_t tail(Ring const &ring) { return (ring.head + RING_BYTES - ring.used) % RING_BYTES; }
+
+void read_bytes(Ring const &ring, std::size_t const offset, std::span<uint8_t> out)
+{
+        for (std::size_t i = 0; i < out.size(); ++i) {
+                out[i] = ring.bytes[(offset + i) % RING_BYTES];
+        }
+}
+
+void write_bytes(Ring &ring, std::size_t const offset, std::span<uint8_t const> const in)
+{
+        for (std::size_t i = 0; i < in.size(); ++i) {
+                ring.bytes[(offset + i) % RING_BYTES] = in[i];
+        }
+}
+
+std::size_t record_bytes(Ring const &ring, std::size_t const offset)
+{
+        return HEADER_BYTES + ring.bytes[(offset + HEADER_BYTES - 1) % RING_BYTES];
+}
+
+// One argument of a record being rendered.
+struct Arg {
+        ArgType type;
+        int64_t integer;
+        double real;
+        std::string_view text;
+};
+
+class ArgReader
+{
+      public:
+        explicit ArgReader(std::span<uint8_t const> args) : args{args} {}
+
+        std::optional<Arg> next()
+        {
+                if (offset >= args.size()) {
+                        return std::nullopt;
+                }
+                Arg arg{static_cast<ArgType>(args[offset++]), 0, 0.0, {}};
+                switch (arg.type) {
+                case ArgType::Int32: {
+                        int32_t value{0};
+                        if (!read(value)) {
+                                return std::nullopt;
+                        }
+                        arg.integer = value;
+                        break;
+                }
+                case ArgType::Int64:
+                        if (!read(arg.integer)) {
+                                return std::nullopt;
+                        }
+                        break;
+                case ArgType::Double:
+                        if (!read(arg.real)) {
+                                return std::nullopt;
+                        }
+                        break;
+                case ArgType::String: {
+                        if (offset >= args.size() || offset + 1 + args[offset] > args.size()) {
+                                return std::nullopt;
+                        }
+                        auto const size = args[offset++];
+                        arg.text = {reinterpret_cast<char const *>(&args[offset]), size};
+                        offset += size;
+                        break;
+                }
+                default:
+                        return std::nullopt;
+                }
+                return arg;
+        }
+
+      private:
+        template <typename T> bool read(T &value)
+        {
+                if (offset + sizeof(T) > args.size()) {
+                        return false;
+                }
+                std::memcpy(&value, &args[offset], sizeof(T));
+                offset += sizeof(T);
+                return true;
+        }
+
+        std::span<uint8_t const> args;
+        std::size_t offset{0};
+};
+
+// Appends to a NUL-terminated buffer, cutting what does not fit.
+class TextWriter
+{
+      public:
+        explicit TextWriter(std::span<char> out) : out{out}
+        {
+                if (!out.empty()) {
+                        out[0] = '\0';
+                }
+        }
+
+        template <typename... Args> void print(char const *const format, Args const... args)
+        {
+                if (size + 1 >= out.size()) {
+                        return;
+                }
+                auto const count = std::snprintf(&out[size], out.size() - size, format, args...);
+                if (count > 0) {
+                        size = std::min(size + static_cast<std::size_t>(count), out.size() - 1);
+                }
+        }
+
+        void append(std::string_view const text) { print("%.*s", static_cast<int>(text.size()), text.data()); }
+
+        std::size_t length() const { return size; }
+
+      private:
+        std::span<char> out;
+        std::size_t size{0};
+};
+
+// Integer conversions are re-done with a 64-bit length modifier on the value widened to match the conversion.
+int64_t widened(Arg const &arg, char const conversion)
+{
+        if (arg.type != ArgType::Int32) {
+                return arg.integer;
+        }
+        auto const is_signed = conversion == 'd' || conversion == 'i';
+        return is_signed ? arg.integer : static_cast<int64_t>(static_cast<uint32_t>(arg.integer));
+}
+
+} // namespace
+
+void begin_wake()
+{
+        std::lock_guard const lock{s_mutex};
+        if (!is_valid(s_ring)) {
+                reset(s_ring);
+                s_ring.wake = 0;
+        }
+        ++s_ring.wake;
+}
+
+void write(uint32_t const id, Level const level, std::span<uint8_t const> const args)
+{
+        std::array<uint8_t, HEADER_BYTES> header{};
+        auto const time_us = static_cast<uint32_t>(Hal::micros_since_wake());
+        auto const arg_bytes = std::min(args.size(), MAX_ARG_BYTES);
+
+        std::lock_guard const lock{s_mutex};
+        if (!is_valid(s_ring)) {
+                reset(s_ring);
+        }
+        std::memcpy(&header[0], &id, sizeof(id));
+        std::memcpy(&header[4], &time_us, sizeof(time_us));
+        std::memcpy(&header[8], &s_ring.wake, sizeof(s_ring.wake));
+        header[10] = static_cast<uint8_t>(level);
+        header[11] = static_cast<uint8_t>(arg_bytes);
+
+        // Drop whole records from the tail until this one fits.
+        auto const size = HEADER_BYTES + arg_bytes;
+        while (RING_BYTES - s_ring.used < size) {
+                auto const oldest = record_bytes(s_ring, tail(s_ring));
+                s_ring.used = oldest <= s_ring.used ? static_cast<uint16_t>(s_ring.used - oldest) : 0;
+        }
+        write_bytes(s_ring, s_ring.head, header);
+        write_bytes(s_ring, s_ring.head + HEADER_BYTES, args.first(arg_bytes));
+        s_ring.head = static_cast<uint16_t>((s_ring.head + size) % RING_BYTES);
+        s_ring.used = static_cast<uint16_t>(s_ring.used + size);
+}
+
+void for_each_record(Visitor const visit, void *const context)
+{
+        std::lock_guard const lock{s_mutex};
+        if (!is_valid(s_ring)) {
+                return;
+        }
+        std::array<uint8_t, HEADER_BYTES + MAX_ARG_BYTES> copy{};
+        for (std::size_t done = 0; done + HEADER_BYTES <= s_ring.used;) {
+                auto const offset = (tail(s_ring) + done) % RING_BYTES;
+                auto const size = record_bytes(s_ring, offset);
+                if (size > copy.size() || done + size > s_ring.used) {
+                        return;
+                }
+                read_bytes(s_ring, offset, std::span{copy}.first(size));
+                Record record{};
+                std::memcpy(&record.id, &copy[0], sizeof(record.id));
+                std::memcpy(&record.time_us, &copy[4], sizeof(record.time_us));
+                std::memcpy(&record.wake, &copy[8], sizeof(record.wake));
+                record.level = static_cast<Level>(copy[10]);
+                record.args = std::span{copy}.subspan(HEADER_BYTES, size - HEADER_BYTES);
+                visit(record, context);
+                done += size;
+        }
+}
+
+void flush()
+{
+        // The formats first, each once, so that the decoder needs nothing but this output.
+        std::array<uint32_t, MAX_FORMATS> printed{};
+        std::size_t printed_count{0};
+        for_each_record([&](Record const &record) {
+                auto const end = printed.begin() + printed_count;
+                if (std::find(printed.begin(), end, record.id) != end || printed_count == printed.size()) {
+                        return;
+                }
+                printed[printed_count++] = record.id;
+                char const *tag{nullptr};
+                if (auto const *const format = find_format(record.id, &tag)) {
+                        std::printf("dlog.format=%08" PRIx32 "\t%s\t%s\n", record.id, tag, format);
+                }
+        });
+        for_each_record([](Record const &record) {
+                std::printf("dlog.record=%08" PRIx32 " %u %" PRIu32 " %u ", record.id, record.wake, record.time_us,
+                            static_cast<unsigned>(record.level));
+                for (auto const byte : record.args) {
+                        std::printf("%02x", byte);
+                }
+                std::printf("\n");
+        });
+        clear();
+}
+
+void clear()
+{
+        std::lock_guard const lock{s_mutex};
+        auto const wake = is_valid(s_ring) ? s_ring.wake : uint16_t{0};
+        reset(s_ring);
+        s_ring.wake = wake;
+}
+
+std::size_t render(std::string_view const format, std::span<uint8_t const> const args, std::span<char> const out)
+{
+        TextWriter text{out};
+        ArgReader reader{args};
+        for (std::size_t i = 0; i < format.size(); ++i) {
+                if (format[i] != '%') {
+                        text.append(format.substr(i, 1));
+                        continue;
+                }
+                if (i + 1 < format.size() && format[i + 1] == '%') {
+                        text.append("%");
+                        ++i;
+                        continue;
+                }
+
+                // Flags, width and precision are kept. A * takes its value from the arguments. Length modifiers are
+                // dropped, since the argument's own type says how wide it is.
+                char spec[24]{'%'};
+                std::size_t spec_size{1};
+                auto const add = [&](std::string_view const part) {
+                        auto const count = std::min(part.size(), sizeof(spec) - 4 - spec_size);
+                        std::memcpy(&spec[spec_size], part.data(), count);
+                        spec_size += count;
+                };
+                auto j = i + 1;
+                for (; j < format.size() && std::string_view{"-+ #0123456789.*hlLqjzt"}.find(format[j]) !=
+                                                std::string_view::npos;
+                     ++j) {
+                        auto const c = format[j];
+                        if (c == '*') {
+                                auto const arg = reader.next();
+                                char number[12];
+                                std::snprintf(number, sizeof(number), "%d",
+                                              arg ? static_cast<int>(arg->integer) : 0);
+                                add(number);
+                        } else if (std::string_view{"hlLqjzt"}.find(c) == std::string_view::npos) {
+                                add({&c, 1});
+                        }
+                }
+                if (j == format.size()) {
+                        break;
+                }
+                auto const conversion = format[j];
+                i = j;
+
+                auto const arg = reader.next();
+                if (!arg) {
+                        text.append("?");
+                        continue;
+                }
+                switch (conversion) {
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o':
+                        add("ll");
+                        add({&conversion, 1});
+                        text.print(spec, static_cast<long long>(widened(*arg, conversion)));
+                        break;
+                case 'c':
+                        add("c");
+                        text.print(spec, static_cast<int>(arg->integer));
+                        break;
+                case 's': {
+                        char string[MAX_STRING_BYTES + 1]{};
+                        arg->text.copy(string, MAX_STRING_BYTES);
+                        add("s");
+                        text.print(spec, static_cast<char const *>(string));
+                        break;
+                }
+                case 'p':
+                        text.print("0x%llx", static_cast<unsigned long long>(arg->integer));
+                        break;
+                default:
+                        add({&conversion, 1});
+                        text.print(spec, arg->real);
+                        break;
+                }
+        }
+        return text.length();
+}
+
+void register_format(uint32_t const id, char const *const tag, char const *const format)
+{
+        if (s_format_count < s_formats.size()) {
+                s_formats[s_format_count++] = Format{id, tag, format};
+        }
+}
+
+char const *find_format(uint32_t const id, char const **const tag)
+{
+        for (std::size_t i = 0; i < s_format_count; ++i) {
+                if (s_formats[i].id == id) {
+                        *tag = s_formats[i].tag;
+                        return s_formats[i].format;
+                }
+        }
+        return nullptr;
+}
+
+} // namespace Log
+
+} // namespace BatteryMonitor
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <span>
+#include <string_view>
+#include <type_traits>
+
+namespace BatteryMonitor
+{
+
+// Binary log for the wake path. An info line through ESP_LOGI is formatted with printf and written to the 115200 baud
+// console before the call returns, which is about 5 ms for a 60 character line. DLOGI only copies a format ID, a
+// timestamp and the raw arguments into a ring in RTC memory. The ring keeps the last few wakes and is printed as hex
+// with flush(), which host/log_decoder turns back into text. Errors and warnings stay on ESP_LOGE and ESP_LOGW.
+namespace Log
+{
+
+enum class Level : uint8_t { Info, Debug };
+
+// Kept in RTC memory that survives a reset, so that the wakes before a crash can be printed after it.
+inline constexpr std::size_t RING_BYTES{1024};
+// id, time_us, wake, level, arg_bytes.
+inline constexpr std::size_t HEADER_BYTES{12};
+inline constexpr std::size_t MAX_ARG_BYTES{64};
+// Longer string arguments keep their end, which is where URLs and topics differ.
+inline constexpr std::size_t MAX_STRING_BYTES{32};
+
+// Each argument is a type byte followed by its value, little-endian.
+enum class ArgType : uint8_t { Int32, Int64, Double, String };
+
+struct Record {
+        uint32_t id;
+        // Since the wake started. Wraps after 71 minutes, which no wake comes near.
+        uint32_t time_us;
+        // Counts wakes since the ring was last cleared.
+        uint16_t wake;
+        Level level;
+        std::span<uint8_t const> args;
+};
+
+// FNV-1a of the tag and the format, so that the ID stays the same across builds until the message changes.
+constexpr uint32_t format_id(std::string_view const tag, std::string_view const format)
+{
+        uint32_t hash{2'166'136'261u};
+        auto const mix = [&hash](char const c) { hash = (hash ^ static_cast<uint8_t>(c)) * 16'777'619u; };
+        for (auto const c : tag) {
+                mix(c);
+        }
+        mix('\0');
+        for (auto const c : format) {
+                mix(c);
+        }
+        return hash;
+}
+
+// Counts a new wake. Clears the ring if it does not hold a valid log, as after power-on.
+void begin_wake();
+// Appends a record, dropping the oldest ones to make room.
+void write(uint32_t id, Level level, std::span<uint8_t const> args);
+// Calls visit(record, context) for each record, oldest first. visit must not log.
+using Visitor = void (*)(Record const &record, void *context);
+void for_each_record(Visitor visit, void *context);
+template <typename Visit> void for_each_record(Visit &&visit)
+{
+        for_each_record([](Record const &record, void *const context) {
+                (*static_cast<std::remove_reference_t<Visit> *>(context))(record);
+        }, &visit);
+}
+// Prints the format of every ID in the ring, then every record as hex, then clears it. See host/log_decoder.
+void flush();
+void clear();
+
+// Writes the printf conversion of format for args into out, cut to fit and NUL-terminated. Returns the length.
+std::size_t render(std::string_view format, std::span<uint8_t const> args, std::span<char> out);
+
+// Format strings by ID, for flush(). Every DLOG call site registers itself before app_main, so records left by an
+// earlier wake can be printed even if their call site has not run in this one.
+void register_format(uint32_t id, char const *tag, char const *format);
+char const *find_format(uint32_t id, char const **tag);
+
+// A string literal as a template argument, so that each call site gets its own registration.
+template <std::size_t N> struct FixedString {
+        constexpr FixedString(char const *const text)
+        {
+                for (std::size_t i = 0; i < N; ++i) {
+                        chars[i] = text[i];
+                }
+        }
+        constexpr std::string_view view() const { return {chars, N - 1}; }
+        char chars[N]{};
+};
+template <std::size_t N> FixedString(char const (&)[N]) -> FixedString<N>;
+
+constexpr std::size_t length(char const *const text) { return std::char_traits<char>::length(text); }
+
+template <FixedString Tag, FixedString Format> struct Registration {
+        static constexpr uint32_t ID{format_id(Tag.view(), Format.view())};
+        static inline bool const registered = (register_format(ID, Tag.chars, Format.chars), true);
+};
+
+namespace Detail
+{
+
+class ArgWriter
+{
+      public:
+        explicit ArgWriter(std::span<uint8_t> out) : out{out} {}
+
+        template <typename T> void add(T const value)
+        {
+                if constexpr (std::is_same_v<T, bool>) {
+                        add_value(ArgType::Int32, static_cast<int32_t>(value));
+                } else if constexpr (std::is_enum_v<T>) {
+                        add(static_cast<std::underlying_type_t<T>>(value));
+                } else if constexpr (std::is_integral_v<T> && sizeof(T) <= sizeof(int32_t)) {
+                        // Stored as 32 bits. The conversion in the format decides the signedness again.
+                        add_value(ArgType::Int32, static_cast<int32_t>(value));
+                } else if constexpr (std::is_integral_v<T>) {
+                        add_value(ArgType::Int64, static_cast<int64_t>(value));
+                } else if constexpr (std::is_floating_point_v<T>) {
+                        add_value(ArgType::Double, static_cast<double>(value));
+                } else if constexpr (std::is_convertible_v<T, char const *>) {
+                        add_string(value);
+                } else {
+                        static_assert(std::is_pointer_v<T>, "Unsupported log argument");
+                        add_value(ArgType::Int64, static_cast<int64_t>(reinterpret_cast<uintptr_t>(value)));
+                }
+        }
+
+        std::span<uint8_t const> written() const { return out.first(size); }
+
+      private:
+        template <typename T> void add_value(ArgType const type, T const value)
+        {
+                if (is_full || size + 1 + sizeof(T) > out.size()) {
+                        is_full = true;
+                        return;
+                }
+                out[size++] = static_cast<uint8_t>(type);
+                // Little-endian, like both the ESP32 and the hosts that decode the log.
+                std::memcpy(&out[size], &value, sizeof(T));
+                size += sizeof(T);
+        }
+
+        void add_string(char const *const text)
+        {
+                auto view = text ? std::string_view{text} : "(null)";
+                view.remove_prefix(view.size() - std::min(view.size(), MAX_STRING_BYTES));
+                if (is_full || size + 2 > out.size()) {
+                        is_full = true;
+                        return;
+                }
+                auto const count = std::min(view.size(), out.size() - size - 2);
+                out[size++] = static_cast<uint8_t>(ArgType::String);
+                out[size++] = static_cast<uint8_t>(count);
+                std::memcpy(&out[size], view.data(), count);
+                size += count;
+        }
+
+        std::span<uint8_t> out;
+        std::size_t size{0};
+        // Arguments after one that did not fit are dropped too, so that they stay in order.
+        bool is_full{false};
+};
+
+template <FixedString Tag, FixedString Format, typename... Args> void write(Level const level, Args const... args)
+{
+        using Site = Registration<Tag, Format>;
+        static_cast<void>(Site::registered);
+        uint8_t buffer[MAX_ARG_BYTES];
+        ArgWriter writer{buffer};
+        (writer.add(args), ...);
+        Log::write(Site::ID, level, writer.written());
+}
+
+} // namespace Detail
+
+} // namespace Log
+
+} // namespace BatteryMonitor
+
+// Drop-in for ESP_LOGI and ESP_LOGD on the wake path. tag must be a constant expression, like the TAG of each file.
+// The dead branch keeps printf format checking.
+#define DLOG_AT(level, tag, format, ...)                                                                               \
+        do {                                                                                                           \
+                if (false)                                                                                             \
+                        std::printf(format __VA_OPT__(, ) __VA_ARGS__);                                                \
+                ::BatteryMonitor::Log::Detail::write<                                                                  \
+                    ::BatteryMonitor::Log::FixedString<::BatteryMonitor::Log::length(tag) + 1>{tag},                   \
+                    ::BatteryMonitor::Log::FixedString{format}>(level __VA_OPT__(, ) __VA_ARGS__);                     \
+        } while (0)
+#define DLOGI(tag, format, ...) DLOG_AT(::BatteryMonitor::Log::Level::Info, tag, format __VA_OPT__(, ) __VA_ARGS__)
+#define DLOGD(tag, format, ...) DLOG_AT(::BatteryMonitor::Log::Level::Debug, tag, format __VA_OPT__(, ) __VA_ARGS__)
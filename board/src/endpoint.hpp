@@ -0,0 +1,145 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// The Home Assistant endpoint, and what a wake remembers about it across deep sleep to connect faster.
+namespace Net
+{
+
+struct Endpoint {
+        bool is_tls;
+        std::string_view host;
+        uint16_t port;
+};
+
+// Scheme, host and port of an http:// or https:// URL. The path, if any, is ignored.
+constexpr std::optional<Endpoint> parse_endpoint(std::string_view url)
+{
+        Endpoint endpoint{};
+        if (url.starts_with("https://")) {
+                endpoint = Endpoint{true, {}, 443};
+                url.remove_prefix(8);
+        } else if (url.starts_with("http://")) {
+                endpoint = Endpoint{false, {}, 80};
+                url.remove_prefix(7);
+        } else {
+                return std::nullopt;
+        }
+        url = url.substr(0, url.find('/'));
+        if (auto const colon = url.rfind(':'); colon != std::string_view::npos) {
+                uint32_t port{0};
+                for (auto const c : url.substr(colon + 1)) {
+                        if (c < '0' || c > '9' || (port = port * 10 + static_cast<uint32_t>(c - '0')) > UINT16_MAX) {
+                                return std::nullopt;
+                        }
+                }
+                if (port == 0) {
+                        return std::nullopt;
+                }
+                endpoint.port = static_cast<uint16_t>(port);
+                url = url.substr(0, colon);
+        }
+        if (url.empty()) {
+                return std::nullopt;
+        }
+        endpoint.host = url;
+        return endpoint;
+}
+
+// FNV-1a, to tell whether a cache entry is for this host after the URL is changed and the board reflashed.
+constexpr uint32_t host_hash(std::string_view const host)
+{
+        uint32_t hash{2'166'136'261u};
+        for (auto const c : host) {
+                hash = (hash ^ static_cast<uint8_t>(c)) * 16'777'619u;
+        }
+        return hash;
+}
+
+// A cache entry is only used from when it was stored until its lifetime runs out. A clock that went backwards also
+// invalidates it.
+struct Validity {
+        uint32_t host_hash;
+        int64_t stored_s;
+        int64_t lifetime_s;
+};
+
+constexpr bool is_valid(Validity const &validity, std::string_view const host, int64_t const now_s)
+{
+        return validity.lifetime_s > 0 && validity.host_hash == host_hash(host) && now_s >= validity.stored_s &&
+               now_s - validity.stored_s < validity.lifetime_s;
+}
+
+// Resolved IPv4 address of the endpoint, in network byte order. Resolving hassio.local takes an mDNS query every
+// wake otherwise. Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero (empty) on
+// power-on.
+struct DnsCache {
+        Validity validity;
+        uint32_t address;
+};
+
+constexpr std::optional<uint32_t> lookup(DnsCache const &cache, std::string_view const host, int64_t const now_s)
+{
+        return is_valid(cache.validity, host, now_s) ? std::optional{cache.address} : std::nullopt;
+}
+
+constexpr void store(DnsCache &cache, std::string_view const host, uint32_t const address, int64_t const now_s,
+                     std::chrono::seconds const ttl)
+{
+        cache = DnsCache{Validity{host_hash(host), now_s, ttl.count()}, address};
+}
+
+// A serialized TLS session, so that the first connection of a wake resumes it with an abbreviated handshake instead
+// of a full one. Sized for a TLS 1.2 session with a ticket and without the peer certificate.
+inline constexpr std::size_t TLS_SESSION_BYTES{512};
+
+// Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero (empty) on power-on.
+template <std::size_t Capacity = TLS_SESSION_BYTES> struct TlsSessionCache {
+        Validity validity;
+        uint16_t size;
+        std::array<uint8_t, Capacity> bytes;
+};
+
+// Empty if there is no session to resume.
+template <std::size_t Capacity>
+constexpr std::span<uint8_t const> lookup(TlsSessionCache<Capacity> const &cache, std::string_view const host,
+                                          int64_t const now_s)
+{
+        if (!is_valid(cache.validity, host, now_s) || cache.size > cache.bytes.size()) {
+                return {};
+        }
+        return std::span{cache.bytes}.first(cache.size);
+}
+
+// Returns false, and forgets the old session, if session does not fit.
+template <std::size_t Capacity>
+constexpr bool store(TlsSessionCache<Capacity> &cache, std::string_view const host,
+                     std::span<uint8_t const> const session, int64_t const now_s, std::chrono::seconds const lifetime)
+{
+        static_assert(Capacity <= UINT16_MAX);
+        if (session.empty() || session.size() > cache.bytes.size()) {
+                cache.validity = Validity{};
+                return false;
+        }
+        cache.validity = Validity{host_hash(host), now_s, lifetime.count()};
+        cache.size = static_cast<uint16_t>(session.size());
+        for (std::size_t i = 0; i < session.size(); ++i) {
+                cache.bytes[i] = session[i];
+        }
+        return true;
+}
+
+template <typename Cache> constexpr void forget(Cache &cache) { cache.validity = Validity{}; }
+
+} // namespace Net
+
+} // namespace BatteryMonitor
@@ -0,0 +1,54 @@
+#include "filter.hpp"
+#include <algorithm>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+namespace Filter
+{
+
+int median(std::span<int> const samples)
+{
+        if (samples.empty()) {
+                return 0;
+        }
+
+        auto const mid = samples.begin() + static_cast<std::ptrdiff_t>(samples.size() / 2);
+        std::nth_element(samples.begin(), mid, samples.end());
+        if (samples.size() % 2 != 0) {
+                return *mid;
+        }
+
+        // Even count: the lower middle is the largest element of the left partition.
+        auto const lower = *std::max_element(samples.begin(), mid);
+        return lower + (*mid - lower) / 2;
+}
+
+int trimmed_mean(std::span<int> const samples, std::size_t trim_count)
+{
+        if (samples.empty()) {
+                return 0;
+        }
+
+        trim_count = std::min(trim_count, (samples.size() - 1) / 2);
+        auto const first = samples.begin() + static_cast<std::ptrdiff_t>(trim_count);
+        auto const last = samples.end() - static_cast<std::ptrdiff_t>(trim_count);
+        if (trim_count > 0) {
+                // Move the trim_count smallest to the front, then the trim_count largest to the back.
+                std::nth_element(samples.begin(), first, samples.end());
+                std::nth_element(first, last, samples.end());
+        }
+
+        int64_t sum{0};
+        for (auto it = first; it != last; ++it) {
+                sum += *it;
+        }
+        auto const count = static_cast<int64_t>(last - first);
+        auto const rounding = (sum >= 0 ? count : -count) / 2;
+        return static_cast<int>((sum + rounding) / count);
+}
+
+} // namespace Filter
+
+} // namespace BatteryMonitor
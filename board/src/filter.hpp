@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+namespace BatteryMonitor
+{
+
+namespace Filter
+{
+
+// Samples per channel in one ADC read, and how many each read discards from each end before averaging.
+inline constexpr std::size_t READ_SAMPLES{64};
+inline constexpr std::size_t READ_TRIM{READ_SAMPLES / 8};
+
+// Median of the samples, rounded down to the nearest integer for even counts.
+// Reorders samples in place. No allocation. Returns 0 for an empty span.
+int median(std::span<int> samples);
+
+// Mean of the samples after discarding the trim_count smallest and trim_count largest, rounded to the nearest integer.
+// trim_count is clamped so at least one sample is kept. Reorders samples in place. No allocation.
+// Returns 0 for an empty span.
+int trimmed_mean(std::span<int> samples, std::size_t trim_count);
+
+} // namespace Filter
+
+} // namespace BatteryMonitor
@@ -0,0 +1,197 @@
+extern "C" {
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+}
+
+#include "deferred_log.hpp"
+#include "ha_client.hpp"
+#include "payload.hpp"
+#include "secrets.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <ctime>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+namespace
+{
+
+constexpr auto TAG{"HA"};
+
+static_assert(!Secrets::LONG_LIVED_ACCESS_TOKEN.empty());
+static_assert(!Secrets::HA_URL.empty());
+static_assert(Secrets::HA_URL.back() != '/', "HA URL must not have a leading slash.");
+
+constexpr auto HOST_HEADER = terminated<HA_AUTHORITY.size()>(HA_AUTHORITY);
+
+// Home Assistant rarely changes address. A failed connection to the cached one resolves again anyway.
+constexpr std::chrono::hours DNS_CACHE_TTL{1};
+RTC_DATA_ATTR Net::DnsCache s_dns_cache;
+
+constexpr int HTTP_TIMEOUT_MS{5'000};
+
+} // namespace
+
+std::optional<uint32_t> resolve_ha_address(UploadStats &stats)
+{
+        auto const now_s = static_cast<int64_t>(std::time(nullptr));
+        if (auto const cached = Net::lookup(s_dns_cache, HA_ENDPOINT.host, now_s)) {
+                return cached;
+        }
+
+        // lwIP sends an mDNS query for .local names, and a DNS query otherwise.
+        auto const start_us = micros_since_wake();
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result{nullptr};
+        auto const error = getaddrinfo(HA_HOST_NAME.data(), nullptr, &hints, &result);
+        stats.resolve_us += micros_since_wake() - start_us;
+        if (error != 0 || result == nullptr) {
+                ESP_LOGW(TAG, "Could not resolve %s: %d.", HA_HOST_NAME.data(), error);
+                return std::nullopt;
+        }
+        auto const address = reinterpret_cast<sockaddr_in const *>(result->ai_addr)->sin_addr.s_addr;
+        freeaddrinfo(result);
+        Net::store(s_dns_cache, HA_ENDPOINT.host, address, now_s, DNS_CACHE_TTL);
+        DLOGI(TAG, "Resolved %s in %lld ms.", HA_HOST_NAME.data(),
+              static_cast<long long>((micros_since_wake() - start_us) / 1000));
+        return address;
+}
+
+void forget_ha_address() { Net::forget(s_dns_cache); }
+
+AddressUrl address_url(uint32_t const address)
+{
+        AddressUrl url{};
+        auto const *const octets = reinterpret_cast<uint8_t const *>(&address);
+        std::snprintf(url.data(), url.size(), "%s://%u.%u.%u.%u:%u", HA_ENDPOINT.is_tls ? "https" : "http", octets[0],
+                      octets[1], octets[2], octets[3], HA_ENDPOINT.port);
+        return url;
+}
+
+HaClient::~HaClient()
+{
+        close();
+        if (client != nullptr) {
+                esp_http_client_cleanup(client);
+        }
+}
+
+bool HaClient::post(std::string_view const entity_id, std::string_view const body)
+{
+        return post_to(HA_STATES_PATH, entity_id, body);
+}
+
+bool HaClient::fire_event(std::string_view const event_type, std::string_view const body)
+{
+        return post_to(HA_EVENTS_PATH, event_type, body);
+}
+
+bool HaClient::post_to(std::string_view const path, std::string_view const name, std::string_view const body)
+{
+        ++upload_stats.posts;
+        upload_stats.bytes_sent += static_cast<uint32_t>(body.size());
+        // Home Assistant may have closed the kept-alive connection since the last post, or moved to another address.
+        // Reconnect once.
+        std::optional<bool> response;
+        for (int attempt = 0; attempt < 2 && !response; ++attempt) {
+                if (attempt > 0) {
+                        ESP_LOGW(TAG, "Connection lost. Reconnecting.");
+                        close();
+                }
+                if (!base_url) {
+                        if (auto const address = resolve_ha_address(upload_stats)) {
+                                base_url = address_url(*address);
+                        }
+                }
+                // Without an address, esp_http_client resolves the name itself.
+                std::array<char, std::max(Secrets::HA_URL.size(), sizeof(AddressUrl)) + HA_STATES_PATH.size() + 64> url;
+                Payload::Writer url_writer{url};
+                url_writer.append(base_url ? std::string_view{base_url->data()} : Secrets::HA_URL);
+                url_writer.append(path).append(name).append('\0');
+                if (url_writer.overflowed()) {
+                        ESP_LOGE(TAG, "Name too long: %.*s", static_cast<int>(name.size()), name.data());
+                        ++upload_stats.failures;
+                        return false;
+                }
+                response = exchange(url.data(), body);
+        }
+        auto const is_ok = response.value_or(false);
+        if (!is_ok) {
+                ++upload_stats.failures;
+                close();
+        }
+        return is_ok;
+}
+
+void HaClient::close()
+{
+        if (client != nullptr && is_connected) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_http_client_close(client));
+        }
+        is_connected = false;
+}
+
+std::optional<bool> HaClient::exchange(char const *const url, std::string_view const body)
+{
+        if (client == nullptr) {
+                esp_http_client_config_t config{};
+                config.url = url;
+                config.method = HTTP_METHOD_POST;
+                config.timeout_ms = HTTP_TIMEOUT_MS;
+                config.keep_alive_enable = true;
+                client = esp_http_client_init(&config);
+                if (client == nullptr) {
+                        ESP_LOGE(TAG, "HTTP client init failed.");
+                        return std::nullopt;
+                }
+                esp_http_client_set_header(client, "Authorization", HA_AUTHORIZATION.data());
+                esp_http_client_set_header(client, "Content-Type", "application/json");
+        } else {
+                esp_http_client_set_url(client, url);
+        }
+        // Setting the URL sets Host to the address. Virtual hosts and reverse proxies need the name.
+        esp_http_client_set_header(client, "Host", HOST_HEADER.data());
+
+        // open() connects only if the session is not connected yet, then sends the request headers.
+        auto const start_us = micros_since_wake();
+        if (ESP_ERROR_CHECK_WITHOUT_ABORT(esp_http_client_open(client, static_cast<int>(body.size()))) != ESP_OK) {
+                if (!is_connected && base_url) {
+                        forget_ha_address();
+                        base_url.reset();
+                }
+                return std::nullopt;
+        }
+        auto const opened_us = micros_since_wake();
+        if (!is_connected) {
+                is_connected = true;
+                ++upload_stats.connects;
+                upload_stats.connect_us += opened_us - start_us;
+        }
+
+        auto const body_size = static_cast<int>(body.size());
+        if (esp_http_client_write(client, body.data(), body_size) != body_size ||
+            esp_http_client_fetch_headers(client) < 0) {
+                return std::nullopt;
+        }
+        // Drain the response so that the next request starts on a clean connection.
+        int flushed{0};
+        esp_http_client_flush_response(client, &flushed);
+        upload_stats.request_us += micros_since_wake() - opened_us;
+
+        auto const status = esp_http_client_get_status_code(client);
+        DLOGI(TAG, "POST %s: HTTP %d, %zu bytes.", url, status, body.size());
+        return status >= 200 && status < 300;
+}
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
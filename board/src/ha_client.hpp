@@ -0,0 +1,86 @@
+#pragma once
+
+extern "C" {
+#include "esp_http_client.h"
+}
+
+#include "endpoint.hpp"
+#include "hal.hpp"
+#include "secrets.h"
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+static_assert(Net::parse_endpoint(Secrets::HA_URL), "HA URL must start with http:// or https://.");
+inline constexpr Net::Endpoint HA_ENDPOINT{*Net::parse_endpoint(Secrets::HA_URL)};
+// The host and port as written in HA_URL, for the Host header of requests sent to the cached address.
+inline constexpr std::string_view HA_AUTHORITY{Secrets::HA_URL.substr(Secrets::HA_URL.find("://") + 3)};
+
+inline constexpr std::string_view HA_STATES_PATH{"/api/states/"};
+inline constexpr std::string_view HA_EVENTS_PATH{"/api/events/"};
+
+// NUL-terminated copy of text, for the C APIs.
+template <std::size_t Size> constexpr std::array<char, Size + 1> terminated(std::string_view const text)
+{
+        std::array<char, Size + 1> chars{};
+        std::copy(text.begin(), text.end(), chars.begin());
+        return chars;
+}
+inline constexpr auto HA_HOST_NAME = terminated<HA_ENDPOINT.host.size()>(HA_ENDPOINT.host);
+// "Bearer <token>", built at compile time.
+inline constexpr auto HA_AUTHORIZATION = [] {
+        constexpr std::string_view scheme{"Bearer "};
+        std::array<char, scheme.size() + Secrets::LONG_LIVED_ACCESS_TOKEN.size() + 1> header{};
+        auto const end = std::copy(scheme.begin(), scheme.end(), header.begin());
+        std::copy(Secrets::LONG_LIVED_ACCESS_TOKEN.begin(), Secrets::LONG_LIVED_ACCESS_TOKEN.end(), end);
+        return header;
+}();
+
+// IPv4 address of HA_ENDPOINT's host in network byte order, from the DNS cache in RTC memory if it has not expired.
+// Time spent resolving is added to stats.
+std::optional<uint32_t> resolve_ha_address(UploadStats &stats);
+// Resolve again on the next call, after a connection to the cached address failed.
+void forget_ha_address();
+
+// "http://" or "https://", the dotted address and the port, for a URL that skips name resolution.
+using AddressUrl = std::array<char, sizeof("https://255.255.255.255:65535")>;
+AddressUrl address_url(uint32_t address);
+
+// Home Assistant REST client. All posts in a wake share one HTTP/1.1 keep-alive connection.
+class HaClient final : public Uploader
+{
+      public:
+        HaClient() = default;
+        ~HaClient() override;
+        HaClient(HaClient const &) = delete;
+        HaClient &operator=(HaClient const &) = delete;
+
+        bool post(std::string_view entity_id, std::string_view body) override;
+        bool fire_event(std::string_view event_type, std::string_view body) override;
+        void close() override;
+        UploadStats const &stats() const override { return upload_stats; }
+
+      private:
+        // POST body to HA_URL + path + name, with the host replaced by its cached address.
+        bool post_to(std::string_view path, std::string_view name, std::string_view body);
+        // Send one request on the session. Returns whether the status was 2xx, or std::nullopt if the connection
+        // failed.
+        std::optional<bool> exchange(char const *url, std::string_view body);
+
+        // Cleared when a connection fails, to resolve again.
+        std::optional<AddressUrl> base_url;
+        esp_http_client_handle_t client{nullptr};
+        bool is_connected{false};
+        UploadStats upload_stats{};
+};
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
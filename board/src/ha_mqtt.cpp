@@ -0,0 +1,220 @@
+extern "C" {
+#include "esp_log.h"
+}
+
+#include "deferred_log.hpp"
+#include "ha_mqtt.hpp"
+#include "mqtt_discovery.hpp"
+#include "payload.hpp"
+#include "secrets.h"
+#include "utils.h"
+#include <array>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+#define MQTT_CONNECTED_BIT BIT0
+#define MQTT_DISCONNECTED_BIT BIT1
+#define MQTT_PUBLISHED_BIT BIT2
+
+namespace
+{
+
+constexpr auto TAG{"MQTT"};
+
+static_assert(!Secrets::MQTT_BROKER_URI.empty());
+
+constexpr std::chrono::seconds MQTT_TIMEOUT{5};
+
+// Hash of the discovery configs the broker retains. Kept in RTC memory so they are only republished after they
+// change. Zero on power-on, so the first wake always publishes them.
+RTC_DATA_ATTR uint32_t s_published_discovery_hash;
+
+} // namespace
+
+HaMqttClient::~HaMqttClient()
+{
+        close();
+        if (client != nullptr) {
+                esp_mqtt_client_destroy(client);
+        }
+        if (events != nullptr) {
+                vEventGroupDelete(events);
+        }
+}
+
+bool HaMqttClient::post(std::string_view const entity_id, std::string_view const body)
+{
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        Payload::Writer topic_writer{topic};
+        Mqtt::append_state_topic(topic_writer, entity_id).append('\0');
+        if (topic_writer.overflowed()) {
+                ESP_LOGE(TAG, "Entity ID too long: %.*s", static_cast<int>(entity_id.size()), entity_id.data());
+                return false;
+        }
+
+        // States are retained so that Home Assistant has them after a restart while the monitor sleeps.
+        return publish_with_retry(topic.data(), body, Mqtt::qos_for(entity_id), true);
+}
+
+bool HaMqttClient::fire_event(std::string_view const event_type, std::string_view const body)
+{
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        Payload::Writer topic_writer{topic};
+        Mqtt::append_event_topic(topic_writer, event_type).append('\0');
+        if (topic_writer.overflowed()) {
+                ESP_LOGE(TAG, "Event type too long: %.*s", static_cast<int>(event_type.size()), event_type.data());
+                return false;
+        }
+        return publish_with_retry(topic.data(), body, 1, false);
+}
+
+bool HaMqttClient::publish_with_retry(char const *const topic, std::string_view const payload, int const qos,
+                                      bool const retain)
+{
+        ++upload_stats.posts;
+        upload_stats.bytes_sent += static_cast<uint32_t>(payload.size());
+        auto is_ok = connect() && publish(topic, payload, qos, retain);
+        if (!is_ok) {
+                ESP_LOGW(TAG, "Publish failed. Reconnecting.");
+                close();
+                is_ok = connect() && publish(topic, payload, qos, retain);
+        }
+        if (!is_ok) {
+                ++upload_stats.failures;
+                close();
+        }
+        return is_ok;
+}
+
+void HaMqttClient::close()
+{
+        if (client != nullptr && is_connected) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_mqtt_client_disconnect(client));
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_mqtt_client_stop(client));
+        }
+        is_connected = false;
+}
+
+void HaMqttClient::handle_event(void *const arg, esp_event_base_t, int32_t const event_id, void *const event_data)
+{
+        auto &self = *static_cast<HaMqttClient *>(arg);
+        auto const event = static_cast<esp_mqtt_event_handle_t>(event_data);
+        switch (static_cast<esp_mqtt_event_id_t>(event_id)) {
+        case MQTT_EVENT_CONNECTED:
+                xEventGroupSetBits(self.events, MQTT_CONNECTED_BIT);
+                break;
+        case MQTT_EVENT_DISCONNECTED:
+                xEventGroupClearBits(self.events, MQTT_CONNECTED_BIT);
+                xEventGroupSetBits(self.events, MQTT_DISCONNECTED_BIT);
+                break;
+        case MQTT_EVENT_PUBLISHED:
+                self.acked_msg_id = event->msg_id;
+                xEventGroupSetBits(self.events, MQTT_PUBLISHED_BIT);
+                break;
+        default:
+                break;
+        }
+}
+
+bool HaMqttClient::connect()
+{
+        if (is_connected) {
+                return true;
+        }
+        if (client == nullptr) {
+                esp_mqtt_client_config_t config{};
+                config.broker.address.uri = Secrets::MQTT_BROKER_URI.data();
+                if (!Secrets::MQTT_USERNAME.empty()) {
+                        config.credentials.username = Secrets::MQTT_USERNAME.data();
+                        config.credentials.authentication.password = Secrets::MQTT_PASSWORD.data();
+                }
+                config.credentials.client_id = "batterymonitor";
+                // The connection only lives for one wake, and a failed connect is retried by post().
+                config.network.disable_auto_reconnect = true;
+                config.network.timeout_ms = static_cast<int>(std::chrono::milliseconds{MQTT_TIMEOUT}.count());
+                client = esp_mqtt_client_init(&config);
+                events = xEventGroupCreate();
+                if (client == nullptr || events == nullptr) {
+                        ESP_LOGE(TAG, "MQTT client init failed.");
+                        return false;
+                }
+                esp_mqtt_client_register_event(client, MQTT_EVENT_ANY, handle_event, this);
+        }
+
+        // CONNECT to CONNACK.
+        auto const start_us = micros_since_wake();
+        xEventGroupClearBits(events, MQTT_CONNECTED_BIT | MQTT_DISCONNECTED_BIT);
+        if (ESP_ERROR_CHECK_WITHOUT_ABORT(esp_mqtt_client_start(client)) != ESP_OK) {
+                return false;
+        }
+        auto const bits = xEventGroupWaitBits(events, MQTT_CONNECTED_BIT | MQTT_DISCONNECTED_BIT, pdFALSE, pdFALSE,
+                                              Utils::to_ticks(MQTT_TIMEOUT));
+        ++upload_stats.connects;
+        upload_stats.connect_us += micros_since_wake() - start_us;
+        if ((bits & MQTT_CONNECTED_BIT) == 0) {
+                ESP_LOGE(TAG, "Broker connection failed.");
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_mqtt_client_stop(client));
+                return false;
+        }
+        is_connected = true;
+        return publish_discovery();
+}
+
+bool HaMqttClient::publish_discovery()
+{
+        auto const hash = Mqtt::discovery_hash();
+        if (hash == s_published_discovery_hash) {
+                return true;
+        }
+
+        DLOGI(TAG, "Publishing discovery configs.");
+        static std::array<char, Mqtt::DISCOVERY_CONFIG_SIZE> config;
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        for (auto const &entity : Mqtt::DISCOVERY_ENTITIES) {
+                Payload::Writer topic_writer{topic};
+                Mqtt::append_discovery_topic(topic_writer, entity.entity_id).append('\0');
+                Payload::Writer config_writer{config};
+                auto const payload = Mqtt::append_discovery_config(config_writer, entity).view();
+                if (topic_writer.overflowed() || !payload) {
+                        ESP_LOGE(TAG, "Discovery config does not fit.");
+                        return false;
+                }
+                // Retained, so Home Assistant finds the entities whenever it subscribes.
+                if (!publish(topic.data(), *payload, 1, true)) {
+                        return false;
+                }
+        }
+        s_published_discovery_hash = hash;
+        return true;
+}
+
+bool HaMqttClient::publish(char const *const topic, std::string_view const payload, int const qos, bool const retain)
+{
+        auto const start_us = micros_since_wake();
+        xEventGroupClearBits(events, MQTT_PUBLISHED_BIT);
+        auto const msg_id = esp_mqtt_client_publish(client, topic, payload.data(), static_cast<int>(payload.size()),
+                                                    qos, retain ? 1 : 0);
+        if (msg_id < 0) {
+                return false;
+        }
+        // QoS 0 messages are sent once publish returns. QoS 1 messages are done at their PUBACK.
+        while (qos > 0 && acked_msg_id != msg_id) {
+                auto const bits = xEventGroupWaitBits(events, MQTT_PUBLISHED_BIT | MQTT_DISCONNECTED_BIT, pdTRUE,
+                                                      pdFALSE, Utils::to_ticks(MQTT_TIMEOUT));
+                if ((bits & MQTT_PUBLISHED_BIT) == 0) {
+                        ESP_LOGE(TAG, "No PUBACK for %s.", topic);
+                        return false;
+                }
+        }
+        upload_stats.request_us += micros_since_wake() - start_us;
+        DLOGI(TAG, "PUBLISH %s: QoS %d, %zu bytes.", topic, qos, payload.size());
+        return true;
+}
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
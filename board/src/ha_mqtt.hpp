@@ -0,0 +1,56 @@
+#pragma once
+
+extern "C" {
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "mqtt_client.h"
+}
+
+#include "hal.hpp"
+#include <atomic>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+// Home Assistant MQTT client. Publishes each state JSON to the entity's state topic over one broker connection per
+// wake, and the discovery configs only when they changed since the last wake that published them.
+class HaMqttClient final : public Uploader
+{
+      public:
+        HaMqttClient() = default;
+        ~HaMqttClient() override;
+        HaMqttClient(HaMqttClient const &) = delete;
+        HaMqttClient &operator=(HaMqttClient const &) = delete;
+
+        // Publishes body to batterymonitor/<object_id>/state. Waits for the PUBACK of QoS 1 messages.
+        bool post(std::string_view entity_id, std::string_view body) override;
+        // Publishes body to batterymonitor/event/<event_type> at QoS 1.
+        bool fire_event(std::string_view event_type, std::string_view body) override;
+        void close() override;
+        UploadStats const &stats() const override { return upload_stats; }
+
+      private:
+        static void handle_event(void *arg, esp_event_base_t base, int32_t event_id, void *event_data);
+
+        // Publish on the session, reconnecting once if that fails.
+        bool publish_with_retry(char const *topic, std::string_view payload, int qos, bool retain);
+        bool connect();
+        bool publish_discovery();
+        // Returns false if the message was not sent, or a QoS 1 message was not acknowledged.
+        bool publish(char const *topic, std::string_view payload, int qos, bool retain);
+
+        esp_mqtt_client_handle_t client{nullptr};
+        EventGroupHandle_t events{nullptr};
+        bool is_connected{false};
+        // Message ID of the last PUBACK.
+        std::atomic<int> acked_msg_id{-1};
+        UploadStats upload_stats{};
+};
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
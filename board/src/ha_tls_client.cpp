@@ -0,0 +1,291 @@
+extern "C" {
+#include "esp_attr.h"
+#include "esp_crt_bundle.h"
+#include "esp_log.h"
+#include "lwip/sockets.h"
+#include <unistd.h>
+}
+
+#include "deferred_log.hpp"
+#include "ha_client.hpp"
+#include "ha_tls_client.hpp"
+#include "http.hpp"
+#include <array>
+#include <ctime>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+namespace
+{
+
+constexpr auto TAG{"HA TLS"};
+
+constexpr std::chrono::seconds HTTP_TIMEOUT{5};
+// Saved sessions are offered for this long. A server that has already forgotten one does a full handshake instead.
+constexpr std::chrono::hours TLS_SESSION_LIFETIME{24};
+// mbedTLS wants the PEM with its terminating NUL.
+constexpr auto CA_CERT = terminated<Secrets::HA_CA_CERT.size()>(Secrets::HA_CA_CERT);
+
+RTC_DATA_ATTR Net::TlsSessionCache<> s_tls_session;
+
+int send_to_socket(void *const context, unsigned char const *const data, std::size_t const size)
+{
+        auto const sent = ::send(*static_cast<int *>(context), data, size, 0);
+        return sent < 0 ? MBEDTLS_ERR_SSL_INTERNAL_ERROR : static_cast<int>(sent);
+}
+
+int receive_from_socket(void *const context, unsigned char *const data, std::size_t const size)
+{
+        auto const received = ::recv(*static_cast<int *>(context), data, size, 0);
+        return received < 0 ? MBEDTLS_ERR_SSL_TIMEOUT : static_cast<int>(received);
+}
+
+// Offer the session saved by an earlier wake, if there is one.
+void offer_saved_session(mbedtls_ssl_context &ssl)
+{
+        auto const saved = Net::lookup(s_tls_session, HA_ENDPOINT.host, static_cast<int64_t>(std::time(nullptr)));
+        if (saved.empty()) {
+                return;
+        }
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        if (mbedtls_ssl_session_load(&session, saved.data(), saved.size()) != 0 ||
+            mbedtls_ssl_set_session(&ssl, &session) != 0) {
+                ESP_LOGW(TAG, "Saved TLS session not usable.");
+                Net::forget(s_tls_session);
+        }
+        mbedtls_ssl_session_free(&session);
+}
+
+// Keep the session of this handshake for the next wake. With session tickets the server keeps no state for it.
+void save_session(mbedtls_ssl_context const &ssl)
+{
+        mbedtls_ssl_session session;
+        mbedtls_ssl_session_init(&session);
+        std::array<uint8_t, Net::TLS_SESSION_BYTES> bytes;
+        std::size_t size{0};
+        if (mbedtls_ssl_get_session(&ssl, &session) != 0 ||
+            mbedtls_ssl_session_save(&session, bytes.data(), bytes.size(), &size) != 0 ||
+            !Net::store(s_tls_session, HA_ENDPOINT.host, std::span{bytes}.first(size),
+                        static_cast<int64_t>(std::time(nullptr)), TLS_SESSION_LIFETIME)) {
+                ESP_LOGW(TAG, "TLS session not saved. Is CONFIG_MBEDTLS_SSL_KEEP_PEER_CERTIFICATE off?");
+                Net::forget(s_tls_session);
+        }
+        mbedtls_ssl_session_free(&session);
+}
+
+} // namespace
+
+HaTlsClient::HaTlsClient()
+{
+        mbedtls_entropy_init(&entropy);
+        mbedtls_ctr_drbg_init(&drbg);
+        mbedtls_x509_crt_init(&ca_certificate);
+        mbedtls_ssl_config_init(&config);
+        mbedtls_ssl_init(&ssl);
+}
+
+HaTlsClient::~HaTlsClient()
+{
+        close();
+        mbedtls_ssl_free(&ssl);
+        mbedtls_ssl_config_free(&config);
+        mbedtls_x509_crt_free(&ca_certificate);
+        mbedtls_ctr_drbg_free(&drbg);
+        mbedtls_entropy_free(&entropy);
+}
+
+bool HaTlsClient::post(std::string_view const entity_id, std::string_view const body)
+{
+        return post_to(HA_STATES_PATH, entity_id, body);
+}
+
+bool HaTlsClient::fire_event(std::string_view const event_type, std::string_view const body)
+{
+        return post_to(HA_EVENTS_PATH, event_type, body);
+}
+
+bool HaTlsClient::post_to(std::string_view const path, std::string_view const name, std::string_view const body)
+{
+        std::array<char, HA_AUTHORIZATION.size() + HA_AUTHORITY.size() + 256> headers;
+        Payload::Writer writer{headers};
+        Http::append_post(writer, HA_AUTHORITY, path, name, HA_AUTHORIZATION.data(), body.size());
+        auto const request = writer.view();
+        if (!request) {
+                ESP_LOGE(TAG, "Name too long: %.*s", static_cast<int>(name.size()), name.data());
+                return false;
+        }
+
+        ++upload_stats.posts;
+        upload_stats.bytes_sent += static_cast<uint32_t>(body.size());
+        // Home Assistant may have closed the kept-alive connection since the last post. Reconnect once.
+        auto response = exchange(*request, body);
+        if (!response) {
+                ESP_LOGW(TAG, "Connection lost. Reconnecting.");
+                close();
+                response = exchange(*request, body);
+        }
+        auto const is_ok = response.value_or(false);
+        if (!is_ok) {
+                ++upload_stats.failures;
+                close();
+        }
+        return is_ok;
+}
+
+void HaTlsClient::close()
+{
+        if (is_connected) {
+                mbedtls_ssl_close_notify(&ssl);
+        }
+        if (socket_fd >= 0) {
+                ::close(socket_fd);
+                socket_fd = -1;
+        }
+        is_connected = false;
+}
+
+bool HaTlsClient::set_up()
+{
+        if (is_set_up) {
+                return true;
+        }
+        if (mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy, nullptr, 0) != 0 ||
+            mbedtls_ssl_config_defaults(&config, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                        MBEDTLS_SSL_PRESET_DEFAULT) != 0) {
+                ESP_LOGE(TAG, "TLS setup failed.");
+                return false;
+        }
+        if (Secrets::HA_CA_CERT.empty()) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_crt_bundle_attach(&config));
+        } else if (mbedtls_x509_crt_parse(&ca_certificate, reinterpret_cast<unsigned char const *>(CA_CERT.data()),
+                                          CA_CERT.size()) != 0) {
+                ESP_LOGE(TAG, "HA_CA_CERT is not a valid PEM certificate.");
+                return false;
+        } else {
+                mbedtls_ssl_conf_ca_chain(&config, &ca_certificate, nullptr);
+        }
+        mbedtls_ssl_conf_authmode(&config, MBEDTLS_SSL_VERIFY_REQUIRED);
+        mbedtls_ssl_conf_rng(&config, mbedtls_ctr_drbg_random, &drbg);
+        mbedtls_ssl_conf_session_tickets(&config, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+        if (mbedtls_ssl_setup(&ssl, &config) != 0 || mbedtls_ssl_set_hostname(&ssl, HA_HOST_NAME.data()) != 0) {
+                ESP_LOGE(TAG, "TLS setup failed.");
+                return false;
+        }
+        is_set_up = true;
+        return true;
+}
+
+bool HaTlsClient::connect()
+{
+        auto const address = set_up() ? resolve_ha_address(upload_stats) : std::nullopt;
+        if (!address) {
+                return false;
+        }
+
+        auto const start_us = micros_since_wake();
+        socket_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (socket_fd < 0) {
+                return false;
+        }
+        timeval const timeout{static_cast<time_t>(HTTP_TIMEOUT.count()), 0};
+        ::setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ::setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        // The headers and the body go out as two records. Without this the body waits for the server's delayed ACK.
+        int const no_delay{1};
+        ::setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(HA_ENDPOINT.port);
+        server.sin_addr.s_addr = *address;
+        if (::connect(socket_fd, reinterpret_cast<sockaddr const *>(&server), sizeof(server)) != 0) {
+                ESP_LOGW(TAG, "Could not connect. Resolving %s again next time.", HA_HOST_NAME.data());
+                forget_ha_address();
+                close();
+                return false;
+        }
+        auto const tcp_us = micros_since_wake();
+
+        mbedtls_ssl_session_reset(&ssl);
+        mbedtls_ssl_set_bio(&ssl, &socket_fd, send_to_socket, receive_from_socket, nullptr);
+        offer_saved_session(ssl);
+        int result{0};
+        while ((result = mbedtls_ssl_handshake(&ssl)) != 0) {
+                if (result != MBEDTLS_ERR_SSL_WANT_READ && result != MBEDTLS_ERR_SSL_WANT_WRITE) {
+                        ESP_LOGE(TAG, "TLS handshake failed: -0x%x.", static_cast<unsigned>(-result));
+                        Net::forget(s_tls_session);
+                        close();
+                        return false;
+                }
+        }
+        auto const end_us = micros_since_wake();
+        is_connected = true;
+        ++upload_stats.connects;
+        upload_stats.connect_us += end_us - start_us;
+        DLOGI(TAG, "Connected: TCP %lld ms, TLS handshake %lld ms.", static_cast<long long>((tcp_us - start_us) / 1000),
+              static_cast<long long>((end_us - tcp_us) / 1000));
+        save_session(ssl);
+        return true;
+}
+
+bool HaTlsClient::write_all(std::span<char const> data)
+{
+        while (!data.empty()) {
+                auto const written =
+                    mbedtls_ssl_write(&ssl, reinterpret_cast<unsigned char const *>(data.data()), data.size());
+                if (written == MBEDTLS_ERR_SSL_WANT_READ || written == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                        continue;
+                }
+                if (written <= 0) {
+                        return false;
+                }
+                data = data.subspan(static_cast<std::size_t>(written));
+        }
+        return true;
+}
+
+std::optional<bool> HaTlsClient::exchange(std::span<char const> const headers, std::string_view const body)
+{
+        if (!is_connected && !connect()) {
+                return std::nullopt;
+        }
+
+        auto const start_us = micros_since_wake();
+        if (!write_all(headers) || !write_all(body)) {
+                return std::nullopt;
+        }
+        // Read the whole response so that the next request starts on a clean connection.
+        Http::ResponseReader response;
+        std::array<char, 256> buffer;
+        while (!response.is_done() && !response.is_failed()) {
+                auto const received =
+                    mbedtls_ssl_read(&ssl, reinterpret_cast<unsigned char *>(buffer.data()), buffer.size());
+                if (received == MBEDTLS_ERR_SSL_WANT_READ || received == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                        continue;
+                }
+                if (received <= 0) {
+                        return std::nullopt;
+                }
+                response.feed(std::span{buffer}.first(static_cast<std::size_t>(received)));
+        }
+        upload_stats.request_us += micros_since_wake() - start_us;
+        if (response.is_failed()) {
+                ESP_LOGE(TAG, "Malformed response.");
+                close();
+                return false;
+        }
+        if (response.is_closing()) {
+                close();
+        }
+        auto const status = response.status();
+        DLOGI(TAG, "POST: HTTP %d, %zu bytes.", status, body.size());
+        return status >= 200 && status < 300;
+}
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
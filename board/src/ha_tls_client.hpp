@@ -0,0 +1,61 @@
+#pragma once
+
+extern "C" {
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/x509_crt.h"
+}
+
+#include "hal.hpp"
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+// Home Assistant REST client for an https:// HA_URL. Uses mbedTLS directly rather than esp_http_client, so that the
+// TLS session can be saved to RTC memory and resumed on the next wake with an abbreviated handshake. All posts in a
+// wake share one keep-alive connection, like HaClient.
+class HaTlsClient final : public Uploader
+{
+      public:
+        HaTlsClient();
+        ~HaTlsClient() override;
+        HaTlsClient(HaTlsClient const &) = delete;
+        HaTlsClient &operator=(HaTlsClient const &) = delete;
+
+        bool post(std::string_view entity_id, std::string_view body) override;
+        bool fire_event(std::string_view event_type, std::string_view body) override;
+        void close() override;
+        UploadStats const &stats() const override { return upload_stats; }
+
+      private:
+        bool post_to(std::string_view path, std::string_view name, std::string_view body);
+        // Set up the TLS configuration on the first connection of the wake.
+        bool set_up();
+        // Connect to the cached address and resume the saved session if there is one.
+        bool connect();
+        // Send one request on the session. Returns whether the status was 2xx, or std::nullopt if the connection
+        // failed.
+        std::optional<bool> exchange(std::span<char const> headers, std::string_view body);
+        bool write_all(std::span<char const> data);
+
+        bool is_set_up{false};
+        bool is_connected{false};
+        int socket_fd{-1};
+        mbedtls_entropy_context entropy;
+        mbedtls_ctr_drbg_context drbg;
+        mbedtls_x509_crt ca_certificate;
+        mbedtls_ssl_config config;
+        mbedtls_ssl_context ssl;
+        UploadStats upload_stats{};
+};
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
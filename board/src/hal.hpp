@@ -0,0 +1,171 @@
+#pragma once
+
+#if __has_include("esp_attr.h")
+#include "esp_attr.h"
+#else
+// Host builds have no RTC memory. Static storage already survives a simulated deep sleep.
+#define RTC_DATA_ATTR
+#define RTC_NOINIT_ATTR
+#endif
+
+#if __has_include("esp_log.h")
+#include "esp_log.h"
+#else
+#include <cstdio>
+// Host builds only print warnings and errors so that benchmarks are not dominated by console output.
+#define ESP_LOGE(tag, format, ...) std::fprintf(stderr, "E (%s) " format "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) std::fprintf(stderr, "W (%s) " format "\n", tag __VA_OPT__(, ) __VA_ARGS__)
+// The dead branch keeps format checking and marks the arguments as used.
+#define ESP_LOGI(tag, format, ...)                                                                                     \
+        do {                                                                                                           \
+                if (false)                                                                                             \
+                        std::fprintf(stderr, "I (%s) " format "\n", tag __VA_OPT__(, ) __VA_ARGS__);                   \
+        } while (0)
+#define ESP_LOGD(tag, format, ...) ESP_LOGI(tag, format __VA_OPT__(, ) __VA_ARGS__)
+#endif
+
+#include "sleep_policy.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// Hardware abstraction layer. The wake cycle only talks to the device through these, so that it builds and runs on
+// the target (hal_esp.cpp) and on a workstation (host/hal_host.cpp).
+namespace Hal
+{
+
+// Microseconds since this wake started.
+int64_t micros_since_wake();
+
+// ADC1, shared by every analog sensor.
+class Adc
+{
+      public:
+        virtual ~Adc() = default;
+        // Sample every channel in one pass and write the calibrated millivolts at each pin to pin_millivolts, which
+        // has one entry per channel. Returns false if the read failed.
+        virtual bool read_millivolts(std::span<uint8_t const> channels, std::span<int32_t> pin_millivolts) = 0;
+        // Sample one channel continuously at sample_rate_hz until pin_millivolts is full. Returns the number of
+        // calibrated samples written, or zero if the capture failed.
+        virtual std::size_t capture_millivolts(uint8_t channel, uint32_t sample_rate_hz,
+                                               std::span<uint16_t> pin_millivolts) = 0;
+};
+
+// Wall clock that keeps running through deep sleep.
+class Clock
+{
+      public:
+        virtual ~Clock() = default;
+        virtual int64_t now_s() = 0;
+};
+
+// Link to the network Home Assistant is on.
+class Network
+{
+      public:
+        virtual ~Network() = default;
+        // Bring the link up. Returns false if it is not up within timeout.
+        virtual bool connect(std::chrono::milliseconds timeout) = 0;
+        virtual void disconnect() = 0;
+        // Signal strength of the link in dBm, or std::nullopt if it is not up.
+        virtual std::optional<int8_t> rssi() = 0;
+};
+
+// Running totals for an uploader.
+struct UploadStats {
+        uint32_t connects;
+        uint32_t posts;
+        uint32_t failures;
+        // Time spent opening connections, and in requests from sending to the end of the response.
+        int64_t connect_us;
+        int64_t request_us;
+        // Request bodies only. Headers are the same with or without keep-alive.
+        uint32_t bytes_sent;
+        // Time spent resolving the server's name. Zero on wakes that used the cached address.
+        int64_t resolve_us;
+};
+
+constexpr UploadStats operator-(UploadStats const &after, UploadStats const &before)
+{
+        return UploadStats{after.connects - before.connects,     after.posts - before.posts,
+                           after.failures - before.failures,     after.connect_us - before.connect_us,
+                           after.request_us - before.request_us, after.bytes_sent - before.bytes_sent,
+                           after.resolve_us - before.resolve_us};
+}
+
+// RAM use of a wake, to catch stack overflows and heap fragmentation before they happen.
+struct MemoryStats {
+        uint32_t free_heap;
+        // Lowest free heap since boot.
+        uint32_t min_free_heap;
+        // Largest single allocation that would still succeed.
+        uint32_t largest_free_block;
+        // Most of the wake arena in use at once.
+        uint32_t arena_peak;
+        // Stack never touched by each task, in bytes. Zero if unknown or the task did not run.
+        uint32_t main_stack_free;
+        uint32_t wifi_stack_free;
+        uint32_t upload_stack_free;
+};
+
+// Heap and stack use so far. The caller fills in what the platform does not know about.
+MemoryStats memory_stats();
+
+// Posts entity states to Home Assistant. Posts share one keep-alive connection until close().
+class Uploader
+{
+      public:
+        virtual ~Uploader() = default;
+        // POST body, a state JSON, to /api/states/<entity_id>. Reconnects once if the connection fails. Returns false
+        // if the post failed.
+        virtual bool post(std::string_view entity_id, std::string_view body) = 0;
+        // POST body, a JSON object, to /api/events/<event_type>, on the same connection as post().
+        virtual bool fire_event(std::string_view event_type, std::string_view body) = 0;
+        // Close the connection. Called before the network goes down.
+        virtual void close() = 0;
+        virtual UploadStats const &stats() const = 0;
+};
+
+// NOR flash partition that keeps the offline reading log. Erased bytes read as 0xff, and writes can only clear bits.
+class Flash
+{
+      public:
+        static constexpr std::size_t SECTOR_SIZE{4096};
+
+        virtual ~Flash() = default;
+        // Partition size in bytes. A multiple of SECTOR_SIZE.
+        virtual std::size_t size() const = 0;
+        virtual bool read(std::size_t offset, std::span<uint8_t> data) = 0;
+        virtual bool write(std::size_t offset, std::span<uint8_t const> data) = 0;
+        // Erase the sector that starts at offset.
+        virtual bool erase_sector(std::size_t offset) = 0;
+};
+
+// Ends the wake.
+class Sleeper
+{
+      public:
+        virtual ~Sleeper() = default;
+        // Sleep for interval. Deep sleep does not return on the target. Light sleep returns when the next wake starts,
+        // with the network still up.
+        virtual void sleep(std::chrono::seconds interval, SleepMode mode) = 0;
+};
+
+struct Platform {
+        Adc &adc;
+        Clock &clock;
+        Network &network;
+        Uploader &uploader;
+        Sleeper &sleeper;
+        Flash &log_flash;
+};
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
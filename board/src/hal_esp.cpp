@@ -0,0 +1,353 @@
+extern "C" {
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_pm.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "soc/soc_caps.h"
+}
+
+#include "battery.hpp"
+#include "deferred_log.hpp"
+#include "ha_client.hpp"
+#include "ha_mqtt.hpp"
+#include "ha_tls_client.hpp"
+#include "hal_esp.hpp"
+#include "raw_trace.hpp"
+#include "static_task.hpp"
+#include "trace.hpp"
+#include "ulp_monitor.hpp"
+#include "utils.h"
+#include "wifi.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <ctime>
+#include <type_traits>
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+namespace
+{
+
+constexpr auto TAG{"HAL"};
+// On targets with a ULP-FSM, let the ULP watch the battery between reports instead of waking on a timer.
+constexpr bool USE_ULP_MONITOR{true};
+constexpr std::chrono::seconds ULP_SAMPLE_PERIOD{10};
+// Shortest deep sleep, for a wake that ran past its interval.
+constexpr std::chrono::milliseconds MIN_SLEEP_TIMER{100};
+// esp_timer_get_time() at the start of this wake. Zero on a boot.
+int64_t s_wake_start_us{0};
+
+// How states reach Home Assistant: POST to the REST API, or publish to an MQTT broker with discovery.
+enum class Transport { Http, Mqtt };
+constexpr Transport UPLOAD_TRANSPORT{Transport::Http};
+
+// Active-low output of a comparator that trips on a fast battery step, such as a crank, to wake for a capture. Must be
+// an RTC GPIO on the ESP32, or a deep-sleep wake GPIO on other targets. -1 to only capture on steps seen by a wake.
+constexpr int CAPTURE_WAKE_GPIO{-1};
+
+// Print the deferred log before every sleep instead of only after a reset. For debugging: it spends the console
+// time that deferred logging saves.
+constexpr bool FLUSH_LOG_EVERY_WAKE{false};
+
+// Print every wake's ADC codes as a raw trace (raw_trace.hpp), to replay on the host with --replay. Filtered prints
+// the code each read reduces to, about 30 characters a wake. Bursts prints every sample of the read, about 650
+// characters, so that replay covers the filter too. Both spend the console time that deferred logging saves.
+enum class RawRecording { Off, Filtered, Bursts };
+constexpr RawRecording RAW_RECORDING{RawRecording::Off};
+// The unit's calibration is printed once per boot, ahead of the first sample.
+RTC_DATA_ATTR bool s_is_calibration_recorded{false};
+
+void print_line(Payload::Writer const &writer)
+{
+        if (auto const line = writer.view()) {
+                std::printf("%.*s\n", static_cast<int>(line->size()), line->data());
+        }
+}
+
+void record_raw_trace()
+{
+        auto const &session = get_adc_session();
+        if (!session.is_calibrated()) {
+                return;
+        }
+        ArenaScope const scope{wake_arena()};
+        auto const buffer = wake_arena().allocate<char>(RawTrace::MAX_LINE_BYTES);
+        if (!s_is_calibration_recorded) {
+                Payload::Writer writer{buffer};
+                print_line(RawTrace::append_calibration(
+                    writer, RawTrace::UnitCalibration{session.calibration_table(), Sensors::battery_divider()}));
+                s_is_calibration_recorded = true;
+        }
+        std::array<int, Sensors::ADC_SENSOR_COUNT> filtered{};
+        std::array<std::span<int const>, Sensors::ADC_SENSOR_COUNT> bursts{};
+        for (std::size_t i = 0; i < bursts.size(); ++i) {
+                filtered[i] = session.last_raw(i);
+                bursts[i] = RAW_RECORDING == RawRecording::Bursts ? session.last_burst(i)
+                                                                   : std::span<int const>{&filtered[i], 1};
+        }
+        Payload::Writer writer{buffer};
+        print_line(RawTrace::append_sample(writer, static_cast<int64_t>(std::time(nullptr)), bursts));
+}
+
+// Starts the Wi-Fi driver, which then runs in its own tasks. Check wifi_stack_free in the wake trace before shrinking.
+constexpr uint32_t WIFI_TASK_STACK_BYTES{4096};
+StaticTask<WIFI_TASK_STACK_BYTES> s_wifi_task;
+
+// Start Wi-Fi state machine.
+void start_wifi_task(void *args)
+{
+        while (1) {
+                Wifi::wifi_init_station();
+                vTaskSuspend(NULL);
+        }
+}
+
+class EspAdc final : public Adc
+{
+      public:
+        bool read_millivolts(std::span<uint8_t const> const channels, std::span<int32_t> const pin_millivolts) override
+        {
+                if (!read_pin_millivolts(channels, pin_millivolts)) {
+                        return false;
+                }
+                // Only the wake's pass over every ADC sensor is a sample.
+                if constexpr (RAW_RECORDING != RawRecording::Off) {
+                        if (std::ranges::equal(channels, Sensors::ADC_CHANNELS)) {
+                                record_raw_trace();
+                        }
+                }
+                return true;
+        }
+
+        std::size_t capture_millivolts(uint8_t const channel, uint32_t const sample_rate_hz,
+                                       std::span<uint16_t> const pin_millivolts) override
+        {
+                return capture_pin_millivolts(channel, sample_rate_hz, pin_millivolts);
+        }
+};
+
+class EspClock final : public Clock
+{
+      public:
+        // The RTC keeps system time running through deep sleep. Nothing sets it, so it counts from power-on.
+        int64_t now_s() override { return static_cast<int64_t>(std::time(nullptr)); }
+};
+
+class EspNetwork final : public Network
+{
+      public:
+        explicit EspNetwork(ConnectPolicy const &policy) : policy{policy} {}
+
+        bool connect(std::chrono::milliseconds const timeout) override
+        {
+                s_wifi_task.start(start_wifi_task, "start wifi task", nullptr, 5);
+                return Wifi::connect_within(policy, timeout);
+        }
+
+        void disconnect() override
+        {
+                DLOGI(TAG, "Stopping Wi-Fi.");
+                Wifi::stop_wifi();
+        }
+
+        std::optional<int8_t> rssi() override { return Wifi::get_rssi(); }
+
+      private:
+        ConnectPolicy const &policy;
+};
+
+// The readinglog partition in partitions.csv.
+class EspFlash final : public Flash
+{
+      public:
+        std::size_t size() const override { return partition != nullptr ? partition->size : 0; }
+
+        bool read(std::size_t const offset, std::span<uint8_t> const data) override
+        {
+                return partition != nullptr && ESP_ERROR_CHECK_WITHOUT_ABORT(esp_partition_read(
+                                                   partition, offset, data.data(), data.size())) == ESP_OK;
+        }
+
+        bool write(std::size_t const offset, std::span<uint8_t const> const data) override
+        {
+                return partition != nullptr && ESP_ERROR_CHECK_WITHOUT_ABORT(esp_partition_write(
+                                                   partition, offset, data.data(), data.size())) == ESP_OK;
+        }
+
+        bool erase_sector(std::size_t const offset) override
+        {
+                return partition != nullptr && ESP_ERROR_CHECK_WITHOUT_ABORT(esp_partition_erase_range(
+                                                   partition, offset, SECTOR_SIZE)) == ESP_OK;
+        }
+
+      private:
+        esp_partition_t const *partition{
+            esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "readinglog")};
+};
+
+class EspSleeper final : public Sleeper
+{
+      public:
+        EspSleeper(Network &network, WakeState const &state, WakeConfig const &config)
+            : network{network}, state{state}, config{config}
+        {
+        }
+
+        void sleep(std::chrono::seconds const interval, SleepMode const mode) override
+        {
+                if (mode == SleepMode::Light && light_sleep(interval)) {
+                        return;
+                }
+                deep_sleep(interval);
+        }
+
+      private:
+        void deep_sleep(std::chrono::seconds const interval)
+        {
+                DLOGI(TAG, "Shutting down peripherals.");
+                network.disconnect();
+
+                // Anchored to the start of this wake, however long the upload took.
+                auto const awake = std::chrono::microseconds{micros_since_wake()};
+                auto const timer = sleep_timer(interval, awake, MIN_SLEEP_TIMER);
+                DLOGI(TAG, "Enabling sleep timer wakeup: %lld ms until wakeup.",
+                      static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(timer).count()));
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_sleep_enable_timer_wakeup(timer.count()));
+                if (USE_ULP_MONITOR && Ulp::is_supported()) {
+                        start_ulp_monitor();
+                }
+                if constexpr (CAPTURE_WAKE_GPIO >= 0) {
+                        enable_capture_wakeup();
+                }
+
+                wake_arena().reset();
+                DLOGI(TAG, "Entering Deep Sleep");
+                if constexpr (FLUSH_LOG_EVERY_WAKE) {
+                        Log::flush();
+                }
+                Trace::mark(Trace::Phase::SleepStart);
+                esp_deep_sleep_start();
+        }
+
+        // Returns once the interval is over, with Wi-Fi still associated. Returns false right away if automatic light
+        // sleep could not be enabled, e.g. without CONFIG_PM_ENABLE.
+        bool light_sleep(std::chrono::seconds const interval)
+        {
+                if (!is_light_sleep_enabled) {
+                        esp_pm_config_t const pm_config{
+                            .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+                            .min_freq_mhz = CONFIG_XTAL_FREQ,
+                            .light_sleep_enable = true,
+                        };
+                        if (ESP_ERROR_CHECK_WITHOUT_ABORT(esp_pm_configure(&pm_config)) != ESP_OK) {
+                                ESP_LOGW(TAG, "Automatic light sleep not available. Using deep sleep.");
+                                return false;
+                        }
+                        is_light_sleep_enabled = true;
+                }
+
+                auto const awake = std::chrono::microseconds{micros_since_wake()};
+                auto const timer = sleep_timer(interval, awake, MIN_SLEEP_TIMER);
+                DLOGI(TAG, "Light sleeping for %lld ms.",
+                      static_cast<long long>(std::chrono::duration_cast<std::chrono::milliseconds>(timer).count()));
+                Wifi::set_power_save(true);
+                wake_arena().reset();
+                if constexpr (FLUSH_LOG_EVERY_WAKE) {
+                        Log::flush();
+                }
+                Trace::mark(Trace::Phase::SleepStart);
+                // With no task ready, the idle task light sleeps until the next tick it must run, waking the radio
+                // only for the beacons it listens to.
+                vTaskDelay(Utils::to_ticks(timer));
+                s_wake_start_us = esp_timer_get_time();
+                Wifi::set_power_save(false);
+                return true;
+        }
+
+        // Hand the battery over to the ULP with a window around the last report. Replaces the timer wakeup on
+        // success.
+        void start_ulp_monitor()
+        {
+                auto const window_center = state.last_report.valid ? state.last_report.millivolts
+                                                                   : state.last_millivolts;
+                auto const window = Ulp::report_window(config.report_policy, window_center);
+                auto const low_raw = battery_millivolts_to_raw(window.low_millivolts);
+                auto const high_raw = battery_millivolts_to_raw(window.high_millivolts);
+                if (!low_raw || !high_raw) {
+                        ESP_LOGW(TAG, "No ADC calibration for the ULP window. Using the sleep timer.");
+                        return;
+                }
+
+                auto const heartbeat_runs =
+                    static_cast<uint16_t>(config.report_policy.heartbeat_interval / ULP_SAMPLE_PERIOD);
+                if (Ulp::start(*low_raw, *high_raw, heartbeat_runs, ULP_SAMPLE_PERIOD)) {
+                        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_TIMER));
+                }
+        }
+
+        static void enable_capture_wakeup()
+        {
+#if SOC_PM_SUPPORT_EXT0_WAKEUP
+                ESP_ERROR_CHECK_WITHOUT_ABORT(
+                    esp_sleep_enable_ext0_wakeup(static_cast<gpio_num_t>(CAPTURE_WAKE_GPIO), 0));
+#else
+                ESP_ERROR_CHECK_WITHOUT_ABORT(
+                    esp_deep_sleep_enable_gpio_wakeup(1ULL << CAPTURE_WAKE_GPIO, ESP_GPIO_WAKEUP_GPIO_LOW));
+#endif
+        }
+
+        Network &network;
+        WakeState const &state;
+        WakeConfig const &config;
+        bool is_light_sleep_enabled{false};
+};
+
+} // namespace
+
+// Called from app_main, so the main stack is the caller's.
+MemoryStats memory_stats()
+{
+        MemoryStats stats{};
+        stats.free_heap = static_cast<uint32_t>(heap_caps_get_free_size(MALLOC_CAP_8BIT));
+        stats.min_free_heap = static_cast<uint32_t>(heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+        stats.largest_free_block = static_cast<uint32_t>(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+        stats.main_stack_free = uxTaskGetStackHighWaterMark(nullptr) * sizeof(StackType_t);
+        stats.wifi_stack_free = s_wifi_task.stack_free();
+        return stats;
+}
+
+bool is_capture_wake()
+{
+        auto const cause = esp_sleep_get_wakeup_cause();
+        return CAPTURE_WAKE_GPIO >= 0 && (cause == ESP_SLEEP_WAKEUP_EXT0 || cause == ESP_SLEEP_WAKEUP_GPIO);
+}
+
+// esp_timer starts at boot, and every deep sleep wake is a boot. A wake from light sleep starts the count again.
+int64_t micros_since_wake() { return esp_timer_get_time() - s_wake_start_us; }
+
+Platform &esp_platform(WakeState const &state, WakeConfig const &config)
+{
+        static EspAdc adc;
+        static EspClock clock;
+        static EspNetwork network{config.connect_policy};
+        static std::conditional_t<UPLOAD_TRANSPORT == Transport::Mqtt, HaMqttClient,
+                                  std::conditional_t<HA_ENDPOINT.is_tls, HaTlsClient, HaClient>>
+            uploader;
+        static EspSleeper sleeper{network, state, config};
+        static EspFlash log_flash;
+        static Platform platform{adc, clock, network, uploader, sleeper, log_flash};
+        return platform;
+}
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "hal.hpp"
+#include "wake_cycle.hpp"
+
+namespace BatteryMonitor
+{
+
+namespace Hal
+{
+
+// Target implementation of the HAL. When the ULP is available, the sleeper hands the battery over to it with a window
+// around the last report in state, instead of waking on a timer.
+Platform &esp_platform(WakeState const &state, WakeConfig const &config);
+
+// Whether this wake was started by the external capture trigger.
+bool is_capture_wake();
+
+} // namespace Hal
+
+} // namespace BatteryMonitor
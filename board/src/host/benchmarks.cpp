@@ -0,0 +1,366 @@
+#include "benchmarks.hpp"
+#include "calibration.hpp"
+#include "capture.hpp"
+#include "deferred_log.hpp"
+#include "entity.hpp"
+#include "filter.hpp"
+#include "hal_host.hpp"
+#include "reading_log.hpp"
+#include "utils.h"
+#include "wake_cycle.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+std::atomic<std::size_t> s_allocation_count{0};
+}
+
+// Count heap allocations so that the benchmark can report them per encode.
+// GCC does not see that the replaced operator new pairs with the free() below.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(std::size_t size)
+{
+        s_allocation_count.fetch_add(1, std::memory_order_relaxed);
+        if (auto *const memory = std::malloc(size == 0 ? 1 : size)) {
+                return memory;
+        }
+        throw std::bad_alloc{};
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+// The upload path before the payload encoder: a heap-allocated entity, std::to_string for the voltage, every
+// attribute built from literals, and the readings formatted into a string attribute.
+std::string encode_legacy(WakeState const &state, ReportReason const reason, int64_t const now_s)
+{
+        auto entity = std::make_unique<Entity>();
+        entity->state = std::to_string(state.readings.newest().millivolts / 1000.f);
+        entity->entity_id = "sensor.car_battery";
+        entity->add_attribute("friendly_name", "Car Battery Voltage");
+        entity->add_attribute("unit_of_measurement", "Volts");
+
+        std::string readings{"["};
+        readings.reserve(state.readings.size() * sizeof("[86400,12.345],"));
+        for (std::size_t i = 0; i < state.readings.size(); ++i) {
+                auto const &reading = state.readings[i];
+                char buf[48];
+                std::snprintf(buf, sizeof(buf), "%s[%lld,%u.%03u]", i == 0 ? "" : ",",
+                              static_cast<long long>(now_s - reading.timestamp_s), reading.millivolts / 1000u,
+                              reading.millivolts % 1000u);
+                readings += buf;
+        }
+        readings += "]";
+        entity->add_attribute("readings", readings);
+        entity->add_attribute("report_reason", report_reason_name(reason));
+        return to_json(*entity);
+}
+
+struct Result {
+        double encode_ns;
+        double allocations;
+        std::size_t bytes;
+};
+
+template <typename Encode> Result measure(std::size_t const iterations, Encode &&encode)
+{
+        std::size_t bytes{0};
+        auto const allocations_before = s_allocation_count.load();
+        auto const start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < iterations; ++i) {
+                bytes = encode();
+        }
+        auto const elapsed = std::chrono::steady_clock::now() - start;
+        auto const allocations = s_allocation_count.load() - allocations_before;
+        return Result{std::chrono::duration<double, std::nano>(elapsed).count() / static_cast<double>(iterations),
+                      static_cast<double>(allocations) / static_cast<double>(iterations), bytes};
+}
+
+void print(char const *path, std::size_t const readings, Result const &result)
+{
+        std::printf("payload.%s.readings_%zu.encode_ns=%.1f\n", path, readings, result.encode_ns);
+        std::printf("payload.%s.readings_%zu.allocations=%.1f\n", path, readings, result.allocations);
+        std::printf("payload.%s.readings_%zu.bytes=%zu\n", path, readings, result.bytes);
+}
+
+// Keep the compiler from dropping a result that is otherwise unused.
+template <typename T> void keep(T const &value) { asm volatile("" : : "r,m"(value) : "memory"); }
+
+// Stand-ins for recordings of a 12.6 V battery at the capture rate, with a few millivolts of ADC noise.
+constexpr uint16_t WAVEFORM_RESTING_MILLIVOLTS{12'600};
+
+// 100 ms at rest, the starter's inrush down to 9.4 V, 700 ms of cranking around 10.2 V with commutation ripple,
+// then the engine catches and the alternator brings it up to 14.2 V.
+std::vector<uint16_t> crank_waveform(uint32_t const rate_hz, std::size_t const samples)
+{
+        std::mt19937 rng{1};
+        std::normal_distribution<double> noise{0.0, 4.0};
+        std::vector<uint16_t> waveform(samples);
+        for (std::size_t i = 0; i < samples; ++i) {
+                auto const t = static_cast<double>(i) / rate_hz;
+                double mv{WAVEFORM_RESTING_MILLIVOLTS};
+                if (t >= 0.1 && t < 0.8) {
+                        auto const inrush = -800.0 * std::exp(-(t - 0.1) / 0.02);
+                        auto const commutation = 300.0 * std::sin(2 * M_PI * 150.0 * t);
+                        mv = 10'200.0 + inrush + commutation;
+                } else if (t >= 0.8) {
+                        auto const charge = 1.0 - std::exp(-(t - 0.8) / 0.15);
+                        mv = 10'200.0 + (14'200.0 - 10'200.0) * charge + 60.0 * std::sin(2 * M_PI * 700.0 * t);
+                }
+                waveform[i] = static_cast<uint16_t>(std::lround(mv + noise(rng)));
+        }
+        return waveform;
+}
+
+// The alternator at 14.2 V with the ripple of a healthy rectifier.
+std::vector<uint16_t> charging_waveform(uint32_t const rate_hz, std::size_t const samples)
+{
+        std::mt19937 rng{2};
+        std::normal_distribution<double> noise{0.0, 4.0};
+        std::vector<uint16_t> waveform(samples);
+        for (std::size_t i = 0; i < samples; ++i) {
+                auto const t = static_cast<double>(i) / rate_hz;
+                waveform[i] = static_cast<uint16_t>(std::lround(14'200.0 + 40.0 * std::sin(2 * M_PI * 700.0 * t) +
+                                                                noise(rng)));
+        }
+        return waveform;
+}
+
+// One battery millivolt reading per line, taken at the capture rate. Returns an empty waveform on failure.
+std::vector<uint16_t> load_waveform(char const *const path)
+{
+        std::vector<uint16_t> waveform;
+        auto *const file = std::fopen(path, "r");
+        if (file == nullptr) {
+                return waveform;
+        }
+        unsigned millivolts{0};
+        while (waveform.size() < Capture::MAX_SAMPLES && std::fscanf(file, "%u", &millivolts) == 1) {
+                waveform.push_back(static_cast<uint16_t>(millivolts));
+        }
+        std::fclose(file);
+        return waveform;
+}
+
+} // namespace
+
+void run_payload_benchmark(std::size_t const iterations)
+{
+        constexpr int64_t NOW_S{1'700'000'000};
+        for (auto const reading_count : {std::size_t{1}, READING_RING_CAPACITY}) {
+                // Static like the RTC memory it stands in for.
+                static WakeState state;
+                state.readings.clear();
+                for (std::size_t i = 0; i < reading_count; ++i) {
+                        auto const age_s = static_cast<int64_t>(reading_count - i) * 60;
+                        state.readings.push({NOW_S - age_s, static_cast<uint16_t>(12'600 - i)});
+                }
+
+                auto const legacy = measure(iterations, [&] {
+                        auto const json = encode_legacy(state, ReportReason::Heartbeat, NOW_S);
+                        return json.size();
+                });
+                static std::array<char, BATCH_PAYLOAD_SIZE> buffer;
+                auto const fixed = measure(iterations, [&] {
+                        auto const json = encode_batch_state(buffer, state, ReportReason::Heartbeat, NOW_S);
+                        return json ? json->size() : 0;
+                });
+                print("legacy", reading_count, legacy);
+                print("fixed", reading_count, fixed);
+        }
+}
+
+void run_log_benchmark(std::size_t const readings)
+{
+        // A reading a minute from a slowly drifting battery.
+        std::vector<Reading> written(readings);
+        std::mt19937 generator{1};
+        std::uniform_int_distribution<int> step{-3, 3};
+        int millivolts{12'600};
+        for (std::size_t i = 0; i < readings; ++i) {
+                millivolts = std::clamp(millivolts + step(generator), 11'000, 13'000);
+                written[i] = {1'700'000'000 + static_cast<int64_t>(i) * 60, static_cast<uint16_t>(millivolts)};
+        }
+
+        RamFlash flash{LOG_PARTITION_SIZE};
+        static LogCursor cursor;
+        cursor = LogCursor{};
+        ReadingLog log{flash, cursor};
+        // Mount up front so that formatting is not timed.
+        log.pending();
+        auto const bytes_before = flash.bytes_written();
+        auto start = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < readings; i += READING_RING_CAPACITY) {
+                log.append(std::span{written}.subspan(i, std::min(READING_RING_CAPACITY, readings - i)));
+        }
+        auto const append_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+        auto const bytes_written = flash.bytes_written() - bytes_before;
+
+        // Everything that was not dropped comes back in order.
+        std::array<Reading, BACKFILL_CHUNK_READINGS> chunk;
+        std::size_t read_back{0};
+        std::size_t mismatches{0};
+        start = std::chrono::steady_clock::now();
+        LogPosition next;
+        while (auto const count = log.read(chunk, next)) {
+                for (std::size_t i = 0; i < count; ++i, ++read_back) {
+                        mismatches += chunk[i] != written[cursor.dropped + read_back];
+                }
+                log.mark_uploaded(next, count);
+        }
+        auto const read_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+
+        auto const count = static_cast<double>(std::max<std::size_t>(readings, 1));
+        auto const bytes_per_reading = static_cast<double>(bytes_written) / count;
+        auto const sectors = LOG_PARTITION_SIZE / Hal::Flash::SECTOR_SIZE;
+        std::printf("log.readings=%zu\n", readings);
+        std::printf("log.append_ns_per_reading=%.1f\n", append_ns.count() / count);
+        std::printf("log.read_ns_per_reading=%.1f\n",
+                    read_ns.count() / static_cast<double>(std::max<std::size_t>(read_back, 1)));
+        std::printf("log.flash_bytes_per_reading=%.2f\n", bytes_per_reading);
+        std::printf("log.capacity_readings=%.0f\n",
+                    static_cast<double>(sectors - 1) * (Hal::Flash::SECTOR_SIZE - ReadingLog::HEADER_SIZE) /
+                        std::max(bytes_per_reading, 1.0));
+        std::printf("log.dropped=%u\n", cursor.dropped);
+        std::printf("log.read_back=%zu\n", read_back);
+        std::printf("log.mismatches=%zu\n", mismatches);
+        std::printf("log.sector_erases_max=%u\n", flash.max_sector_erases());
+        std::printf("log.sector_erases_min=%u\n", flash.min_sector_erases());
+}
+
+void run_micro_benchmark(std::size_t const iterations)
+{
+        // The ESP32's line fitting at 11 dB with a typical Vref.
+        auto const table = *Calibration::build_table([](int const raw) -> std::optional<int> {
+                return static_cast<int>((61'630 * raw + 32'768) / 65'536) + 142;
+        });
+        auto const &temperature = Sensors::REGISTRY[1];
+        static std::array<char, SENSOR_PAYLOAD_SIZE> buffer;
+
+        // Inputs change every iteration so that nothing is folded into a constant.
+        std::size_t i{0};
+        auto const raw = [&i] { return static_cast<int>(++i % (Calibration::AdcTable::MAX_RAW + 1)); };
+        auto const millivolts = [&i] { return static_cast<int32_t>(10'000 + ++i % 5'000); };
+        auto const run = [iterations](char const *name, auto &&step) {
+                auto const result = measure(iterations, [&step] {
+                        keep(step());
+                        return std::size_t{0};
+                });
+                std::printf("micro.%s.ns_per_op=%.2f\n", name, result.encode_ns);
+                std::printf("micro.%s.allocations=%.1f\n", name, result.allocations);
+        };
+
+        // One channel's burst of an ADC read, with noise and the odd spike. The filters reorder it in place, so each
+        // run works on a fresh copy, which is included in the time.
+        constexpr std::size_t BURSTS{16};
+        std::array<std::array<int, Filter::READ_SAMPLES>, BURSTS> bursts{};
+        std::mt19937 rng{1};
+        std::normal_distribution<double> noise{0.0, 6.0};
+        for (auto &burst : bursts) {
+                for (auto &sample : burst) {
+                        sample = static_cast<int>(std::lround(2'480.0 + noise(rng)));
+                }
+                burst[rng() % burst.size()] = Calibration::AdcTable::MAX_RAW;
+        }
+        std::array<int, Filter::READ_SAMPLES> burst{};
+        auto const next_burst = [&] {
+                burst = bursts[++i % BURSTS];
+                return std::span{burst};
+        };
+
+        run("trimmed_mean_64_trim_8", [&] { return Filter::trimmed_mean(next_burst(), Filter::READ_TRIM); });
+        run("median_64", [&] { return Filter::median(next_burst()); });
+        run("burst_copy_64", [&] { return next_burst()[0]; });
+        run("raw_to_battery_millivolts",
+            [&] { return Sensors::battery_millivolts(Calibration::to_millivolts(table, raw())); });
+        // The float divider the integer one replaced.
+        run("raw_to_battery_millivolts_float", [&] {
+                return static_cast<int32_t>(std::lround(Calibration::to_millivolts(table, raw()) * 5.02f));
+        });
+        run("battery_millivolts_to_raw",
+            [&] { return Calibration::to_raw(table, Sensors::battery_pin_millivolts(millivolts())); });
+        run("append_fixed", [&] {
+                Payload::Writer writer{buffer};
+                return writer.append_fixed(millivolts(), 3).view()->size();
+        });
+        run("sensor_state", [&] {
+                Payload::Writer writer{buffer};
+                return Sensors::append_state(writer, temperature, millivolts() - 10'000).view()->size();
+        });
+        run("to_ticks", [&] { return Utils::to_ticks(std::chrono::milliseconds{millivolts()}); });
+        // A typical wake path line, deferred and formatted. The console time for the text comes on top of the latter.
+        run("deferred_log", [&] {
+                DLOGI("Wake", "Recorded reading %zu/%zu.", static_cast<std::size_t>(millivolts()), std::size_t{64});
+                return 0;
+        });
+        run("format_log", [&] {
+                return std::snprintf(buffer.data(), buffer.size(), "I (%d) %s: Recorded reading %zu/%zu.\n", 1234,
+                                     "Wake", static_cast<std::size_t>(millivolts()), std::size_t{64});
+        });
+}
+
+void run_capture_benchmark(std::size_t const iterations, char const *const waveform_path)
+{
+        auto const &policy = WAKE_CONFIG.capture_policy;
+        auto const samples = Capture::sample_count(policy);
+        static std::array<uint16_t, Capture::MAX_SAMPLES / 2> scratch;
+
+        auto const run = [&](char const *name, std::vector<uint16_t> const &waveform, uint16_t const resting) {
+                Capture::Features features{};
+                auto const result = measure(iterations, [&] {
+                        features = Capture::extract(policy, Capture::Trigger::Drop, resting, waveform, scratch);
+                        keep(features);
+                        return std::size_t{0};
+                });
+                std::printf("capture.%s.samples=%lu\n", name, static_cast<unsigned long>(features.samples));
+                std::printf("capture.%s.min_mv=%u\n", name, features.min_millivolts);
+                std::printf("capture.%s.dip_ms=%lu\n", name, static_cast<unsigned long>(features.dip_ms));
+                std::printf("capture.%s.recovery_ms=%ld\n", name,
+                            features.is_recovered ? static_cast<long>(features.recovery_ms) : -1L);
+                std::printf("capture.%s.settled_mv=%u\n", name, features.settled_millivolts);
+                std::printf("capture.%s.ripple_mv=%u\n", name, features.ripple_millivolts);
+                std::printf("capture.%s.ripple_rms_mv=%u\n", name, features.ripple_rms_millivolts);
+                std::printf("capture.%s.extract_us=%.2f\n", name, result.encode_ns / 1000.0);
+                std::printf("capture.%s.ns_per_sample=%.3f\n", name,
+                            result.encode_ns / static_cast<double>(std::max<std::size_t>(waveform.size(), 1)));
+                std::printf("capture.%s.allocations=%.1f\n", name, result.allocations);
+        };
+
+        if (waveform_path != nullptr) {
+                auto const waveform = load_waveform(waveform_path);
+                if (waveform.empty()) {
+                        std::fprintf(stderr, "Could not read a waveform from %s\n", waveform_path);
+                        return;
+                }
+                // A recording starts at rest.
+                run("recorded", waveform, waveform.front());
+                return;
+        }
+        run("crank", crank_waveform(policy.sample_rate_hz, samples), WAVEFORM_RESTING_MILLIVOLTS);
+        run("charging", charging_waveform(policy.sample_rate_hz, samples), WAVEFORM_RESTING_MILLIVOLTS);
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
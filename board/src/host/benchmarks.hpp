@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Compare the fixed-buffer payload encoder with the entity-and-strings path it replaced (the shape of the old
+// HAEntity upload). Prints key=value results.
+void run_payload_benchmark(std::size_t iterations);
+// Append readings to the flash reading log in reading-ring batches, read them back in backfill chunks, and report
+// throughput, flash bytes per reading and sector wear. Prints key=value results.
+void run_log_benchmark(std::size_t readings);
+// Time the small pure functions on every wake's path: the ADC burst filter, voltage conversion, payload formatting
+// and tick conversion. Prints key=value results.
+void run_micro_benchmark(std::size_t iterations);
+// Extract capture features from a synthetic crank and a charging alternator, or from the recording at waveform_path
+// (one battery millivolt reading per line at the capture rate) if it is not null. Prints the features and the time
+// per sample as key=value results.
+void run_capture_benchmark(std::size_t iterations, char const *waveform_path);
+// Time a wake's upload over TLS against a local server three ways: resolving the name and doing a full handshake,
+// with the address from the DNS cache, and resuming the session saved by the previous wake. Prints key=value results.
+void run_tls_benchmark(std::size_t iterations);
+
+} // namespace Host
+
+} // namespace BatteryMonitor
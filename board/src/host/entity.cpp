@@ -0,0 +1,61 @@
+#include "entity.hpp"
+#include <cstdio>
+
+namespace BatteryMonitor
+{
+
+namespace
+{
+
+void append_json_string(std::string &out, std::string const &value)
+{
+        out += '"';
+        for (auto const c : value) {
+                switch (c) {
+                case '"':
+                        out += "\\\"";
+                        break;
+                case '\\':
+                        out += "\\\\";
+                        break;
+                case '\n':
+                        out += "\\n";
+                        break;
+                default:
+                        if (static_cast<unsigned char>(c) < 0x20) {
+                                char escaped[7];
+                                std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                                out += escaped;
+                        } else {
+                                out += c;
+                        }
+                }
+        }
+        out += '"';
+}
+
+} // namespace
+
+void Entity::add_attribute(std::string key, std::string value)
+{
+        attributes.emplace_back(std::move(key), std::move(value));
+}
+
+std::string to_json(Entity const &entity)
+{
+        std::string out{"{\"state\":"};
+        append_json_string(out, entity.state);
+        out += ",\"attributes\":{";
+        for (std::size_t i = 0; i < entity.attributes.size(); ++i) {
+                if (i != 0) {
+                        out += ',';
+                }
+                append_json_string(out, entity.attributes[i].first);
+                out += ':';
+                append_json_string(out, entity.attributes[i].second);
+        }
+        out += "}}";
+        return out;
+}
+
+} // namespace BatteryMonitor
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace BatteryMonitor
+{
+
+// A Home Assistant entity state built from strings, as the firmware did before the payload encoder. Only kept as the
+// baseline of the payload benchmark, so it is not built for the board.
+struct Entity {
+        std::string entity_id;
+        std::string state;
+        std::vector<std::pair<std::string, std::string>> attributes;
+
+        void add_attribute(std::string key, std::string value);
+};
+
+// Body for POST /api/states/<entity_id>: {"state":"...","attributes":{"key":"value",...}}
+std::string to_json(Entity const &entity);
+
+} // namespace BatteryMonitor
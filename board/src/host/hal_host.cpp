@@ -0,0 +1,457 @@
+#include "hal_host.hpp"
+#include "mqtt_discovery.hpp"
+#include "sensors.hpp"
+#include "trace.hpp"
+#include "wake_cycle.hpp"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdlib>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace BatteryMonitor
+{
+
+namespace
+{
+
+std::chrono::steady_clock::time_point s_wake_start{std::chrono::steady_clock::now()};
+
+int64_t elapsed_us(std::chrono::steady_clock::time_point const start)
+{
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+// TCP connection to port on 127.0.0.1. Returns the socket, or -1 if the connection failed.
+int connect_loopback(uint16_t const port)
+{
+        auto const fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+                return -1;
+        }
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+                ::close(fd);
+                return -1;
+        }
+        return fd;
+}
+
+} // namespace
+
+namespace Hal
+{
+
+int64_t micros_since_wake()
+{
+        auto const elapsed = std::chrono::steady_clock::now() - s_wake_start;
+        // Trace treats a zero timestamp as a phase that was not reached.
+        return std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+// The host has no fixed heap or task stacks worth reporting. Only the wake arena is measured.
+MemoryStats memory_stats() { return MemoryStats{}; }
+
+} // namespace Hal
+
+namespace Host
+{
+
+void reset_wake_clock() { s_wake_start = std::chrono::steady_clock::now(); }
+
+SimulatedAdc::SimulatedAdc(SimulatedClock &clock, DischargeProfile const &profile)
+    : clock{clock}, profile{profile}, start_s{clock.now_s()}, generator{profile.seed},
+      noise{0.0, profile.noise_millivolts}
+{
+}
+
+bool SimulatedAdc::read_millivolts(std::span<uint8_t const> const channels, std::span<int32_t> const pin_millivolts)
+{
+        constexpr auto battery_channel = Sensors::REGISTRY[Sensors::BATTERY].adc_channel;
+        auto const hours = static_cast<double>(clock.now_s() - start_s) / 3600.0;
+        for (std::size_t i = 0; i < channels.size(); ++i) {
+                if (channels[i] == battery_channel) {
+                        auto const battery_millivolts =
+                            profile.start_millivolts - profile.drain_millivolts_per_hour * hours + noise(generator);
+                        pin_millivolts[i] = Sensors::battery_pin_millivolts(
+                            static_cast<int32_t>(std::lround(std::max(battery_millivolts, 0.0))));
+                } else {
+                        // TMP235 at 20 C +- 10 C.
+                        auto const celsius = 20.0 + 10.0 * std::sin(2.0 * M_PI * hours / 24.0);
+                        pin_millivolts[i] = static_cast<int32_t>(std::lround(500.0 + 10.0 * celsius));
+                }
+        }
+        return true;
+}
+
+std::size_t SimulatedAdc::capture_millivolts(uint8_t const channel, uint32_t, std::span<uint16_t> const pin_millivolts)
+{
+        std::array<int32_t, 1> pin{};
+        if (!read_millivolts({&channel, 1}, pin)) {
+                return 0;
+        }
+        // ADC noise at the pin.
+        for (auto &sample : pin_millivolts) {
+                auto const noisy = pin[0] + static_cast<int32_t>(std::lround(noise(generator)));
+                sample = static_cast<uint16_t>(std::clamp<int32_t>(noisy, 0, UINT16_MAX));
+        }
+        return pin_millivolts.size();
+}
+
+bool LoopbackNetwork::connect(std::chrono::milliseconds)
+{
+        ++connect_count;
+        Trace::mark(Trace::Phase::WifiStarted);
+        if (!is_up) {
+                return false;
+        }
+        Trace::mark(Trace::Phase::GotIp);
+        return true;
+}
+
+RamFlash::RamFlash(std::size_t const size)
+    : bytes(size / SECTOR_SIZE * SECTOR_SIZE, 0xff), sector_erases(size / SECTOR_SIZE, 0)
+{
+}
+
+bool RamFlash::read(std::size_t const offset, std::span<uint8_t> const data)
+{
+        if (offset + data.size() > bytes.size()) {
+                return false;
+        }
+        std::copy_n(bytes.begin() + static_cast<std::ptrdiff_t>(offset), data.size(), data.begin());
+        return true;
+}
+
+bool RamFlash::write(std::size_t const offset, std::span<uint8_t const> const data)
+{
+        if (offset + data.size() > bytes.size()) {
+                return false;
+        }
+        // Programming can only clear bits.
+        for (std::size_t i = 0; i < data.size(); ++i) {
+                bytes[offset + i] &= data[i];
+        }
+        write_byte_count += data.size();
+        return true;
+}
+
+bool RamFlash::erase_sector(std::size_t const offset)
+{
+        if (offset % SECTOR_SIZE != 0 || offset >= bytes.size()) {
+                return false;
+        }
+        std::fill_n(bytes.begin() + static_cast<std::ptrdiff_t>(offset), SECTOR_SIZE, 0xff);
+        ++sector_erases[offset / SECTOR_SIZE];
+        return true;
+}
+
+uint32_t RamFlash::max_sector_erases() const { return *std::max_element(sector_erases.begin(), sector_erases.end()); }
+
+uint32_t RamFlash::min_sector_erases() const { return *std::min_element(sector_erases.begin(), sector_erases.end()); }
+
+HttpUploader::HttpUploader(uint16_t const port, std::string_view const token, bool const keep_alive)
+    : port{port}, token{token}, keep_alive{keep_alive}
+{
+}
+
+HttpUploader::~HttpUploader() { close(); }
+
+bool HttpUploader::post(std::string_view const entity_id, std::string_view const body)
+{
+        return post_to("/api/states/", entity_id, body);
+}
+
+bool HttpUploader::fire_event(std::string_view const event_type, std::string_view const body)
+{
+        return post_to("/api/events/", event_type, body);
+}
+
+bool HttpUploader::post_to(std::string_view const path, std::string_view const name, std::string_view const body)
+{
+        std::string request{"POST "};
+        request += path;
+        request += name;
+        request += " HTTP/1.1\r\nHost: 127.0.0.1\r\nAuthorization: Bearer ";
+        request += token;
+        request += "\r\nContent-Type: application/json\r\nContent-Length: ";
+        request += std::to_string(body.size());
+        request += keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n";
+        request += body;
+
+        ++upload_stats.posts;
+        upload_stats.bytes_sent += static_cast<uint32_t>(body.size());
+        payload_byte_count += body.size();
+        max_payload_byte_count = std::max(max_payload_byte_count, body.size());
+
+        // A kept-alive connection may have been closed by the server since the last post. Reconnect once.
+        auto response = exchange(request);
+        if (!response) {
+                close();
+                response = exchange(request);
+        }
+        auto const is_ok = response.value_or(false);
+        if (!is_ok) {
+                ++upload_stats.failures;
+                close();
+        } else if (!keep_alive) {
+                close();
+        }
+        return is_ok;
+}
+
+void HttpUploader::close()
+{
+        if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+        }
+}
+
+bool HttpUploader::connect()
+{
+        auto const start = std::chrono::steady_clock::now();
+        fd = connect_loopback(port);
+        ++upload_stats.connects;
+        upload_stats.connect_us += elapsed_us(start);
+        return fd >= 0;
+}
+
+std::optional<bool> HttpUploader::exchange(std::string const &request)
+{
+        if (fd < 0 && !connect()) {
+                return std::nullopt;
+        }
+
+        auto const start = std::chrono::steady_clock::now();
+        auto const sent = ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        if (sent != static_cast<ssize_t>(request.size())) {
+                return std::nullopt;
+        }
+
+        // Read the headers and the Content-Length body so that the next request starts on a clean connection.
+        std::string response;
+        std::size_t header_end{std::string::npos};
+        std::size_t content_length{0};
+        char buf[256];
+        while (header_end == std::string::npos || response.size() < header_end + content_length) {
+                auto const n = ::recv(fd, buf, sizeof(buf), 0);
+                if (n <= 0) {
+                        return std::nullopt;
+                }
+                response.append(buf, static_cast<std::size_t>(n));
+                if (header_end == std::string::npos && (header_end = response.find("\r\n\r\n")) != std::string::npos) {
+                        header_end += 4;
+                        constexpr std::string_view length_header{"Content-Length:"};
+                        if (auto const pos = response.find(length_header); pos < header_end) {
+                                content_length =
+                                    std::strtoul(response.c_str() + pos + length_header.size(), nullptr, 10);
+                        }
+                }
+        }
+        upload_stats.request_us += elapsed_us(start);
+        if (response.find("Connection: close") < header_end) {
+                close();
+        }
+        return response.starts_with("HTTP/1.1 2");
+}
+
+namespace
+{
+
+// MQTT 3.1.1 control packet types, in the high nibble of the first byte.
+constexpr uint8_t MQTT_CONNECT{0x10};
+constexpr uint8_t MQTT_CONNACK{0x20};
+constexpr uint8_t MQTT_PUBLISH{0x30};
+constexpr uint8_t MQTT_PUBACK{0x40};
+constexpr uint8_t MQTT_DISCONNECT{0xe0};
+constexpr uint16_t MQTT_KEEP_ALIVE_S{60};
+
+void append_remaining_length(std::string &packet, std::size_t length)
+{
+        do {
+                auto byte = static_cast<uint8_t>(length % 128);
+                length /= 128;
+                if (length > 0) {
+                        byte |= 0x80;
+                }
+                packet += static_cast<char>(byte);
+        } while (length > 0);
+}
+
+void append_u16(std::string &packet, uint16_t const value)
+{
+        packet += static_cast<char>(value >> 8);
+        packet += static_cast<char>(value & 0xff);
+}
+
+void append_mqtt_string(std::string &packet, std::string_view const value)
+{
+        append_u16(packet, static_cast<uint16_t>(value.size()));
+        packet += value;
+}
+
+} // namespace
+
+MqttUploader::MqttUploader(uint16_t const port) : port{port} {}
+
+MqttUploader::~MqttUploader() { close(); }
+
+bool MqttUploader::post(std::string_view const entity_id, std::string_view const body)
+{
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        Payload::Writer topic_writer{topic};
+        auto const topic_view = Mqtt::append_state_topic(topic_writer, entity_id).view();
+        if (!topic_view) {
+                return false;
+        }
+
+        return publish_with_retry(*topic_view, body, Mqtt::qos_for(entity_id), true);
+}
+
+bool MqttUploader::fire_event(std::string_view const event_type, std::string_view const body)
+{
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        Payload::Writer topic_writer{topic};
+        auto const topic_view = Mqtt::append_event_topic(topic_writer, event_type).view();
+        return topic_view && publish_with_retry(*topic_view, body, 1, false);
+}
+
+bool MqttUploader::publish_with_retry(std::string_view const topic, std::string_view const payload, int const qos,
+                                      bool const retain)
+{
+        ++upload_stats.posts;
+        upload_stats.bytes_sent += static_cast<uint32_t>(payload.size());
+        payload_byte_count += payload.size();
+        max_payload_byte_count = std::max(max_payload_byte_count, payload.size());
+
+        // The broker may have dropped the connection since the last publish. Reconnect once.
+        auto is_ok = connect() && publish(topic, payload, qos, retain);
+        if (!is_ok) {
+                close();
+                is_ok = connect() && publish(topic, payload, qos, retain);
+        }
+        if (!is_ok) {
+                ++upload_stats.failures;
+                close();
+        }
+        return is_ok;
+}
+
+void MqttUploader::close()
+{
+        if (fd >= 0) {
+                constexpr char disconnect[]{static_cast<char>(MQTT_DISCONNECT), 0};
+                send_all({disconnect, sizeof(disconnect)});
+                ::close(fd);
+                fd = -1;
+        }
+}
+
+bool MqttUploader::connect()
+{
+        if (fd >= 0) {
+                return true;
+        }
+
+        // CONNECT to CONNACK, with a clean session and no credentials.
+        auto const start = std::chrono::steady_clock::now();
+        fd = connect_loopback(port);
+        std::string body;
+        append_mqtt_string(body, "MQTT");
+        body += '\x04'; // Protocol level 3.1.1
+        body += '\x02'; // Clean session
+        append_u16(body, MQTT_KEEP_ALIVE_S);
+        append_mqtt_string(body, "batterymonitor");
+        std::string packet{static_cast<char>(MQTT_CONNECT)};
+        append_remaining_length(packet, body.size());
+        packet += body;
+        std::array<uint8_t, 2> connack{};
+        auto const is_connected = fd >= 0 && send_all(packet) && receive(MQTT_CONNACK, connack) && connack[1] == 0;
+        ++upload_stats.connects;
+        upload_stats.connect_us += elapsed_us(start);
+        if (!is_connected) {
+                close();
+                return false;
+        }
+
+        auto const hash = Mqtt::discovery_hash();
+        if (hash == published_discovery_hash) {
+                return true;
+        }
+        std::array<char, Mqtt::TOPIC_SIZE> topic;
+        std::array<char, Mqtt::DISCOVERY_CONFIG_SIZE> config;
+        for (auto const &entity : Mqtt::DISCOVERY_ENTITIES) {
+                Payload::Writer topic_writer{topic};
+                Payload::Writer config_writer{config};
+                auto const topic_view = Mqtt::append_discovery_topic(topic_writer, entity.entity_id).view();
+                auto const config_view = Mqtt::append_discovery_config(config_writer, entity).view();
+                if (!topic_view || !config_view || !publish(*topic_view, *config_view, 1, true)) {
+                        return false;
+                }
+                ++discovery_publish_count;
+        }
+        published_discovery_hash = hash;
+        return true;
+}
+
+bool MqttUploader::publish(std::string_view const topic, std::string_view const payload, int const qos,
+                           bool const retain)
+{
+        auto const start = std::chrono::steady_clock::now();
+        auto const packet_id = next_packet_id;
+        next_packet_id = next_packet_id == UINT16_MAX ? 1 : next_packet_id + 1;
+
+        std::string packet{static_cast<char>(MQTT_PUBLISH | (qos << 1) | (retain ? 1 : 0))};
+        append_remaining_length(packet, 2 + topic.size() + (qos > 0 ? 2 : 0) + payload.size());
+        append_mqtt_string(packet, topic);
+        if (qos > 0) {
+                append_u16(packet, packet_id);
+        }
+        packet += payload;
+        if (!send_all(packet)) {
+                return false;
+        }
+        if (qos > 0) {
+                std::array<uint8_t, 2> puback{};
+                if (!receive(MQTT_PUBACK, puback) || ((puback[0] << 8) | puback[1]) != packet_id) {
+                        return false;
+                }
+        }
+        upload_stats.request_us += elapsed_us(start);
+        return true;
+}
+
+bool MqttUploader::send_all(std::string_view const packet)
+{
+        return fd >= 0 && ::send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(packet.size());
+}
+
+bool MqttUploader::receive(uint8_t const type, std::span<uint8_t> const body)
+{
+        std::array<uint8_t, 2> header{};
+        if (::recv(fd, header.data(), header.size(), MSG_WAITALL) != static_cast<ssize_t>(header.size()) ||
+            (header[0] & 0xf0) != type || header[1] != body.size()) {
+                return false;
+        }
+        return ::recv(fd, body.data(), body.size(), MSG_WAITALL) == static_cast<ssize_t>(body.size());
+}
+
+void SimulatedSleeper::sleep(std::chrono::seconds const interval, SleepMode const mode)
+{
+        light_sleep_count += mode == SleepMode::Light;
+        wake_arena().reset();
+        Trace::mark(Trace::Phase::SleepStart);
+        clock.advance(interval);
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,181 @@
+#pragma once
+
+#include "hal.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Start a new simulated wake. Hal::micros_since_wake() counts from here.
+void reset_wake_clock();
+
+// Wall clock that only moves when the simulated device sleeps.
+class SimulatedClock final : public Hal::Clock
+{
+      public:
+        int64_t now_s() override { return seconds; }
+        void advance(std::chrono::seconds const interval) { seconds += interval.count(); }
+
+      private:
+        int64_t seconds{1'700'000'000};
+};
+
+// A battery draining at a constant rate, read through an ADC with Gaussian noise. Deterministic for a given seed.
+// The temperature sensor follows a daily cycle between 10 C and 30 C.
+struct DischargeProfile {
+        uint16_t start_millivolts;
+        double drain_millivolts_per_hour;
+        double noise_millivolts;
+        uint32_t seed;
+};
+
+class SimulatedAdc final : public Hal::Adc
+{
+      public:
+        SimulatedAdc(SimulatedClock &clock, DischargeProfile const &profile);
+        bool read_millivolts(std::span<uint8_t const> channels, std::span<int32_t> pin_millivolts) override;
+        // The discharge has no cranks, so a capture is the resting battery with noise.
+        std::size_t capture_millivolts(uint8_t channel, uint32_t sample_rate_hz,
+                                       std::span<uint16_t> pin_millivolts) override;
+
+      private:
+        SimulatedClock &clock;
+        DischargeProfile profile;
+        int64_t start_s;
+        std::mt19937 generator;
+        std::normal_distribution<double> noise;
+};
+
+// Loopback network that is up unless taken down, e.g. to simulate the car being parked away from home. Marks the
+// Wi-Fi trace phases so traces look like the target's.
+class LoopbackNetwork final : public Hal::Network
+{
+      public:
+        bool connect(std::chrono::milliseconds timeout) override;
+        void disconnect() override {}
+        std::optional<int8_t> rssi() override { return -55; }
+        std::size_t connects() const { return connect_count; }
+        void set_up(bool const up) { is_up = up; }
+
+      private:
+        std::size_t connect_count{0};
+        bool is_up{true};
+};
+
+// Size of the readinglog partition in partitions.csv.
+constexpr std::size_t LOG_PARTITION_SIZE{256 * 1024};
+
+// Flash partition in memory, with NOR semantics, that counts writes and erases.
+class RamFlash final : public Hal::Flash
+{
+      public:
+        explicit RamFlash(std::size_t size);
+        std::size_t size() const override { return bytes.size(); }
+        bool read(std::size_t offset, std::span<uint8_t> data) override;
+        bool write(std::size_t offset, std::span<uint8_t const> data) override;
+        bool erase_sector(std::size_t offset) override;
+
+        std::size_t bytes_written() const { return write_byte_count; }
+        uint32_t max_sector_erases() const;
+        uint32_t min_sector_erases() const;
+
+      private:
+        std::vector<uint8_t> bytes;
+        std::vector<uint32_t> sector_erases;
+        std::size_t write_byte_count{0};
+};
+
+// Posts to a Home Assistant REST endpoint on 127.0.0.1 over plain HTTP/1.1. With keep_alive, posts share one
+// connection until close(). Without it, every post opens its own connection, as the target used to.
+class HttpUploader final : public Hal::Uploader
+{
+      public:
+        HttpUploader(uint16_t port, std::string_view token, bool keep_alive = true);
+        ~HttpUploader() override;
+        bool post(std::string_view entity_id, std::string_view body) override;
+        bool fire_event(std::string_view event_type, std::string_view body) override;
+        void close() override;
+        Hal::UploadStats const &stats() const override { return upload_stats; }
+
+        std::size_t payload_bytes() const { return payload_byte_count; }
+        std::size_t max_payload_bytes() const { return max_payload_byte_count; }
+
+      private:
+        bool post_to(std::string_view path, std::string_view name, std::string_view body);
+        bool connect();
+        // Send request and read the response. Returns whether the status was 2xx, or std::nullopt if the connection
+        // failed.
+        std::optional<bool> exchange(std::string const &request);
+
+        uint16_t port;
+        std::string_view token;
+        bool keep_alive;
+        int fd{-1};
+        Hal::UploadStats upload_stats{};
+        std::size_t payload_byte_count{0};
+        std::size_t max_payload_byte_count{0};
+};
+
+// Publishes to an MQTT 3.1.1 broker on 127.0.0.1, such as mosquitto or Host::MockMqttBroker, with the same topics,
+// QoS and discovery configs as the target. Publishes share one connection until close(). Discovery configs are only
+// published when they changed since the last connection that published them.
+class MqttUploader final : public Hal::Uploader
+{
+      public:
+        explicit MqttUploader(uint16_t port);
+        ~MqttUploader() override;
+        bool post(std::string_view entity_id, std::string_view body) override;
+        bool fire_event(std::string_view event_type, std::string_view body) override;
+        void close() override;
+        Hal::UploadStats const &stats() const override { return upload_stats; }
+
+        std::size_t payload_bytes() const { return payload_byte_count; }
+        std::size_t max_payload_bytes() const { return max_payload_byte_count; }
+        std::size_t discovery_publishes() const { return discovery_publish_count; }
+
+      private:
+        bool publish_with_retry(std::string_view topic, std::string_view payload, int qos, bool retain);
+        bool connect();
+        // Send a PUBLISH and, for QoS 1, wait for its PUBACK. Returns false if the connection failed.
+        bool publish(std::string_view topic, std::string_view payload, int qos, bool retain);
+        bool send_all(std::string_view packet);
+        // Read one packet of the given type and remaining length, as CONNACK and PUBACK are.
+        bool receive(uint8_t type, std::span<uint8_t> body);
+
+        uint16_t port;
+        int fd{-1};
+        uint16_t next_packet_id{1};
+        uint32_t published_discovery_hash{0};
+        Hal::UploadStats upload_stats{};
+        std::size_t payload_byte_count{0};
+        std::size_t max_payload_byte_count{0};
+        std::size_t discovery_publish_count{0};
+};
+
+// Advances the simulated clock instead of sleeping, and counts the sleeps in each mode.
+class SimulatedSleeper final : public Hal::Sleeper
+{
+      public:
+        explicit SimulatedSleeper(SimulatedClock &clock) : clock{clock} {}
+        void sleep(std::chrono::seconds interval, SleepMode mode) override;
+        std::size_t light_sleeps() const { return light_sleep_count; }
+
+      private:
+        SimulatedClock &clock;
+        std::size_t light_sleep_count{0};
+};
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,102 @@
+#include "log_decoder.hpp"
+#include <cinttypes>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+struct Format {
+        std::string tag;
+        std::string format;
+};
+
+char level_letter(Log::Level const level) { return level == Log::Level::Debug ? 'D' : 'I'; }
+
+std::vector<uint8_t> parse_hex(char const *text)
+{
+        std::vector<uint8_t> bytes;
+        unsigned byte{0};
+        for (int consumed{0}; std::sscanf(text, "%2x%n", &byte, &consumed) == 1 && consumed == 2; text += consumed) {
+                bytes.push_back(static_cast<uint8_t>(byte));
+        }
+        return bytes;
+}
+
+} // namespace
+
+std::size_t decode_log(std::FILE *const in, std::FILE *const out)
+{
+        std::unordered_map<uint32_t, Format> formats;
+        std::size_t records{0};
+        char line[512];
+        while (std::fgets(line, sizeof(line), in)) {
+                line[std::strcspn(line, "\r\n")] = '\0';
+                // Anything before the key, such as a timestamp added by the serial monitor, is skipped.
+                if (auto const *const format = std::strstr(line, "dlog.format=")) {
+                        char *fields = const_cast<char *>(format) + std::strlen("dlog.format=");
+                        auto const id = static_cast<uint32_t>(std::strtoul(fields, &fields, 16));
+                        auto *const tag = std::strchr(fields, '\t');
+                        auto *const text = tag ? std::strchr(tag + 1, '\t') : nullptr;
+                        if (text) {
+                                formats[id] = Format{std::string{tag + 1, text}, std::string{text + 1}};
+                        }
+                        continue;
+                }
+                auto const *const record_line = std::strstr(line, "dlog.record=");
+                if (!record_line) {
+                        continue;
+                }
+                uint32_t id{0};
+                unsigned wake{0};
+                uint32_t time_us{0};
+                unsigned level{0};
+                int consumed{0};
+                if (std::sscanf(record_line, "dlog.record=%" SCNx32 " %u %" SCNu32 " %u %n", &id, &wake, &time_us,
+                                &level, &consumed) != 4) {
+                        continue;
+                }
+                auto const args = parse_hex(record_line + consumed);
+                auto const letter = level_letter(static_cast<Log::Level>(level));
+                auto const found = formats.find(id);
+                if (found == formats.end()) {
+                        std::fprintf(out, "[wake %u +%.3f ms] %c unknown format %08" PRIx32 "\n", wake,
+                                     static_cast<double>(time_us) / 1000.0, letter, id);
+                } else {
+                        char text[256];
+                        Log::render(found->second.format, args, text);
+                        std::fprintf(out, "[wake %u +%.3f ms] %c (%s) %s\n", wake,
+                                     static_cast<double>(time_us) / 1000.0, letter, found->second.tag.c_str(), text);
+                }
+                ++records;
+        }
+        return records;
+}
+
+std::size_t console_bytes(Log::Record const &record)
+{
+        char const *tag{nullptr};
+        auto const *const format = Log::find_format(record.id, &tag);
+        if (!format) {
+                return 0;
+        }
+        char text[256];
+        auto const text_bytes = Log::render(format, record.args, text);
+        // "\033[0;32mI (%lu) %s: %s\033[0m\n", with the millisecond timestamp printed by ESP_LOGI.
+        char prefix[32];
+        auto const prefix_bytes = std::snprintf(prefix, sizeof(prefix), "I (%" PRIu32 ") ", record.time_us / 1000);
+        return std::strlen("\033[0;32m") + static_cast<std::size_t>(prefix_bytes) + std::strlen(tag) + 2 + text_bytes +
+               std::strlen("\033[0m\n");
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
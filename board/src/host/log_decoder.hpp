@@ -0,0 +1,23 @@
+#pragma once
+
+#include "deferred_log.hpp"
+#include <cstddef>
+#include <cstdio>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Turn the dlog.format and dlog.record lines that Log::flush() prints back into text, one line per record. Other
+// lines, such as the rest of a serial console capture, are skipped. Returns the number of records decoded.
+std::size_t decode_log(std::FILE *in, std::FILE *out);
+
+// Bytes that ESP_LOGI would have written to the console for record, with the default colors and timestamp. 0 if its
+// format is not registered in this build.
+std::size_t console_bytes(Log::Record const &record);
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,363 @@
+#ifndef PROJECTIO_TESTING
+
+// Host build of the battery monitor. Runs the wake cycle against a simulated battery and a local mock Home Assistant
+// server or MQTT broker, and prints key=value metrics for benchmarking. With --transport both, runs the same
+// simulation over each and prefixes the keys with http_ and mqtt_.
+//
+//   battery_monitor_host [--wakes N] [--drain MV_PER_HOUR] [--noise MV] [--seed N] [--keep-alive 0|1]
+//                        [--transport http|mqtt|both] [--broker-port PORT] [--offline-wakes N]
+//   battery_monitor_host --bench payload|log|micro|capture|tls [--iterations N] [--waveform PATH]
+//   battery_monitor_host --decode-log PATH
+//   battery_monitor_host --replay PATH [--golden PATH] [--write-golden PATH]
+//
+// --decode-log prints the records in a serial console capture that holds the output of Log::flush(), or in standard
+// input if PATH is -. --replay runs a raw trace recorded on the board through the measurement pipeline.
+
+#include "benchmarks.hpp"
+#include "deferred_log.hpp"
+#include "hal_host.hpp"
+#include "log_decoder.hpp"
+#include "mock_ha_server.hpp"
+#include "mock_mqtt_broker.hpp"
+#include "replay.hpp"
+#include "secrets.h"
+#include "trace.hpp"
+#include "wake_cycle.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace
+{
+
+constexpr auto TAG{"Host"};
+
+struct Options {
+        // Benchmark to run instead of the simulation.
+        std::string_view bench;
+        std::size_t iterations{100'000};
+        // Recording for the capture benchmark, instead of the synthetic waveforms.
+        char const *waveform{nullptr};
+        // Console capture to decode instead of running the simulation.
+        char const *decode_log{nullptr};
+        // Raw trace to replay instead of running the simulation, the golden file to compare it with, and where to
+        // write a new one.
+        char const *replay{nullptr};
+        char const *golden{nullptr};
+        char const *write_golden{nullptr};
+        std::size_t wakes{10'000};
+        // Wakes a quarter of the way in with no network, as if the car were parked away from home.
+        std::size_t offline_wakes{0};
+        bool keep_alive{true};
+        // http, mqtt, or both side by side.
+        std::string_view transport{"http"};
+        // External MQTT broker on 127.0.0.1, instead of the mock one.
+        uint16_t broker_port{0};
+        Host::DischargeProfile profile{.start_millivolts = 12'700,
+                                       .drain_millivolts_per_hour = 10.0,
+                                       .noise_millivolts = 5.0,
+                                       .seed = 1};
+};
+
+bool parse_options(int argc, char **argv, Options &options)
+{
+        for (int i = 1; i + 1 < argc; i += 2) {
+                auto const value = argv[i + 1];
+                if (std::strcmp(argv[i], "--bench") == 0) {
+                        options.bench = value;
+                } else if (std::strcmp(argv[i], "--iterations") == 0) {
+                        options.iterations = std::max<std::size_t>(std::strtoull(value, nullptr, 10), 1);
+                } else if (std::strcmp(argv[i], "--waveform") == 0) {
+                        options.waveform = value;
+                } else if (std::strcmp(argv[i], "--decode-log") == 0) {
+                        options.decode_log = value;
+                } else if (std::strcmp(argv[i], "--replay") == 0) {
+                        options.replay = value;
+                } else if (std::strcmp(argv[i], "--golden") == 0) {
+                        options.golden = value;
+                } else if (std::strcmp(argv[i], "--write-golden") == 0) {
+                        options.write_golden = value;
+                } else if (std::strcmp(argv[i], "--wakes") == 0) {
+                        options.wakes = std::strtoull(value, nullptr, 10);
+                } else if (std::strcmp(argv[i], "--offline-wakes") == 0) {
+                        options.offline_wakes = std::strtoull(value, nullptr, 10);
+                } else if (std::strcmp(argv[i], "--drain") == 0) {
+                        options.profile.drain_millivolts_per_hour = std::strtod(value, nullptr);
+                } else if (std::strcmp(argv[i], "--noise") == 0) {
+                        options.profile.noise_millivolts = std::strtod(value, nullptr);
+                } else if (std::strcmp(argv[i], "--keep-alive") == 0) {
+                        options.keep_alive = std::strcmp(value, "0") != 0;
+                } else if (std::strcmp(argv[i], "--transport") == 0) {
+                        options.transport = value;
+                } else if (std::strcmp(argv[i], "--broker-port") == 0) {
+                        options.broker_port = static_cast<uint16_t>(std::strtoul(value, nullptr, 10));
+                } else if (std::strcmp(argv[i], "--seed") == 0) {
+                        options.profile.seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+                } else {
+                        return false;
+                }
+        }
+        auto const is_transport_valid =
+            options.transport == "http" || options.transport == "mqtt" || options.transport == "both";
+        auto const is_bench_valid = options.bench.empty() || options.bench == "payload" || options.bench == "log" ||
+                                   options.bench == "micro" || options.bench == "capture" || options.bench == "tls";
+        return argc % 2 == 1 && is_transport_valid && is_bench_valid;
+}
+
+// Static like the RTC memory it stands in for.
+WakeState wake_state;
+
+// Run the wake cycle options.wakes times against uploader and print the metrics, each key prefixed with prefix.
+// Returns false if any upload failed.
+template <typename Uploader> bool simulate(Options const &options, Uploader &uploader, char const *const prefix)
+{
+        wake_state = WakeState{};
+        Host::SimulatedClock clock;
+        Host::SimulatedAdc adc{clock, options.profile};
+        Host::LoopbackNetwork network;
+        Host::SimulatedSleeper sleeper{clock};
+        Host::RamFlash flash{Host::LOG_PARTITION_SIZE};
+        Hal::Platform platform{adc, clock, network, uploader, sleeper, flash};
+
+        auto const start_s = clock.now_s();
+        std::size_t uploads{0};
+        int64_t total_wake_us{0};
+        int64_t max_wake_us{0};
+        int64_t total_upload_wake_us{0};
+        std::size_t log_records{0};
+        std::size_t log_record_bytes{0};
+        std::size_t log_console_bytes{0};
+        // Modelled charge of every cycle as chosen, and as it would have been in deep sleep throughout.
+        uint64_t sleep_charge_uc{0};
+        uint64_t deep_only_charge_uc{0};
+        auto const start = std::chrono::steady_clock::now();
+        auto const offline_start = options.wakes / 4;
+        for (std::size_t i = 0; i < options.wakes; ++i) {
+                network.set_up(i < offline_start || i >= offline_start + options.offline_wakes);
+                Host::reset_wake_clock();
+                Trace::begin_cycle();
+                Log::begin_wake();
+                auto decision = sample_and_decide(wake_state, WAKE_CONFIG, platform.adc, platform.clock);
+                if (decision) {
+                        capture_event(WAKE_CONFIG, platform.adc, *decision, false);
+                }
+                auto const sleep_interval =
+                    decision ? decision->sleep_interval : WAKE_CONFIG.sleep_policy.base_interval;
+                auto const is_uploading = decision && decision->reason != ReportReason::None;
+                if (is_uploading && upload(wake_state, WAKE_CONFIG, platform, *decision)) {
+                        ++uploads;
+                }
+                if (is_uploading) {
+                        record_memory(wake_state, Hal::memory_stats());
+                }
+                auto const wake_us = Hal::micros_since_wake();
+                total_wake_us += wake_us;
+                max_wake_us = std::max(max_wake_us, wake_us);
+                if (is_uploading) {
+                        total_upload_wake_us += wake_us;
+                }
+                // What the same lines through ESP_LOGI would have sent to the console.
+                Log::for_each_record([&](Log::Record const &record) {
+                        ++log_records;
+                        log_record_bytes += Log::HEADER_BYTES + record.args.size();
+                        log_console_bytes += Host::console_bytes(record);
+                });
+                Log::clear();
+                auto const mode = choose_sleep_mode(wake_state, WAKE_CONFIG, sleep_interval, is_uploading);
+                sleep_charge_uc += wake_state.sleep_charge_uc;
+                deep_only_charge_uc += cycle_charge_uc(WAKE_CONFIG.sleep_energy_model, SleepMode::Deep,
+                                                       sleep_interval, wake_state.upload_permille);
+                platform.sleeper.sleep(sleep_interval, mode);
+        }
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        auto const wakes = std::max<std::size_t>(options.wakes, 1);
+        auto const &stats = uploader.stats();
+        auto const posts = static_cast<double>(std::max<uint32_t>(stats.posts, 1));
+        std::printf("%swakes=%zu\n", prefix, options.wakes);
+        std::printf("%suploads=%zu\n", prefix, uploads);
+        std::printf("%sradio_free_wakes=%zu\n", prefix, options.wakes - network.connects());
+        std::printf("%ssimulated_hours=%.1f\n", prefix, static_cast<double>(clock.now_s() - start_s) / 3600.0);
+        std::printf("%sfinal_millivolts=%u\n", prefix, wake_state.last_millivolts);
+        std::printf("%swake_cycle_mean_us=%.1f\n", prefix,
+                    static_cast<double>(total_wake_us) / static_cast<double>(wakes));
+        std::printf("%swake_cycle_max_us=%lld\n", prefix, static_cast<long long>(max_wake_us));
+        // Wake to the last acknowledgement and close, on wakes that uploaded.
+        std::printf("%supload_wake_mean_us=%.1f\n", prefix,
+                    static_cast<double>(total_upload_wake_us) / static_cast<double>(std::max<std::size_t>(uploads, 1)));
+        std::printf("%sposts=%u\n", prefix, stats.posts);
+        std::printf("%spost_failures=%u\n", prefix, stats.failures);
+        std::printf("%sposts_per_s=%.1f\n", prefix, static_cast<double>(stats.posts) / elapsed);
+        std::printf("%sconnects=%u\n", prefix, stats.connects);
+        std::printf("%sconnect_mean_us=%.1f\n", prefix,
+                    static_cast<double>(stats.connect_us) / static_cast<double>(std::max<uint32_t>(stats.connects, 1)));
+        std::printf("%srequest_mean_us=%.1f\n", prefix, static_cast<double>(stats.request_us) / posts);
+        std::printf("%spayload_bytes_mean=%.1f\n", prefix, static_cast<double>(uploader.payload_bytes()) / posts);
+        std::printf("%spayload_bytes_max=%zu\n", prefix, uploader.max_payload_bytes());
+        std::printf("%sbytes_sent=%u\n", prefix, stats.bytes_sent);
+        std::printf("%slog_pending=%u\n", prefix, wake_state.log.pending);
+        std::printf("%slog_dropped=%u\n", prefix, wake_state.log.dropped);
+        std::printf("%sflash_bytes_written=%zu\n", prefix, flash.bytes_written());
+        std::printf("%sflash_sector_erases_max=%u\n", prefix, flash.max_sector_erases());
+        std::printf("%sarena_peak_bytes=%zu\n", prefix, wake_arena().peak());
+        std::printf("%sarena_bytes=%zu\n", prefix, wake_arena().capacity());
+        // Only the lines of the portable wake path. The target logs more per wake, from the ADC and Wi-Fi drivers.
+        auto const per_wake = [wakes](std::size_t const total) {
+                return static_cast<double>(total) / static_cast<double>(wakes);
+        };
+        // uC per second is uA.
+        auto const simulated_s = static_cast<double>(std::max<int64_t>(clock.now_s() - start_s, 1));
+        std::printf("%ssleep_light_wakes=%zu\n", prefix, sleeper.light_sleeps());
+        std::printf("%ssleep_modelled_mean_ua=%.1f\n", prefix, static_cast<double>(sleep_charge_uc) / simulated_s);
+        std::printf("%ssleep_deep_only_mean_ua=%.1f\n", prefix,
+                    static_cast<double>(deep_only_charge_uc) / simulated_s);
+        std::printf("%sdlog_records_per_wake=%.2f\n", prefix, per_wake(log_records));
+        std::printf("%sdlog_record_bytes_per_wake=%.1f\n", prefix, per_wake(log_record_bytes));
+        std::printf("%sdlog_console_bytes_per_wake=%.1f\n", prefix, per_wake(log_console_bytes));
+        // 10 bits per byte at 115200 baud, which ESP_LOGI waits for and the deferred log does not.
+        std::printf("%sdlog_console_ms_saved_per_wake=%.2f\n", prefix,
+                    per_wake(log_console_bytes) * 10.0 * 1000.0 / 115'200.0);
+        // The estimator's view of the simulated battery, to compare with --drain.
+        if (auto const charge = Charge::estimate(wake_state.charge, WAKE_CONFIG.charge_policy, clock.now_s())) {
+                std::printf("%scharge_soc_percent=%u\n", prefix, charge->soc_percent);
+                std::printf("%scharge_resting_millivolts=%u\n", prefix, charge->resting_millivolts);
+                std::printf("%scharge_noise_mv=%.1f\n", prefix, static_cast<double>(charge->noise_millivolts));
+                std::printf("%scharge_drain_mv_per_hour=%.2f\n", prefix,
+                            static_cast<double>(charge->drain_millivolts_per_hour.value_or(0.f)));
+                std::printf("%scharge_hours_to_cutoff=%.1f\n", prefix,
+                            static_cast<double>(charge->hours_to_cutoff.value_or(0.f)));
+        }
+        return stats.failures == 0;
+}
+
+bool run_http(Options const &options, char const *const prefix)
+{
+        Host::MockHaServer server;
+        if (!server.start()) {
+                ESP_LOGE(TAG, "Could not start the mock Home Assistant server.");
+                return false;
+        }
+        Host::HttpUploader uploader{server.port(), Secrets::LONG_LIVED_ACCESS_TOKEN, options.keep_alive};
+        auto const is_ok = simulate(options, uploader, prefix);
+        server.stop();
+
+        std::printf("%skeep_alive=%d\n", prefix, options.keep_alive ? 1 : 0);
+        std::printf("%sserver_connections=%zu\n", prefix, server.connections());
+        std::printf("%sserver_requests=%zu\n", prefix, server.requests());
+        std::printf("%sserver_bytes=%zu\n", prefix, server.bytes_received());
+        return is_ok;
+}
+
+bool run_mqtt(Options const &options, char const *const prefix)
+{
+        // An external broker such as mosquitto only gets the client side metrics.
+        if (options.broker_port != 0) {
+                Host::MqttUploader uploader{options.broker_port};
+                auto const is_ok = simulate(options, uploader, prefix);
+                std::printf("%sdiscovery_publishes=%zu\n", prefix, uploader.discovery_publishes());
+                return is_ok;
+        }
+
+        Host::MockMqttBroker broker;
+        if (!broker.start()) {
+                ESP_LOGE(TAG, "Could not start the mock MQTT broker.");
+                return false;
+        }
+        Host::MqttUploader uploader{broker.port()};
+        auto const is_ok = simulate(options, uploader, prefix);
+        broker.stop();
+
+        std::printf("%sdiscovery_publishes=%zu\n", prefix, uploader.discovery_publishes());
+        std::printf("%sserver_connections=%zu\n", prefix, broker.connections());
+        std::printf("%sserver_requests=%zu\n", prefix, broker.publishes());
+        std::printf("%sserver_bytes=%zu\n", prefix, broker.bytes_received());
+        return is_ok;
+}
+
+int decode_log(char const *const path)
+{
+        auto *const in = std::strcmp(path, "-") == 0 ? stdin : std::fopen(path, "r");
+        if (!in) {
+                ESP_LOGE(TAG, "Could not open %s.", path);
+                return EXIT_FAILURE;
+        }
+        auto const records = Host::decode_log(in, stdout);
+        if (in != stdin) {
+                std::fclose(in);
+        }
+        std::fprintf(stderr, "%zu records\n", records);
+        return EXIT_SUCCESS;
+}
+
+int run(Options const &options)
+{
+        auto is_ok = true;
+        if (options.transport == "http") {
+                is_ok = run_http(options, "");
+        } else if (options.transport == "mqtt") {
+                is_ok = run_mqtt(options, "");
+        } else {
+                // Same seed and wakes for both, so the metrics compare directly.
+                is_ok = run_http(options, "http_");
+                is_ok = run_mqtt(options, "mqtt_") && is_ok;
+        }
+        return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+} // namespace
+
+} // namespace BatteryMonitor
+
+int main(int argc, char **argv)
+{
+        BatteryMonitor::Options options;
+        if (!BatteryMonitor::parse_options(argc, argv, options)) {
+                std::fprintf(stderr,
+                             "usage: %s [--wakes N] [--drain MV_PER_HOUR] [--noise MV] [--seed N] [--keep-alive 0|1]\n"
+                             "       [--transport http|mqtt|both] [--broker-port PORT] [--offline-wakes N]\n",
+                             argv[0]);
+                std::fprintf(stderr,
+                             "       %s --bench payload|log|micro|capture|tls [--iterations N] [--waveform PATH]\n",
+                             argv[0]);
+                std::fprintf(stderr, "       %s --decode-log PATH\n", argv[0]);
+                std::fprintf(stderr, "       %s --replay PATH [--golden PATH] [--write-golden PATH]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+        if (options.decode_log) {
+                return BatteryMonitor::decode_log(options.decode_log);
+        }
+        if (options.replay) {
+                auto const is_ok =
+                    BatteryMonitor::Host::run_replay(options.replay, options.golden, options.write_golden);
+                return is_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        if (options.bench == "payload") {
+                BatteryMonitor::Host::run_payload_benchmark(options.iterations);
+                return EXIT_SUCCESS;
+        }
+        if (options.bench == "log") {
+                BatteryMonitor::Host::run_log_benchmark(options.iterations);
+                return EXIT_SUCCESS;
+        }
+        if (options.bench == "micro") {
+                BatteryMonitor::Host::run_micro_benchmark(options.iterations);
+                return EXIT_SUCCESS;
+        }
+        if (options.bench == "capture") {
+                BatteryMonitor::Host::run_capture_benchmark(options.iterations, options.waveform);
+                return EXIT_SUCCESS;
+        }
+        if (options.bench == "tls") {
+                BatteryMonitor::Host::run_tls_benchmark(options.iterations);
+                return EXIT_SUCCESS;
+        }
+        return BatteryMonitor::run(options);
+}
+
+#endif
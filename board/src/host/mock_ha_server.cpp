@@ -0,0 +1,147 @@
+#include "mock_ha_server.hpp"
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+// Read one HTTP request (headers and Content-Length body). Returns the number of bytes read, or 0 on error or when
+// the client closed the connection. Sets is_closing if the client asked to close the connection after this request.
+std::size_t read_request(int const fd, bool &is_closing)
+{
+        std::string request;
+        char buf[1024];
+        std::size_t header_end{std::string::npos};
+        std::size_t content_length{0};
+        while (true) {
+                auto const n = ::recv(fd, buf, sizeof(buf), 0);
+                if (n <= 0) {
+                        return 0;
+                }
+                request.append(buf, static_cast<std::size_t>(n));
+                if (header_end == std::string::npos) {
+                        header_end = request.find("\r\n\r\n");
+                        if (header_end == std::string::npos) {
+                                continue;
+                        }
+                        header_end += 4;
+                        constexpr std::string_view length_header{"Content-Length:"};
+                        auto const length_pos = request.find(length_header);
+                        if (length_pos < header_end) {
+                                content_length =
+                                    std::strtoul(request.c_str() + length_pos + length_header.size(), nullptr, 10);
+                        }
+                        auto const close_pos = request.find("Connection: close");
+                        is_closing = close_pos != std::string::npos && close_pos < header_end;
+                }
+                if (request.size() >= header_end + content_length) {
+                        return request.size();
+                }
+        }
+}
+
+} // namespace
+
+MockHaServer::~MockHaServer() { stop(); }
+
+bool MockHaServer::start(uint16_t const port)
+{
+        listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+                return false;
+        }
+        int const reuse{1};
+        ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listen_fd, 16) != 0) {
+                ::close(listen_fd);
+                listen_fd = -1;
+                return false;
+        }
+
+        socklen_t length{sizeof(address)};
+        ::getsockname(listen_fd, reinterpret_cast<sockaddr *>(&address), &length);
+        bound_port = ntohs(address.sin_port);
+        running = true;
+        thread = std::thread{&MockHaServer::serve, this};
+        return true;
+}
+
+void MockHaServer::stop()
+{
+        if (!running.exchange(false)) {
+                return;
+        }
+        // Unblock accept() and recv().
+        ::shutdown(listen_fd, SHUT_RDWR);
+        if (auto const fd = client_fd.load(); fd >= 0) {
+                ::shutdown(fd, SHUT_RDWR);
+        }
+        ::close(listen_fd);
+        listen_fd = -1;
+        if (thread.joinable()) {
+                thread.join();
+        }
+}
+
+void MockHaServer::serve()
+{
+        constexpr char const keep_alive_response[]{"HTTP/1.1 200 OK\r\n"
+                                                    "Content-Type: application/json\r\n"
+                                                    "Content-Length: 2\r\n"
+                                                    "Connection: keep-alive\r\n"
+                                                    "\r\n"
+                                                    "{}"};
+        constexpr char const close_response[]{"HTTP/1.1 200 OK\r\n"
+                                               "Content-Type: application/json\r\n"
+                                               "Content-Length: 2\r\n"
+                                               "Connection: close\r\n"
+                                               "\r\n"
+                                               "{}"};
+        while (running) {
+                auto const fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                        continue;
+                }
+                client_fd = fd;
+                ++connection_count;
+                // One client at a time. Serve requests on this connection until the client closes it.
+                auto is_closing = false;
+                while (!is_closing) {
+                        auto const received = read_request(fd, is_closing);
+                        if (received == 0) {
+                                break;
+                        }
+                        ++request_count;
+                        byte_count += received;
+                        if (is_closing) {
+                                ::send(fd, close_response, sizeof(close_response) - 1, MSG_NOSIGNAL);
+                        } else {
+                                ::send(fd, keep_alive_response, sizeof(keep_alive_response) - 1, MSG_NOSIGNAL);
+                        }
+                }
+                client_fd = -1;
+                ::close(fd);
+        }
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Minimal local stand-in for the Home Assistant REST API. Accepts POST /api/states/<entity_id> on 127.0.0.1, answers
+// 200 with a small JSON body, and counts what it received. Keeps connections alive unless the client asks to close
+// them. Serves one connection at a time.
+class MockHaServer
+{
+      public:
+        MockHaServer() = default;
+        ~MockHaServer();
+        MockHaServer(MockHaServer const &) = delete;
+        MockHaServer &operator=(MockHaServer const &) = delete;
+
+        // Listen on port, or on an ephemeral port if port is 0. Returns false if the socket could not be bound.
+        bool start(uint16_t port = 0);
+        void stop();
+
+        uint16_t port() const { return bound_port; }
+        std::size_t connections() const { return connection_count.load(); }
+        std::size_t requests() const { return request_count.load(); }
+        std::size_t bytes_received() const { return byte_count.load(); }
+
+      private:
+        void serve();
+
+        int listen_fd{-1};
+        uint16_t bound_port{0};
+        std::atomic<bool> running{false};
+        std::atomic<int> client_fd{-1};
+        std::atomic<std::size_t> connection_count{0};
+        std::atomic<std::size_t> request_count{0};
+        std::atomic<std::size_t> byte_count{0};
+        std::thread thread;
+};
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,164 @@
+#include "mock_mqtt_broker.hpp"
+#include <arpa/inet.h>
+#include <array>
+#include <cstdint>
+#include <netinet/in.h>
+#include <span>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+// One control packet: the first byte of the fixed header and everything after the remaining length.
+struct Packet {
+        uint8_t header;
+        std::string body;
+        // Including the fixed header.
+        std::size_t size;
+};
+
+bool read_exactly(int const fd, void *const data, std::size_t const size)
+{
+        return ::recv(fd, data, size, MSG_WAITALL) == static_cast<ssize_t>(size);
+}
+
+// Returns false on error or when the client closed the connection.
+bool read_packet(int const fd, Packet &packet)
+{
+        if (!read_exactly(fd, &packet.header, 1)) {
+                return false;
+        }
+        std::size_t remaining_length{0};
+        std::size_t header_size{1};
+        for (unsigned shift = 0;; shift += 7) {
+                uint8_t byte{};
+                if (shift > 21 || !read_exactly(fd, &byte, 1)) {
+                        return false;
+                }
+                ++header_size;
+                remaining_length |= static_cast<std::size_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                        break;
+                }
+        }
+        packet.body.resize(remaining_length);
+        packet.size = header_size + remaining_length;
+        return remaining_length == 0 || read_exactly(fd, packet.body.data(), remaining_length);
+}
+
+bool send_packet(int const fd, std::span<char const> const packet)
+{
+        return ::send(fd, packet.data(), packet.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(packet.size());
+}
+
+} // namespace
+
+MockMqttBroker::~MockMqttBroker() { stop(); }
+
+bool MockMqttBroker::start(uint16_t const port)
+{
+        listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (listen_fd < 0) {
+                return false;
+        }
+        int const reuse{1};
+        ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listen_fd, 16) != 0) {
+                ::close(listen_fd);
+                listen_fd = -1;
+                return false;
+        }
+
+        socklen_t length{sizeof(address)};
+        ::getsockname(listen_fd, reinterpret_cast<sockaddr *>(&address), &length);
+        bound_port = ntohs(address.sin_port);
+        running = true;
+        thread = std::thread{&MockMqttBroker::serve, this};
+        return true;
+}
+
+void MockMqttBroker::stop()
+{
+        if (!running.exchange(false)) {
+                return;
+        }
+        // Unblock accept() and recv().
+        ::shutdown(listen_fd, SHUT_RDWR);
+        if (auto const fd = client_fd.load(); fd >= 0) {
+                ::shutdown(fd, SHUT_RDWR);
+        }
+        ::close(listen_fd);
+        listen_fd = -1;
+        if (thread.joinable()) {
+                thread.join();
+        }
+}
+
+void MockMqttBroker::serve()
+{
+        constexpr std::array<char, 4> connack{0x20, 0x02, 0x00, 0x00};
+        constexpr std::array<char, 2> pingresp{static_cast<char>(0xd0), 0x00};
+        while (running) {
+                auto const fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd < 0) {
+                        continue;
+                }
+                client_fd = fd;
+                ++connection_count;
+                // One client at a time, until it disconnects.
+                Packet packet;
+                auto is_connected = true;
+                while (is_connected && read_packet(fd, packet)) {
+                        byte_count += packet.size;
+                        switch (packet.header & 0xf0) {
+                        case 0x10: // CONNECT
+                                is_connected = send_packet(fd, connack);
+                                break;
+                        case 0x30: { // PUBLISH
+                                ++publish_count;
+                                auto const qos = (packet.header >> 1) & 0x03;
+                                if (qos > 0 && packet.body.size() >= 2) {
+                                        // The packet ID follows the topic.
+                                        auto const topic_length = (static_cast<uint8_t>(packet.body[0]) << 8) |
+                                                                  static_cast<uint8_t>(packet.body[1]);
+                                        auto const id_pos = 2 + static_cast<std::size_t>(topic_length);
+                                        if (packet.body.size() < id_pos + 2) {
+                                                is_connected = false;
+                                                break;
+                                        }
+                                        std::array<char, 4> const puback{0x40, 0x02, packet.body[id_pos],
+                                                                         packet.body[id_pos + 1]};
+                                        is_connected = send_packet(fd, puback);
+                                }
+                                break;
+                        }
+                        case 0xc0: // PINGREQ
+                                is_connected = send_packet(fd, pingresp);
+                                break;
+                        default: // DISCONNECT, or anything this broker does not handle.
+                                is_connected = false;
+                                break;
+                        }
+                }
+                client_fd = -1;
+                ::close(fd);
+        }
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Minimal local stand-in for an MQTT 3.1.1 broker. Accepts CONNECT, PUBLISH at QoS 0 and 1, PINGREQ and DISCONNECT
+// on 127.0.0.1, acknowledges them, and counts what it received. Does not route messages to subscribers. Serves one
+// connection at a time.
+class MockMqttBroker
+{
+      public:
+        MockMqttBroker() = default;
+        ~MockMqttBroker();
+        MockMqttBroker(MockMqttBroker const &) = delete;
+        MockMqttBroker &operator=(MockMqttBroker const &) = delete;
+
+        // Listen on port, or on an ephemeral port if port is 0. Returns false if the socket could not be bound.
+        bool start(uint16_t port = 0);
+        void stop();
+
+        uint16_t port() const { return bound_port; }
+        std::size_t connections() const { return connection_count.load(); }
+        std::size_t publishes() const { return publish_count.load(); }
+        std::size_t bytes_received() const { return byte_count.load(); }
+
+      private:
+        void serve();
+
+        int listen_fd{-1};
+        uint16_t bound_port{0};
+        std::atomic<bool> running{false};
+        std::atomic<int> client_fd{-1};
+        std::atomic<std::size_t> connection_count{0};
+        std::atomic<std::size_t> publish_count{0};
+        std::atomic<std::size_t> byte_count{0};
+        std::thread thread;
+};
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,272 @@
+#include "replay.hpp"
+#include "raw_trace.hpp"
+#include "trace.hpp"
+#include "wake_cycle.hpp"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+constexpr auto TAG{"Replay"};
+
+class ReplayClock final : public Hal::Clock
+{
+      public:
+        int64_t now_s() override { return seconds; }
+        int64_t seconds{0};
+};
+
+// Converts the codes of the current sample with the unit's table, like the board's ADC session.
+class ReplayAdc final : public Hal::Adc
+{
+      public:
+        explicit ReplayAdc(Calibration::AdcTable const &table) : table{table} {}
+
+        bool read_millivolts(std::span<uint8_t const> const channels, std::span<int32_t> const pin_millivolts) override
+        {
+                for (std::size_t i = 0; i < channels.size(); ++i) {
+                        auto const found = std::find(Sensors::ADC_CHANNELS.begin(), Sensors::ADC_CHANNELS.end(),
+                                                     channels[i]);
+                        if (sample == nullptr || found == Sensors::ADC_CHANNELS.end()) {
+                                return false;
+                        }
+                        auto const index = static_cast<std::size_t>(found - Sensors::ADC_CHANNELS.begin());
+                        pin_millivolts[i] = Calibration::to_millivolts(table, sample->raw[index]);
+                }
+                return true;
+        }
+
+        // Traces hold no captures.
+        std::size_t capture_millivolts(uint8_t, uint32_t, std::span<uint16_t>) override { return 0; }
+
+        RawTrace::Sample const *sample{nullptr};
+
+      private:
+        Calibration::AdcTable const &table;
+};
+
+// What replay makes of one sample. A golden file has one line per sample.
+struct Output {
+        int64_t timestamp_s;
+        int32_t battery_millivolts;
+        int32_t temperature;
+        ReportReason reason;
+};
+
+struct LoadedTrace {
+        RawTrace::UnitCalibration calibration;
+        bool is_calibrated;
+        std::vector<RawTrace::Sample> samples;
+        std::size_t bad_lines;
+};
+
+// A straight line to 3100 mV, roughly the range of an uncalibrated ESP32 at 11 dB. Good enough to compare decisions
+// between builds, but not voltages against the board.
+RawTrace::UnitCalibration nominal_calibration()
+{
+        RawTrace::UnitCalibration calibration{{}, Sensors::NOMINAL_BATTERY_DIVIDER};
+        for (std::size_t knot = 0; knot < Calibration::AdcTable::KNOTS; ++knot) {
+                calibration.table.millivolts[knot] =
+                    static_cast<uint16_t>(Calibration::knot_raw(knot) * 3100 / Calibration::AdcTable::MAX_RAW);
+        }
+        return calibration;
+}
+
+// The first calibration line applies to the whole trace. Lines without a key are skipped.
+bool load_trace(char const *const path, LoadedTrace &trace)
+{
+        auto *const file = std::fopen(path, "r");
+        if (!file) {
+                ESP_LOGE(TAG, "Could not open %s.", path);
+                return false;
+        }
+        trace = LoadedTrace{nominal_calibration(), false, {}, 0};
+        std::array<char, RawTrace::MAX_LINE_BYTES + 2> line;
+        while (std::fgets(line.data(), static_cast<int>(line.size()), file)) {
+                std::string_view const text{line.data()};
+                if (auto const sample = RawTrace::parse_sample(text)) {
+                        trace.samples.push_back(*sample);
+                } else if (text.find(RawTrace::SAMPLE_KEY) != std::string_view::npos) {
+                        ++trace.bad_lines;
+                } else if (auto const calibration = RawTrace::parse_calibration(text)) {
+                        if (!trace.is_calibrated) {
+                                trace.calibration = *calibration;
+                                trace.is_calibrated = true;
+                        }
+                } else if (text.find(RawTrace::CALIBRATION_KEY) != std::string_view::npos) {
+                        ++trace.bad_lines;
+                }
+        }
+        std::fclose(file);
+        return true;
+}
+
+std::optional<ReportReason> parse_reason(std::string_view const name)
+{
+        for (auto reason = uint8_t{0}; reason <= static_cast<uint8_t>(ReportReason::Capture); ++reason) {
+                if (name == report_reason_name(static_cast<ReportReason>(reason))) {
+                        return static_cast<ReportReason>(reason);
+                }
+        }
+        return std::nullopt;
+}
+
+bool load_golden(char const *const path, std::vector<Output> &golden)
+{
+        auto *const file = std::fopen(path, "r");
+        if (!file) {
+                ESP_LOGE(TAG, "Could not open %s.", path);
+                return false;
+        }
+        Output output{};
+        char name[32];
+        while (std::fscanf(file, "%" SCNd64 " %" SCNd32 " %" SCNd32 " %31s", &output.timestamp_s,
+                           &output.battery_millivolts, &output.temperature, name) == 4) {
+                output.reason = parse_reason(name).value_or(ReportReason::None);
+                golden.push_back(output);
+        }
+        std::fclose(file);
+        return true;
+}
+
+bool write_golden(char const *const path, std::vector<Output> const &outputs)
+{
+        auto *const file = std::fopen(path, "w");
+        if (!file) {
+                ESP_LOGE(TAG, "Could not create %s.", path);
+                return false;
+        }
+        for (auto const &output : outputs) {
+                std::fprintf(file, "%" PRId64 " %" PRId32 " %" PRId32 " %s\n", output.timestamp_s,
+                             output.battery_millivolts, output.temperature, report_reason_name(output.reason));
+        }
+        return std::fclose(file) == 0;
+}
+
+// Prints the drift of outputs from golden. Returns whether they match.
+bool compare(std::vector<Output> const &outputs, std::vector<Output> const &golden)
+{
+        auto const count = std::min(outputs.size(), golden.size());
+        std::size_t drifted{0};
+        std::size_t decision_changes{0};
+        std::size_t golden_uploads{0};
+        int32_t max_drift{0};
+        int64_t total_drift{0};
+        for (std::size_t i = 0; i < count; ++i) {
+                auto const drift = outputs[i].battery_millivolts - golden[i].battery_millivolts;
+                max_drift = std::max(max_drift, std::abs(drift));
+                total_drift += std::abs(drift);
+                drifted += drift != 0 || outputs[i].temperature != golden[i].temperature ||
+                           outputs[i].timestamp_s != golden[i].timestamp_s;
+                decision_changes += outputs[i].reason != golden[i].reason;
+        }
+        for (auto const &output : golden) {
+                golden_uploads += output.reason != ReportReason::None;
+        }
+        std::printf("replay.golden_samples=%zu\n", golden.size());
+        std::printf("replay.golden_uploads=%zu\n", golden_uploads);
+        std::printf("replay.drift_samples=%zu\n", drifted);
+        std::printf("replay.drift_max_mv=%" PRId32 "\n", max_drift);
+        std::printf("replay.drift_mean_mv=%.3f\n",
+                    static_cast<double>(total_drift) / static_cast<double>(std::max<std::size_t>(count, 1)));
+        std::printf("replay.decision_changes=%zu\n", decision_changes);
+        return outputs.size() == golden.size() && drifted == 0 && decision_changes == 0;
+}
+
+} // namespace
+
+bool run_replay(char const *const trace_path, char const *const golden_path, char const *const write_golden_path)
+{
+        LoadedTrace trace;
+        if (!load_trace(trace_path, trace)) {
+                return false;
+        }
+        if (trace.samples.empty()) {
+                ESP_LOGE(TAG, "No samples in %s.", trace_path);
+                return false;
+        }
+        if (!trace.is_calibrated) {
+                ESP_LOGW(TAG, "No calibration in %s. Converting with a nominal table.", trace_path);
+        }
+
+        // Static like the RTC memory it stands in for.
+        static WakeState state;
+        state = WakeState{};
+        ReplayClock clock;
+        ReplayAdc adc{trace.calibration.table};
+        Sensors::set_battery_divider(trace.calibration.divider);
+        std::vector<Output> outputs;
+        outputs.reserve(trace.samples.size());
+        std::array<std::size_t, static_cast<std::size_t>(ReportReason::Capture) + 1> uploads{};
+        std::size_t capture_triggers{0};
+        std::size_t failed_reads{0};
+
+        auto const start = std::chrono::steady_clock::now();
+        for (auto const &sample : trace.samples) {
+                adc.sample = &sample;
+                clock.seconds = sample.timestamp_s;
+                Trace::begin_cycle();
+                auto const decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+                if (!decision) {
+                        ++failed_reads;
+                        continue;
+                }
+                // Every upload succeeds, so that decisions only depend on the trace.
+                if (decision->reason != ReportReason::None) {
+                        mark_reported(state);
+                }
+                ++uploads[static_cast<std::size_t>(decision->reason)];
+                capture_triggers += decision->capture_trigger != Capture::Trigger::None;
+                outputs.push_back(Output{sample.timestamp_s, *decision->values[Sensors::BATTERY],
+                                         decision->values[Sensors::TEMPERATURE].value_or(0), decision->reason});
+        }
+        auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        Sensors::set_battery_divider(Sensors::NOMINAL_BATTERY_DIVIDER);
+
+        auto const span_s = trace.samples.back().timestamp_s - trace.samples.front().timestamp_s;
+        std::printf("replay.samples=%zu\n", trace.samples.size());
+        std::printf("replay.bad_lines=%zu\n", trace.bad_lines);
+        std::printf("replay.failed_reads=%zu\n", failed_reads);
+        std::printf("replay.calibration=%s\n", trace.is_calibrated ? "recorded" : "nominal");
+        std::printf("replay.trace_hours=%.1f\n", static_cast<double>(span_s) / 3600.0);
+        std::printf("replay.elapsed_ms=%.1f\n", elapsed * 1000.0);
+        std::printf("replay.samples_per_s=%.0f\n", static_cast<double>(trace.samples.size()) / elapsed);
+        std::printf("replay.uploads=%zu\n", outputs.size() - uploads[static_cast<std::size_t>(ReportReason::None)]);
+        for (std::size_t reason = 1; reason < uploads.size(); ++reason) {
+                std::printf("replay.uploads_%s=%zu\n", report_reason_name(static_cast<ReportReason>(reason)),
+                            uploads[reason]);
+        }
+        std::printf("replay.capture_triggers=%zu\n", capture_triggers);
+        std::printf("replay.final_millivolts=%u\n", state.last_millivolts);
+        if (auto const charge = Charge::estimate(state.charge, WAKE_CONFIG.charge_policy, clock.now_s())) {
+                std::printf("replay.charge_soc_percent=%u\n", charge->soc_percent);
+                std::printf("replay.charge_drain_mv_per_hour=%.2f\n",
+                            static_cast<double>(charge->drain_millivolts_per_hour.value_or(0.f)));
+        }
+
+        auto is_ok = failed_reads == 0;
+        if (golden_path) {
+                std::vector<Output> golden;
+                is_ok = load_golden(golden_path, golden) && compare(outputs, golden) && is_ok;
+        }
+        if (write_golden_path) {
+                is_ok = write_golden(write_golden_path, outputs) && is_ok;
+        }
+        return is_ok;
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
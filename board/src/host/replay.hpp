@@ -0,0 +1,18 @@
+#pragma once
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+// Feed the raw trace at trace_path (see raw_trace.hpp) through the firmware's conversion, filtering, charge estimator
+// and report decisions, as fast as they run. Prints the throughput and the uploads the report policy would have made
+// as key=value results. With golden_path, also prints how far each converted reading and decision drifted from that
+// golden file. Writes this run's readings and decisions as a golden file to write_golden_path if it is not null.
+// Returns false if the trace could not be read or anything drifted.
+bool run_replay(char const *trace_path, char const *golden_path, char const *write_golden_path);
+
+} // namespace Host
+
+} // namespace BatteryMonitor
@@ -0,0 +1,324 @@
+#include "benchmarks.hpp"
+#include "endpoint.hpp"
+#include "http.hpp"
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+namespace BatteryMonitor
+{
+
+namespace Host
+{
+
+namespace
+{
+
+using Clock = std::chrono::steady_clock;
+
+constexpr std::string_view HOST{"localhost"};
+constexpr std::string_view RESPONSE{"HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: 2\r\n\r\n{}"};
+// The firmware's mbedTLS is built for TLS 1.2 only, where the session ticket arrives within the handshake.
+constexpr int TLS_VERSION{TLS1_2_VERSION};
+// OpenSSL keeps the server certificate in the session, which the firmware's mbedTLS is configured not to.
+constexpr std::size_t HOST_SESSION_BYTES{1024};
+
+// A self-signed P-256 certificate for localhost, made at start-up so that nothing secret is checked in.
+struct Identity {
+        EVP_PKEY *key{nullptr};
+        X509 *certificate{nullptr};
+
+        Identity()
+        {
+                key = EVP_EC_gen("P-256");
+                certificate = X509_new();
+                X509_set_version(certificate, 2);
+                ASN1_INTEGER_set(X509_get_serialNumber(certificate), 1);
+                X509_gmtime_adj(X509_getm_notBefore(certificate), 0);
+                X509_gmtime_adj(X509_getm_notAfter(certificate), 24 * 60 * 60);
+                auto *const name = X509_get_subject_name(certificate);
+                X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                           reinterpret_cast<unsigned char const *>(std::string{HOST}.c_str()), -1, -1,
+                                           0);
+                X509_set_issuer_name(certificate, name);
+                X509_set_pubkey(certificate, key);
+                X509_sign(certificate, key, EVP_sha256());
+        }
+        ~Identity()
+        {
+                X509_free(certificate);
+                EVP_PKEY_free(key);
+        }
+        Identity(Identity const &) = delete;
+        Identity &operator=(Identity const &) = delete;
+};
+
+// Answers every POST with 200 over TLS on 127.0.0.1, keeping connections alive, one connection at a time. Issues
+// stateless session tickets, as Home Assistant's server does.
+class TlsServer
+{
+      public:
+        explicit TlsServer(Identity const &identity)
+        {
+                context = SSL_CTX_new(TLS_server_method());
+                SSL_CTX_set_min_proto_version(context, TLS_VERSION);
+                SSL_CTX_set_max_proto_version(context, TLS_VERSION);
+                SSL_CTX_use_certificate(context, identity.certificate);
+                SSL_CTX_use_PrivateKey(context, identity.key);
+        }
+        ~TlsServer()
+        {
+                running = false;
+                ::shutdown(listen_fd, SHUT_RDWR);
+                if (thread.joinable()) {
+                        thread.join();
+                }
+                ::close(listen_fd);
+                SSL_CTX_free(context);
+        }
+        TlsServer(TlsServer const &) = delete;
+        TlsServer &operator=(TlsServer const &) = delete;
+
+        bool start()
+        {
+                listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+                sockaddr_in address{};
+                address.sin_family = AF_INET;
+                address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                socklen_t length{sizeof(address)};
+                if (listen_fd < 0 || ::bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+                    ::listen(listen_fd, 4) != 0 ||
+                    ::getsockname(listen_fd, reinterpret_cast<sockaddr *>(&address), &length) != 0) {
+                        return false;
+                }
+                bound_port = ntohs(address.sin_port);
+                running = true;
+                thread = std::thread{[this] { serve(); }};
+                return true;
+        }
+
+        uint16_t port() const { return bound_port; }
+
+      private:
+        void serve()
+        {
+                while (running) {
+                        auto const fd = ::accept(listen_fd, nullptr, nullptr);
+                        if (fd < 0) {
+                                continue;
+                        }
+                        auto *const ssl = SSL_new(context);
+                        SSL_set_fd(ssl, fd);
+                        if (SSL_accept(ssl) == 1) {
+                                while (read_request(ssl) &&
+                                       SSL_write(ssl, RESPONSE.data(), static_cast<int>(RESPONSE.size())) > 0) {
+                                }
+                        }
+                        SSL_free(ssl);
+                        ::close(fd);
+                }
+        }
+
+        // Headers, then a Content-Length body. False when the client closed the connection.
+        static bool read_request(SSL *const ssl)
+        {
+                std::string request;
+                std::array<char, 1024> buffer;
+                while (true) {
+                        auto const received = SSL_read(ssl, buffer.data(), static_cast<int>(buffer.size()));
+                        if (received <= 0) {
+                                return false;
+                        }
+                        request.append(buffer.data(), static_cast<std::size_t>(received));
+                        auto const end = request.find("\r\n\r\n");
+                        auto const length = request.find("Content-Length: ");
+                        if (end != std::string::npos && length < end &&
+                            request.size() >= end + 4 + std::stoul(request.substr(length + 16))) {
+                                return true;
+                        }
+                }
+        }
+
+        SSL_CTX *context{nullptr};
+        int listen_fd{-1};
+        uint16_t bound_port{0};
+        std::atomic<bool> running{false};
+        std::thread thread;
+};
+
+enum class Path { Cold, CachedAddress, Resumed };
+
+struct WakeResult {
+        bool ok;
+        bool resumed;
+        Clock::duration resolve;
+        Clock::duration handshake;
+        Clock::duration total;
+};
+
+// What a wake keeps in RTC memory on the board.
+struct Caches {
+        Net::DnsCache dns{};
+        Net::TlsSessionCache<HOST_SESSION_BYTES> session{};
+};
+
+std::optional<uint32_t> resolve(Caches &caches, Path const path)
+{
+        if (path != Path::Cold) {
+                if (auto const address = Net::lookup(caches.dns, HOST, 0)) {
+                        return address;
+                }
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *found{nullptr};
+        if (::getaddrinfo(std::string{HOST}.c_str(), nullptr, &hints, &found) != 0 || found == nullptr) {
+                return std::nullopt;
+        }
+        auto const address = reinterpret_cast<sockaddr_in const *>(found->ai_addr)->sin_addr.s_addr;
+        ::freeaddrinfo(found);
+        Net::store(caches.dns, HOST, address, 0, std::chrono::hours{1});
+        return address;
+}
+
+// One wake's upload the way HaTlsClient does it: resolve, connect, handshake, POST, close.
+WakeResult run_wake(SSL_CTX *const context, uint16_t const port, Caches &caches, Path const path)
+{
+        WakeResult result{};
+        auto const start = Clock::now();
+        auto const address = resolve(caches, path);
+        auto const resolved = Clock::now();
+        result.resolve = resolved - start;
+        if (!address) {
+                return result;
+        }
+
+        auto const fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in server{};
+        server.sin_family = AF_INET;
+        server.sin_port = htons(port);
+        server.sin_addr.s_addr = *address;
+        int const no_delay{1};
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+        if (::connect(fd, reinterpret_cast<sockaddr const *>(&server), sizeof(server)) != 0) {
+                ::close(fd);
+                return result;
+        }
+        auto *const ssl = SSL_new(context);
+        SSL_set_fd(ssl, fd);
+        SSL_set_tlsext_host_name(ssl, std::string{HOST}.c_str());
+        SSL_set1_host(ssl, std::string{HOST}.c_str());
+        if (auto const saved = Net::lookup(caches.session, HOST, 0); path == Path::Resumed && !saved.empty()) {
+                auto const *bytes = saved.data();
+                if (auto *const session = d2i_SSL_SESSION(nullptr, &bytes, static_cast<long>(saved.size()))) {
+                        SSL_set_session(ssl, session);
+                        SSL_SESSION_free(session);
+                }
+        }
+        auto const handshake_start = Clock::now();
+        if (SSL_connect(ssl) == 1) {
+                result.handshake = Clock::now() - handshake_start;
+                result.resumed = SSL_session_reused(ssl) == 1;
+                if (auto *const session = SSL_get1_session(ssl)) {
+                        std::array<uint8_t, HOST_SESSION_BYTES> bytes;
+                        auto *out = bytes.data();
+                        auto const size = i2d_SSL_SESSION(session, nullptr) <= static_cast<int>(bytes.size())
+                                              ? i2d_SSL_SESSION(session, &out)
+                                              : 0;
+                        Net::store(caches.session, HOST, std::span{bytes}.first(static_cast<std::size_t>(size)), 0,
+                                   std::chrono::hours{24});
+                        SSL_SESSION_free(session);
+                }
+
+                std::array<char, 512> headers;
+                Payload::Writer writer{headers};
+                constexpr std::string_view body{R"({"state":"12.650"})"};
+                Http::append_post(writer, HOST, "/api/states/", "sensor.car_battery", "Bearer token", body.size());
+                auto const request = writer.view().value_or("");
+                Http::ResponseReader response;
+                std::array<char, 256> buffer;
+                if (SSL_write(ssl, request.data(), static_cast<int>(request.size())) > 0 &&
+                    SSL_write(ssl, body.data(), static_cast<int>(body.size())) > 0) {
+                        while (!response.is_done() && !response.is_failed()) {
+                                auto const received = SSL_read(ssl, buffer.data(), static_cast<int>(buffer.size()));
+                                if (received <= 0) {
+                                        break;
+                                }
+                                response.feed(std::span{buffer}.first(static_cast<std::size_t>(received)));
+                        }
+                }
+                result.ok = response.is_done() && response.status() == 200;
+                SSL_shutdown(ssl);
+        }
+        SSL_free(ssl);
+        ::close(fd);
+        result.total = Clock::now() - start;
+        return result;
+}
+
+} // namespace
+
+void run_tls_benchmark(std::size_t const iterations)
+{
+        Identity const identity;
+        TlsServer server{identity};
+        if (!server.start()) {
+                std::fprintf(stderr, "Could not start the TLS server.\n");
+                return;
+        }
+        auto *const context = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_min_proto_version(context, TLS_VERSION);
+        SSL_CTX_set_max_proto_version(context, TLS_VERSION);
+        SSL_CTX_set_verify(context, SSL_VERIFY_PEER, nullptr);
+        X509_STORE_add_cert(SSL_CTX_get_cert_store(context), identity.certificate);
+        // Sessions are kept by the caller, like the RTC memory cache on the board.
+        SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_OFF);
+
+        constexpr std::array paths{std::pair{Path::Cold, "cold"}, std::pair{Path::CachedAddress, "cached_address"},
+                                   std::pair{Path::Resumed, "resumed"}};
+        for (auto const &[path, name] : paths) {
+                Caches caches;
+                // A wake before the measured ones fills the caches, as the previous wake would have.
+                run_wake(context, server.port(), caches, path);
+                Clock::duration resolve{}, handshake{}, total{};
+                std::size_t ok{0}, resumed{0};
+                for (std::size_t i = 0; i < iterations; ++i) {
+                        auto const result = run_wake(context, server.port(), caches, path);
+                        ok += result.ok;
+                        resumed += result.resumed;
+                        resolve += result.resolve;
+                        handshake += result.handshake;
+                        total += result.total;
+                }
+                auto const mean_us = [&](Clock::duration const duration) {
+                        return std::chrono::duration<double, std::micro>(duration).count() / iterations;
+                };
+                std::printf("tls.%s.resolve_us=%.1f\n", name, mean_us(resolve));
+                std::printf("tls.%s.handshake_us=%.1f\n", name, mean_us(handshake));
+                std::printf("tls.%s.wake_us=%.1f\n", name, mean_us(total));
+                std::printf("tls.%s.resumed=%zu\n", name, resumed);
+                std::printf("tls.%s.ok=%zu\n", name, ok);
+                if (path == Path::Resumed) {
+                        std::printf("tls.session_bytes=%u\n", caches.session.size);
+                }
+        }
+        SSL_CTX_free(context);
+}
+
+} // namespace Host
+
+} // namespace BatteryMonitor
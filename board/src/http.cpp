@@ -0,0 +1,126 @@
+#include "http.hpp"
+#include <algorithm>
+
+namespace BatteryMonitor
+{
+
+namespace Http
+{
+
+namespace
+{
+
+constexpr std::string_view HEADERS_END{"\r\n\r\n"};
+
+bool equals_ignoring_case(std::string_view const a, std::string_view const b)
+{
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char const x, char const y) {
+                       auto const lower = [](char const c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; };
+                       return lower(x) == lower(y);
+               });
+}
+
+std::string_view trim(std::string_view text)
+{
+        while (!text.empty() && text.front() == ' ') {
+                text.remove_prefix(1);
+        }
+        while (!text.empty() && text.back() == ' ') {
+                text.remove_suffix(1);
+        }
+        return text;
+}
+
+// Non-negative decimal, or std::nullopt.
+std::optional<std::size_t> parse_size(std::string_view const text)
+{
+        if (text.empty() || text.size() > 9) {
+                return std::nullopt;
+        }
+        std::size_t value{0};
+        for (auto const c : text) {
+                if (c < '0' || c > '9') {
+                        return std::nullopt;
+                }
+                value = value * 10 + static_cast<std::size_t>(c - '0');
+        }
+        return value;
+}
+
+} // namespace
+
+Payload::Writer &append_post(Payload::Writer &writer, std::string_view const host, std::string_view const path,
+                             std::string_view const name, std::string_view const authorization,
+                             std::size_t const body_size)
+{
+        writer.append("POST ").append(path).append(name).append(" HTTP/1.1\r\nHost: ").append(host);
+        writer.append("\r\nAuthorization: ").append(authorization);
+        writer.append("\r\nContent-Type: application/json\r\nContent-Length: ");
+        writer.append_int(static_cast<int64_t>(body_size));
+        return writer.append("\r\nConnection: keep-alive").append(HEADERS_END);
+}
+
+std::size_t ResponseReader::feed(std::span<char const> const data)
+{
+        std::size_t used{0};
+        while (!is_headers_done && !is_malformed && used < data.size()) {
+                if (headers_size == headers.size()) {
+                        is_malformed = true;
+                        return used;
+                }
+                headers[headers_size++] = data[used++];
+                if (std::string_view{headers.data(), headers_size}.ends_with(HEADERS_END)) {
+                        is_headers_done = true;
+                        is_malformed = !parse_headers();
+                }
+        }
+        auto const body = std::min(body_left, data.size() - used);
+        body_left -= body;
+        return used + body;
+}
+
+bool ResponseReader::parse_headers()
+{
+        std::string_view text{headers.data(), headers_size - HEADERS_END.size()};
+        auto const status_end = text.find("\r\n");
+        auto const status_line = text.substr(0, status_end);
+        // "HTTP/1.1 200 OK"
+        if (!status_line.starts_with("HTTP/1.") || status_line.size() < 12) {
+                return false;
+        }
+        auto const code = parse_size(status_line.substr(9, 3));
+        if (!code) {
+                return false;
+        }
+        status_code = static_cast<int>(*code);
+
+        bool has_length{false};
+        text.remove_prefix(std::min(text.size(), status_end == std::string_view::npos ? text.size() : status_end + 2));
+        while (!text.empty()) {
+                auto const line_end = text.find("\r\n");
+                auto const line = text.substr(0, line_end);
+                text.remove_prefix(line_end == std::string_view::npos ? text.size() : line_end + 2);
+                auto const colon = line.find(':');
+                if (colon == std::string_view::npos) {
+                        continue;
+                }
+                auto const name = line.substr(0, colon);
+                auto const value = trim(line.substr(colon + 1));
+                if (equals_ignoring_case(name, "Content-Length")) {
+                        auto const length = parse_size(value);
+                        if (!length) {
+                                return false;
+                        }
+                        body_left = *length;
+                        has_length = true;
+                } else if (equals_ignoring_case(name, "Connection")) {
+                        is_close = equals_ignoring_case(value, "close");
+                }
+        }
+        // 204 and 304 have no body. Anything else without a length would be read until the connection closes.
+        return has_length || status_code == 204 || status_code == 304;
+}
+
+} // namespace Http
+
+} // namespace BatteryMonitor
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "payload.hpp"
+#include <array>
+#include <cstddef>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// Just enough HTTP/1.1 to POST to Home Assistant over a connection that the caller opened, such as a TLS session.
+namespace Http
+{
+
+// Append the request line and headers of a keep-alive POST of a JSON body of body_size bytes to path + name. The body
+// is sent after them.
+Payload::Writer &append_post(Payload::Writer &writer, std::string_view host, std::string_view path,
+                             std::string_view name, std::string_view authorization, std::size_t body_size);
+
+// Reads one response from the bytes received for it, without allocating. Bodies must have a Content-Length, which
+// Home Assistant always sends.
+class ResponseReader
+{
+      public:
+        // Returns how many bytes of data belong to this response.
+        std::size_t feed(std::span<char const> data);
+
+        bool is_done() const { return is_headers_done && body_left == 0; }
+        // Malformed, or the headers did not fit.
+        bool is_failed() const { return is_malformed; }
+        // 0 until the headers are read.
+        int status() const { return status_code; }
+        // The server closes the connection after this response.
+        bool is_closing() const { return is_close; }
+
+      private:
+        bool parse_headers();
+
+        std::array<char, 512> headers{};
+        std::size_t headers_size{0};
+        std::size_t body_left{0};
+        int status_code{0};
+        bool is_headers_done{false};
+        bool is_malformed{false};
+        bool is_close{false};
+};
+
+} // namespace Http
+
+} // namespace BatteryMonitor
@@ -1,20 +1,27 @@
 #ifndef PROJECTIO_TESTING
 
 extern "C" {
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_sleep.h"
+#include "esp_system.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 #include "freertos/task.h"
+#include "soc/soc_caps.h"
 }
 
 #include <chrono>
-#include "battery.hpp"
-#include "esp_ha_lib.hpp"
+#include "deferred_log.hpp"
+#include "ha_client.hpp"
+#include "hal_esp.hpp"
 #include "nvs_control.hpp"
-#include "secrets.h"
+#include "spsc_queue.hpp"
+#include "static_task.hpp"
+#include "trace.hpp"
+#include "ulp_monitor.hpp"
 #include "utils.h"
-#include "wifi.h"
+#include "wake_cycle.hpp"
 #include <cstring>
 
 namespace BatteryMonitor
@@ -23,92 +30,138 @@ namespace BatteryMonitor
 namespace
 {
 
+#define UPLOAD_DONE_BIT BIT0
+#define UPLOAD_FAILED_BIT BIT1
+#define UPLOAD_START_BIT BIT2
+
 constexpr auto TAG{"Main"};
-constexpr std::chrono::minutes TIME_IN_DEEP_SLEEP{1};
+static_assert(WAKE_CONFIG.capture_policy.sample_rate_hz <= SOC_ADC_SAMPLE_FREQ_THRES_HIGH,
+              "The ADC cannot capture that fast");
+// Hard deadline for the awake window. Sleep normally starts as soon as the upload finishes.
 constexpr std::chrono::seconds TIME_UNTIL_DEEP_SLEEP{10};
 
-// Read and upload battery data to Home Assistant.
-void upload_battery_task(void *args)
+// Kept in RTC slow memory so it survives deep sleep. Zero-initialized on power-on.
+RTC_DATA_ATTR WakeState wake_state;
+
+EventGroupHandle_t s_upload_event_group{nullptr};
+// NVS stays initialized across light sleep.
+bool s_is_nvs_ready{false};
+
+// Posts every entity. Payloads come from the wake arena, so this is mostly the HTTP or MQTT client. Check
+// upload_stack_free in the wake trace before shrinking. The TLS handshake needs twice as much.
+constexpr uint32_t UPLOAD_TASK_STACK_BYTES{Hal::HA_ENDPOINT.is_tls ? 8192u : 4096u};
+StaticTask<UPLOAD_TASK_STACK_BYTES> s_upload_task;
+
+// This wake's sampled record, handed from app_main, which samples, to the upload task by copy. app_main never waits on
+// the upload for anything but the sleep deadline.
+SpscQueue<WakeDecision, 2> s_decisions;
+
+// On each wake that reports, upload the buffered battery readings and the other sensors to Home Assistant, then signal
+// the result to app_main. Waits for the next such wake in between, which only comes after a light sleep.
+void upload_battery_task(void *)
 {
-        while (1) {
-                auto const battery_entity = create_battery_entity();
-
-                ESP_LOGI(TAG, "Waiting for Wi-Fi to upload battery...");
-                if (Wifi::wait_wifi_connected(Utils::to_ticks(std::chrono::seconds{5}))) {
-                        ESP_LOGI(TAG, "Uploading battery to %s", Secrets::HA_URL.data());
-                        battery_entity->post();
-                        ESP_LOGI(TAG, "Battery upload attempted.");
-                } else {
-                        ESP_LOGI(TAG, "upload_battery timed out. Retrying...");
-                }
-                battery_entity->print();
-                vTaskDelay(Utils::to_ticks(std::chrono::seconds{1}));
+        auto &platform = Hal::esp_platform(wake_state, WAKE_CONFIG);
+        while (true) {
+                xEventGroupWaitBits(s_upload_event_group, UPLOAD_START_BIT, pdTRUE, pdFALSE, portMAX_DELAY);
+                auto const decision = s_decisions.pop();
+                auto const is_uploaded = decision && upload(wake_state, WAKE_CONFIG, platform, *decision);
+                xEventGroupSetBits(s_upload_event_group, is_uploaded ? UPLOAD_DONE_BIT : UPLOAD_FAILED_BIT);
         }
 }
 
-// Start Wi-Fi state machine.
-void start_wifi_task(void *args)
+// Log what the ULP saw if it woke us.
+void log_ulp_results()
 {
-        while (1) {
-                Wifi::wifi_init_station();
-                vTaskSuspend(NULL);
+        auto const results = Ulp::read_results();
+        if (!results) {
+                return;
+        }
+        DLOGI(TAG, "Woken by ULP (%s). Last sample: %u raw.",
+              results->reason == Ulp::WakeReason::Window ? "window" : "heartbeat", results->last_sample);
+        for (auto const sample : results->samples) {
+                DLOGD(TAG, "ULP sample: %u raw", sample);
         }
 }
 
-// Turn off peripherals and enters deep sleep
-void start_deep_sleep()
+// Sample, upload if the reading is worth reporting, and sleep. Returns after a light sleep, when the next wake starts.
+void run_wake(Hal::Platform &platform)
 {
-        ESP_LOGI(TAG, "Shutting down peripherals.");
-        ESP_LOGI(TAG, "Stopping Wi-Fi.");
-        Wifi::stop_wifi();
-
-        ESP_LOGI(TAG, "Entering Deep Sleep");
-        esp_deep_sleep_start();
-}
-
-} // namespace
-
+        // Sample and buffer. Only bring up the radio when the reading is worth reporting.
+        auto decision = sample_and_decide(wake_state, WAKE_CONFIG, platform.adc, platform.clock);
+        if (!decision) {
+                // The read failed and sample_and_decide logged why. Nothing was buffered, so try again next wake.
+                auto const retry_interval = WAKE_CONFIG.sleep_policy.base_interval;
+                platform.sleeper.sleep(retry_interval,
+                                       choose_sleep_mode(wake_state, WAKE_CONFIG, retry_interval, false));
+                return;
+        }
+        capture_event(WAKE_CONFIG, platform.adc, *decision, Hal::is_capture_wake());
+        auto const sleep_interval = decision->sleep_interval;
+        if (decision->reason == ReportReason::None) {
+                DLOGI(TAG, "Reading unchanged. Skipping Wi-Fi.");
+                platform.sleeper.sleep(sleep_interval,
+                                       choose_sleep_mode(wake_state, WAKE_CONFIG, sleep_interval, false));
+                return;
+        }
+        DLOGI(TAG, "Reporting reading: %s", report_reason_name(decision->reason));
 
-extern "C" {
-void app_main(void)
-{
         // Init non-volatile storage (for Wi-Fi).
-        {
-            auto const is_nvs_init_success = Nvs::init_nvs();
-            if (!is_nvs_init_success) {
-                    ESP_LOGI(TAG, "Entering Deep Sleep due to NVS init failure. Monitor has failed.");
-                    esp_deep_sleep_start();
-            }
+        if (!s_is_nvs_ready) {
+                s_is_nvs_ready = Nvs::init_nvs();
+                Trace::mark(Trace::Phase::NvsInit);
+                if (!s_is_nvs_ready) {
+                        DLOGI(TAG, "Entering Deep Sleep due to NVS init failure. Monitor has failed.");
+                        esp_deep_sleep_start();
+                }
         }
 
-        // Setup Home Assistant info.
-        {
-            static_assert(!Secrets::LONG_LIVED_ACCESS_TOKEN.empty());
-            static_assert(!Secrets::HA_URL.empty());
-            static_assert(Secrets::HA_URL.back() != '/', "HA URL must not have a leading slash.");
-            esphalib::api::set_ha_url(Secrets::HA_URL.data());
-            esphalib::api::set_long_lived_access_token(Secrets::LONG_LIVED_ACCESS_TOKEN.data());
+        // Connect to Wi-Fi and upload sensor data.
+        xEventGroupClearBits(s_upload_event_group, UPLOAD_DONE_BIT | UPLOAD_FAILED_BIT);
+        s_decisions.push(*decision);
+        s_upload_task.start(upload_battery_task, "upload battery task", nullptr, 1);
+        xEventGroupSetBits(s_upload_event_group, UPLOAD_START_BIT);
+
+        // Sleep as soon as the upload finishes, or fails, or the deadline passes.
+        auto const bits = xEventGroupWaitBits(s_upload_event_group, UPLOAD_DONE_BIT | UPLOAD_FAILED_BIT, pdFALSE,
+                                              pdFALSE, Utils::to_ticks(TIME_UNTIL_DEEP_SLEEP));
+        auto mode = choose_sleep_mode(wake_state, WAKE_CONFIG, sleep_interval, true);
+        if (Utils::are_bits_set(bits, EventBits_t{UPLOAD_DONE_BIT})) {
+                DLOGI(TAG, "Upload finished");
+        } else if (Utils::are_bits_set(bits, EventBits_t{UPLOAD_FAILED_BIT})) {
+                DLOGI(TAG, "Upload failed");
+        } else {
+                // The upload task is still running. Only the reset of a deep sleep stops it.
+                DLOGI(TAG, "Deep Sleep timeout reached");
+                mode = SleepMode::Deep;
         }
 
-        // Main.
-        {
-            ESP_LOGI(TAG, "Enabling sleep timer wakeup: %lld minutes until wakeup. \n", TIME_IN_DEEP_SLEEP.count());
-            ESP_ERROR_CHECK_WITHOUT_ABORT(esp_sleep_enable_timer_wakeup(std::chrono::duration_cast<std::chrono::microseconds>(TIME_IN_DEEP_SLEEP).count()));
-
-            // Connect to Wi-Fi.
-            TaskHandle_t wifi_task_handle = nullptr;
-            xTaskCreate(start_wifi_task, "start wifi task", 4096, nullptr, 5, &wifi_task_handle);
+        auto memory = Hal::memory_stats();
+        memory.upload_stack_free = s_upload_task.stack_free();
+        record_memory(wake_state, memory);
 
-            // Upload sensor data.
-            TaskHandle_t upload_battery_task_handle = nullptr;
-            xTaskCreate(upload_battery_task, "upload battery task", 4096, nullptr, 1, &upload_battery_task_handle);
+        platform.sleeper.sleep(sleep_interval, mode);
+}
 
-            // Go to deep sleep after a set amount of time.
-            vTaskDelay(Utils::to_ticks(TIME_UNTIL_DEEP_SLEEP));
-            ESP_LOGI(TAG, "Deep Sleep timeout reached");
+} // namespace
 
-            // NOTE: Tasks don't need to be cleaned up because deep sleep will reset the device and clear RAM.
-            start_deep_sleep();
+extern "C" {
+void app_main(void)
+{
+        Trace::begin_cycle();
+        Log::begin_wake();
+        // After a reset or a crash, print what the wakes before it logged. Empty after power-on.
+        if (esp_reset_reason() != ESP_RST_DEEPSLEEP) {
+                Log::flush();
+        }
+        log_ulp_results();
+        auto &platform = Hal::esp_platform(wake_state, WAKE_CONFIG);
+        s_upload_event_group = xEventGroupCreate();
+
+        // One wake per pass. Deep sleep ends the loop, and the next wake starts at the top of app_main.
+        while (true) {
+                run_wake(platform);
+                Trace::begin_cycle();
+                Log::begin_wake();
         }
 }
 }
@@ -0,0 +1,68 @@
+#include "mqtt_discovery.hpp"
+
+namespace BatteryMonitor
+{
+
+namespace Mqtt
+{
+
+std::string_view object_id(std::string_view const entity_id)
+{
+        auto const dot = entity_id.find('.');
+        return dot == std::string_view::npos ? entity_id : entity_id.substr(dot + 1);
+}
+
+Payload::Writer &append_state_topic(Payload::Writer &writer, std::string_view const entity_id)
+{
+        return writer.append(TOPIC_PREFIX).append('/').append(object_id(entity_id)).append("/state");
+}
+
+Payload::Writer &append_event_topic(Payload::Writer &writer, std::string_view const event_type)
+{
+        return writer.append(TOPIC_PREFIX).append("/event/").append(event_type);
+}
+
+Payload::Writer &append_discovery_topic(Payload::Writer &writer, std::string_view const entity_id)
+{
+        return writer.append(DISCOVERY_PREFIX).append("/sensor/").append(object_id(entity_id)).append("/config");
+}
+
+Payload::Writer &append_discovery_config(Payload::Writer &writer, DiscoveryEntity const &entity)
+{
+        auto const id = object_id(entity.entity_id);
+        writer.append(R"({"name":")").append(entity.friendly_name);
+        writer.append(R"(","object_id":")").append(id);
+        writer.append(R"(","unique_id":")").append(TOPIC_PREFIX).append('_').append(id);
+        writer.append(R"(","state_topic":")");
+        append_state_topic(writer, entity.entity_id);
+        writer.append(R"(","value_template":"{{ value_json.state }}","json_attributes_topic":")");
+        append_state_topic(writer, entity.entity_id);
+        writer.append(R"(","json_attributes_template":"{{ value_json.attributes | tojson }}")");
+        if (!entity.unit.empty()) {
+                writer.append(R"(,"unit_of_measurement":")").append(entity.unit).append('"');
+        }
+        if (!entity.device_class.empty()) {
+                writer.append(R"(,"device_class":")").append(entity.device_class).append('"');
+        }
+        return writer.append(R"(,"device":{"identifiers":["batterymonitor"],"name":"Battery Monitor"}})");
+}
+
+uint32_t discovery_hash()
+{
+        // FNV-1a
+        uint32_t hash{2'166'136'261u};
+        std::array<char, DISCOVERY_CONFIG_SIZE> buffer;
+        for (auto const &entity : DISCOVERY_ENTITIES) {
+                Payload::Writer writer{buffer};
+                append_discovery_topic(writer, entity.entity_id);
+                append_discovery_config(writer, entity);
+                for (auto const c : writer.view().value_or("")) {
+                        hash = (hash ^ static_cast<uint8_t>(c)) * 16'777'619u;
+                }
+        }
+        return hash;
+}
+
+} // namespace Mqtt
+
+} // namespace BatteryMonitor
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "payload.hpp"
+#include "sensors.hpp"
+#include "wake_cycle.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// Home Assistant over MQTT: topic layout, discovery configs and QoS, shared by the target and host clients.
+namespace Mqtt
+{
+
+// What Home Assistant needs to create an entity through MQTT discovery.
+struct DiscoveryEntity {
+        std::string_view entity_id;
+        std::string_view friendly_name;
+        std::string_view unit;
+        std::string_view device_class;
+};
+
+constexpr std::string_view TOPIC_PREFIX{"batterymonitor"};
+constexpr std::string_view DISCOVERY_PREFIX{"homeassistant"};
+
+// Every entity the monitor publishes: the sensor registry, the wake trace, the last capture and the charge estimate.
+constexpr auto DISCOVERY_ENTITIES = [] {
+        std::array<DiscoveryEntity, Sensors::SENSOR_COUNT + 4> entities{};
+        for (std::size_t i = 0; i < Sensors::SENSOR_COUNT; ++i) {
+                auto const &sensor = Sensors::REGISTRY[i];
+                entities[i] = {sensor.entity_id, sensor.friendly_name, sensor.unit, sensor.device_class};
+        }
+        entities[Sensors::SENSOR_COUNT] = {WAKE_TRACE_ENTITY_ID, "Battery Monitor Wake Time", "ms", "duration"};
+        entities[Sensors::SENSOR_COUNT + 1] = {CAPTURE_ENTITY_ID, "Car Battery Event", "Volts", ""};
+        entities[Sensors::SENSOR_COUNT + 2] = {CHARGE_ENTITY_ID, "Car Battery Charge", "%", "battery"};
+        entities[Sensors::SENSOR_COUNT + 3] = {HOURS_LEFT_ENTITY_ID, "Car Battery Hours Left", "h", "duration"};
+        return entities;
+}();
+
+// Big enough for any topic or discovery config above.
+constexpr std::size_t TOPIC_SIZE{128};
+constexpr std::size_t DISCOVERY_CONFIG_SIZE{640};
+
+// "sensor.car_battery" -> "car_battery".
+std::string_view object_id(std::string_view entity_id);
+
+// batterymonitor/<object_id>/state. The payload is the same state JSON the REST API takes.
+Payload::Writer &append_state_topic(Payload::Writer &writer, std::string_view entity_id);
+// batterymonitor/event/<event_type>. Events are not retained and always go out at QoS 1.
+Payload::Writer &append_event_topic(Payload::Writer &writer, std::string_view event_type);
+// homeassistant/sensor/<object_id>/config
+Payload::Writer &append_discovery_topic(Payload::Writer &writer, std::string_view entity_id);
+Payload::Writer &append_discovery_config(Payload::Writer &writer, DiscoveryEntity const &entity);
+
+// Hash of every discovery config. Configs are only republished when this changes.
+uint32_t discovery_hash();
+
+// The battery batch carries the buffered history, so it must be acknowledged before the buffer is cleared. The rest
+// are replaced on the next report and go out at QoS 0.
+constexpr int qos_for(std::string_view const entity_id)
+{
+        return entity_id == Sensors::REGISTRY[Sensors::BATTERY].entity_id ? 1 : 0;
+}
+
+} // namespace Mqtt
+
+} // namespace BatteryMonitor
@@ -2,6 +2,7 @@ extern "C" {
 #include "esp_log.h"
 #include "nvs_flash.h"
 }
+#include "deferred_log.hpp"
 #include "nvs_control.hpp"
 
 namespace BatteryMonitor
@@ -34,7 +35,7 @@ bool init_nvs()
         }
 
         auto const msg = success ? "NVS init successful." : "NVS init failure.";
-        ESP_LOGI(TAG, "%s", msg);
+        DLOGI(TAG, "%s", msg);
         return success;
 }
 
@@ -0,0 +1,82 @@
+#include "payload.hpp"
+#include <algorithm>
+#include <charconv>
+
+namespace BatteryMonitor
+{
+
+namespace Payload
+{
+
+Writer &Writer::append(std::string_view const text)
+{
+        if (is_overflowed || text.size() > buffer.size() - length) {
+                is_overflowed = true;
+                return *this;
+        }
+        std::copy(text.begin(), text.end(), buffer.begin() + length);
+        length += text.size();
+        return *this;
+}
+
+Writer &Writer::append(char const c) { return append(std::string_view{&c, 1}); }
+
+Writer &Writer::append_int(int64_t const value)
+{
+        char digits[20];
+        auto const [end, error] = std::to_chars(std::begin(digits), std::end(digits), value);
+        return append(std::string_view{digits, static_cast<std::size_t>(end - digits)});
+}
+
+Writer &Writer::append_fixed(int64_t const value, unsigned decimals)
+{
+        constexpr unsigned MAX_DECIMALS{18};
+        decimals = std::min(decimals, MAX_DECIMALS);
+        if (value < 0) {
+                append('-');
+        }
+        // Work on the magnitude so that the most negative value does not overflow.
+        auto magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        uint64_t scale{1};
+        for (unsigned i = 0; i < decimals; ++i) {
+                scale *= 10;
+        }
+
+        char digits[21];
+        auto const [end, error] = std::to_chars(std::begin(digits), std::end(digits), magnitude / scale);
+        append(std::string_view{digits, static_cast<std::size_t>(end - digits)});
+        if (decimals == 0) {
+                return *this;
+        }
+        magnitude %= scale;
+        for (auto i = decimals; i > 0; --i) {
+                digits[i - 1] = static_cast<char>('0' + magnitude % 10);
+                magnitude /= 10;
+        }
+        return append('.').append(std::string_view{digits, decimals});
+}
+
+std::optional<std::string_view> Writer::view() const
+{
+        if (is_overflowed) {
+                return std::nullopt;
+        }
+        return std::string_view{buffer.data(), length};
+}
+
+Writer &append_readings(Writer &writer, std::span<Reading const> const readings, int64_t const now_s)
+{
+        writer.append('[');
+        for (std::size_t i = 0; i < readings.size(); ++i) {
+                if (i != 0) {
+                        writer.append(',');
+                }
+                writer.append('[').append_int(now_s - readings[i].timestamp_s).append(',');
+                writer.append_fixed(readings[i].millivolts, 3).append(']');
+        }
+        return writer.append(']');
+}
+
+} // namespace Payload
+
+} // namespace BatteryMonitor
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "reading_ring.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace Payload
+{
+
+// Appends text to a caller-provided buffer without allocating. Once something does not fit, the writer is overflowed
+// and ignores everything after it.
+class Writer
+{
+      public:
+        explicit constexpr Writer(std::span<char> buffer) : buffer{buffer} {}
+
+        Writer &append(std::string_view text);
+        Writer &append(char c);
+        Writer &append_int(int64_t value);
+        // value / 10^decimals with exactly decimals digits after the point, e.g. 12345 with 3 decimals is "12.345".
+        Writer &append_fixed(int64_t value, unsigned decimals);
+
+        constexpr bool overflowed() const { return is_overflowed; }
+        constexpr std::size_t size() const { return length; }
+        // The text written so far, or std::nullopt if it did not fit.
+        std::optional<std::string_view> view() const;
+
+      private:
+        std::span<char> buffer;
+        std::size_t length{0};
+        bool is_overflowed{false};
+};
+
+// Longest reading written by append_readings, including its separator.
+constexpr std::size_t MAX_READING_BYTES{sizeof(",[-9223372036854775808,65.535]") - 1};
+
+// Append the readings as a JSON array of [age in seconds, volts] pairs, oldest first.
+template <std::size_t Capacity>
+Writer &append_readings(Writer &writer, ReadingRing<Capacity> const &ring, int64_t const now_s)
+{
+        writer.append('[');
+        for (std::size_t i = 0; i < ring.size(); ++i) {
+                auto const &reading = ring[i];
+                if (i != 0) {
+                        writer.append(',');
+                }
+                writer.append('[').append_int(now_s - reading.timestamp_s).append(',');
+                writer.append_fixed(reading.millivolts, 3).append(']');
+        }
+        return writer.append(']');
+}
+
+// The same for readings copied out of the ring, such as those read back from the flash log.
+Writer &append_readings(Writer &writer, std::span<Reading const> readings, int64_t now_s);
+
+} // namespace Payload
+
+} // namespace BatteryMonitor
@@ -0,0 +1,127 @@
+#include "raw_trace.hpp"
+#include <charconv>
+
+namespace BatteryMonitor
+{
+
+namespace RawTrace
+{
+
+namespace
+{
+
+// Splits the fields after key off line, or returns false if line does not hold key.
+bool find_fields(std::string_view const line, std::string_view const key, std::string_view &fields)
+{
+        auto const start = line.find(key);
+        if (start == std::string_view::npos) {
+                return false;
+        }
+        fields = line.substr(start + key.size());
+        fields = fields.substr(0, fields.find_first_of("\r\n"));
+        return true;
+}
+
+// The next space-separated field, or an empty view at the end.
+std::string_view next_field(std::string_view &fields)
+{
+        auto const start = fields.find_first_not_of(' ');
+        if (start == std::string_view::npos) {
+                fields = {};
+                return {};
+        }
+        fields.remove_prefix(start);
+        auto const end = fields.find(' ');
+        auto const field = fields.substr(0, end);
+        fields.remove_prefix(end == std::string_view::npos ? fields.size() : end);
+        return field;
+}
+
+template <typename T> bool parse_number(std::string_view const text, T &value)
+{
+        auto const *const end = text.data() + text.size();
+        auto const [last, error] = std::from_chars(text.data(), end, value);
+        return error == std::errc{} && last == end;
+}
+
+} // namespace
+
+Payload::Writer &append_calibration(Payload::Writer &writer, UnitCalibration const &calibration)
+{
+        writer.append(CALIBRATION_KEY).append_int(calibration.divider.gain_q16);
+        writer.append(' ').append_int(calibration.divider.offset_millivolts);
+        for (auto const millivolts : calibration.table.millivolts) {
+                writer.append(' ').append_int(millivolts);
+        }
+        return writer;
+}
+
+Payload::Writer &append_sample(Payload::Writer &writer, int64_t const timestamp_s,
+                               std::span<std::span<int const> const> const bursts)
+{
+        writer.append(SAMPLE_KEY).append_int(timestamp_s);
+        for (auto const burst : bursts) {
+                for (std::size_t i = 0; i < burst.size(); ++i) {
+                        writer.append(i == 0 ? ' ' : ',').append_int(burst[i]);
+                }
+        }
+        return writer;
+}
+
+std::optional<UnitCalibration> parse_calibration(std::string_view const line)
+{
+        std::string_view fields;
+        if (!find_fields(line, CALIBRATION_KEY, fields)) {
+                return std::nullopt;
+        }
+        UnitCalibration calibration{};
+        if (!parse_number(next_field(fields), calibration.divider.gain_q16) ||
+            !parse_number(next_field(fields), calibration.divider.offset_millivolts) ||
+            calibration.divider.gain_q16 <= 0) {
+                return std::nullopt;
+        }
+        for (auto &millivolts : calibration.table.millivolts) {
+                if (!parse_number(next_field(fields), millivolts)) {
+                        return std::nullopt;
+                }
+        }
+        if (!next_field(fields).empty()) {
+                return std::nullopt;
+        }
+        return calibration;
+}
+
+std::optional<Sample> parse_sample(std::string_view const line)
+{
+        std::string_view fields;
+        Sample sample{};
+        if (!find_fields(line, SAMPLE_KEY, fields) || !parse_number(next_field(fields), sample.timestamp_s)) {
+                return std::nullopt;
+        }
+        std::array<int, Filter::READ_SAMPLES> burst;
+        for (auto &raw : sample.raw) {
+                auto codes = next_field(fields);
+                std::size_t count{0};
+                for (; !codes.empty() && count < burst.size(); ++count) {
+                        auto const comma = codes.find(',');
+                        if (!parse_number(codes.substr(0, comma), burst[count]) || burst[count] < 0 ||
+                            burst[count] > Calibration::AdcTable::MAX_RAW) {
+                                return std::nullopt;
+                        }
+                        codes.remove_prefix(comma == std::string_view::npos ? codes.size() : comma + 1);
+                }
+                if (count == 0 || !codes.empty()) {
+                        return std::nullopt;
+                }
+                auto const trim = count * Filter::READ_TRIM / Filter::READ_SAMPLES;
+                raw = Filter::trimmed_mean(std::span{burst}.first(count), trim);
+        }
+        if (!next_field(fields).empty()) {
+                return std::nullopt;
+        }
+        return sample;
+}
+
+} // namespace RawTrace
+
+} // namespace BatteryMonitor
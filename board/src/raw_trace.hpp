@@ -0,0 +1,60 @@
+#pragma once
+
+#include "calibration.hpp"
+#include "filter.hpp"
+#include "payload.hpp"
+#include "sensors.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// Raw ADC codes recorded on the board, so that the conversion, filtering and report decisions can be replayed on the
+// host (host/replay.cpp). A trace is text, one line per wake, and can be cut from a serial console capture:
+//
+//   raw.calibration=<divider gain_q16> <divider offset mV> <table knot mV> ...
+//   raw.sample=<timestamp s> <code>[,<code>...] ...
+//
+// A sample has one field per ADC sensor, in registry order, so it includes the board temperature. Each field is the
+// filtered code of a read, or the whole burst, which replay filters like the board does.
+namespace RawTrace
+{
+
+inline constexpr std::string_view CALIBRATION_KEY{"raw.calibration="};
+inline constexpr std::string_view SAMPLE_KEY{"raw.sample="};
+// Fits a sample of full bursts and a calibration line.
+inline constexpr std::size_t MAX_LINE_BYTES{32 + Sensors::ADC_SENSOR_COUNT * Filter::READ_SAMPLES * 5 +
+                                            Calibration::AdcTable::KNOTS * 6};
+
+// What a unit converts raw codes with.
+struct UnitCalibration {
+        Calibration::AdcTable table;
+        Sensors::Divider divider;
+};
+
+struct Sample {
+        int64_t timestamp_s;
+        // Filtered code of each ADC sensor, in registry order.
+        std::array<int32_t, Sensors::ADC_SENSOR_COUNT> raw;
+};
+
+// Writes a calibration line without the newline.
+Payload::Writer &append_calibration(Payload::Writer &writer, UnitCalibration const &calibration);
+// Writes a sample line without the newline. bursts has one entry per ADC sensor. A filtered read is a burst of one.
+Payload::Writer &append_sample(Payload::Writer &writer, int64_t timestamp_s,
+                               std::span<std::span<int const> const> bursts);
+
+// Anything before the key, such as a timestamp added by the serial monitor, is skipped. std::nullopt if line holds
+// no such record or it is malformed.
+std::optional<UnitCalibration> parse_calibration(std::string_view line);
+// Bursts are reduced with Filter::trimmed_mean, trimming the same share of each end as the board.
+std::optional<Sample> parse_sample(std::string_view line);
+
+} // namespace RawTrace
+
+} // namespace BatteryMonitor
@@ -0,0 +1,476 @@
+#include "reading_log.hpp"
+#include "deferred_log.hpp"
+#include <algorithm>
+#include <array>
+
+namespace BatteryMonitor
+{
+
+namespace
+{
+
+constexpr auto TAG{"Log"};
+
+constexpr uint32_t SECTOR_MAGIC{0x314c4d42}; // "BML1"
+constexpr uint8_t ERASED{0xff};
+
+// Record type, in the high nibble of the tag. The low nibble is the payload length.
+enum class RecordType : uint8_t { Absolute = 1, Delta = 2, Uploaded = 3 };
+
+struct Record {
+        RecordType type;
+        uint32_t offset;
+        // For readings.
+        Reading reading;
+        // For uploaded markers.
+        LogPosition uploaded;
+};
+
+// One sector at a time, so it is static rather than on the task stack.
+std::array<uint8_t, Hal::Flash::SECTOR_SIZE> s_sector;
+
+uint8_t crc8(std::span<uint8_t const> const data)
+{
+        uint8_t crc{0};
+        for (auto const byte : data) {
+                crc ^= byte;
+                for (int bit = 0; bit < 8; ++bit) {
+                        crc = static_cast<uint8_t>((crc & 0x80) != 0 ? (crc << 1) ^ 0x07 : crc << 1);
+                }
+        }
+        return crc;
+}
+
+constexpr uint64_t zigzag(int64_t const value)
+{
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+constexpr int64_t unzigzag(uint64_t const value)
+{
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Builds one record into a small buffer.
+class RecordWriter
+{
+      public:
+        explicit RecordWriter(RecordType const type) { bytes[0] = static_cast<uint8_t>(type) << 4; }
+
+        RecordWriter &varint(uint64_t value)
+        {
+                while (value >= 0x80) {
+                        bytes[length++] = static_cast<uint8_t>(value | 0x80);
+                        value >>= 7;
+                }
+                bytes[length++] = static_cast<uint8_t>(value);
+                return *this;
+        }
+
+        std::span<uint8_t const> finish()
+        {
+                bytes[0] |= static_cast<uint8_t>(length - 1);
+                bytes[length] = crc8({bytes.data(), length});
+                return {bytes.data(), length + 1};
+        }
+
+      private:
+        // Tag, two 10-byte varints at most, CRC.
+        std::array<uint8_t, 1 + 10 + 10 + 1> bytes{};
+        std::size_t length{1};
+};
+
+// Decodes the records of one sector in order. Stops at the end of the data or at a damaged record, such as one that
+// was being written when power was lost.
+class SectorReader
+{
+      public:
+        explicit SectorReader(std::span<uint8_t const> const sector) : sector{sector} {}
+
+        bool next(Record &record)
+        {
+                if (position >= sector.size() || sector[position] == ERASED) {
+                        return false;
+                }
+                auto const tag = sector[position];
+                auto const length = std::size_t{tag & 0x0fu};
+                if (position + 1 + length + 1 > sector.size() ||
+                    crc8(sector.subspan(position, 1 + length)) != sector[position + 1 + length]) {
+                        is_damaged = true;
+                        return false;
+                }
+
+                record.type = static_cast<RecordType>(tag >> 4);
+                record.offset = static_cast<uint32_t>(position);
+                auto payload = sector.subspan(position + 1, length);
+                uint64_t first{};
+                uint64_t second{};
+                if (!varint(payload, first) || !varint(payload, second)) {
+                        is_damaged = true;
+                        return false;
+                }
+                switch (record.type) {
+                case RecordType::Absolute:
+                        base = {static_cast<int64_t>(first), static_cast<uint16_t>(second)};
+                        record.reading = base;
+                        is_based = true;
+                        break;
+                case RecordType::Delta:
+                        if (!is_based) {
+                                is_damaged = true;
+                                return false;
+                        }
+                        base = {base.timestamp_s + unzigzag(first),
+                                static_cast<uint16_t>(base.millivolts + unzigzag(second))};
+                        record.reading = base;
+                        break;
+                case RecordType::Uploaded:
+                        record.uploaded = {static_cast<uint32_t>(first), static_cast<uint32_t>(second)};
+                        break;
+                default:
+                        is_damaged = true;
+                        return false;
+                }
+                position += 1 + length + 1;
+                return true;
+        }
+
+        uint32_t end() const { return static_cast<uint32_t>(position); }
+        bool damaged() const { return is_damaged; }
+        bool has_reading() const { return is_based; }
+        Reading const &last_reading() const { return base; }
+
+      private:
+        static bool varint(std::span<uint8_t const> &payload, uint64_t &value)
+        {
+                value = 0;
+                for (unsigned shift = 0; !payload.empty() && shift < 64; shift += 7) {
+                        auto const byte = payload.front();
+                        payload = payload.subspan(1);
+                        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                        if ((byte & 0x80) == 0) {
+                                return true;
+                        }
+                }
+                return false;
+        }
+
+        std::span<uint8_t const> sector;
+        std::size_t position{ReadingLog::HEADER_SIZE};
+        bool is_damaged{false};
+        bool is_based{false};
+        Reading base{};
+};
+
+void put_u32(uint8_t *const bytes, uint32_t const value)
+{
+        for (int i = 0; i < 4; ++i) {
+                bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+}
+
+constexpr bool is_before(LogPosition const &a, LogPosition const &b)
+{
+        return a.sequence < b.sequence || (a.sequence == b.sequence && a.offset < b.offset);
+}
+
+uint32_t get_u32(uint8_t const *const bytes)
+{
+        return static_cast<uint32_t>(bytes[0]) | static_cast<uint32_t>(bytes[1]) << 8 |
+               static_cast<uint32_t>(bytes[2]) << 16 | static_cast<uint32_t>(bytes[3]) << 24;
+}
+
+// Read the sector at index into s_sector. Returns its sequence number, or 0 if it has no valid header.
+uint32_t load_sector(Hal::Flash &flash, uint32_t const index)
+{
+        if (!flash.read(index * Hal::Flash::SECTOR_SIZE, s_sector) || get_u32(s_sector.data()) != SECTOR_MAGIC) {
+                return 0;
+        }
+        return get_u32(s_sector.data() + 4);
+}
+
+} // namespace
+
+bool ReadingLog::append(std::span<Reading const> const readings)
+{
+        if (!mount()) {
+                return false;
+        }
+        // Records are gathered and written in runs, which costs less than one write per record.
+        std::array<uint8_t, 256> run;
+        std::size_t run_length{0};
+        auto const flush = [&] {
+                auto const is_written = run_length == 0 || write_record({run.data(), run_length});
+                run_length = 0;
+                return is_written;
+        };
+
+        for (auto const &reading : readings) {
+                auto const encode = [&] {
+                        if (!cursor.has_base) {
+                                return RecordWriter{RecordType::Absolute}
+                                    .varint(static_cast<uint64_t>(reading.timestamp_s))
+                                    .varint(reading.millivolts);
+                        }
+                        return RecordWriter{RecordType::Delta}
+                            .varint(zigzag(reading.timestamp_s - cursor.base.timestamp_s))
+                            .varint(zigzag(static_cast<int64_t>(reading.millivolts) - cursor.base.millivolts));
+                };
+                auto writer = encode();
+                auto record = writer.finish();
+                if (cursor.write.offset + run_length + record.size() > Hal::Flash::SECTOR_SIZE) {
+                        if (!flush() || !advance_sector()) {
+                                return false;
+                        }
+                        writer = encode();
+                        record = writer.finish();
+                }
+                if (run_length + record.size() > run.size() && !flush()) {
+                        return false;
+                }
+                std::copy(record.begin(), record.end(), run.begin() + static_cast<std::ptrdiff_t>(run_length));
+                run_length += record.size();
+                cursor.has_base = true;
+                cursor.base = reading;
+                ++cursor.pending;
+        }
+        return flush();
+}
+
+std::size_t ReadingLog::pending() { return mount() ? cursor.pending : 0; }
+
+std::size_t ReadingLog::read(std::span<Reading> const readings, LogPosition &next)
+{
+        next = cursor.read;
+        if (!mount()) {
+                return 0;
+        }
+        std::size_t count{0};
+        next = cursor.read;
+        while (count < readings.size() && next != cursor.write) {
+                if (load_sector(flash, sector_of(next.sequence)) != next.sequence) {
+                        ESP_LOGE(TAG, "Sector %u is gone.", static_cast<unsigned>(next.sequence));
+                        break;
+                }
+                SectorReader reader{s_sector};
+                Record record;
+                while (count < readings.size() && reader.next(record)) {
+                        if (record.offset < next.offset) {
+                                continue;
+                        }
+                        if (record.type != RecordType::Uploaded) {
+                                readings[count++] = record.reading;
+                        }
+                        next.offset = reader.end();
+                }
+                if (count < readings.size()) {
+                        // Done with this sector.
+                        next = next.sequence == cursor.write.sequence ? cursor.write
+                                                                      : LogPosition{next.sequence + 1, HEADER_SIZE};
+                }
+        }
+        return count;
+}
+
+bool ReadingLog::mark_uploaded(LogPosition const next, std::size_t const count)
+{
+        if (!mount()) {
+                return false;
+        }
+        cursor.read = next;
+        cursor.pending -= static_cast<uint32_t>(std::min<std::size_t>(count, cursor.pending));
+        cursor.stale -= static_cast<uint32_t>(std::min<std::size_t>(count, cursor.stale));
+        auto writer = RecordWriter{RecordType::Uploaded}.varint(next.sequence).varint(next.offset);
+        auto const record = writer.finish();
+        if (cursor.write.offset + record.size() > Hal::Flash::SECTOR_SIZE && !advance_sector()) {
+                return false;
+        }
+        if (cursor.read == cursor.write) {
+                // Nothing is pending, so the marker can point past itself.
+                cursor.read.offset += static_cast<uint32_t>(record.size());
+        }
+        return write_record(record);
+}
+
+bool ReadingLog::drop_stale()
+{
+        if (!mount()) {
+                return false;
+        }
+        if (cursor.stale == 0) {
+                return true;
+        }
+        ESP_LOGW(TAG, "Dropping %u readings logged before power-on.", static_cast<unsigned>(cursor.stale));
+        cursor.dropped += cursor.stale;
+        return mark_uploaded(cursor.power_on, cursor.stale);
+}
+
+bool ReadingLog::mount()
+{
+        if (cursor.is_mounted) {
+                return true;
+        }
+        if (sector_count() < 2) {
+                ESP_LOGE(TAG, "The log partition needs at least two sectors.");
+                return false;
+        }
+
+        // The newest sector has the highest sequence number.
+        uint32_t newest_sequence{0};
+        for (uint32_t i = 0; i < sector_count(); ++i) {
+                if (auto const sequence = load_sector(flash, i); sequence > newest_sequence) {
+                        newest_sequence = sequence;
+                        cursor.write_sector = i;
+                }
+        }
+        if (newest_sequence == 0) {
+                return format();
+        }
+        cursor.write = {newest_sequence, HEADER_SIZE};
+        bool is_damaged{false};
+
+        // The last uploaded marker is the read position. Walk every sector from the oldest to find it, then again to
+        // count the readings after it.
+        auto oldest_sequence = newest_sequence;
+        while (oldest_sequence > 1 && newest_sequence - oldest_sequence + 1 < sector_count() &&
+               load_sector(flash, sector_of(oldest_sequence - 1)) == oldest_sequence - 1) {
+                --oldest_sequence;
+        }
+        LogPosition const oldest{oldest_sequence, HEADER_SIZE};
+        cursor.read = oldest;
+        for (auto sequence = oldest_sequence; sequence <= newest_sequence; ++sequence) {
+                load_sector(flash, sector_of(sequence));
+                SectorReader reader{s_sector};
+                Record record;
+                while (reader.next(record)) {
+                        if (record.type == RecordType::Uploaded) {
+                                cursor.read = is_before(record.uploaded, oldest) ? oldest : record.uploaded;
+                        }
+                }
+                if (sequence == newest_sequence) {
+                        cursor.write.offset = reader.end();
+                        cursor.has_base = reader.has_reading();
+                        cursor.base = reader.last_reading();
+                        is_damaged = reader.damaged();
+                }
+        }
+        cursor.pending = 0;
+        for (auto sequence = cursor.read.sequence; sequence <= newest_sequence; ++sequence) {
+                load_sector(flash, sector_of(sequence));
+                SectorReader reader{s_sector};
+                Record record;
+                while (reader.next(record)) {
+                        cursor.pending += record.type != RecordType::Uploaded &&
+                                          !is_before({sequence, record.offset}, cursor.read);
+                }
+        }
+        if (cursor.read.sequence == newest_sequence && cursor.read.offset > cursor.write.offset) {
+                cursor.read = cursor.write;
+        }
+        cursor.dropped = 0;
+        cursor.is_mounted = true;
+        DLOGI(TAG, "Mounted: sector %u, %u readings pending.", static_cast<unsigned>(newest_sequence),
+              static_cast<unsigned>(cursor.pending));
+
+        // A record was cut short. Flash after it cannot be rewritten, so continue in a fresh sector.
+        if (is_damaged) {
+                ESP_LOGW(TAG, "Damaged record at the end of the log.");
+                auto const is_at_end = cursor.read == cursor.write;
+                if (!advance_sector()) {
+                        return false;
+                }
+                if (is_at_end) {
+                        cursor.read = cursor.write;
+                }
+        }
+        // Everything pending at the first mount since power-on was logged before it. Mounting again after a flash
+        // failure keeps that boundary.
+        if (!cursor.has_power_on) {
+                cursor.has_power_on = true;
+                cursor.power_on = cursor.write;
+                cursor.stale = cursor.pending;
+        }
+        return true;
+}
+
+bool ReadingLog::format()
+{
+        DLOGI(TAG, "Formatting the reading log.");
+        cursor = LogCursor{};
+        cursor.has_power_on = true;
+        cursor.write_sector = sector_count() - 1;
+        cursor.write = {0, HEADER_SIZE};
+        cursor.read = {1, HEADER_SIZE};
+        cursor.is_mounted = true;
+        if (!advance_sector()) {
+                cursor.is_mounted = false;
+                return false;
+        }
+        return true;
+}
+
+bool ReadingLog::advance_sector()
+{
+        auto const sequence = cursor.write.sequence + 1;
+        auto const sector = (cursor.write_sector + 1) % sector_count();
+
+        // The sector being erased is the oldest. Drop what was not uploaded from it.
+        if (sequence >= sector_count() && cursor.read.sequence <= sequence - sector_count()) {
+                auto const erased_sequence = sequence - sector_count();
+                uint32_t lost{0};
+                if (cursor.read.sequence == erased_sequence && load_sector(flash, sector) == erased_sequence) {
+                        SectorReader reader{s_sector};
+                        Record record;
+                        while (reader.next(record)) {
+                                lost += record.type != RecordType::Uploaded && record.offset >= cursor.read.offset;
+                        }
+                }
+                lost = std::min(lost, cursor.pending);
+                cursor.pending -= lost;
+                cursor.dropped += lost;
+                cursor.stale -= std::min(lost, cursor.stale);
+                cursor.read = {erased_sequence + 1, HEADER_SIZE};
+                if (lost > 0) {
+                        ESP_LOGW(TAG, "Log full. Dropped %u readings.", static_cast<unsigned>(lost));
+                }
+        }
+
+        std::array<uint8_t, HEADER_SIZE> header{};
+        put_u32(header.data(), SECTOR_MAGIC);
+        put_u32(header.data() + 4, sequence);
+        auto const address = static_cast<std::size_t>(sector) * Hal::Flash::SECTOR_SIZE;
+        if (!flash.erase_sector(address) || !flash.write(address, header)) {
+                // Mount again before the next write, in case the flash is in an unexpected state.
+                cursor.is_mounted = false;
+                return false;
+        }
+        cursor.write_sector = sector;
+        cursor.write = {sequence, HEADER_SIZE};
+        cursor.has_base = false;
+        return true;
+}
+
+bool ReadingLog::write_record(std::span<uint8_t const> const record)
+{
+        if (!flash.write(address(cursor.write.sequence, cursor.write.offset), record)) {
+                cursor.is_mounted = false;
+                return false;
+        }
+        cursor.write.offset += static_cast<uint32_t>(record.size());
+        return true;
+}
+
+uint32_t ReadingLog::sector_count() const { return static_cast<uint32_t>(flash.size() / Hal::Flash::SECTOR_SIZE); }
+
+uint32_t ReadingLog::sector_of(uint32_t const sequence) const
+{
+        auto const count = sector_count();
+        return (cursor.write_sector + count - (cursor.write.sequence - sequence) % count) % count;
+}
+
+std::size_t ReadingLog::address(uint32_t const sequence, uint32_t const offset) const
+{
+        return static_cast<std::size_t>(sector_of(sequence)) * Hal::Flash::SECTOR_SIZE + offset;
+}
+
+} // namespace BatteryMonitor
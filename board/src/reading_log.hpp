@@ -0,0 +1,87 @@
+#pragma once
+
+#include "hal.hpp"
+#include "reading_ring.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace BatteryMonitor
+{
+
+// A record in the log: the sequence number of its sector and its offset in the sector.
+struct LogPosition {
+        uint32_t sequence;
+        uint32_t offset;
+
+        constexpr bool operator==(LogPosition const &) const = default;
+};
+
+// Where the log is. Kept in RTC memory with the wake state so that appending does not scan the flash. Zero-initialized
+// (not mounted) on power-on.
+struct LogCursor {
+        bool is_mounted;
+        uint32_t write_sector;
+        // The next record goes here.
+        LogPosition write;
+        // The oldest reading not uploaded yet.
+        LogPosition read;
+        // Readings from read to write.
+        uint32_t pending;
+        // Readings overwritten before they were uploaded, or dropped as stale, since power-on.
+        uint32_t dropped;
+        // The newest reading in the write sector, which the next delta is against.
+        bool has_base;
+        Reading base;
+        // Where this power-on's readings start. The clock started again at power-on, so readings before it have
+        // timestamps that cannot be compared with the clock.
+        bool has_power_on;
+        LogPosition power_on;
+        // Pending readings before power_on.
+        uint32_t stale;
+};
+
+// Append-only log of readings in a flash partition, for readings taken while Home Assistant is unreachable.
+//
+// Sectors are written in rotation, so every sector is erased once per pass over the partition and wear is spread
+// evenly. Each sector starts with a header holding its sequence number. Records follow: a tag byte with the record type
+// and payload length, a varint payload and a CRC-8. The first reading in a sector holds its timestamp and millivolts,
+// and later readings only the zigzag-encoded change from the one before, which is usually 2 bytes. Uploads are recorded
+// by appending an uploaded marker instead of rewriting old records. When the log is full, the oldest sector is erased
+// and its readings are dropped.
+class ReadingLog
+{
+      public:
+        static constexpr std::size_t HEADER_SIZE{8};
+        static constexpr std::size_t MAX_RECORD_SIZE{16};
+
+        ReadingLog(Hal::Flash &flash, LogCursor &cursor) : flash{flash}, cursor{cursor} {}
+
+        // Append readings, oldest first. Returns false if the flash failed.
+        bool append(std::span<Reading const> readings);
+        // Readings not uploaded yet.
+        std::size_t pending();
+        // Copy up to readings.size() of the oldest pending readings to readings. Returns how many were copied, and
+        // sets next to the position after the last one, to pass to mark_uploaded() once they are uploaded.
+        std::size_t read(std::span<Reading> readings, LogPosition &next);
+        // Record that the count readings before next are uploaded.
+        bool mark_uploaded(LogPosition next, std::size_t count);
+        // Drop the pending readings logged before power-on as if they were uploaded. Returns false if the flash failed.
+        bool drop_stale();
+
+      private:
+        // Find the newest sector, the last uploaded marker and the end of the log. Done once after power-on.
+        bool mount();
+        bool format();
+        // Erase the oldest sector and continue there, dropping its readings if they were not uploaded.
+        bool advance_sector();
+        bool write_record(std::span<uint8_t const> record);
+        uint32_t sector_count() const;
+        uint32_t sector_of(uint32_t sequence) const;
+        std::size_t address(uint32_t sequence, uint32_t offset) const;
+
+        Hal::Flash &flash;
+        LogCursor &cursor;
+};
+
+} // namespace BatteryMonitor
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+// A battery reading taken on a wake.
+struct Reading {
+        // System time in seconds. The RTC keeps this running through deep sleep, but nothing sets it, so it starts
+        // again at 0 on power-on.
+        int64_t timestamp_s;
+        uint16_t millivolts;
+
+        constexpr bool operator==(Reading const &) const = default;
+};
+
+// Fixed-size ring of readings, oldest first. When full, pushing overwrites the oldest reading.
+// Kept as an aggregate with no constructors so that it can be placed in RTC memory with RTC_DATA_ATTR.
+template <std::size_t Capacity> struct ReadingRing {
+        static_assert(Capacity > 0);
+
+        std::array<Reading, Capacity> readings;
+        // Index of the oldest reading.
+        std::size_t head;
+        std::size_t count;
+
+        static constexpr auto capacity() -> std::size_t { return Capacity; }
+        constexpr auto size() const -> std::size_t { return count; }
+        constexpr auto empty() const -> bool { return count == 0; }
+        constexpr auto full() const -> bool { return count == Capacity; }
+
+        // Append a reading. Returns true if the oldest reading was overwritten to make room.
+        constexpr auto push(Reading const &reading) -> bool
+        {
+                readings[(head + count) % Capacity] = reading;
+                if (full()) {
+                        head = (head + 1) % Capacity;
+                        return true;
+                }
+                ++count;
+                return false;
+        }
+
+        // Reading at position index, where 0 is the oldest.
+        constexpr auto operator[](std::size_t index) const -> Reading const &
+        {
+                return readings[(head + index) % Capacity];
+        }
+
+        constexpr auto newest() const -> Reading const & { return (*this)[count - 1]; }
+
+        constexpr void clear()
+        {
+                head = 0;
+                count = 0;
+        }
+};
+
+} // namespace BatteryMonitor
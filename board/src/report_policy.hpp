@@ -0,0 +1,89 @@
+#pragma once
+
+#include "reading_ring.hpp"
+#include <chrono>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+// When a new reading is worth powering up the radio for.
+struct ReportPolicy {
+        // Report when the voltage has moved more than this since the last report.
+        uint16_t hysteresis_millivolts;
+        // Report when the voltage crosses this threshold in either direction.
+        uint16_t alert_millivolts;
+        // Report at least this often even if nothing changed.
+        std::chrono::seconds heartbeat_interval;
+};
+
+// The last reading uploaded to Home Assistant.
+// Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero (invalid) on power-on.
+struct ReportState {
+        bool valid;
+        int64_t timestamp_s;
+        uint16_t millivolts;
+};
+
+enum class ReportReason : uint8_t {
+        None,
+        PowerOn,
+        Delta,
+        AlertCrossed,
+        Heartbeat,
+        BufferFull,
+        // A high-rate capture of a crank or charging event.
+        Capture,
+};
+
+constexpr auto report_reason_name(ReportReason const reason) -> char const *
+{
+        switch (reason) {
+        case ReportReason::None:
+                return "none";
+        case ReportReason::PowerOn:
+                return "power_on";
+        case ReportReason::Delta:
+                return "delta";
+        case ReportReason::AlertCrossed:
+                return "alert_crossed";
+        case ReportReason::Heartbeat:
+                return "heartbeat";
+        case ReportReason::BufferFull:
+                return "buffer_full";
+        case ReportReason::Capture:
+                return "capture";
+        }
+        return "unknown";
+}
+
+// Decide whether this wake should bring up Wi-Fi and upload, and why. ReportReason::None means sample and sleep.
+constexpr auto report_reason(ReportPolicy const &policy, ReportState const &last_report, Reading const &reading,
+                             bool const is_buffer_full) -> ReportReason
+{
+        if (!last_report.valid) {
+                return ReportReason::PowerOn;
+        }
+
+        auto const was_alert = last_report.millivolts <= policy.alert_millivolts;
+        auto const is_alert = reading.millivolts <= policy.alert_millivolts;
+        if (was_alert != is_alert) {
+                return ReportReason::AlertCrossed;
+        }
+
+        auto const delta = static_cast<int32_t>(reading.millivolts) - static_cast<int32_t>(last_report.millivolts);
+        if (delta > policy.hysteresis_millivolts || -delta > policy.hysteresis_millivolts) {
+                return ReportReason::Delta;
+        }
+
+        if (reading.timestamp_s - last_report.timestamp_s >= policy.heartbeat_interval.count()) {
+                return ReportReason::Heartbeat;
+        }
+
+        if (is_buffer_full) {
+                return ReportReason::BufferFull;
+        }
+        return ReportReason::None;
+}
+
+} // namespace BatteryMonitor
@@ -1,3 +1,5 @@
+#pragma once
+
 #include <string_view>
 
 namespace BatteryMonitor
@@ -10,8 +12,15 @@ inline constexpr std::string_view LONG_LIVED_ACCESS_TOKEN{
     "eyJhbGciOiJIUzI1NiIsInR5cCI6IkpXVCJ9."
     "eyJpc3MiOiIxNDI4MDFmZWJmY2U0MTI0YTkzMTFlMmVjMjZkN2ZhYSIsImlhdCI6MTcwODA2NjY3MiwiZXhwIjoyMDIzNDI2NjcyfQ.0-"
     "whVd4GJpr28A06FmxQ25VIpO34ydyf0atmEy33FEw"};
-// must be of the form "http://<ha.local>" with no leading slash
+// must be of the form "http://<ha.local>" or "https://<ha.local>" with no leading slash
 inline constexpr std::string_view HA_URL{"http://hassio.local:8123"};
+// Only used with an https:// HA_URL. PEM of the CA that signed Home Assistant's certificate, or of the certificate
+// itself if it is self-signed. Leave empty for a certificate from a public CA, such as Let's Encrypt.
+inline constexpr std::string_view HA_CA_CERT{""};
+// Only used with the MQTT transport. Leave the username empty if the broker allows anonymous clients.
+inline constexpr std::string_view MQTT_BROKER_URI{"mqtt://hassio.local:1883"};
+inline constexpr std::string_view MQTT_USERNAME{"batterymonitor"};
+inline constexpr std::string_view MQTT_PASSWORD{"password"};
 inline constexpr std::string_view NETWORK_SSID{"changeme"};
 inline constexpr std::string_view NETWORK_PASSWORD{"password"};
 
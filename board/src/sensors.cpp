@@ -0,0 +1,105 @@
+#include "sensors.hpp"
+#include <utility>
+
+namespace BatteryMonitor
+{
+
+namespace Sensors
+{
+
+namespace
+{
+// Fits closer than this amplify the meter's own error too much.
+constexpr int32_t MIN_FIELD_POINT_SPAN_MILLIVOLTS{500};
+
+Divider s_battery_divider{NOMINAL_BATTERY_DIVIDER};
+
+// Round-to-nearest division. divisor must be positive.
+constexpr int64_t divide_rounded(int64_t const dividend, int64_t const divisor)
+{
+        return (dividend >= 0 ? dividend + divisor / 2 : dividend - divisor / 2) / divisor;
+}
+} // namespace
+
+std::optional<Divider> field_calibrated_divider(FieldPoint a, FieldPoint b)
+{
+        if (a.reported_millivolts > b.reported_millivolts) {
+                std::swap(a, b);
+        }
+        int64_t const reported_span = b.reported_millivolts - a.reported_millivolts;
+        int64_t const actual_span = b.actual_millivolts - a.actual_millivolts;
+        if (reported_span < MIN_FIELD_POINT_SPAN_MILLIVOLTS || actual_span <= 0) {
+                return std::nullopt;
+        }
+        // Reported voltages are linear in the pin voltage, so scale the nominal gain by the slope between the points
+        // and put the rest in the offset.
+        auto const gain_q16 = divide_rounded(NOMINAL_BATTERY_DIVIDER.gain_q16 * actual_span, reported_span);
+        auto const offset = a.actual_millivolts - divide_rounded(a.reported_millivolts * actual_span, reported_span);
+        return Divider{static_cast<int32_t>(gain_q16), static_cast<int32_t>(offset)};
+}
+
+void set_battery_divider(Divider const divider) { s_battery_divider = divider; }
+
+Divider battery_divider() { return s_battery_divider; }
+
+int32_t battery_millivolts(int32_t const pin_millivolts)
+{
+        auto const &divider = s_battery_divider;
+        return static_cast<int32_t>(divide_rounded(int64_t{pin_millivolts} * divider.gain_q16, 1 << 16)) +
+               divider.offset_millivolts;
+}
+
+int32_t battery_pin_millivolts(int32_t const battery_millivolts)
+{
+        auto const &divider = s_battery_divider;
+        return static_cast<int32_t>(
+            divide_rounded(int64_t{battery_millivolts - divider.offset_millivolts} * (1 << 16), divider.gain_q16));
+}
+
+int32_t tmp235_centidegrees(int32_t const pin_millivolts) { return (pin_millivolts - 500) * 10; }
+
+bool sample_adc(Hal::Adc &adc, Values &values)
+{
+        std::array<int32_t, ADC_SENSOR_COUNT> pin_millivolts{};
+        if (!adc.read_millivolts(ADC_CHANNELS, pin_millivolts)) {
+                return false;
+        }
+        std::size_t channel{0};
+        for (std::size_t i = 0; i < SENSOR_COUNT; ++i) {
+                if (REGISTRY[i].source == Source::Adc) {
+                        values[i] = REGISTRY[i].convert(pin_millivolts[channel++]);
+                }
+        }
+        return true;
+}
+
+void set_source(Values &values, Source const source, int32_t const raw)
+{
+        for (std::size_t i = 0; i < SENSOR_COUNT; ++i) {
+                if (REGISTRY[i].source == source) {
+                        values[i] = REGISTRY[i].convert(raw);
+                }
+        }
+}
+
+Payload::Writer &append_state(Payload::Writer &writer, Sensor const &sensor, int32_t const value)
+{
+        return append_state_head(writer, sensor, value).append("}}");
+}
+
+Payload::Writer &append_state_head(Payload::Writer &writer, Sensor const &sensor, int32_t const value)
+{
+        writer.append(R"({"state":")").append_fixed(value, sensor.decimals);
+        writer.append(R"(","attributes":{"friendly_name":")").append(sensor.friendly_name).append('"');
+        if (!sensor.unit.empty()) {
+                writer.append(R"(,"unit_of_measurement":")").append(sensor.unit).append('"');
+        }
+        if (!sensor.device_class.empty()) {
+                writer.append(R"(,"device_class":")").append(sensor.device_class).append('"');
+        }
+        return writer;
+}
+
+} // namespace Sensors
+
+} // namespace BatteryMonitor
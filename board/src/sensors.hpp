@@ -0,0 +1,122 @@
+#pragma once
+
+#include "hal.hpp"
+#include "payload.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+namespace Sensors
+{
+
+// Where a sensor's raw value comes from.
+enum class Source : uint8_t {
+        Adc,       // Calibrated millivolts at an ADC1 pin. All ADC sensors are sampled together in one pass.
+        WifiRssi,  // Signal strength of the associated AP in dBm. Only read on wakes that connect.
+        WakeCount, // Wakes since power-on.
+};
+
+struct Sensor {
+        std::string_view entity_id;
+        std::string_view friendly_name;
+        std::string_view unit;
+        // Home Assistant device class. Empty for none.
+        std::string_view device_class;
+        Source source;
+        // ADC1 channel for Source::Adc.
+        uint8_t adc_channel;
+        // Raw value to the reported value, in units of 10^-decimals.
+        int32_t (*convert)(int32_t raw);
+        uint8_t decimals;
+};
+
+// Battery voltage divider between the screw terminals and the ADC pin: battery = pin * gain_q16 / 2^16 + offset.
+struct Divider {
+        int32_t gain_q16;
+        int32_t offset_millivolts;
+};
+// 5.02 from the resistor values.
+inline constexpr Divider NOMINAL_BATTERY_DIVIDER{328'991, 0};
+
+// One point of a two-point field calibration: the battery voltage the monitor reported with the nominal divider, and
+// the voltage measured at the terminals at the same time.
+struct FieldPoint {
+        int32_t reported_millivolts;
+        int32_t actual_millivolts;
+};
+// Field calibration of this unit, if any. Points far apart, e.g. resting and charging, fit best. For example:
+// BATTERY_FIELD_CALIBRATION{{{{12'480, 12'530}, {14'210, 14'260}}}};
+inline constexpr std::optional<std::array<FieldPoint, 2>> BATTERY_FIELD_CALIBRATION{};
+
+// Divider that maps the two reported voltages to the measured ones. std::nullopt if the points are too close together.
+std::optional<Divider> field_calibrated_divider(FieldPoint a, FieldPoint b);
+// Divider used by battery_millivolts(). NOMINAL_BATTERY_DIVIDER until set.
+void set_battery_divider(Divider divider);
+Divider battery_divider();
+
+int32_t battery_millivolts(int32_t pin_millivolts);
+// Inverse of battery_millivolts(): the pin voltage for a battery voltage.
+int32_t battery_pin_millivolts(int32_t battery_millivolts);
+// TMP235: 500 mV at 0 C and 10 mV/C. Returns hundredths of a degree.
+int32_t tmp235_centidegrees(int32_t pin_millivolts);
+constexpr int32_t identity(int32_t const raw) { return raw; }
+
+// Every sensor on the board. The battery comes first: it drives the reading ring and the report policies, and is
+// published as a batch. The rest are published as plain states on the same upload.
+inline constexpr std::array REGISTRY{
+    Sensor{"sensor.car_battery", "Car Battery Voltage", "Volts", "", Source::Adc, 3, battery_millivolts, 3},
+    Sensor{"sensor.battery_monitor_temperature", "Battery Monitor Temperature", "°C", "temperature", Source::Adc, 4,
+           tmp235_centidegrees, 2},
+    Sensor{"sensor.battery_monitor_rssi", "Battery Monitor Wi-Fi Signal", "dBm", "signal_strength", Source::WifiRssi, 0,
+           identity, 0},
+    Sensor{"sensor.battery_monitor_wakes", "Battery Monitor Wakes", "", "", Source::WakeCount, 0, identity, 0},
+};
+constexpr std::size_t SENSOR_COUNT{REGISTRY.size()};
+constexpr std::size_t BATTERY{0};
+static_assert(REGISTRY[BATTERY].source == Source::Adc);
+// Board temperature, which compensates the battery's resting voltage.
+constexpr std::size_t TEMPERATURE{1};
+static_assert(REGISTRY[TEMPERATURE].device_class == "temperature");
+
+constexpr std::size_t ADC_SENSOR_COUNT = [] {
+        std::size_t count{0};
+        for (auto const &sensor : REGISTRY) {
+                count += sensor.source == Source::Adc ? 1 : 0;
+        }
+        return count;
+}();
+
+// ADC1 channels of the ADC sensors, in registry order.
+constexpr auto ADC_CHANNELS = [] {
+        std::array<uint8_t, ADC_SENSOR_COUNT> channels{};
+        std::size_t i{0};
+        for (auto const &sensor : REGISTRY) {
+                if (sensor.source == Source::Adc) {
+                        channels[i++] = sensor.adc_channel;
+                }
+        }
+        return channels;
+}();
+
+// Converted values of this wake, indexed like REGISTRY. std::nullopt if not read.
+using Values = std::array<std::optional<int32_t>, SENSOR_COUNT>;
+
+// Sample every ADC sensor in one pass of a single ADC session. Returns false if the read failed.
+bool sample_adc(Hal::Adc &adc, Values &values);
+// Convert raw and store it for every sensor with this source.
+void set_source(Values &values, Source source, int32_t raw);
+
+// State JSON for a sensor: {"state":"<value>","attributes":{"friendly_name":...}}.
+Payload::Writer &append_state(Payload::Writer &writer, Sensor const &sensor, int32_t value);
+// The same, but with the attributes object left open for more attributes. Close it with "}}".
+Payload::Writer &append_state_head(Payload::Writer &writer, Sensor const &sensor, int32_t value);
+
+} // namespace Sensors
+
+} // namespace BatteryMonitor
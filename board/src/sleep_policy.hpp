@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+namespace BatteryMonitor
+{
+
+// Bounds and thresholds for choosing how long to sleep between wakes.
+struct SleepPolicy {
+        std::chrono::seconds min_interval;
+        // Used after power-on and while the battery is charging.
+        std::chrono::seconds base_interval;
+        std::chrono::seconds max_interval;
+        // Wake as often as possible at or below this voltage.
+        uint16_t alert_millivolts;
+        // Within this much of the alert threshold, a falling voltage is sampled at min_interval.
+        uint16_t approach_millivolts;
+        // Changes no larger than this between wakes count as stable.
+        uint16_t stable_millivolts;
+};
+
+// Sleep interval for the next wake. Backs off while the voltage is stable, and tightens while it falls towards the
+// alert threshold. previous_interval is zero after power-on.
+constexpr auto next_sleep_interval(SleepPolicy const &policy, std::chrono::seconds const previous_interval,
+                                   uint16_t const previous_millivolts, uint16_t const millivolts)
+    -> std::chrono::seconds
+{
+        if (previous_interval.count() == 0) {
+                return policy.base_interval;
+        }
+        if (millivolts <= policy.alert_millivolts) {
+                return policy.min_interval;
+        }
+
+        auto const delta = static_cast<int32_t>(millivolts) - static_cast<int32_t>(previous_millivolts);
+        auto const is_stable = (delta >= -policy.stable_millivolts) && (delta <= policy.stable_millivolts);
+        if (is_stable) {
+                return std::min(previous_interval * 2, policy.max_interval);
+        }
+        if (delta < 0) {
+                if (millivolts <= policy.alert_millivolts + policy.approach_millivolts) {
+                        return policy.min_interval;
+                }
+                return std::max(previous_interval / 2, policy.min_interval);
+        }
+        // Rising, e.g. while driving or on a charger.
+        return policy.base_interval;
+}
+
+// Sleep timer that keeps wakes interval apart from wake start to wake start, so that time spent on the network does
+// not push later samples back. Never shorter than min_timer.
+constexpr auto sleep_timer(std::chrono::seconds const interval, std::chrono::microseconds const awake,
+                           std::chrono::microseconds const min_timer) -> std::chrono::microseconds
+{
+        return std::max<std::chrono::microseconds>(interval - awake, min_timer);
+}
+
+// How to spend the time between wakes. Deep sleep powers almost everything down, so every wake boots again and has to
+// bring Wi-Fi up from nothing to upload. Automatic light sleep keeps RAM and the Wi-Fi association, and wakes for DTIM
+// beacons to keep it.
+enum class SleepMode : uint8_t { Deep, Light };
+
+constexpr auto sleep_mode_name(SleepMode const mode) -> char const *
+{
+        return mode == SleepMode::Light ? "light" : "deep";
+}
+
+// Duration and average supply current of one step of a wake.
+struct PhaseCost {
+        std::chrono::milliseconds duration;
+        uint32_t current_ua;
+};
+
+// Charge drawn by a step, in nanocoulombs. uA * ms = nC.
+constexpr auto charge_nc(PhaseCost const &cost) -> uint64_t
+{
+        return static_cast<uint64_t>(cost.duration.count()) * cost.current_ua;
+}
+
+// What each step of a cycle costs in either mode. The ULP monitor, which makes some deep sleep wakes unnecessary, is
+// left out, so the model favours light sleep slightly.
+struct SleepEnergyModel {
+        // Booting from deep sleep and sampling. Every deep sleep wake pays this.
+        PhaseCost cold_wake;
+        // Resuming from light sleep and sampling.
+        PhaseCost light_wake;
+        // NVS, the netif, the event loop and Wi-Fi from a cold boot, up to an IP. Paid by deep sleep wakes that upload.
+        PhaseCost associate;
+        // Posting with Wi-Fi up. Paid by wakes that upload in either mode.
+        PhaseCost upload;
+        uint32_t deep_sleep_ua;
+        // Automatic light sleep with Wi-Fi associated in power save, averaged over the beacons it wakes for.
+        uint32_t light_sleep_ua;
+};
+
+// Current drawn while asleep in mode.
+constexpr auto sleep_current_ua(SleepEnergyModel const &model, SleepMode const mode) -> uint32_t
+{
+        return mode == SleepMode::Deep ? model.deep_sleep_ua : model.light_sleep_ua;
+}
+
+namespace Detail
+{
+
+// Charge of one cycle that does not depend on its length, in nC: the wake, less the sleep current over the wake. The
+// share of wakes that upload is in permille.
+constexpr auto fixed_charge_nc(SleepEnergyModel const &model, SleepMode const mode, uint16_t const upload_permille)
+    -> int64_t
+{
+        auto const share = [upload_permille](uint64_t const value) { return value * upload_permille / 1000; };
+        auto const is_deep = mode == SleepMode::Deep;
+        auto const &wake = is_deep ? model.cold_wake : model.light_wake;
+        auto awake_nc = charge_nc(wake) + share(charge_nc(model.upload));
+        auto awake_ms = static_cast<uint64_t>(wake.duration.count()) +
+                        share(static_cast<uint64_t>(model.upload.duration.count()));
+        if (is_deep) {
+                awake_nc += share(charge_nc(model.associate));
+                awake_ms += share(static_cast<uint64_t>(model.associate.duration.count()));
+        }
+        return static_cast<int64_t>(awake_nc) - static_cast<int64_t>(awake_ms * sleep_current_ua(model, mode));
+}
+
+} // namespace Detail
+
+// Modelled charge of a cycle of interval, wake included, in microcoulombs.
+constexpr auto cycle_charge_uc(SleepEnergyModel const &model, SleepMode const mode,
+                               std::chrono::seconds const interval, uint16_t const upload_permille) -> uint64_t
+{
+        auto const sleep_ua = sleep_current_ua(model, mode);
+        auto const interval_ms = std::chrono::duration_cast<std::chrono::milliseconds>(interval).count();
+        auto const charge_nc = Detail::fixed_charge_nc(model, mode, upload_permille) +
+                               static_cast<int64_t>(interval_ms) * static_cast<int64_t>(sleep_ua);
+        return static_cast<uint64_t>(std::max<int64_t>(charge_nc, 0)) / 1000;
+}
+
+// Intervals shorter than this cost less in light sleep. Zero if deep sleep always wins.
+constexpr auto sleep_crossover(SleepEnergyModel const &model, uint16_t const upload_permille) -> std::chrono::seconds
+{
+        auto const saved_nc = Detail::fixed_charge_nc(model, SleepMode::Deep, upload_permille) -
+                              Detail::fixed_charge_nc(model, SleepMode::Light, upload_permille);
+        if (saved_nc <= 0) {
+                return std::chrono::seconds{0};
+        }
+        if (model.light_sleep_ua <= model.deep_sleep_ua) {
+                return std::chrono::seconds{std::numeric_limits<int32_t>::max()};
+        }
+        auto const extra_ua = static_cast<int64_t>(model.light_sleep_ua - model.deep_sleep_ua);
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::milliseconds{saved_nc / extra_ua});
+}
+
+constexpr auto select_sleep_mode(SleepEnergyModel const &model, std::chrono::seconds const interval,
+                                 uint16_t const upload_permille) -> SleepMode
+{
+        return cycle_charge_uc(model, SleepMode::Light, interval, upload_permille) <
+                       cycle_charge_uc(model, SleepMode::Deep, interval, upload_permille)
+                   ? SleepMode::Light
+                   : SleepMode::Deep;
+}
+
+// Running share of wakes that uploaded, in permille. Each wake weighs an eighth, so a few uploads in a row, such as
+// while the voltage moves, tip the choice quickly.
+constexpr auto update_upload_share(uint16_t const upload_permille, bool const is_uploading) -> uint16_t
+{
+        // Rounded towards this wake, so that the share reaches 0 and 1000 rather than stalling short of them.
+        return static_cast<uint16_t>(is_uploading ? (upload_permille * 7u + 1000u + 7u) / 8u
+                                                  : upload_permille * 7u / 8u);
+}
+
+} // namespace BatteryMonitor
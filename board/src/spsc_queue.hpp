@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+namespace BatteryMonitor
+{
+
+// Lock-free ring between exactly one producer task and one consumer task. Neither side ever blocks or takes a lock, so
+// a stalled consumer cannot delay the producer. It only fills the ring.
+template <typename T, std::size_t Capacity> class SpscQueue
+{
+        static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Indices are wrapped with a mask.");
+        static_assert(std::is_trivially_copyable_v<T>, "Slots are copied in and out without synchronization.");
+
+      public:
+        // Producer only. Returns false if the ring is full.
+        bool push(T const &value)
+        {
+                auto const head = write_index.load(std::memory_order_relaxed);
+                if (head - read_index.load(std::memory_order_acquire) == Capacity) {
+                        return false;
+                }
+                slots[head & (Capacity - 1)] = value;
+                write_index.store(head + 1, std::memory_order_release);
+                return true;
+        }
+
+        // Consumer only. std::nullopt if the ring is empty.
+        std::optional<T> pop()
+        {
+                T value;
+                return pop_batch({&value, 1}) == 1 ? std::optional<T>{value} : std::nullopt;
+        }
+
+        // Consumer only. Pops up to out.size() entries, oldest first, and returns how many.
+        std::size_t pop_batch(std::span<T> const out)
+        {
+                auto const tail = read_index.load(std::memory_order_relaxed);
+                auto const available = write_index.load(std::memory_order_acquire) - tail;
+                auto const count = std::min(available, out.size());
+                for (std::size_t i = 0; i < count; ++i) {
+                        out[i] = slots[(tail + i) & (Capacity - 1)];
+                }
+                read_index.store(tail + count, std::memory_order_release);
+                return count;
+        }
+
+        // Exact from either side when the other is idle, otherwise a snapshot.
+        std::size_t size() const
+        {
+                return write_index.load(std::memory_order_acquire) - read_index.load(std::memory_order_acquire);
+        }
+        static constexpr std::size_t capacity() { return Capacity; }
+
+      private:
+        // Each index is only written by one side. Kept on separate cache lines so that the two sides do not contend.
+        static constexpr std::size_t CACHE_LINE{64};
+        alignas(CACHE_LINE) std::atomic<std::size_t> write_index{0};
+        alignas(CACHE_LINE) std::atomic<std::size_t> read_index{0};
+        alignas(CACHE_LINE) std::array<T, Capacity> slots{};
+};
+
+} // namespace BatteryMonitor
@@ -0,0 +1,41 @@
+#pragma once
+
+extern "C" {
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+}
+
+#include <array>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+// A FreeRTOS task with its stack and control block in static memory, so that starting it cannot fail for lack of
+// heap, and its RAM is counted in the image size.
+template <uint32_t StackBytes> class StaticTask
+{
+      public:
+        // Does nothing if the task was already started.
+        void start(TaskFunction_t const function, char const *const name, void *const args,
+                   UBaseType_t const priority)
+        {
+                if (handle == nullptr) {
+                        handle = xTaskCreateStatic(function, name, StackBytes, args, priority, stack.data(), &tcb);
+                }
+        }
+
+        // Bytes of stack never touched since the task started. Zero if it did not start.
+        uint32_t stack_free() const
+        {
+                return handle != nullptr ? uxTaskGetStackHighWaterMark(handle) * sizeof(StackType_t) : 0;
+        }
+
+      private:
+        // ESP-IDF takes stack sizes in bytes.
+        std::array<StackType_t, StackBytes / sizeof(StackType_t)> stack;
+        StaticTask_t tcb;
+        TaskHandle_t handle{nullptr};
+};
+
+} // namespace BatteryMonitor
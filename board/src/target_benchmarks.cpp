@@ -0,0 +1,118 @@
+#ifdef PROJECTIO_TESTING
+
+extern "C" {
+#include "esp_idf_version.h"
+#include "esp_log.h"
+#include "sdkconfig.h"
+}
+
+#include "battery.hpp"
+#include "deferred_log.hpp"
+#include "ha_client.hpp"
+#include "payload.hpp"
+#include "sensors.hpp"
+#include "target_benchmarks.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+
+namespace BatteryMonitor
+{
+
+namespace Benchmarks
+{
+
+namespace
+{
+constexpr auto TAG{"Benchmarks"};
+constexpr std::string_view BENCHMARK_ENTITY_ID{"sensor.battery_monitor_benchmark"};
+
+std::array<Sample, MAX_RUNS> s_samples;
+
+// Run step runs times, after one untimed run to warm up caches, and print the results.
+template <typename Step> void run(std::string_view const name, std::size_t const runs, Step &&step)
+{
+        step();
+        auto const count = std::min(runs, MAX_RUNS);
+        for (std::size_t i = 0; i < count; ++i) {
+                s_samples[i] = measure_once(step);
+        }
+        print(name, {s_samples.data(), count});
+}
+} // namespace
+
+void print_header()
+{
+        std::printf("bench.target=%s\n", CONFIG_IDF_TARGET);
+        std::printf("bench.cpu_mhz=%d\n", CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+        std::printf("bench.idf=%s\n", esp_get_idf_version());
+}
+
+void print(std::string_view const name, std::span<Sample> const samples)
+{
+        if (samples.empty()) {
+                return;
+        }
+        std::sort(samples.begin(), samples.end(), [](auto const &a, auto const &b) { return a.cycles < b.cycles; });
+        int64_t total_us{0};
+        for (auto const &sample : samples) {
+                total_us += sample.us;
+        }
+        auto const key = [&name](char const *metric) {
+                std::printf("bench.%.*s.%s=", static_cast<int>(name.size()), name.data(), metric);
+        };
+        key("runs");
+        std::printf("%zu\n", samples.size());
+        key("cycles_min");
+        std::printf("%lu\n", static_cast<unsigned long>(samples.front().cycles));
+        key("cycles_median");
+        std::printf("%lu\n", static_cast<unsigned long>(samples[samples.size() / 2].cycles));
+        key("cycles_max");
+        std::printf("%lu\n", static_cast<unsigned long>(samples.back().cycles));
+        key("us_mean");
+        std::printf("%lld\n", static_cast<long long>(total_us / static_cast<int64_t>(samples.size())));
+}
+
+void run_target_benchmarks(std::size_t const runs)
+{
+        ESP_LOGI(TAG, "Running target benchmarks, %zu runs each.", runs);
+        print_header();
+
+        // A wake creates the session once. The calibration is only built on the first wake after power-on.
+        run("adc_session_init", runs, [] {
+                release_adc_session();
+                get_adc_session();
+        });
+        run("calibration_build", runs, [] { rebuild_adc_calibration(); });
+
+        std::array<int32_t, Sensors::ADC_SENSOR_COUNT> pin_millivolts{};
+        run("adc_read", runs, [&pin_millivolts] { read_pin_millivolts(Sensors::ADC_CHANNELS, pin_millivolts); });
+        int raw{0};
+        run("raw_to_millivolts", runs, [&raw] {
+                raw = (raw + 997) % 4096;
+                get_adc_session().raw_to_millivolts(raw);
+        });
+        run("battery_millivolts_to_raw", runs, [] { battery_millivolts_to_raw(12'600); });
+
+        // One of the ADC lines of every wake, through the console and through the deferred log.
+        run("console_log", runs, [&raw] { ESP_LOGI(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", 1, 6, raw); });
+        run("deferred_log", runs, [&raw] { DLOGI(TAG, "ADC%d Channel[%d] Cali Voltage: %d mV", 1, 6, raw); });
+        Log::clear();
+
+        // The first post opens the connection. The rest reuse it, like the posts of one wake.
+        static std::array<char, 256> buffer;
+        Payload::Writer writer{buffer};
+        auto const body = *Sensors::append_state(writer, Sensors::REGISTRY[Sensors::BATTERY], 12'600).view();
+        Hal::HaClient client;
+        std::array<Sample, 1> first_post{measure_once([&] { client.post(BENCHMARK_ENTITY_ID, body); })};
+        print("post_connect", first_post);
+        run("post", runs, [&] { client.post(BENCHMARK_ENTITY_ID, body); });
+        client.close();
+        release_adc_session();
+}
+
+} // namespace Benchmarks
+
+} // namespace BatteryMonitor
+
+#endif
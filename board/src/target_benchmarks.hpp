@@ -0,0 +1,53 @@
+#pragma once
+
+extern "C" {
+#include "esp_cpu.h"
+#include "esp_timer.h"
+}
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// On-target benchmark harness for the test environment. Results are printed to the console as key=value lines
+// starting with "bench.", the same shape as the host benchmarks, so that runs on esp32dev and esp32c3dev or on two
+// commits can be diffed directly.
+namespace Benchmarks
+{
+
+// Runs of each step in run_target_benchmarks().
+constexpr std::size_t DEFAULT_RUNS{16};
+constexpr std::size_t MAX_RUNS{64};
+
+// One timed run of a step. The cycle counter wraps after 2^32 cycles, about 17 s at 240 MHz, so longer steps only
+// have a meaningful time.
+struct Sample {
+        uint32_t cycles;
+        int64_t us;
+};
+
+template <typename Step> Sample measure_once(Step &&step)
+{
+        auto const start_us = esp_timer_get_time();
+        auto const start_cycles = static_cast<uint32_t>(esp_cpu_get_cycle_count());
+        step();
+        auto const cycles = static_cast<uint32_t>(esp_cpu_get_cycle_count()) - start_cycles;
+        return Sample{cycles, esp_timer_get_time() - start_us};
+}
+
+// Target, CPU frequency and IDF version, so that results from different boards are told apart.
+void print_header();
+// Runs, min/median/max cycles and mean time of a step as bench.<name>.<metric>=<value>.
+void print(std::string_view name, std::span<Sample> samples);
+
+// Time ADC session setup, the calibration build, ADC reads, table conversion and state posts to Home Assistant.
+// Expects NVS and Wi-Fi to be up.
+void run_target_benchmarks(std::size_t runs);
+
+} // namespace Benchmarks
+
+} // namespace BatteryMonitor
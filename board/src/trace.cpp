@@ -0,0 +1,40 @@
+#include "trace.hpp"
+#include "hal.hpp"
+
+namespace BatteryMonitor
+{
+
+namespace Trace
+{
+
+namespace
+{
+
+// Kept in RTC slow memory so the traces survive deep sleep. Zero-initialized on power-on.
+RTC_DATA_ATTR CycleTrace s_current_cycle;
+RTC_DATA_ATTR CycleTrace s_previous_cycle;
+RTC_DATA_ATTR CycleTrace s_previous_upload_cycle;
+
+} // namespace
+
+void begin_cycle()
+{
+        s_previous_cycle = s_current_cycle;
+        if (s_previous_cycle.reached(Phase::Posted)) {
+                s_previous_upload_cycle = s_previous_cycle;
+        }
+        s_current_cycle = CycleTrace{};
+}
+
+void mark(Phase const phase)
+{
+        s_current_cycle.timestamps_us[static_cast<std::size_t>(phase)] = Hal::micros_since_wake();
+}
+
+CycleTrace const &previous_cycle() { return s_previous_cycle; }
+
+CycleTrace const &previous_upload_cycle() { return s_previous_upload_cycle; }
+
+} // namespace Trace
+
+} // namespace BatteryMonitor
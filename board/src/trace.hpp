@@ -0,0 +1,108 @@
+#pragma once
+
+#include "sleep_policy.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+namespace Trace
+{
+
+// Wake-cycle phases, in order. Each is marked when the phase ends.
+enum class Phase : uint8_t {
+        Sampled,       // Battery read and buffered.
+        NvsInit,       // Nvs::init_nvs() returned.
+        WifiStarted,   // esp_wifi_start() returned.
+        GotIp,         // IP_EVENT_STA_GOT_IP received.
+        EntityCreated, // Payloads to upload are encoded.
+        Posted,        // Payloads are posted.
+        SleepStart,    // About to sleep.
+        Count
+};
+
+constexpr std::size_t PHASE_COUNT{static_cast<std::size_t>(Phase::Count)};
+
+constexpr auto phase_name(Phase const phase) -> char const *
+{
+        constexpr std::array<char const *, PHASE_COUNT> names{"sampled",        "nvs_init", "wifi_started", "got_ip",
+                                                              "entity_created", "posted",   "sleep_start"};
+        return names[static_cast<std::size_t>(phase)];
+}
+
+// Microseconds since the wake started at the end of each phase. Zero if the phase was not reached on that wake.
+struct CycleTrace {
+        std::array<int64_t, PHASE_COUNT> timestamps_us;
+
+        constexpr auto reached(Phase const phase) const -> bool
+        {
+                return timestamps_us[static_cast<std::size_t>(phase)] != 0;
+        }
+
+        // Time spent in a phase, measured from the end of the last reached phase before it (or boot).
+        constexpr auto duration_us(Phase const phase) const -> int64_t
+        {
+                auto const index = static_cast<std::size_t>(phase);
+                if (timestamps_us[index] == 0) {
+                        return 0;
+                }
+                int64_t start{0};
+                for (std::size_t i = 0; i < index; ++i) {
+                        if (timestamps_us[i] != 0) {
+                                start = timestamps_us[i];
+                        }
+                }
+                return timestamps_us[index] - start;
+        }
+
+        // Time from boot to the end of the last reached phase.
+        constexpr auto awake_us() const -> int64_t
+        {
+                int64_t last{0};
+                for (auto const timestamp : timestamps_us) {
+                        if (timestamp != 0) {
+                                last = timestamp;
+                        }
+                }
+                return last;
+        }
+};
+
+// Average supply current drawn in each phase. Sleep currents are in the SleepEnergyModel.
+struct CurrentModel {
+        std::array<uint32_t, PHASE_COUNT> phase_ua;
+};
+
+// Rough figures for an ESP32 module on this board. Radio phases dominate.
+constexpr CurrentModel DEFAULT_CURRENT_MODEL{
+    .phase_ua = {40'000, 40'000, 80'000, 120'000, 100'000, 160'000, 80'000},
+};
+
+// Estimated charge drawn over one cycle, including the sleep in mode that follows it, in microcoulombs.
+constexpr auto estimate_charge_uc(CycleTrace const &trace, CurrentModel const &model,
+                                  SleepEnergyModel const &sleep_model, SleepMode const mode, int64_t const sleep_us)
+    -> uint64_t
+{
+        // uA * us = pC
+        uint64_t charge_pc{0};
+        for (std::size_t i = 0; i < PHASE_COUNT; ++i) {
+                charge_pc += static_cast<uint64_t>(trace.duration_us(static_cast<Phase>(i))) * model.phase_ua[i];
+        }
+        charge_pc += static_cast<uint64_t>(sleep_us) * sleep_current_ua(sleep_model, mode);
+        return charge_pc / 1'000'000;
+}
+
+// Start tracing a new wake. The finished trace of the last wake becomes previous_cycle().
+void begin_cycle();
+// Record the end of a phase on this wake.
+void mark(Phase phase);
+// Trace of the last wake.
+CycleTrace const &previous_cycle();
+// Trace of the last wake that uploaded.
+CycleTrace const &previous_upload_cycle();
+
+} // namespace Trace
+
+} // namespace BatteryMonitor
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "report_policy.hpp"
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+namespace Ulp
+{
+
+// Layout of the ULP program's data in RTC slow memory, in 32-bit words. The ULP only uses the low 16 bits.
+// The program itself is loaded after the data.
+namespace Layout
+{
+constexpr std::size_t LOW_THRESHOLD{0};
+constexpr std::size_t HIGH_THRESHOLD{1};
+// Number of ULP runs between heartbeat wakes.
+constexpr std::size_t HEARTBEAT_RUNS{2};
+constexpr std::size_t RUN_COUNTER{3};
+constexpr std::size_t LAST_SAMPLE{4};
+constexpr std::size_t WAKE_REASON{5};
+constexpr std::size_t SAMPLE_INDEX{6};
+constexpr std::size_t SAMPLES{7};
+constexpr std::size_t SAMPLE_COUNT{8};
+constexpr std::size_t PROGRAM{SAMPLES + SAMPLE_COUNT};
+} // namespace Layout
+
+static_assert((Layout::SAMPLE_COUNT & (Layout::SAMPLE_COUNT - 1)) == 0, "Sample ring index is wrapped with a mask.");
+
+// ADC reads averaged per ULP run. Power of two so the ULP can divide with a shift.
+constexpr uint32_t OVERSAMPLE_SHIFT{2};
+constexpr uint32_t OVERSAMPLE_COUNT{1u << OVERSAMPLE_SHIFT};
+
+enum class WakeReason : uint16_t {
+        None = 0,
+        Window = 1,
+        Heartbeat = 2,
+};
+
+// Battery voltages outside of which the ULP wakes the main CPU.
+struct Window {
+        uint16_t low_millivolts;
+        uint16_t high_millivolts;
+};
+
+// The window that matches report_reason(): leaving it means the voltage moved more than the hysteresis since the
+// last report or crossed the alert threshold.
+constexpr auto report_window(ReportPolicy const &policy, uint16_t const last_report_millivolts) -> Window
+{
+        auto low = last_report_millivolts > policy.hysteresis_millivolts
+                       ? static_cast<uint16_t>(last_report_millivolts - policy.hysteresis_millivolts)
+                       : uint16_t{0};
+        auto high = static_cast<uint16_t>(
+            last_report_millivolts < UINT16_MAX - policy.hysteresis_millivolts
+                ? last_report_millivolts + policy.hysteresis_millivolts
+                : UINT16_MAX);
+        // Wake as soon as the alert threshold is crossed, even within the hysteresis.
+        if (last_report_millivolts > policy.alert_millivolts && low <= policy.alert_millivolts) {
+                low = static_cast<uint16_t>(policy.alert_millivolts + 1);
+        } else if (last_report_millivolts <= policy.alert_millivolts && high > policy.alert_millivolts) {
+                high = policy.alert_millivolts;
+        }
+        return Window{low, high};
+}
+
+// Host model of the ULP program's data memory and of one run of the program. Mirrors ulp_monitor.cpp instruction
+// for instruction so the wake decision can be tested without hardware.
+struct Model {
+        std::array<uint16_t, Layout::PROGRAM> data;
+
+        // One timer-triggered run with the given raw ADC reads. Returns the reason the main CPU would be woken.
+        constexpr auto run(std::array<uint16_t, OVERSAMPLE_COUNT> const &raw_reads) -> WakeReason
+        {
+                uint32_t sum{0};
+                for (auto const raw : raw_reads) {
+                        sum += raw;
+                }
+                auto const sample = static_cast<uint16_t>(sum >> OVERSAMPLE_SHIFT);
+                data[Layout::LAST_SAMPLE] = sample;
+                auto const index = data[Layout::SAMPLE_INDEX];
+                data[Layout::SAMPLES + index] = sample;
+                data[Layout::SAMPLE_INDEX] = static_cast<uint16_t>((index + 1) & (Layout::SAMPLE_COUNT - 1));
+
+                auto reason = WakeReason::None;
+                if (sample < data[Layout::LOW_THRESHOLD] || sample > data[Layout::HIGH_THRESHOLD]) {
+                        reason = WakeReason::Window;
+                } else {
+                        data[Layout::RUN_COUNTER] = static_cast<uint16_t>(data[Layout::RUN_COUNTER] + 1);
+                        if (data[Layout::RUN_COUNTER] < data[Layout::HEARTBEAT_RUNS]) {
+                                return WakeReason::None;
+                        }
+                        reason = WakeReason::Heartbeat;
+                }
+                data[Layout::WAKE_REASON] = static_cast<uint16_t>(reason);
+                data[Layout::RUN_COUNTER] = 0;
+                return reason;
+        }
+};
+
+} // namespace Ulp
+
+} // namespace BatteryMonitor
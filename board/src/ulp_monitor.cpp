@@ -0,0 +1,191 @@
+extern "C" {
+#include "esp_log.h"
+#include "esp_sleep.h"
+#include "sdkconfig.h"
+#if CONFIG_ULP_COPROC_TYPE_FSM
+#include "esp32/ulp.h"
+#include "soc/rtc_cntl_reg.h"
+#include "ulp_adc.h"
+#endif
+}
+
+#include "battery.hpp"
+#include "deferred_log.hpp"
+#include "sensors.hpp"
+#include "ulp_monitor.hpp"
+
+namespace BatteryMonitor
+{
+
+namespace Ulp
+{
+
+namespace
+{
+constexpr auto TAG{"ULP"};
+}
+
+#if CONFIG_ULP_COPROC_TYPE_FSM
+
+namespace
+{
+
+// Must match BATT_VOLTAGE_ADC_* in battery.cpp so the ULP's raw codes compare with the main CPU's.
+constexpr adc_unit_t ULP_ADC_UNIT{ADC_UNIT_1};
+constexpr adc_channel_t ULP_ADC_CHANNEL{static_cast<adc_channel_t>(Sensors::REGISTRY[Sensors::BATTERY].adc_channel)};
+constexpr adc_atten_t ULP_ADC_ATTEN{ADC_ATTEN_DB_11};
+constexpr adc_bitwidth_t ULP_ADC_BITWIDTH{ADC_BITWIDTH_12};
+
+enum Label : uint32_t {
+        LABEL_WAKE_WINDOW,
+        LABEL_WAKE,
+        LABEL_WAIT_READY,
+        LABEL_HALT,
+};
+
+// Same steps as Model::run() in ulp_model.hpp. R3 holds the data base address (0) throughout.
+// SUBR sets the overflow flag when the result would be negative, which is how "less than" is tested.
+const ulp_insn_t program[] = {
+    // R1 = sum of OVERSAMPLE_COUNT reads, R0 = average.
+    I_MOVI(R1, 0),
+    I_ADC(R0, ULP_ADC_UNIT, ULP_ADC_CHANNEL),
+    I_ADDR(R1, R1, R0),
+    I_ADC(R0, ULP_ADC_UNIT, ULP_ADC_CHANNEL),
+    I_ADDR(R1, R1, R0),
+    I_ADC(R0, ULP_ADC_UNIT, ULP_ADC_CHANNEL),
+    I_ADDR(R1, R1, R0),
+    I_ADC(R0, ULP_ADC_UNIT, ULP_ADC_CHANNEL),
+    I_ADDR(R1, R1, R0),
+    I_RSHI(R0, R1, OVERSAMPLE_SHIFT),
+    I_MOVI(R3, 0),
+    I_ST(R0, R3, Layout::LAST_SAMPLE),
+
+    // samples[index] = R0, index = (index + 1) & (SAMPLE_COUNT - 1)
+    I_LD(R2, R3, Layout::SAMPLE_INDEX),
+    I_ST(R0, R2, Layout::SAMPLES),
+    I_ADDI(R2, R2, 1),
+    I_ANDI(R2, R2, Layout::SAMPLE_COUNT - 1),
+    I_ST(R2, R3, Layout::SAMPLE_INDEX),
+
+    // Wake if R0 < low or high < R0.
+    I_LD(R1, R3, Layout::LOW_THRESHOLD),
+    I_SUBR(R2, R0, R1),
+    M_BXF(LABEL_WAKE_WINDOW),
+    I_LD(R1, R3, Layout::HIGH_THRESHOLD),
+    I_SUBR(R2, R1, R0),
+    M_BXF(LABEL_WAKE_WINDOW),
+
+    // ++counter. Halt while counter < heartbeat_runs.
+    I_LD(R1, R3, Layout::RUN_COUNTER),
+    I_ADDI(R1, R1, 1),
+    I_ST(R1, R3, Layout::RUN_COUNTER),
+    I_LD(R2, R3, Layout::HEARTBEAT_RUNS),
+    I_SUBR(R2, R1, R2),
+    M_BXF(LABEL_HALT),
+    I_MOVI(R2, static_cast<uint16_t>(WakeReason::Heartbeat)),
+    M_BX(LABEL_WAKE),
+
+    M_LABEL(LABEL_WAKE_WINDOW),
+    I_MOVI(R2, static_cast<uint16_t>(WakeReason::Window)),
+
+    M_LABEL(LABEL_WAKE),
+    I_ST(R2, R3, Layout::WAKE_REASON),
+    I_MOVI(R1, 0),
+    I_ST(R1, R3, Layout::RUN_COUNTER),
+
+    // Wait until the main CPU can be woken, wake it, and stop the ULP timer until the next start().
+    M_LABEL(LABEL_WAIT_READY),
+    I_RD_REG(RTC_CNTL_LOW_POWER_ST_REG, RTC_CNTL_RDY_FOR_WAKEUP_S, RTC_CNTL_RDY_FOR_WAKEUP_S),
+    M_BL(LABEL_WAIT_READY, 1),
+    I_WAKE(),
+    I_END(),
+
+    M_LABEL(LABEL_HALT),
+    I_HALT(),
+};
+
+uint16_t data_word(std::size_t const offset) { return static_cast<uint16_t>(RTC_SLOW_MEM[offset] & UINT16_MAX); }
+
+} // namespace
+
+bool is_supported() { return true; }
+
+bool start(uint16_t const low_raw, uint16_t const high_raw, uint16_t const heartbeat_runs,
+           std::chrono::microseconds const period)
+{
+        // The ULP needs the ADC unit configured for it, so the main CPU's session has to go first.
+        release_adc_session();
+
+        ulp_adc_cfg_t adc_config;
+        adc_config.adc_n = ULP_ADC_UNIT;
+        adc_config.channel = ULP_ADC_CHANNEL;
+        adc_config.atten = ULP_ADC_ATTEN;
+        adc_config.width = ULP_ADC_BITWIDTH;
+        adc_config.ulp_mode = ADC_ULP_MODE_FSM;
+        auto ret = ulp_adc_init(&adc_config);
+        if (ret != ESP_OK) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+                return false;
+        }
+
+        for (std::size_t i = 0; i < Layout::PROGRAM; ++i) {
+                RTC_SLOW_MEM[i] = 0;
+        }
+        RTC_SLOW_MEM[Layout::LOW_THRESHOLD] = low_raw;
+        RTC_SLOW_MEM[Layout::HIGH_THRESHOLD] = high_raw;
+        RTC_SLOW_MEM[Layout::HEARTBEAT_RUNS] = heartbeat_runs;
+
+        auto size = sizeof(program) / sizeof(ulp_insn_t);
+        ret = ulp_process_macros_and_load(Layout::PROGRAM, program, &size);
+        if (ret == ESP_OK) {
+                ret = ulp_set_wakeup_period(0, static_cast<uint32_t>(period.count()));
+        }
+        if (ret == ESP_OK) {
+                ret = esp_sleep_enable_ulp_wakeup();
+        }
+        if (ret == ESP_OK) {
+                ret = ulp_run(Layout::PROGRAM);
+        }
+        if (ret != ESP_OK) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(ret);
+                return false;
+        }
+
+        DLOGI(TAG, "ULP monitor started. Window: [%u, %u] raw, heartbeat every %u runs.", low_raw, high_raw,
+              heartbeat_runs);
+        return true;
+}
+
+std::optional<Results> read_results()
+{
+        if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_ULP) {
+                return std::nullopt;
+        }
+
+        Results results{};
+        results.reason = static_cast<WakeReason>(data_word(Layout::WAKE_REASON));
+        results.last_sample = data_word(Layout::LAST_SAMPLE);
+        auto const next_index = data_word(Layout::SAMPLE_INDEX);
+        for (std::size_t i = 0; i < Layout::SAMPLE_COUNT; ++i) {
+                results.samples[i] = data_word(Layout::SAMPLES + ((next_index + i) & (Layout::SAMPLE_COUNT - 1)));
+        }
+        return results;
+}
+
+#else
+
+bool is_supported() { return false; }
+
+bool start(uint16_t, uint16_t, uint16_t, std::chrono::microseconds)
+{
+        ESP_LOGW(TAG, "ULP monitor is not supported on this target.");
+        return false;
+}
+
+std::optional<Results> read_results() { return std::nullopt; }
+
+#endif
+
+} // namespace Ulp
+
+} // namespace BatteryMonitor
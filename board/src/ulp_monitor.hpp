@@ -0,0 +1,36 @@
+#pragma once
+
+#include "ulp_model.hpp"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace BatteryMonitor
+{
+
+namespace Ulp
+{
+
+// What the ULP program saw before it woke the main CPU.
+struct Results {
+        WakeReason reason;
+        uint16_t last_sample;
+        // Raw ADC codes, oldest first.
+        std::array<uint16_t, Layout::SAMPLE_COUNT> samples;
+};
+
+// Whether this build can run the ULP monitor. Only ESP32 targets with the ULP-FSM enabled in sdkconfig can.
+bool is_supported();
+
+// Load and start the ULP program, and enable it as a wakeup source. It samples the battery every period and wakes the
+// main CPU when the raw reading leaves [low_raw, high_raw] or after heartbeat_runs runs.
+// Releases this wake's ADC session. Returns false if the ULP could not be started.
+bool start(uint16_t low_raw, uint16_t high_raw, uint16_t heartbeat_runs, std::chrono::microseconds period);
+
+// Results left by the ULP program if it woke the main CPU on this wake.
+std::optional<Results> read_results();
+
+} // namespace Ulp
+
+} // namespace BatteryMonitor
@@ -1,7 +1,17 @@
 #pragma once
 
+#if __has_include("freertos/FreeRTOS.h")
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
+#else
+#include <cstdint>
+// Host builds have no FreeRTOS. Same tick rate as the sdkconfigs, so that tick conversions match the target.
+using TickType_t = uint32_t;
+using EventBits_t = uint32_t;
+#define configTICK_RATE_HZ 100
+#define pdMS_TO_TICKS(xTimeInMs)                                                                                       \
+        ((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#endif
 #include <chrono>
 #include <concepts>
 
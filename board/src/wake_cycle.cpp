@@ -0,0 +1,436 @@
+#include "wake_cycle.hpp"
+#include "deferred_log.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+
+namespace BatteryMonitor
+{
+
+namespace
+{
+constexpr auto TAG{"Wake"};
+
+// Constant parts of the state JSON. Numeric attributes are sent as JSON numbers.
+constexpr std::string_view WAKE_TRACE_STATE_PREFIX{R"({"state":")"};
+constexpr std::string_view WAKE_TRACE_ATTRIBUTES_PREFIX{
+    R"(","attributes":{"friendly_name":"Battery Monitor Wake Time","unit_of_measurement":"ms")"};
+
+// Post every sensor but the battery. They share the battery's connection.
+void post_sensors(Hal::Platform &platform, Sensors::Values values)
+{
+        if (auto const rssi = platform.network.rssi()) {
+                Sensors::set_source(values, Sensors::Source::WifiRssi, *rssi);
+        }
+
+        ArenaScope const scope{wake_arena()};
+        auto const buffer = wake_arena().allocate<char>(SENSOR_PAYLOAD_SIZE);
+        for (std::size_t i = 0; i < Sensors::SENSOR_COUNT; ++i) {
+                if (i == Sensors::BATTERY || !values[i]) {
+                        continue;
+                }
+                auto const &sensor = Sensors::REGISTRY[i];
+                Payload::Writer writer{buffer};
+                if (auto const state = Sensors::append_state(writer, sensor, *values[i]).view()) {
+                        platform.uploader.post(sensor.entity_id, *state);
+                } else {
+                        ESP_LOGE(TAG, "%.*s payload does not fit.", static_cast<int>(sensor.entity_id.size()),
+                                 sensor.entity_id.data());
+                }
+        }
+}
+
+// Post the charge estimate, if the battery has rested long enough for one.
+void post_charge(WakeState const &state, WakeConfig const &config, Hal::Platform &platform)
+{
+        auto const estimate = Charge::estimate(state.charge, config.charge_policy, platform.clock.now_s());
+        if (!estimate) {
+                return;
+        }
+        ArenaScope const scope{wake_arena()};
+        auto const buffer = wake_arena().allocate<char>(CHARGE_PAYLOAD_SIZE);
+        if (auto const charge = encode_charge_state(buffer, *estimate)) {
+                platform.uploader.post(CHARGE_ENTITY_ID, *charge);
+        }
+        if (auto const hours_left = encode_hours_left_state(buffer, *estimate, config.charge_policy)) {
+                platform.uploader.post(HOURS_LEFT_ENTITY_ID, *hours_left);
+        }
+}
+
+// Fire the readings logged while offline, oldest first, and mark them uploaded chunk by chunk. Readings are sent as
+// ages, so those logged before power-on, on a clock that has since started again, are dropped instead.
+void backfill(ReadingLog &log, Hal::Uploader &uploader, int64_t const now_s)
+{
+        if (!log.drop_stale()) {
+                return;
+        }
+        ArenaScope const scope{wake_arena()};
+        auto const readings = wake_arena().allocate<Reading>(BACKFILL_CHUNK_READINGS);
+        auto const buffer = wake_arena().allocate<char>(BACKFILL_PAYLOAD_SIZE);
+        for (std::size_t chunk = 0; chunk < MAX_BACKFILL_CHUNKS_PER_WAKE && log.pending() > 0; ++chunk) {
+                LogPosition next;
+                auto const count = log.read(readings, next);
+                auto const body = encode_backfill(buffer, readings.first(count), now_s);
+                if (count == 0 || !body || !uploader.fire_event(BACKFILL_EVENT_TYPE, *body)) {
+                        return;
+                }
+                log.mark_uploaded(next, count);
+                DLOGI(TAG, "Backfilled %zu logged readings. %zu left.", count, log.pending());
+        }
+}
+
+// Move every buffered reading to the flash log.
+void spill(WakeState &state, ReadingLog &log)
+{
+        ArenaScope const scope{wake_arena()};
+        auto const readings = wake_arena().allocate<Reading>(state.readings.size());
+        if (readings.size() != state.readings.size()) {
+                ESP_LOGE(TAG, "No room to log the readings.");
+                return;
+        }
+        for (std::size_t i = 0; i < readings.size(); ++i) {
+                readings[i] = state.readings[i];
+        }
+        if (log.append(readings)) {
+                DLOGI(TAG, "Logged %zu readings to flash.", state.readings.size());
+                state.readings.clear();
+        } else {
+                ESP_LOGE(TAG, "Reading log write failed.");
+        }
+}
+
+bool upload_all(WakeState &state, WakeConfig const &config, Hal::Platform &platform, WakeDecision const &decision,
+                ReadingLog &log)
+{
+        DLOGI(TAG, "Waiting for network to upload battery...");
+        auto const is_connected = platform.network.connect(config.network_timeout);
+        record_connect(config.connect_policy, state.connect, is_connected);
+        if (!is_connected) {
+                ESP_LOGE(TAG, "Upload timed out waiting for the network. %u failures in a row.",
+                         state.connect.consecutive_failures);
+                return false;
+        }
+
+        // From the arena so that a full batch does not sit on the upload task's stack.
+        ArenaScope const scope{wake_arena()};
+        auto const batch_buffer = wake_arena().allocate<char>(BATCH_PAYLOAD_SIZE);
+        auto const wake_trace_buffer = wake_arena().allocate<char>(WAKE_TRACE_PAYLOAD_SIZE);
+        auto const batch = encode_batch_state(batch_buffer, state, decision.reason, platform.clock.now_s());
+        auto const wake_trace = encode_wake_trace_state(wake_trace_buffer, state, config);
+        Trace::mark(Trace::Phase::EntityCreated);
+        if (!batch) {
+                ESP_LOGE(TAG, "Battery payload does not fit in %zu bytes.", batch_buffer.size());
+                return false;
+        }
+
+        DLOGI(TAG, "Uploading %zu battery readings.", state.readings.size());
+        auto const stats_before = platform.uploader.stats();
+        auto const is_posted = platform.uploader.post(BATTERY_ENTITY_ID, *batch);
+        post_sensors(platform, decision.values);
+        post_charge(state, config, platform);
+        if (decision.capture) {
+                ArenaScope const capture_scope{wake_arena()};
+                auto const capture_buffer = wake_arena().allocate<char>(CAPTURE_PAYLOAD_SIZE);
+                if (auto const capture = encode_capture_state(capture_buffer, *decision.capture)) {
+                        platform.uploader.post(CAPTURE_ENTITY_ID, *capture);
+                }
+        }
+        if (is_posted) {
+                backfill(log, platform.uploader, platform.clock.now_s());
+        }
+        if (wake_trace) {
+                platform.uploader.post(WAKE_TRACE_ENTITY_ID, *wake_trace);
+        }
+        platform.uploader.close();
+        Trace::mark(Trace::Phase::Posted);
+
+        state.last_upload_stats = platform.uploader.stats() - stats_before;
+        auto const &stats = state.last_upload_stats;
+        DLOGI(TAG, "Upload: %u connects in %lld us, %u posts in %lld us, %u bytes sent.", stats.connects,
+              static_cast<long long>(stats.connect_us), stats.posts, static_cast<long long>(stats.request_us),
+              stats.bytes_sent);
+        if (!is_posted) {
+                ESP_LOGE(TAG, "Battery upload failed.");
+                return false;
+        }
+
+        mark_reported(state);
+        return true;
+}
+
+} // namespace
+
+Arena &wake_arena()
+{
+        alignas(std::max_align_t) static std::array<std::byte, WAKE_ARENA_SIZE> buffer;
+        static Arena arena{buffer};
+        return arena;
+}
+
+std::optional<WakeDecision> sample_and_decide(WakeState &state, WakeConfig const &config, Hal::Adc &adc,
+                                              Hal::Clock &clock)
+{
+        // One ADC pass for every analog sensor.
+        Sensors::Values values{};
+        if (!Sensors::sample_adc(adc, values) || !values[Sensors::BATTERY]) {
+                ESP_LOGE(TAG, "Battery read failed.");
+                return std::nullopt;
+        }
+        Sensors::set_source(values, Sensors::Source::WakeCount, static_cast<int32_t>(++state.wake_count));
+
+        auto const millivolts = std::clamp<int32_t>(*values[Sensors::BATTERY], 0, UINT16_MAX);
+        Reading const reading{clock.now_s(), static_cast<uint16_t>(millivolts)};
+        if (state.readings.push(reading)) {
+                ESP_LOGW(TAG, "Reading ring full. Oldest reading dropped.");
+        }
+        Charge::update(state.charge, config.charge_policy, reading, values[Sensors::TEMPERATURE]);
+        Trace::mark(Trace::Phase::Sampled);
+        DLOGI(TAG, "Recorded reading %zu/%zu.", state.readings.size(), state.readings.capacity());
+
+        auto const previous_millivolts = state.last_millivolts;
+        auto const interval = next_sleep_interval(config.sleep_policy, std::chrono::seconds{state.sleep_interval_s},
+                                                  previous_millivolts, reading.millivolts);
+        state.sleep_interval_s = static_cast<uint32_t>(interval.count());
+        state.last_millivolts = reading.millivolts;
+
+        auto const reason = report_reason(config.report_policy, state.last_report, reading, state.readings.full());
+        auto const trigger = Capture::trigger(config.capture_policy, previous_millivolts, reading.millivolts, false);
+        return WakeDecision{reading, reason, interval, values, trigger, previous_millivolts, std::nullopt};
+}
+
+void mark_reported(WakeState &state)
+{
+        if (state.readings.size() == 0) {
+                return;
+        }
+        auto const &newest = state.readings.newest();
+        state.last_report = ReportState{true, newest.timestamp_s, newest.millivolts};
+        state.readings.clear();
+}
+
+bool capture_event(WakeConfig const &config, Hal::Adc &adc, WakeDecision &decision, bool const is_external)
+{
+        auto const &policy = config.capture_policy;
+        auto const trigger = is_external ? Capture::Trigger::External : decision.capture_trigger;
+        if (trigger == Capture::Trigger::None) {
+                return false;
+        }
+
+        // From the arena so that a capture does not sit on the stack, and shares its memory with the upload.
+        ArenaScope const scope{wake_arena()};
+        auto const samples = wake_arena().allocate<uint16_t>(Capture::sample_count(policy));
+        auto const scratch =
+            wake_arena().allocate<uint16_t>(samples.size() / std::max<std::size_t>(policy.smoothing_samples, 1));
+        if (samples.empty()) {
+                ESP_LOGE(TAG, "No room for a capture.");
+                return false;
+        }
+        auto const battery_channel = Sensors::REGISTRY[Sensors::BATTERY].adc_channel;
+        auto const count = adc.capture_millivolts(battery_channel, policy.sample_rate_hz, samples);
+        if (count == 0) {
+                ESP_LOGE(TAG, "Capture failed.");
+                return false;
+        }
+        for (std::size_t i = 0; i < count; ++i) {
+                samples[i] = static_cast<uint16_t>(std::clamp<int32_t>(Sensors::battery_millivolts(samples[i]), 0,
+                                                                       UINT16_MAX));
+        }
+        // Without an earlier reading, this wake's reading is the best guess at rest.
+        auto const resting = decision.previous_millivolts != 0 ? decision.previous_millivolts
+                                                               : decision.reading.millivolts;
+        decision.capture = Capture::extract(policy, trigger, resting, samples.first(count), scratch);
+        if (decision.reason == ReportReason::None) {
+                decision.reason = ReportReason::Capture;
+        }
+        DLOGI(TAG, "Captured %zu samples (%s). Min %u mV, dip %lu ms, ripple %u mV.", count,
+              Capture::trigger_name(trigger), decision.capture->min_millivolts,
+              static_cast<unsigned long>(decision.capture->dip_ms), decision.capture->ripple_millivolts);
+        return true;
+}
+
+bool upload(WakeState &state, WakeConfig const &config, Hal::Platform &platform, WakeDecision const &decision)
+{
+        ReadingLog log{platform.log_flash, state.log};
+        if (!take_connect_turn(state.connect)) {
+                ESP_LOGW(TAG, "Network failed on %u wakes in a row. Skipping it for this wake and %u more.",
+                         state.connect.consecutive_failures, state.connect.wakes_to_skip);
+        } else if (upload_all(state, config, platform, decision, log)) {
+                return true;
+        }
+        if (state.readings.full()) {
+                spill(state, log);
+        }
+        return false;
+}
+
+SleepMode choose_sleep_mode(WakeState &state, WakeConfig const &config, std::chrono::seconds const interval,
+                            bool const is_uploading)
+{
+        auto const &model = config.sleep_energy_model;
+        state.upload_permille = update_upload_share(state.upload_permille, is_uploading);
+        state.sleep_mode = select_sleep_mode(model, interval, state.upload_permille);
+        auto const charge_uc = cycle_charge_uc(model, state.sleep_mode, interval, state.upload_permille);
+        state.sleep_charge_uc = static_cast<uint32_t>(std::min<uint64_t>(charge_uc, UINT32_MAX));
+        DLOGI(TAG, "Sleeping %lld s in %s sleep: %lu uC modelled, %u permille uploading, light below %lld s.",
+              static_cast<long long>(interval.count()), sleep_mode_name(state.sleep_mode),
+              static_cast<unsigned long>(state.sleep_charge_uc), state.upload_permille,
+              static_cast<long long>(sleep_crossover(model, state.upload_permille).count()));
+        return state.sleep_mode;
+}
+
+void record_memory(WakeState &state, Hal::MemoryStats memory)
+{
+        memory.arena_peak = static_cast<uint32_t>(wake_arena().peak());
+        state.last_memory = memory;
+        DLOGI(TAG, "Memory: %lu bytes heap free (min %lu, largest block %lu), arena peak %lu of %zu bytes.",
+              static_cast<unsigned long>(memory.free_heap), static_cast<unsigned long>(memory.min_free_heap),
+              static_cast<unsigned long>(memory.largest_free_block), static_cast<unsigned long>(memory.arena_peak),
+              WAKE_ARENA_SIZE);
+}
+
+std::optional<std::string_view> encode_batch_state(std::span<char> const buffer, WakeState const &state,
+                                                   ReportReason const reason, int64_t const now_s)
+{
+        Payload::Writer writer{buffer};
+        Sensors::append_state_head(writer, Sensors::REGISTRY[Sensors::BATTERY], state.readings.newest().millivolts);
+        writer.append(R"(,"readings":)");
+        Payload::append_readings(writer, state.readings, now_s);
+        writer.append(R"(,"report_reason":")").append(report_reason_name(reason)).append(R"("}})");
+        return writer.view();
+}
+
+std::optional<std::string_view> encode_wake_trace_state(std::span<char> const buffer, WakeState const &state,
+                                                        WakeConfig const &config)
+{
+        auto const &trace = Trace::previous_upload_cycle();
+        auto const sleep_us = static_cast<int64_t>(state.sleep_interval_s) * 1'000'000;
+        // Both wakes are followed by the sleep the last wake chose.
+        auto const estimate_uc = [&](Trace::CycleTrace const &cycle) {
+                return static_cast<int64_t>(Trace::estimate_charge_uc(cycle, config.current_model,
+                                                                      config.sleep_energy_model, state.sleep_mode,
+                                                                      sleep_us));
+        };
+
+        Payload::Writer writer{buffer};
+        writer.append(WAKE_TRACE_STATE_PREFIX).append_int(trace.awake_us() / 1000);
+        writer.append(WAKE_TRACE_ATTRIBUTES_PREFIX);
+        for (std::size_t i = 0; i < Trace::PHASE_COUNT; ++i) {
+                auto const phase = static_cast<Trace::Phase>(i);
+                writer.append(R"(,")").append(Trace::phase_name(phase)).append(R"(_ms":)");
+                writer.append_int(trace.duration_us(phase) / 1000);
+        }
+        writer.append(R"(,"estimated_charge_uC":)");
+        writer.append_int(estimate_uc(trace));
+
+        // The wake before this one usually only sampled, so report it separately.
+        auto const &last_trace = Trace::previous_cycle();
+        writer.append(R"(,"last_wake_ms":)").append_int(last_trace.awake_us() / 1000);
+        writer.append(R"(,"last_wake_estimated_charge_uC":)");
+        writer.append_int(estimate_uc(last_trace));
+
+        auto const &stats = state.last_upload_stats;
+        writer.append(R"(,"upload_connects":)").append_int(stats.connects);
+        writer.append(R"(,"upload_connect_ms":)").append_int(stats.connect_us / 1000);
+        writer.append(R"(,"upload_request_ms":)").append_int(stats.request_us / 1000);
+        writer.append(R"(,"upload_bytes_sent":)").append_int(stats.bytes_sent);
+        writer.append(R"(,"upload_resolve_ms":)").append_int(stats.resolve_us / 1000);
+
+        // The mode the last wake chose, with the modelled charge of its cycle and the interval below which light sleep
+        // would win.
+        writer.append(R"(,"sleep_mode":")").append(sleep_mode_name(state.sleep_mode)).append('"');
+        writer.append(R"(,"sleep_modelled_charge_uC":)").append_int(state.sleep_charge_uc);
+        writer.append(R"(,"sleep_crossover_s":)");
+        writer.append_int(sleep_crossover(config.sleep_energy_model, state.upload_permille).count());
+
+        auto const &memory = state.last_memory;
+        writer.append(R"(,"free_heap":)").append_int(memory.free_heap);
+        writer.append(R"(,"min_free_heap":)").append_int(memory.min_free_heap);
+        writer.append(R"(,"largest_free_block":)").append_int(memory.largest_free_block);
+        writer.append(R"(,"arena_peak":)").append_int(memory.arena_peak);
+        writer.append(R"(,"main_stack_free":)").append_int(memory.main_stack_free);
+        writer.append(R"(,"wifi_stack_free":)").append_int(memory.wifi_stack_free);
+        writer.append(R"(,"upload_stack_free":)").append_int(memory.upload_stack_free).append("}}");
+        return writer.view();
+}
+
+std::optional<std::string_view> encode_capture_state(std::span<char> const buffer, Capture::Features const &features)
+{
+        Payload::Writer writer{buffer};
+        writer.append(R"({"state":")").append_fixed(features.min_millivolts, 3);
+        writer.append(R"(","attributes":{"friendly_name":"Car Battery Event","unit_of_measurement":"Volts")");
+        writer.append(R"(,"trigger":")").append(Capture::trigger_name(features.trigger)).append('"');
+        writer.append(R"(,"resting_voltage":)").append_fixed(features.resting_millivolts, 3);
+        writer.append(R"(,"min_voltage":)").append_fixed(features.min_millivolts, 3);
+        writer.append(R"(,"dip_ms":)").append_int(features.dip_ms);
+        writer.append(R"(,"recovery_ms":)");
+        if (features.is_recovered) {
+                writer.append_int(features.recovery_ms);
+        } else {
+                writer.append("null");
+        }
+        writer.append(R"(,"settled_voltage":)").append_fixed(features.settled_millivolts, 3);
+        writer.append(R"(,"ripple_mv":)").append_int(features.ripple_millivolts);
+        writer.append(R"(,"ripple_rms_mv":)").append_int(features.ripple_rms_millivolts);
+        writer.append(R"(,"sample_rate_hz":)").append_int(features.sample_rate_hz);
+        writer.append(R"(,"samples":)").append_int(features.samples).append("}}");
+        return writer.view();
+}
+
+std::optional<std::string_view> encode_charge_state(std::span<char> const buffer, Charge::Estimate const &estimate)
+{
+        // Floats to fixed point, at the precision they are published with.
+        auto const tenths = [](float const value) { return static_cast<int32_t>(std::lround(value * 10.f)); };
+
+        Payload::Writer writer{buffer};
+        writer.append(R"({"state":")").append_int(estimate.soc_percent);
+        writer.append(R"(","attributes":{"friendly_name":"Car Battery Charge","unit_of_measurement":"%")");
+        writer.append(R"(,"device_class":"battery","resting_voltage":)").append_fixed(estimate.resting_millivolts, 3);
+        writer.append(R"(,"noise_mv":)").append_fixed(tenths(estimate.noise_millivolts), 1);
+        writer.append(R"(,"drain_mv_per_hour":)");
+        if (estimate.drain_millivolts_per_hour) {
+                writer.append_fixed(tenths(*estimate.drain_millivolts_per_hour), 1);
+        } else {
+                writer.append("null");
+        }
+        writer.append(R"(,"hours_since_charge":)");
+        if (estimate.hours_since_charge) {
+                writer.append_fixed(tenths(*estimate.hours_since_charge), 1);
+        } else {
+                writer.append("null");
+        }
+        writer.append(R"(,"charged_voltage":)");
+        if (estimate.charged_millivolts) {
+                writer.append_fixed(*estimate.charged_millivolts, 3);
+        } else {
+                writer.append("null");
+        }
+        writer.append("}}");
+        return writer.view();
+}
+
+std::optional<std::string_view> encode_hours_left_state(std::span<char> const buffer, Charge::Estimate const &estimate,
+                                                        Charge::Policy const &policy)
+{
+        if (!estimate.hours_to_cutoff) {
+                return std::nullopt;
+        }
+        auto const tenths = static_cast<int32_t>(std::lround(*estimate.hours_to_cutoff * 10.f));
+        Payload::Writer writer{buffer};
+        writer.append(R"({"state":")").append_fixed(tenths, 1);
+        writer.append(R"(","attributes":{"friendly_name":"Car Battery Hours Left","unit_of_measurement":"h")");
+        writer.append(R"(,"device_class":"duration","cutoff_voltage":)").append_fixed(policy.cutoff_millivolts, 3);
+        writer.append("}}");
+        return writer.view();
+}
+
+std::optional<std::string_view> encode_backfill(std::span<char> const buffer, std::span<Reading const> const readings,
+                                                int64_t const now_s)
+{
+        Payload::Writer writer{buffer};
+        writer.append(R"({"entity_id":")").append(BATTERY_ENTITY_ID).append(R"(","readings":)");
+        Payload::append_readings(writer, readings, now_s).append('}');
+        return writer.view();
+}
+
+} // namespace BatteryMonitor
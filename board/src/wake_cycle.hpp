@@ -0,0 +1,225 @@
+#pragma once
+
+#include "arena.hpp"
+#include "capture.hpp"
+#include "charge_estimator.hpp"
+#include "connect_policy.hpp"
+#include "hal.hpp"
+#include "payload.hpp"
+#include "reading_log.hpp"
+#include "reading_ring.hpp"
+#include "report_policy.hpp"
+#include "sensors.hpp"
+#include "sleep_policy.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string_view>
+
+namespace BatteryMonitor
+{
+
+// Readings kept between uploads. Enough for a heartbeat interval at the base sleep interval.
+constexpr std::size_t READING_RING_CAPACITY{64};
+
+inline constexpr std::string_view BATTERY_ENTITY_ID{Sensors::REGISTRY[Sensors::BATTERY].entity_id};
+inline constexpr std::string_view WAKE_TRACE_ENTITY_ID{"sensor.battery_monitor_wake_time"};
+inline constexpr std::string_view CAPTURE_ENTITY_ID{"sensor.car_battery_event"};
+inline constexpr std::string_view CHARGE_ENTITY_ID{"sensor.car_battery_charge"};
+inline constexpr std::string_view HOURS_LEFT_ENTITY_ID{"sensor.car_battery_hours_left"};
+
+// Payload buffers. The batch buffer fits a full reading ring.
+inline constexpr std::size_t BATCH_PAYLOAD_SIZE{256 + READING_RING_CAPACITY * Payload::MAX_READING_BYTES};
+inline constexpr std::size_t WAKE_TRACE_PAYLOAD_SIZE{1024};
+inline constexpr std::size_t SENSOR_PAYLOAD_SIZE{256};
+inline constexpr std::size_t CAPTURE_PAYLOAD_SIZE{512};
+inline constexpr std::size_t CHARGE_PAYLOAD_SIZE{384};
+
+// A capture's samples and smoothed points. The capture is summarized before the upload, so it shares the wake arena
+// with the upload's payloads.
+inline constexpr std::size_t CAPTURE_ARENA_BYTES{Capture::MAX_SAMPLES * sizeof(uint16_t) +
+                                                 Capture::MAX_SAMPLES / 2 * sizeof(uint16_t)};
+
+// Readings logged to flash while offline are fired as this Home Assistant event once it is reachable again, in chunks.
+// A long backlog is spread over several wakes so that one wake does not keep the radio on for long.
+inline constexpr std::string_view BACKFILL_EVENT_TYPE{"battery_monitor_backfill"};
+inline constexpr std::size_t BACKFILL_CHUNK_READINGS{128};
+inline constexpr std::size_t MAX_BACKFILL_CHUNKS_PER_WAKE{8};
+inline constexpr std::size_t BACKFILL_PAYLOAD_SIZE{64 + BACKFILL_CHUNK_READINGS * Payload::MAX_READING_BYTES};
+
+// The upload's payloads in use at once, or the reading ring on its way to the flash log.
+inline constexpr std::size_t UPLOAD_ARENA_BYTES{
+    std::max({BATCH_PAYLOAD_SIZE + WAKE_TRACE_PAYLOAD_SIZE +
+                  std::max({SENSOR_PAYLOAD_SIZE, CAPTURE_PAYLOAD_SIZE, CHARGE_PAYLOAD_SIZE,
+                            BACKFILL_CHUNK_READINGS * sizeof(Reading) + BACKFILL_PAYLOAD_SIZE}),
+              READING_RING_CAPACITY * sizeof(Reading)})};
+// The padding covers alignment.
+inline constexpr std::size_t WAKE_ARENA_SIZE{std::max(CAPTURE_ARENA_BYTES, UPLOAD_ARENA_BYTES) + 64};
+
+// Scratch memory for this wake, in place of function-local static buffers. Reset before sleep.
+Arena &wake_arena();
+
+// Everything the wake cycle keeps across deep sleep.
+// Kept as an aggregate so that it can be placed in RTC memory with RTC_DATA_ATTR. Zero-initialized on power-on.
+struct WakeState {
+        ReadingRing<READING_RING_CAPACITY> readings;
+        ReportState last_report;
+        uint32_t sleep_interval_s;
+        uint16_t last_millivolts;
+        uint32_t wake_count;
+        // Uploader counters of the last wake that uploaded.
+        Hal::UploadStats last_upload_stats;
+        LogCursor log;
+        ConnectState connect;
+        Charge::EstimatorState charge;
+        // RAM use of the last wake that uploaded.
+        Hal::MemoryStats last_memory;
+        // Share of recent wakes that uploaded, in permille, and how the last wake chose to sleep.
+        uint16_t upload_permille;
+        SleepMode sleep_mode;
+        uint32_t sleep_charge_uc;
+};
+
+struct WakeConfig {
+        SleepPolicy sleep_policy;
+        ReportPolicy report_policy;
+        // Give up on the upload if the network is not up by then.
+        std::chrono::milliseconds network_timeout;
+        // Retries within network_timeout, and wakes skipped while the network keeps failing.
+        ConnectPolicy connect_policy;
+        Capture::Policy capture_policy;
+        Charge::Policy charge_policy;
+        Trace::CurrentModel current_model;
+        SleepEnergyModel sleep_energy_model;
+};
+
+// Battery voltage that needs attention.
+inline constexpr uint16_t ALERT_MILLIVOLTS{12'000};
+
+// Shared by the target and host builds so that the host simulation runs the same policies.
+inline constexpr WakeConfig WAKE_CONFIG{
+    .sleep_policy =
+        {
+            .min_interval = std::chrono::seconds{30},
+            .base_interval = std::chrono::minutes{1},
+            .max_interval = std::chrono::minutes{10},
+            .alert_millivolts = ALERT_MILLIVOLTS,
+            .approach_millivolts = 300,
+            .stable_millivolts = 20,
+        },
+    .report_policy =
+        {
+            .hysteresis_millivolts = 50,
+            .alert_millivolts = ALERT_MILLIVOLTS,
+            .heartbeat_interval = std::chrono::hours{1},
+        },
+    .network_timeout = std::chrono::seconds{8},
+    .connect_policy =
+        {
+            .attempt_timeout = std::chrono::seconds{3},
+            .initial_backoff = std::chrono::milliseconds{250},
+            .max_backoff = std::chrono::seconds{2},
+            .failures_before_skip = 3,
+            .initial_skip_wakes = 1,
+            .max_skip_wakes = 32,
+        },
+    .capture_policy =
+        {
+            .sample_rate_hz = 4'000,
+            .duration = std::chrono::seconds{2},
+            .step_millivolts = 300,
+            .dip_millivolts = 500,
+            .recovery_millivolts = 200,
+            .smoothing_samples = 4,
+        },
+    .charge_policy =
+        {
+            .charging_millivolts = 13'300,
+            .rest_delay = std::chrono::hours{2},
+            .temperature_microvolts_per_degree = 1'200,
+            .cutoff_millivolts = ALERT_MILLIVOLTS,
+            .drain_window = std::chrono::hours{4},
+        },
+    .current_model = Trace::DEFAULT_CURRENT_MODEL,
+    // Rough figures for an ESP32 module on this board, with Wi-Fi listening every third DTIM beacon in light sleep.
+    // Deep sleep wins unless most wakes upload at a short interval.
+    .sleep_energy_model =
+        {
+            .cold_wake = {std::chrono::milliseconds{150}, 40'000},
+            .light_wake = {std::chrono::milliseconds{20}, 40'000},
+            .associate = {std::chrono::milliseconds{900}, 110'000},
+            .upload = {std::chrono::milliseconds{300}, 150'000},
+            .deep_sleep_ua = 15,
+            .light_sleep_ua = 1'500,
+        },
+};
+
+static_assert(Capture::sample_count(WAKE_CONFIG.capture_policy) <= Capture::MAX_SAMPLES);
+
+// What this wake should do after sampling.
+struct WakeDecision {
+        Reading reading;
+        ReportReason reason;
+        std::chrono::seconds sleep_interval;
+        // Every sensor sampled on this wake, to publish alongside the battery.
+        Sensors::Values values;
+        // Whether the reading calls for a high-rate capture, and the reading before it.
+        Capture::Trigger capture_trigger;
+        uint16_t previous_millivolts;
+        // Features of this wake's capture, to publish alongside the battery.
+        std::optional<Capture::Features> capture;
+};
+
+// Sample all sensors, buffer the battery reading, update the charge estimator, pick the next sleep interval and decide
+// whether to upload.
+// Returns std::nullopt if the battery could not be read.
+std::optional<WakeDecision> sample_and_decide(WakeState &state, WakeConfig const &config, Hal::Adc &adc,
+                                              Hal::Clock &clock);
+
+// The newest buffered reading becomes the last report, and the buffer is cleared. Called once the buffer is uploaded.
+void mark_reported(WakeState &state);
+
+// Capture the battery at a high rate if the decision's trigger, or the external wake source (is_external), calls for
+// it, and summarize the capture into decision. Returns whether a capture was taken. A capture is always reported.
+bool capture_event(WakeConfig const &config, Hal::Adc &adc, WakeDecision &decision, bool is_external);
+
+// Bring up the network and post the buffered readings, the other sensors, the charge estimate, any readings logged to
+// flash while offline and the wake trace over one connection. Clears the buffer and updates the last report on
+// success. On failure, a full buffer is moved to the flash log instead of dropping its oldest readings on the next
+// wake. While the network keeps failing, the connect policy skips the network on some wakes, which then count as
+// failed uploads.
+bool upload(WakeState &state, WakeConfig const &config, Hal::Platform &platform, WakeDecision const &decision);
+
+// Pick how to sleep for interval from the energy model and the share of recent wakes that uploaded, including this
+// one if is_uploading. Keeps the choice and its modelled charge for the wake trace.
+SleepMode choose_sleep_mode(WakeState &state, WakeConfig const &config, std::chrono::seconds interval,
+                            bool is_uploading);
+
+// Keep this wake's RAM use, with the wake arena's peak, for the next wake trace. Called at the end of a wake that
+// uploaded.
+void record_memory(WakeState &state, Hal::MemoryStats memory);
+
+// State JSON for the battery entity: the newest buffered reading, with all buffered readings as an attribute.
+// Written into buffer. Returns std::nullopt if it does not fit.
+std::optional<std::string_view> encode_batch_state(std::span<char> buffer, WakeState const &state, ReportReason reason,
+                                                   int64_t now_s);
+// State JSON for the diagnostics entity: phase durations, estimated charge and RAM use of the last wake that uploaded.
+std::optional<std::string_view> encode_wake_trace_state(std::span<char> buffer, WakeState const &state,
+                                                        WakeConfig const &config);
+// State JSON for the capture entity: the cranking voltage, with every feature as an attribute.
+std::optional<std::string_view> encode_capture_state(std::span<char> buffer, Capture::Features const &features);
+// State JSON for the charge entity: the state of charge in percent, with the resting voltage, drain and time since
+// the last charge as attributes.
+std::optional<std::string_view> encode_charge_state(std::span<char> buffer, Charge::Estimate const &estimate);
+// State JSON for the hours-left entity. Only for an estimate with hours_to_cutoff.
+std::optional<std::string_view> encode_hours_left_state(std::span<char> buffer, Charge::Estimate const &estimate,
+                                                        Charge::Policy const &policy);
+// Event data for a chunk of logged readings: {"entity_id":"sensor.car_battery","readings":[[age in s,volts],...]}
+std::optional<std::string_view> encode_backfill(std::span<char> buffer, std::span<Reading const> readings,
+                                                int64_t now_s);
+
+} // namespace BatteryMonitor
@@ -1,9 +1,18 @@
 #include "wifi.h"
+#include "connect_policy.hpp"
+#include "deferred_log.hpp"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
+#include "hal.hpp"
 #include "freertos/event_groups.h"
+#include "freertos/task.h"
 #include "secrets.h"
+#include "trace.hpp"
 #include "utils.h"
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstring>
 #include <string>
@@ -17,9 +26,10 @@ namespace Wifi
 #define ESP_WIFI_SCAN_AUTH_MODE_THRESHOLD WIFI_AUTH_WPA_WPA2_PSK
 
 /*
- * The event group allows multiple bits for each event, but we only care about two events:
+ * The event group allows multiple bits for each event, but we only care about three events:
  * - Connected to the AP with an IP
- * - Failed to connect after the maximum amount of retries
+ * - The last connection attempt failed, or the connection was lost
+ * - The station stopped
  */
 
 #define WIFI_CONNECTED_BIT BIT0
@@ -29,47 +39,145 @@ namespace Wifi
 namespace
 {
 constexpr auto TAG{"Wi-Fi"};
+// Use the full scan and DHCP path after this many fast reconnects so the DHCP lease is renewed.
+constexpr uint32_t FAST_RECONNECT_MAX_USES{60};
+// Beacon intervals between wakes of the radio in light sleep. Longer saves more but risks the AP dropping the station.
+constexpr uint16_t LIGHT_SLEEP_LISTEN_INTERVAL{3};
 
-EventGroupHandle_t s_wifi_event_group;
+// AP and lease details from the last successful connection.
+struct ConnectionCache {
+        bool valid;
+        uint32_t uses;
+        uint8_t bssid[6];
+        uint8_t channel;
+        esp_netif_ip_info_t ip_info;
+        esp_netif_dns_info_t dns_info;
+};
+
+// Kept in RTC slow memory so it survives deep sleep. Zero-initialized (invalid) on power-on.
+RTC_DATA_ATTR ConnectionCache s_connection_cache;
+
+EventGroupHandle_t s_wifi_event_group{nullptr};
+esp_netif_t *s_sta_netif{nullptr};
+wifi_config_t s_wifi_config; // This has to be static in order to be zero-initialized.
+bool s_is_fast_path{false};
+
+// Connect straight to the cached BSSID and channel with the cached static IP, skipping the scan and DHCP.
+void configure_fast_path()
+{
+        s_wifi_config.sta.bssid_set = true;
+        std::memcpy(s_wifi_config.sta.bssid, s_connection_cache.bssid, sizeof(s_wifi_config.sta.bssid));
+        s_wifi_config.sta.channel = s_connection_cache.channel;
+        s_wifi_config.sta.scan_method = WIFI_FAST_SCAN;
+
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcpc_stop(s_sta_netif));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_set_ip_info(s_sta_netif, &s_connection_cache.ip_info));
+        ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_netif_set_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &s_connection_cache.dns_info));
+        s_is_fast_path = true;
+}
+
+// Scan for the SSID on all channels and lease an IP over DHCP.
+void configure_full_path()
+{
+        s_wifi_config.sta.bssid_set = false;
+        s_wifi_config.sta.channel = 0;
+        s_wifi_config.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+
+        if (s_is_fast_path) {
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_dhcpc_start(s_sta_netif));
+        }
+        s_is_fast_path = false;
+}
+
+// Save the AP and lease so the next wake can take the fast path.
+void save_connection_cache(esp_netif_ip_info_t const &ip_info)
+{
+        wifi_ap_record_t ap_info{};
+        if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+                s_connection_cache.valid = false;
+                return;
+        }
+        std::memcpy(s_connection_cache.bssid, ap_info.bssid, sizeof(s_connection_cache.bssid));
+        s_connection_cache.channel = ap_info.primary;
+        s_connection_cache.ip_info = ip_info;
+        ESP_ERROR_CHECK_WITHOUT_ABORT(
+            esp_netif_get_dns_info(s_sta_netif, ESP_NETIF_DNS_MAIN, &s_connection_cache.dns_info));
+        s_connection_cache.uses = 0;
+        s_connection_cache.valid = true;
+        DLOGI(TAG, "Cached AP on channel %u for fast reconnect.", s_connection_cache.channel);
+}
 
 void event_handler(void *arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
 {
-        static int32_t s_retry_num{0};
         if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_START)) {
                 esp_wifi_connect();
         } else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_DISCONNECTED)) {
+                // Retries are paced by connect_within(), against the wake's budget.
+                xEventGroupClearBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
                 xEventGroupSetBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
-                constexpr int32_t max_retries{10};
-                if (s_retry_num < max_retries) {
-                        esp_wifi_connect();
-                        ++s_retry_num;
-                        ESP_LOGI(TAG, "Retrying connection to AP");
+                if (s_is_fast_path) {
+                        // The cached AP or lease is stale. Fall back to the full path and refresh the cache.
+                        ESP_LOGW(TAG, "Fast reconnect failed. Falling back to full scan and DHCP.");
+                        s_connection_cache.valid = false;
+                        configure_full_path();
+                        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_config(WIFI_IF_STA, &s_wifi_config));
                 }
-                ESP_LOGE(TAG, "Connection to AP failed. SSID: %s", Secrets::NETWORK_SSID.data());
+                auto const event_ptr = static_cast<wifi_event_sta_disconnected_t *>(event_data);
+                ESP_LOGE(TAG, "Connection to AP failed. SSID: %s, reason: %u", Secrets::NETWORK_SSID.data(),
+                         event_ptr->reason);
         } else if ((event_base == IP_EVENT) && (event_id == IP_EVENT_STA_GOT_IP)) {
+                xEventGroupClearBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
                 xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
                 auto const event_ptr = static_cast<ip_event_got_ip_t *>(event_data);
-                ESP_LOGI(TAG, "IP Obtained - " IPSTR, IP2STR(&event_ptr->ip_info.ip));
-                s_retry_num = 0;
+                Trace::mark(Trace::Phase::GotIp);
+                DLOGI(TAG, "IP Obtained - " IPSTR, IP2STR(&event_ptr->ip_info.ip));
+                DLOGI(TAG, "Wake-to-IP latency: %lld ms (%s path)", Hal::micros_since_wake() / 1000,
+                      s_is_fast_path ? "fast" : "full");
+                if (s_is_fast_path) {
+                        ++s_connection_cache.uses;
+                } else {
+                        save_connection_cache(event_ptr->ip_info);
+                }
         } else if ((event_base == WIFI_EVENT) && (event_id == WIFI_EVENT_STA_STOP)) {
                 xEventGroupSetBits(s_wifi_event_group, WIFI_STOPPED_BIT);
         } else {
-                ESP_LOGI(TAG, "Event not handled in event_handler.");
+                DLOGI(TAG, "Event not handled in event_handler.");
         }
 }
 
+std::chrono::milliseconds elapsed_since(int64_t const start_us)
+{
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::microseconds{esp_timer_get_time() - start_us});
+}
+
 } // namespace
 
 bool wait_wifi_connected(TickType_t timeout)
 {
+        if (s_wifi_event_group == nullptr) {
+                // Wi-Fi has not been started yet.
+                vTaskDelay(timeout);
+                return false;
+        }
         auto const bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT, pdFALSE, pdTRUE, timeout);
         return Utils::are_bits_set(bits, EventBits_t{WIFI_CONNECTED_BIT});
 }
 
+std::optional<int8_t> get_rssi()
+{
+        wifi_ap_record_t ap_info{};
+        if (s_wifi_event_group == nullptr || esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+                return std::nullopt;
+        }
+        return ap_info.rssi;
+}
+
 bool wait_wifi(TickType_t timeout)
 {
-        // Waiting until either the connection is established (WIFI_CONNECTED_BIT) or connection failed for the maximum
-        // number of re-tries (WIFI_DISCONNECTED_BIT). The bits are set by event_handler() (see above)
+        // Waiting until either the connection is established (WIFI_CONNECTED_BIT) or the last attempt failed
+        // (WIFI_DISCONNECTED_BIT). The bits are set by event_handler() (see above)
         auto const bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_DISCONNECTED_BIT, pdFALSE,
                                               pdFALSE, timeout);
         // xEventGroupWaitBits() returns the bits before the call
@@ -77,6 +185,55 @@ bool wait_wifi(TickType_t timeout)
         return Utils::are_bits_set(bits, EventBits_t{WIFI_CONNECTED_BIT});
 }
 
+bool connect_within(ConnectPolicy const &policy, std::chrono::milliseconds const budget)
+{
+        auto const start_us = esp_timer_get_time();
+        auto const remaining = [&] { return std::max(budget - elapsed_since(start_us), std::chrono::milliseconds{0}); };
+
+        // The station may still be starting on another task.
+        while (s_wifi_event_group == nullptr) {
+                if (remaining().count() == 0) {
+                        return false;
+                }
+                vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        // The first attempt starts with the station. Every retry waits out a growing backoff, and none is started
+        // unless it can run for a full attempt before the budget is spent.
+        for (uint32_t failed_attempts = 0;;) {
+                auto const wait = std::min(policy.attempt_timeout, remaining());
+                auto const bits = xEventGroupWaitBits(s_wifi_event_group, WIFI_CONNECTED_BIT | WIFI_DISCONNECTED_BIT,
+                                                      pdFALSE, pdFALSE, Utils::to_ticks(wait));
+                if (Utils::are_bits_set(bits, EventBits_t{WIFI_CONNECTED_BIT})) {
+                        return true;
+                }
+                if (!Utils::are_bits_set(bits, EventBits_t{WIFI_DISCONNECTED_BIT})) {
+                        // The attempt hung. Abandon it.
+                        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_disconnect());
+                }
+                ++failed_attempts;
+                if (!fits_another_attempt(policy, failed_attempts, remaining())) {
+                        ESP_LOGW(TAG, "Giving up on the AP after %lu attempts in %lld ms.",
+                                 static_cast<unsigned long>(failed_attempts),
+                                 static_cast<long long>(elapsed_since(start_us).count()));
+                        return false;
+                }
+                auto const delay = backoff_delay(policy, failed_attempts);
+                DLOGI(TAG, "Retrying connection to AP in %lld ms.", static_cast<long long>(delay.count()));
+                vTaskDelay(Utils::to_ticks(delay));
+                xEventGroupClearBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
+                ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_connect());
+        }
+}
+
+void set_power_save(bool const is_light_sleeping)
+{
+        if (s_wifi_event_group == nullptr) {
+                return;
+        }
+        ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_ps(is_light_sleeping ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM));
+}
+
 void stop_wifi()
 {
         // ESP_ERROR_CHECK_WITHOUT_ABORT(
@@ -84,27 +241,31 @@ void stop_wifi()
         //     static_cast<esp_event_handler_instance_t>(&event_handler)));
         // ESP_ERROR_CHECK_WITHOUT_ABORT(
         //     esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID, &event_handler));
+        if (s_wifi_event_group == nullptr) {
+                // Wi-Fi was never started on this wake.
+                return;
+        }
         esp_wifi_stop();
         auto const bits =
             xEventGroupWaitBits(s_wifi_event_group, WIFI_STOPPED_BIT, pdFALSE, pdTRUE, pdMS_TO_TICKS(1000));
         auto const is_wifi_stopped = ((bits & WIFI_STOPPED_BIT) == WIFI_STOPPED_BIT);
         if (is_wifi_stopped) {
-                ESP_LOGI(TAG, "WiFi stopped.");
+                DLOGI(TAG, "WiFi stopped.");
                 vEventGroupDelete(s_wifi_event_group);
+                s_wifi_event_group = nullptr;
         } else {
                 ESP_LOGE(TAG, "WiFi did not stop within the timeout period.");
         }
 }
 
 // NVS must be init before this can be run
-bool wifi_init_station()
+void wifi_init_station()
 {
         s_wifi_event_group = xEventGroupCreate();
-        xEventGroupSetBits(s_wifi_event_group, WIFI_DISCONNECTED_BIT);
 
         ESP_ERROR_CHECK(esp_netif_init());
         ESP_ERROR_CHECK(esp_event_loop_create_default());
-        esp_netif_create_default_wifi_sta();
+        s_sta_netif = esp_netif_create_default_wifi_sta();
 
         wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
         ESP_ERROR_CHECK(esp_wifi_init(&cfg));
@@ -116,7 +277,6 @@ bool wifi_init_station()
         ESP_ERROR_CHECK(
             esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &event_handler, NULL, &instance_got_ip));
 
-        static wifi_config_t wifi_config; // This has to be static in order to be zero-initialized.
         // Ensure these are filled in. No point in running the program if they aren't.
         static_assert(!Secrets::NETWORK_SSID.empty());
         static_assert(!Secrets::NETWORK_PASSWORD.empty());
@@ -124,20 +284,21 @@ bool wifi_init_station()
         static_assert(Secrets::NETWORK_SSID.size() <= sizeof(wifi_sta_config_t::ssid));
         static_assert(Secrets::NETWORK_PASSWORD.size() <= sizeof(wifi_sta_config_t::password));
 
+        auto &wifi_config = s_wifi_config;
         std::memcpy(wifi_config.sta.ssid, Secrets::NETWORK_SSID.data(), Secrets::NETWORK_SSID.size());
         std::memcpy(wifi_config.sta.password, Secrets::NETWORK_PASSWORD.data(), Secrets::NETWORK_PASSWORD.size());
         wifi_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
-        ESP_ERROR_CHECK(esp_wifi_set_config(wifi_interface_t::WIFI_IF_STA, &wifi_config));
-        ESP_ERROR_CHECK(esp_wifi_start());
-
-        // Print if WiFi is connected currently
-        auto const is_connected = wait_wifi_connected(portMAX_DELAY);
-        if (is_connected) {
-                ESP_LOGI(TAG, "Connected to AP SSID: '%s'", wifi_config.sta.ssid);
+        // Only used in WIFI_PS_MAX_MODEM, while the wake light sleeps.
+        wifi_config.sta.listen_interval = LIGHT_SLEEP_LISTEN_INTERVAL;
+        if (s_connection_cache.valid && s_connection_cache.uses < FAST_RECONNECT_MAX_USES) {
+                DLOGI(TAG, "Fast reconnect to cached AP on channel %u.", s_connection_cache.channel);
+                configure_fast_path();
         } else {
-                ESP_LOGI(TAG, "Failed to connect to SSID: '%s'", wifi_config.sta.ssid);
+                configure_full_path();
         }
-        return is_connected;
+        ESP_ERROR_CHECK(esp_wifi_set_config(wifi_interface_t::WIFI_IF_STA, &wifi_config));
+        ESP_ERROR_CHECK(esp_wifi_start());
+        Trace::mark(Trace::Phase::WifiStarted);
 }
 
 } // namespace Wifi
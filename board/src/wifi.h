@@ -1,7 +1,11 @@
 #pragma once
 
+#include "connect_policy.hpp"
 #include "freertos/FreeRTOS.h"
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <optional>
 namespace BatteryMonitor
 {
 
@@ -10,8 +14,17 @@ namespace Wifi
 
 bool wait_wifi_connected(TickType_t timeout);
 bool wait_wifi(TickType_t timeout);
-bool wifi_init_station(void);
+// Start the station. The first connection attempt starts right away. Use connect_within() to wait for it.
+void wifi_init_station(void);
+// Wait for the station to get an IP, retrying failed attempts with the policy's backoff. Gives up once another attempt
+// would not fit in budget. Returns whether it is connected.
+bool connect_within(ConnectPolicy const &policy, std::chrono::milliseconds budget);
 void stop_wifi(void);
+// Stay associated on fewer beacons while the wake light sleeps, and on every DTIM beacon while it is awake. Does nothing
+// if Wi-Fi was never started.
+void set_power_save(bool is_light_sleeping);
+// RSSI of the associated AP in dBm, or std::nullopt if not associated.
+std::optional<int8_t> get_rssi();
 
 } // namespace Wifi
 
@@ -1,8 +1,42 @@
+#ifndef PROJECTIO_NATIVE
 #include "esp_ha_lib.hpp"
 #include "nvs_control.hpp"
 #include "secrets.h"
+#include "target_benchmarks.hpp"
 #include "wifi.h"
+#endif
+#include "calibration.hpp"
+#include "capture.hpp"
+#include "charge_estimator.hpp"
+#include "connect_policy.hpp"
+#include "deferred_log.hpp"
+#include "endpoint.hpp"
+#ifdef PROJECTIO_NATIVE
+#include "host/entity.hpp"
+#include "host/replay.hpp"
+#endif
+#include "filter.hpp"
+#include "http.hpp"
+#include "mqtt_discovery.hpp"
+#include "payload.hpp"
+#include "raw_trace.hpp"
+#include "reading_ring.hpp"
+#include "report_policy.hpp"
+#include "sleep_policy.hpp"
+#include "spsc_queue.hpp"
+#include "trace.hpp"
+#include "ulp_model.hpp"
+#include "wake_cycle.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
 #include <gtest/gtest.h>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace BatteryMonitor
 {
@@ -19,6 +53,1321 @@ constexpr const char *TAG{"TESTING"};
 
 TEST(BatteryMonitorTest, DefaultTest) { EXPECT_TRUE(true); }
 
+TEST(FilterTest, MedianOddCount)
+{
+        std::array<int, 5> samples{9, 1, 5, 3, 7};
+        EXPECT_EQ(Filter::median(samples), 5);
+}
+
+TEST(FilterTest, MedianEvenCount)
+{
+        std::array<int, 4> samples{10, 2, 8, 4};
+        EXPECT_EQ(Filter::median(samples), 6);
+}
+
+TEST(FilterTest, MedianEmpty) { EXPECT_EQ(Filter::median({}), 0); }
+
+TEST(FilterTest, TrimmedMeanRejectsOutliers)
+{
+        std::array<int, 8> samples{2000, 2002, 4095, 1998, 0, 2001, 1999, 2000};
+        EXPECT_EQ(Filter::trimmed_mean(samples, 1), 2000);
+}
+
+TEST(FilterTest, TrimmedMeanRounds)
+{
+        std::array<int, 4> samples{1, 2, 2, 2};
+        EXPECT_EQ(Filter::trimmed_mean(samples, 0), 2);
+}
+
+TEST(FilterTest, TrimmedMeanClampsTrim)
+{
+        std::array<int, 3> samples{5, 100, 1};
+        EXPECT_EQ(Filter::trimmed_mean(samples, 10), 5);
+}
+
+TEST(ReadingRingTest, PushUntilFull)
+{
+        ReadingRing<3> ring{};
+        EXPECT_TRUE(ring.empty());
+        EXPECT_FALSE(ring.push({1, 12000}));
+        EXPECT_FALSE(ring.push({2, 12100}));
+        EXPECT_FALSE(ring.push({3, 12200}));
+        EXPECT_TRUE(ring.full());
+        EXPECT_EQ(ring[0].timestamp_s, 1);
+        EXPECT_EQ(ring.newest().timestamp_s, 3);
+}
+
+TEST(ReadingRingTest, WraparoundOverwritesOldest)
+{
+        ReadingRing<3> ring{};
+        for (int64_t t = 1; t <= 3; ++t) {
+                ring.push({t, 12000});
+        }
+        EXPECT_TRUE(ring.push({4, 12400}));
+        EXPECT_TRUE(ring.push({5, 12500}));
+        EXPECT_EQ(ring.size(), 3u);
+        EXPECT_EQ(ring[0].timestamp_s, 3);
+        EXPECT_EQ(ring[1].timestamp_s, 4);
+        EXPECT_EQ(ring[2].timestamp_s, 5);
+        EXPECT_EQ(ring.newest().millivolts, 12500);
+}
+
+TEST(ReadingRingTest, ClearAfterFlush)
+{
+        ReadingRing<3> ring{};
+        for (int64_t t = 1; t <= 5; ++t) {
+                ring.push({t, 12000});
+        }
+        ring.clear();
+        EXPECT_TRUE(ring.empty());
+        ring.push({6, 12600});
+        EXPECT_EQ(ring.size(), 1u);
+        EXPECT_EQ(ring[0].timestamp_s, 6);
+}
+
+TEST(PayloadTest, AppendReadings)
+{
+        std::array<char, 64> buffer;
+        ReadingRing<2> ring{};
+        Payload::Writer empty{buffer};
+        EXPECT_EQ(Payload::append_readings(empty, ring, 100).view(), "[]");
+        ring.push({40, 12050});
+        ring.push({100, 12601});
+        Payload::Writer writer{buffer};
+        EXPECT_EQ(Payload::append_readings(writer, ring, 100).view(), "[[60,12.050],[0,12.601]]");
+}
+
+TEST(PayloadTest, AppendFixed)
+{
+        std::array<char, 64> buffer;
+        Payload::Writer writer{buffer};
+        writer.append_fixed(12'345, 3).append(' ').append_fixed(7, 3).append(' ').append_fixed(-1'005, 2);
+        writer.append(' ').append_fixed(42, 0);
+        EXPECT_EQ(writer.view(), "12.345 0.007 -10.05 42");
+}
+
+TEST(PayloadTest, OverflowDropsTheRest)
+{
+        std::array<char, 8> buffer;
+        Payload::Writer writer{buffer};
+        writer.append("1234567");
+        EXPECT_EQ(writer.view(), "1234567");
+        writer.append("89").append('0');
+        EXPECT_TRUE(writer.overflowed());
+        EXPECT_EQ(writer.size(), 7u);
+        EXPECT_FALSE(writer.view());
+}
+
+TEST(TraceTest, PhaseDurations)
+{
+        Trace::CycleTrace trace{};
+        trace.timestamps_us = {1'000, 3'000, 10'000, 400'000, 401'000, 600'000, 650'000};
+        EXPECT_EQ(trace.duration_us(Trace::Phase::Sampled), 1'000);
+        EXPECT_EQ(trace.duration_us(Trace::Phase::GotIp), 390'000);
+        EXPECT_EQ(trace.duration_us(Trace::Phase::SleepStart), 50'000);
+        EXPECT_EQ(trace.awake_us(), 650'000);
+}
+
+TEST(TraceTest, SkippedPhasesHaveNoDuration)
+{
+        // A wake that only sampled and went back to sleep.
+        Trace::CycleTrace trace{};
+        trace.timestamps_us[static_cast<std::size_t>(Trace::Phase::Sampled)] = 2'000;
+        trace.timestamps_us[static_cast<std::size_t>(Trace::Phase::SleepStart)] = 2'500;
+        EXPECT_FALSE(trace.reached(Trace::Phase::GotIp));
+        EXPECT_EQ(trace.duration_us(Trace::Phase::GotIp), 0);
+        EXPECT_EQ(trace.duration_us(Trace::Phase::SleepStart), 500);
+        EXPECT_EQ(trace.awake_us(), 2'500);
+}
+
+TEST(TraceTest, EstimateCharge)
+{
+        Trace::CycleTrace trace{};
+        trace.timestamps_us[static_cast<std::size_t>(Trace::Phase::Sampled)] = 1'000;
+        trace.timestamps_us[static_cast<std::size_t>(Trace::Phase::SleepStart)] = 2'000;
+        Trace::CurrentModel model{};
+        model.phase_ua.fill(10'000);
+        SleepEnergyModel sleep_model{};
+        sleep_model.deep_sleep_ua = 10;
+        sleep_model.light_sleep_ua = 1'000;
+        // 2 ms at 10 mA = 20 uC, plus 1 s at 10 uA = 10 uC.
+        EXPECT_EQ(Trace::estimate_charge_uc(trace, model, sleep_model, SleepMode::Deep, 1'000'000), 30u);
+        // The same sleep at 1 mA is 1000 uC.
+        EXPECT_EQ(Trace::estimate_charge_uc(trace, model, sleep_model, SleepMode::Light, 1'000'000), 1'020u);
+}
+
+constexpr ConnectPolicy TEST_CONNECT_POLICY{
+    .attempt_timeout = std::chrono::seconds{3},
+    .initial_backoff = std::chrono::milliseconds{250},
+    .max_backoff = std::chrono::seconds{2},
+    .failures_before_skip = 3,
+    .initial_skip_wakes = 1,
+    .max_skip_wakes = 8,
+};
+
+TEST(ConnectPolicyTest, BackoffDoublesUpToTheCap)
+{
+        using std::chrono::milliseconds;
+        EXPECT_EQ(backoff_delay(TEST_CONNECT_POLICY, 1), milliseconds{250});
+        EXPECT_EQ(backoff_delay(TEST_CONNECT_POLICY, 2), milliseconds{500});
+        EXPECT_EQ(backoff_delay(TEST_CONNECT_POLICY, 4), milliseconds{2'000});
+        EXPECT_EQ(backoff_delay(TEST_CONNECT_POLICY, 1'000), milliseconds{2'000});
+}
+
+TEST(ConnectPolicyTest, GivesUpWhenAnAttemptNoLongerFits)
+{
+        using std::chrono::milliseconds;
+        // 8 s budget: the first attempt times out at 3 s, the retry after 250 ms fits, a third after 500 ms does not.
+        EXPECT_TRUE(fits_another_attempt(TEST_CONNECT_POLICY, 1, milliseconds{5'000}));
+        EXPECT_FALSE(fits_another_attempt(TEST_CONNECT_POLICY, 2, milliseconds{1'750}));
+        // Fast failures, e.g. a missing AP, leave room for more.
+        EXPECT_TRUE(fits_another_attempt(TEST_CONNECT_POLICY, 3, milliseconds{7'000}));
+}
+
+TEST(ConnectPolicyTest, SkipsGrowWhileFailingAndResetOnSuccess)
+{
+        ConnectState state{};
+        std::vector<int> skips;
+        for (int wake = 0; wake < 8; ++wake) {
+                record_connect(TEST_CONNECT_POLICY, state, false);
+                skips.push_back(state.wakes_to_skip);
+                state.wakes_to_skip = 0;
+        }
+        EXPECT_EQ(skips, (std::vector<int>{0, 0, 1, 2, 4, 8, 8, 8}));
+
+        state.wakes_to_skip = 2;
+        EXPECT_FALSE(take_connect_turn(state));
+        EXPECT_FALSE(take_connect_turn(state));
+        EXPECT_TRUE(take_connect_turn(state));
+        record_connect(TEST_CONNECT_POLICY, state, true);
+        EXPECT_EQ(state.consecutive_failures, 0);
+        EXPECT_EQ(state.wakes_to_skip, 0);
+}
+
+constexpr SleepPolicy TEST_SLEEP_POLICY{
+    .min_interval = std::chrono::seconds{30},
+    .base_interval = std::chrono::seconds{60},
+    .max_interval = std::chrono::seconds{600},
+    .alert_millivolts = 12'000,
+    .approach_millivolts = 300,
+    .stable_millivolts = 20,
+};
+
+TEST(SleepPolicyTest, PowerOnUsesBaseInterval)
+{
+        EXPECT_EQ(next_sleep_interval(TEST_SLEEP_POLICY, std::chrono::seconds{0}, 0, 12'600), std::chrono::seconds{60});
+}
+
+TEST(SleepPolicyTest, BacksOffWhileStable)
+{
+        std::chrono::seconds interval{60};
+        interval = next_sleep_interval(TEST_SLEEP_POLICY, interval, 12'600, 12'610);
+        EXPECT_EQ(interval, std::chrono::seconds{120});
+        for (int i = 0; i < 10; ++i) {
+                interval = next_sleep_interval(TEST_SLEEP_POLICY, interval, 12'600, 12'590);
+        }
+        EXPECT_EQ(interval, std::chrono::seconds{600});
+}
+
+TEST(SleepPolicyTest, TightensWhileFalling)
+{
+        EXPECT_EQ(next_sleep_interval(TEST_SLEEP_POLICY, std::chrono::seconds{600}, 12'600, 12'500),
+                  std::chrono::seconds{300});
+        // Falling within the approach margin of the alert threshold.
+        EXPECT_EQ(next_sleep_interval(TEST_SLEEP_POLICY, std::chrono::seconds{600}, 12'350, 12'250),
+                  std::chrono::seconds{30});
+        // At or below the alert threshold, even if stable.
+        EXPECT_EQ(next_sleep_interval(TEST_SLEEP_POLICY, std::chrono::seconds{600}, 11'900, 11'900),
+                  std::chrono::seconds{30});
+}
+
+TEST(SleepPolicyTest, RisingUsesBaseInterval)
+{
+        EXPECT_EQ(next_sleep_interval(TEST_SLEEP_POLICY, std::chrono::seconds{600}, 12'600, 13'800),
+                  std::chrono::seconds{60});
+}
+
+constexpr ReportPolicy TEST_REPORT_POLICY{
+    .hysteresis_millivolts = 50,
+    .alert_millivolts = 12'000,
+    .heartbeat_interval = std::chrono::seconds{3600},
+};
+
+// Run a scripted voltage sequence, one reading a minute, through the report decision and update the state the same
+// way a successful upload does. Returns the reason for every wake.
+template <std::size_t N> auto run_report_script(std::array<uint16_t, N> const &millivolts)
+{
+        std::array<ReportReason, N> reasons{};
+        ReportState state{};
+        for (std::size_t i = 0; i < N; ++i) {
+                Reading const reading{static_cast<int64_t>(i) * 60, millivolts[i]};
+                reasons[i] = report_reason(TEST_REPORT_POLICY, state, reading, false);
+                if (reasons[i] != ReportReason::None) {
+                        state = ReportState{true, reading.timestamp_s, reading.millivolts};
+                }
+        }
+        return reasons;
+}
+
+TEST(ReportPolicyTest, SteadyVoltageStaysRadioFree)
+{
+        auto const reasons = run_report_script(std::array<uint16_t, 5>{12'600, 12'610, 12'590, 12'620, 12'580});
+        EXPECT_EQ(reasons[0], ReportReason::PowerOn);
+        for (std::size_t i = 1; i < reasons.size(); ++i) {
+                EXPECT_EQ(reasons[i], ReportReason::None);
+        }
+}
+
+TEST(ReportPolicyTest, SlowDriftReportsOncePastHysteresis)
+{
+        // Drift is measured against the last report, not the last wake.
+        auto const reasons = run_report_script(std::array<uint16_t, 5>{12'600, 12'580, 12'560, 12'540, 12'530});
+        EXPECT_EQ(reasons[1], ReportReason::None);
+        EXPECT_EQ(reasons[2], ReportReason::None);
+        EXPECT_EQ(reasons[3], ReportReason::Delta);
+        EXPECT_EQ(reasons[4], ReportReason::None);
+}
+
+TEST(ReportPolicyTest, AlertCrossingReportsWithinHysteresis)
+{
+        auto const reasons = run_report_script(std::array<uint16_t, 4>{12'020, 12'000, 11'990, 12'010});
+        EXPECT_EQ(reasons[1], ReportReason::AlertCrossed);
+        EXPECT_EQ(reasons[2], ReportReason::None);
+        EXPECT_EQ(reasons[3], ReportReason::AlertCrossed);
+}
+
+TEST(ReportPolicyTest, HeartbeatAndFullBuffer)
+{
+        ReportState const state{true, 0, 12'600};
+        EXPECT_EQ(report_reason(TEST_REPORT_POLICY, state, {3599, 12'600}, false), ReportReason::None);
+        EXPECT_EQ(report_reason(TEST_REPORT_POLICY, state, {3600, 12'600}, false), ReportReason::Heartbeat);
+        EXPECT_EQ(report_reason(TEST_REPORT_POLICY, state, {60, 12'600}, true), ReportReason::BufferFull);
+}
+
+TEST(UlpModelTest, ReportWindow)
+{
+        auto const window = Ulp::report_window(TEST_REPORT_POLICY, 12'600);
+        EXPECT_EQ(window.low_millivolts, 12'550);
+        EXPECT_EQ(window.high_millivolts, 12'650);
+        // The alert threshold is inside the hysteresis: wake exactly when crossing it.
+        EXPECT_EQ(Ulp::report_window(TEST_REPORT_POLICY, 12'030).low_millivolts, 12'001);
+        EXPECT_EQ(Ulp::report_window(TEST_REPORT_POLICY, 11'980).high_millivolts, 12'000);
+}
+
+TEST(UlpModelTest, WakesWhenLeavingWindow)
+{
+        Ulp::Model ulp{};
+        ulp.data[Ulp::Layout::LOW_THRESHOLD] = 2'000;
+        ulp.data[Ulp::Layout::HIGH_THRESHOLD] = 2'100;
+        ulp.data[Ulp::Layout::HEARTBEAT_RUNS] = 100;
+        EXPECT_EQ(ulp.run({2'050, 2'050, 2'050, 2'050}), Ulp::WakeReason::None);
+        // One noisy read is averaged away.
+        EXPECT_EQ(ulp.run({1'900, 2'050, 2'050, 2'050}), Ulp::WakeReason::None);
+        EXPECT_EQ(ulp.run({1'990, 1'990, 1'990, 1'990}), Ulp::WakeReason::Window);
+        EXPECT_EQ(ulp.data[Ulp::Layout::WAKE_REASON], static_cast<uint16_t>(Ulp::WakeReason::Window));
+        EXPECT_EQ(ulp.data[Ulp::Layout::LAST_SAMPLE], 1'990);
+        EXPECT_EQ(ulp.run({2'101, 2'101, 2'101, 2'101}), Ulp::WakeReason::Window);
+}
+
+TEST(UlpModelTest, HeartbeatAndSampleRing)
+{
+        Ulp::Model ulp{};
+        ulp.data[Ulp::Layout::LOW_THRESHOLD] = 0;
+        ulp.data[Ulp::Layout::HIGH_THRESHOLD] = 4'095;
+        ulp.data[Ulp::Layout::HEARTBEAT_RUNS] = 10;
+        for (uint16_t run = 1; run < 10; ++run) {
+                EXPECT_EQ(ulp.run({run, run, run, run}), Ulp::WakeReason::None);
+        }
+        EXPECT_EQ(ulp.run({10, 10, 10, 10}), Ulp::WakeReason::Heartbeat);
+        EXPECT_EQ(ulp.data[Ulp::Layout::RUN_COUNTER], 0);
+        // Ten runs into an eight-entry ring: the next slot to write holds the oldest sample.
+        EXPECT_EQ(ulp.data[Ulp::Layout::SAMPLE_INDEX], 2);
+        EXPECT_EQ(ulp.data[Ulp::Layout::SAMPLES + 2], 3);
+        EXPECT_EQ(ulp.data[Ulp::Layout::SAMPLES + 1], 10);
+}
+
+constexpr Capture::Policy TEST_CAPTURE_POLICY{
+    .sample_rate_hz = 4'000,
+    .duration = std::chrono::seconds{2},
+    .step_millivolts = 300,
+    .dip_millivolts = 500,
+    .recovery_millivolts = 200,
+    .smoothing_samples = 4,
+};
+
+TEST(CaptureTest, Trigger)
+{
+        EXPECT_EQ(Capture::trigger(TEST_CAPTURE_POLICY, 0, 9'000, false), Capture::Trigger::None);
+        EXPECT_EQ(Capture::trigger(TEST_CAPTURE_POLICY, 12'600, 12'400, false), Capture::Trigger::None);
+        EXPECT_EQ(Capture::trigger(TEST_CAPTURE_POLICY, 12'600, 12'300, false), Capture::Trigger::Drop);
+        EXPECT_EQ(Capture::trigger(TEST_CAPTURE_POLICY, 12'600, 13'900, false), Capture::Trigger::Rise);
+        EXPECT_EQ(Capture::trigger(TEST_CAPTURE_POLICY, 12'600, 12'600, true), Capture::Trigger::External);
+}
+
+TEST(CaptureTest, CrankFeatures)
+{
+        // 100 ms at rest, 500 ms cranking with one noisy sample, then charging.
+        std::vector<uint16_t> samples(Capture::sample_count(TEST_CAPTURE_POLICY), 14'200);
+        std::fill_n(samples.begin(), 400, 12'600);
+        std::fill_n(samples.begin() + 400, 2'000, 9'600);
+        samples[1'000] = 8'000;
+        std::array<uint16_t, Capture::MAX_SAMPLES / 2> scratch;
+        auto const features = Capture::extract(TEST_CAPTURE_POLICY, Capture::Trigger::Drop, 12'600, samples, scratch);
+        EXPECT_EQ(features.samples, 8'000u);
+        // The noisy sample is smoothed into its neighbours.
+        EXPECT_EQ(features.min_millivolts, 9'200);
+        EXPECT_EQ(features.dip_ms, 500u);
+        ASSERT_TRUE(features.is_recovered);
+        EXPECT_EQ(features.recovery_ms, 350u);
+        EXPECT_EQ(features.settled_millivolts, 14'200);
+        EXPECT_EQ(features.ripple_millivolts, 0);
+}
+
+TEST(CaptureTest, ChargingRipple)
+{
+        std::vector<uint16_t> samples(Capture::sample_count(TEST_CAPTURE_POLICY));
+        for (std::size_t i = 0; i < samples.size(); ++i) {
+                samples[i] = i % 2 == 0 ? 14'180 : 14'220;
+        }
+        std::array<uint16_t, Capture::MAX_SAMPLES / 2> scratch;
+        auto const features = Capture::extract(TEST_CAPTURE_POLICY, Capture::Trigger::Rise, 12'600, samples, scratch);
+        EXPECT_EQ(features.min_millivolts, 14'200);
+        EXPECT_EQ(features.dip_ms, 0u);
+        EXPECT_EQ(features.settled_millivolts, 14'200);
+        EXPECT_EQ(features.ripple_millivolts, 40);
+        EXPECT_EQ(features.ripple_rms_millivolts, 20);
+}
+
+constexpr Charge::Policy TEST_CHARGE_POLICY{
+    .charging_millivolts = 13'300,
+    .rest_delay = std::chrono::hours{2},
+    .temperature_microvolts_per_degree = 1'200,
+    .cutoff_millivolts = 12'000,
+    .drain_window = std::chrono::hours{4},
+};
+
+TEST(ChargeEstimatorTest, SocCurve)
+{
+        EXPECT_EQ(Charge::soc_percent(10'500), 0);
+        EXPECT_EQ(Charge::soc_percent(11'310), 0);
+        EXPECT_EQ(Charge::soc_percent(12'100), 50);
+        EXPECT_EQ(Charge::soc_percent(12'170), 55);
+        EXPECT_EQ(Charge::soc_percent(12'730), 100);
+        EXPECT_EQ(Charge::soc_percent(13'000), 100);
+}
+
+TEST(ChargeEstimatorTest, TracksDrainOfSyntheticDischarge)
+{
+        // Two days parked at 1.5 mV/h from 12.60 V with +-4 mV of noise, read every 10 minutes at 25 C.
+        Charge::EstimatorState state{};
+        int64_t now_s{1'000};
+        for (int i = 0; i < 6 * 48; ++i) {
+                auto const noise = (i * 7919) % 9 - 4;
+                auto const millivolts = 12'600 - 1.5 * static_cast<double>(now_s - 1'000) / 3600 + noise;
+                Reading const reading{now_s, static_cast<uint16_t>(std::lround(millivolts))};
+                Charge::update(state, TEST_CHARGE_POLICY, reading, 2'500);
+                now_s += 600;
+        }
+        now_s -= 600;
+        auto const estimate = Charge::estimate(state, TEST_CHARGE_POLICY, now_s);
+        ASSERT_TRUE(estimate);
+        ASSERT_TRUE(estimate->drain_millivolts_per_hour);
+        EXPECT_NEAR(*estimate->drain_millivolts_per_hour, 1.5, 0.05);
+        EXPECT_NEAR(estimate->resting_millivolts, 12'528, 2);
+        EXPECT_LT(estimate->noise_millivolts, 4.f);
+        ASSERT_TRUE(estimate->hours_to_cutoff);
+        EXPECT_NEAR(*estimate->hours_to_cutoff, 528 / 1.5, 3);
+        EXPECT_FALSE(estimate->hours_since_charge);
+}
+
+TEST(ChargeEstimatorTest, ChargingRestartsAfterSurfaceCharge)
+{
+        Charge::EstimatorState state{};
+        Charge::update(state, TEST_CHARGE_POLICY, {0, 12'300}, 2'500);
+        EXPECT_TRUE(Charge::estimate(state, TEST_CHARGE_POLICY, 0));
+
+        // Driving, then surface charge: nothing to estimate yet.
+        Charge::update(state, TEST_CHARGE_POLICY, {3'600, 14'200}, 2'500);
+        EXPECT_FALSE(Charge::estimate(state, TEST_CHARGE_POLICY, 3'600));
+        Charge::update(state, TEST_CHARGE_POLICY, {7'200, 12'900}, 2'500);
+        EXPECT_FALSE(Charge::estimate(state, TEST_CHARGE_POLICY, 7'200));
+
+        // Rested, at 5 C: the reading is lifted by 24 mV to what it would be at 25 C.
+        Charge::update(state, TEST_CHARGE_POLICY, {3'600 * 4, 12'596}, 500);
+        auto const estimate = Charge::estimate(state, TEST_CHARGE_POLICY, 3'600 * 4);
+        ASSERT_TRUE(estimate);
+        EXPECT_EQ(estimate->resting_millivolts, 12'620);
+        EXPECT_EQ(estimate->soc_percent, 90);
+        EXPECT_FALSE(estimate->drain_millivolts_per_hour);
+        ASSERT_TRUE(estimate->hours_since_charge);
+        EXPECT_FLOAT_EQ(*estimate->hours_since_charge, 3.f);
+        EXPECT_EQ(estimate->charged_millivolts, 12'620);
+}
+
+TEST(ChargeEstimatorTest, ChargeAtTimeZeroCounts)
+{
+        // The clock starts at zero on power-on, which can be while the car is running.
+        Charge::EstimatorState state{};
+        Charge::update(state, TEST_CHARGE_POLICY, {0, 14'200}, 2'500);
+        Charge::update(state, TEST_CHARGE_POLICY, {3'600, 12'900}, 2'500);
+        EXPECT_FALSE(Charge::estimate(state, TEST_CHARGE_POLICY, 3'600));
+        Charge::update(state, TEST_CHARGE_POLICY, {3'600 * 3, 12'620}, 2'500);
+        auto const estimate = Charge::estimate(state, TEST_CHARGE_POLICY, 3'600 * 3);
+        ASSERT_TRUE(estimate);
+        ASSERT_TRUE(estimate->hours_since_charge);
+        EXPECT_FLOAT_EQ(*estimate->hours_since_charge, 3.f);
+}
+
+TEST(ArenaTest, AllocatesAlignedUntilFullAndReleasesScopes)
+{
+        alignas(8) std::array<std::byte, 64> buffer;
+        Arena arena{buffer};
+        EXPECT_EQ(arena.allocate<char>(3).size(), 3u);
+        {
+                ArenaScope const scope{arena};
+                auto const words = arena.allocate<uint64_t>(4);
+                ASSERT_EQ(words.size(), 4u);
+                EXPECT_EQ(reinterpret_cast<uintptr_t>(words.data()) % alignof(uint64_t), 0u);
+                EXPECT_EQ(arena.mark(), 40u);
+                EXPECT_TRUE(arena.allocate<char>(25).empty());
+                EXPECT_EQ(arena.allocate<char>(24).size(), 24u);
+        }
+        EXPECT_EQ(arena.mark(), 3u);
+        EXPECT_EQ(arena.peak(), 64u);
+        arena.reset();
+        EXPECT_EQ(arena.allocate<char>(64).size(), 64u);
+}
+
+TEST(SleepPolicyTest, TimerIsAnchoredToWakeStart)
+{
+        using namespace std::chrono_literals;
+        EXPECT_EQ(sleep_timer(60s, 2'500ms, 100ms), 57'500ms);
+        EXPECT_EQ(sleep_timer(30s, 31s, 100ms), 100ms);
+}
+
+TEST(SleepModeTest, CrossoverFollowsTheUploadShare)
+{
+        using namespace std::chrono_literals;
+        auto const &model = WAKE_CONFIG.sleep_energy_model;
+        // Every wake uploads: light sleep saves the boot and the association, about 105 mC, for 1.485 mA more.
+        EXPECT_EQ(sleep_crossover(model, 1000), 70s);
+        EXPECT_EQ(select_sleep_mode(model, 69s, 1000), SleepMode::Light);
+        EXPECT_EQ(select_sleep_mode(model, 71s, 1000), SleepMode::Deep);
+        EXPECT_EQ(cycle_charge_uc(model, SleepMode::Deep, 60s, 1000), 150'879u);
+        // Wakes that only sample are cheap either way, so deep sleep wins at any useful interval.
+        EXPECT_EQ(sleep_crossover(model, 0), 3s);
+        EXPECT_EQ(select_sleep_mode(model, WAKE_CONFIG.sleep_policy.min_interval, 0), SleepMode::Deep);
+
+        auto no_sleep_saving = model;
+        no_sleep_saving.light_sleep_ua = model.deep_sleep_ua;
+        EXPECT_EQ(select_sleep_mode(no_sleep_saving, 1h, 0), SleepMode::Light);
+        auto no_wake_saving = model;
+        no_wake_saving.cold_wake = model.light_wake;
+        no_wake_saving.associate = {};
+        EXPECT_EQ(sleep_crossover(no_wake_saving, 1000), 0s);
+}
+
+TEST(SleepModeTest, UploadShareTracksRecentWakes)
+{
+        using namespace std::chrono_literals;
+        WakeState state{};
+        EXPECT_EQ(choose_sleep_mode(state, WAKE_CONFIG, 60s, true), SleepMode::Deep);
+        EXPECT_EQ(state.upload_permille, 125);
+        for (int i = 0; i < 40; ++i) {
+                choose_sleep_mode(state, WAKE_CONFIG, 60s, true);
+        }
+        EXPECT_EQ(state.upload_permille, 1000);
+        EXPECT_EQ(state.sleep_mode, SleepMode::Light);
+        EXPECT_EQ(state.sleep_charge_uc,
+                  cycle_charge_uc(WAKE_CONFIG.sleep_energy_model, SleepMode::Light, 60s, state.upload_permille));
+        for (int i = 0; i < 60; ++i) {
+                choose_sleep_mode(state, WAKE_CONFIG, 60s, false);
+        }
+        EXPECT_EQ(state.upload_permille, 0);
+        EXPECT_EQ(state.sleep_mode, SleepMode::Deep);
+}
+
+TEST(SpscQueueTest, FullAndEmpty)
+{
+        SpscQueue<Reading, 4> queue;
+        EXPECT_FALSE(queue.pop());
+        for (int64_t i = 0; i < 4; ++i) {
+                EXPECT_TRUE(queue.push({i, 12'000}));
+        }
+        EXPECT_FALSE(queue.push({4, 12'000}));
+        EXPECT_EQ(queue.pop()->timestamp_s, 0);
+
+        // Wraps around the end of the slots.
+        EXPECT_TRUE(queue.push({4, 12'000}));
+        std::array<Reading, 8> batch;
+        ASSERT_EQ(queue.pop_batch(batch), 4u);
+        for (int64_t i = 0; i < 4; ++i) {
+                EXPECT_EQ(batch[i].timestamp_s, i + 1);
+        }
+        EXPECT_EQ(queue.size(), 0u);
+}
+
+TEST(SpscQueueTest, ThreadsTransferEveryRecordInOrder)
+{
+        // A record whose fields must always agree, to catch a slot read while it is being written.
+        struct Record {
+                uint32_t sequence;
+                uint32_t check;
+        };
+        constexpr uint32_t RECORDS{200'000};
+        SpscQueue<Record, 16> queue;
+
+        std::thread producer{[&queue] {
+                for (uint32_t i = 0; i < RECORDS; ++i) {
+                        while (!queue.push({i, ~i})) {
+                                std::this_thread::yield();
+                        }
+                }
+        }};
+        uint32_t expected{0};
+        uint32_t torn{0};
+        std::array<Record, 5> batch;
+        while (expected < RECORDS) {
+                auto const count = queue.pop_batch(batch);
+                if (count == 0) {
+                        std::this_thread::yield();
+                }
+                for (std::size_t i = 0; i < count; ++i, ++expected) {
+                        ASSERT_EQ(batch[i].sequence, expected);
+                        torn += batch[i].check != ~batch[i].sequence ? 1 : 0;
+                }
+        }
+        producer.join();
+        EXPECT_EQ(torn, 0u);
+        EXPECT_EQ(queue.size(), 0u);
+}
+
+// The text of every record in the deferred log, oldest first.
+std::vector<std::string> deferred_log_lines()
+{
+        std::vector<std::string> lines;
+        Log::for_each_record([&lines](Log::Record const &record) {
+                char const *tag{nullptr};
+                auto const *const format = Log::find_format(record.id, &tag);
+                std::array<char, 128> text{};
+                Log::render(format ? format : "?", record.args, text);
+                lines.emplace_back(text.data());
+        });
+        return lines;
+}
+
+TEST(DeferredLogTest, RendersTheArgumentsBack)
+{
+        Log::clear();
+        Log::begin_wake();
+        DLOGI(TAG, "%d %u %s %.2f %lld %5.1f%% %02x", -5, 4'000'000'000u, "text", 3.14159, -1'234'567'890'123LL, 2.5f,
+              uint8_t{10});
+        DLOGD(TAG, "|%-4d|%*d|%.*s|%c", 7, 4, 42, 3, "abcdef", 'z');
+
+        auto const lines = deferred_log_lines();
+        ASSERT_EQ(lines.size(), 2u);
+        EXPECT_EQ(lines[0], "-5 4000000000 text 3.14 -1234567890123   2.5% 0a");
+        EXPECT_EQ(lines[1], "|7   |  42|abc|z");
+        char const *tag{nullptr};
+        EXPECT_STREQ(Log::find_format(Log::format_id(TAG, "%d"), &tag), nullptr);
+}
+
+TEST(DeferredLogTest, FullRingDropsWholeOldestRecords)
+{
+        Log::clear();
+        Log::begin_wake();
+        for (uint32_t i = 0; i < 200; ++i) {
+                DLOGI(TAG, "Record %u of %s.", static_cast<unsigned>(i), "many");
+        }
+
+        auto const lines = deferred_log_lines();
+        // 12 header bytes, 5 for the number and 6 for the string.
+        EXPECT_EQ(lines.size(), Log::RING_BYTES / 23);
+        for (std::size_t i = 0; i < lines.size(); ++i) {
+                EXPECT_EQ(lines[i], "Record " + std::to_string(200 - lines.size() + i) + " of many.");
+        }
+        Log::clear();
+        EXPECT_TRUE(deferred_log_lines().empty());
+}
+
+TEST(EndpointTest, ParsesSchemeHostAndPort)
+{
+        static_assert(Net::parse_endpoint("http://hassio.local:8123")->port == 8123);
+        auto const endpoint = Net::parse_endpoint("https://ha.example.com/api");
+        ASSERT_TRUE(endpoint);
+        EXPECT_TRUE(endpoint->is_tls);
+        EXPECT_EQ(endpoint->host, "ha.example.com");
+        EXPECT_EQ(endpoint->port, 443);
+        EXPECT_FALSE(Net::parse_endpoint("ftp://ha.local"));
+        EXPECT_FALSE(Net::parse_endpoint("http://ha.local:70000"));
+        EXPECT_FALSE(Net::parse_endpoint("http://:8123"));
+}
+
+TEST(EndpointTest, CachesExpireAndBelongToOneHost)
+{
+        Net::DnsCache dns{};
+        EXPECT_FALSE(Net::lookup(dns, "ha.local", 0));
+        Net::store(dns, "ha.local", 0x0100'a8c0, 1000, std::chrono::seconds{60});
+        EXPECT_EQ(Net::lookup(dns, "ha.local", 1059), 0x0100'a8c0u);
+        EXPECT_FALSE(Net::lookup(dns, "ha.local", 1060));
+        EXPECT_FALSE(Net::lookup(dns, "ha.local", 999));
+        EXPECT_FALSE(Net::lookup(dns, "other.local", 1000));
+        Net::forget(dns);
+        EXPECT_FALSE(Net::lookup(dns, "ha.local", 1000));
+
+        Net::TlsSessionCache<> session{};
+        std::array<uint8_t, 3> const bytes{1, 2, 3};
+        ASSERT_TRUE(Net::store(session, "ha.local", bytes, 1000, std::chrono::hours{1}));
+        auto const saved = Net::lookup(session, "ha.local", 1000);
+        EXPECT_TRUE(std::equal(saved.begin(), saved.end(), bytes.begin(), bytes.end()));
+        std::vector<uint8_t> const too_big(Net::TLS_SESSION_BYTES + 1);
+        EXPECT_FALSE(Net::store(session, "ha.local", too_big, 1000, std::chrono::hours{1}));
+        EXPECT_TRUE(Net::lookup(session, "ha.local", 1000).empty());
+}
+
+TEST(HttpTest, AppendPost)
+{
+        std::array<char, 256> buffer;
+        Payload::Writer writer{buffer};
+        Http::append_post(writer, "ha.local:8123", "/api/states/", "sensor.car_battery", "Bearer t", 17);
+        EXPECT_EQ(writer.view(), "POST /api/states/sensor.car_battery HTTP/1.1\r\nHost: ha.local:8123\r\n"
+                                 "Authorization: Bearer t\r\nContent-Type: application/json\r\nContent-Length: 17\r\n"
+                                 "Connection: keep-alive\r\n\r\n");
+}
+
+TEST(HttpTest, ReadsResponsesFedInPieces)
+{
+        std::string_view const responses{"HTTP/1.1 201 Created\r\ncontent-length: 4\r\n\r\n{}\r\n"
+                                         "HTTP/1.1 400 Bad Request\r\nCONNECTION: Close\r\nContent-Length: 0\r\n\r\n"};
+        Http::ResponseReader first;
+        std::size_t offset{0};
+        while (!first.is_done() && !first.is_failed()) {
+                offset += first.feed(responses.substr(offset, 5));
+        }
+        EXPECT_EQ(first.status(), 201);
+        EXPECT_FALSE(first.is_closing());
+
+        Http::ResponseReader second;
+        EXPECT_EQ(second.feed(responses.substr(offset)), responses.size() - offset);
+        EXPECT_TRUE(second.is_done());
+        EXPECT_EQ(second.status(), 400);
+        EXPECT_TRUE(second.is_closing());
+
+        Http::ResponseReader malformed;
+        malformed.feed(std::string_view{"HTTP/1.1 OK\r\n\r\n"});
+        EXPECT_TRUE(malformed.is_failed());
+}
+
+#ifdef PROJECTIO_NATIVE
+TEST(EntityTest, ToJsonEscapesStrings)
+{
+        Entity entity;
+        entity.entity_id = "sensor.car_battery";
+        entity.state = "12.6";
+        entity.add_attribute("friendly_name", "Car \"Battery\"");
+        entity.add_attribute("readings", "[[0,12.600]]\n");
+        EXPECT_EQ(to_json(entity),
+                  R"({"state":"12.6","attributes":{"friendly_name":"Car \"Battery\"","readings":"[[0,12.600]]\n"}})");
+}
+#endif
+
+class FakeAdc final : public Hal::Adc
+{
+      public:
+        bool read_millivolts(std::span<uint8_t const> const channels, std::span<int32_t> const pin_millivolts) override
+        {
+                ++read_count;
+                for (std::size_t i = 0; i < channels.size(); ++i) {
+                        pin_millivolts[i] = channels[i] == Sensors::REGISTRY[Sensors::BATTERY].adc_channel
+                                                ? battery_pin_millivolts
+                                                : temperature_pin_millivolts;
+                }
+                return is_working;
+        }
+        // A crank: the resting pin voltage, 500 ms at 9.5 V, then the alternator at 14.2 V.
+        std::size_t capture_millivolts(uint8_t, uint32_t const sample_rate_hz,
+                                       std::span<uint16_t> const pin_millivolts) override
+        {
+                ++capture_count;
+                for (std::size_t i = 0; i < pin_millivolts.size(); ++i) {
+                        auto const ms = i * 1000 / sample_rate_hz;
+                        pin_millivolts[i] =
+                            static_cast<uint16_t>(ms < 100 ? battery_pin_millivolts : ms < 600 ? 1'893 : 2'829);
+                }
+                return is_working ? pin_millivolts.size() : 0;
+        }
+        // 12.600 V through the divider, and 25 C.
+        int32_t battery_pin_millivolts{2'510};
+        int32_t temperature_pin_millivolts{750};
+        bool is_working{true};
+        int read_count{0};
+        int capture_count{0};
+};
+
+class FakeClock final : public Hal::Clock
+{
+      public:
+        int64_t now_s() override { return seconds; }
+        int64_t seconds{1'000};
+};
+
+class FakeNetwork final : public Hal::Network
+{
+      public:
+        bool connect(std::chrono::milliseconds) override
+        {
+                ++connect_count;
+                return is_up;
+        }
+        void disconnect() override {}
+        std::optional<int8_t> rssi() override { return -61; }
+        bool is_up{true};
+        int connect_count{0};
+};
+
+class FakeUploader final : public Hal::Uploader
+{
+      public:
+        bool post(std::string_view const entity_id, std::string_view const body) override
+        {
+                posted.emplace_back(entity_id, body);
+                ++upload_stats.posts;
+                upload_stats.bytes_sent += static_cast<uint32_t>(body.size());
+                return is_accepting;
+        }
+        bool fire_event(std::string_view const event_type, std::string_view const body) override
+        {
+                events.emplace_back(event_type, body);
+                ++upload_stats.posts;
+                return is_accepting;
+        }
+        void close() override { ++close_count; }
+        Hal::UploadStats const &stats() const override { return upload_stats; }
+
+        std::vector<std::pair<std::string, std::string>> posted;
+        std::vector<std::pair<std::string, std::string>> events;
+        bool is_accepting{true};
+        int close_count{0};
+        Hal::UploadStats upload_stats{};
+};
+
+class FakeSleeper final : public Hal::Sleeper
+{
+      public:
+        void sleep(std::chrono::seconds, SleepMode) override {}
+};
+
+// Four sectors of NOR flash.
+class FakeFlash final : public Hal::Flash
+{
+      public:
+        std::size_t size() const override { return bytes.size(); }
+        bool read(std::size_t const offset, std::span<uint8_t> const data) override
+        {
+                std::copy_n(bytes.begin() + static_cast<std::ptrdiff_t>(offset), data.size(), data.begin());
+                return true;
+        }
+        bool write(std::size_t const offset, std::span<uint8_t const> const data) override
+        {
+                for (std::size_t i = 0; i < data.size(); ++i) {
+                        bytes[offset + i] &= data[i];
+                }
+                return true;
+        }
+        bool erase_sector(std::size_t const offset) override
+        {
+                std::fill_n(bytes.begin() + static_cast<std::ptrdiff_t>(offset), SECTOR_SIZE, 0xff);
+                ++erase_count;
+                return true;
+        }
+
+        std::vector<uint8_t> bytes = std::vector<uint8_t>(4 * SECTOR_SIZE, 0xff);
+        int erase_count{0};
+};
+
+// A reading a minute, drifting down a millivolt at a time.
+std::vector<Reading> make_readings(std::size_t const count, int64_t const start_s = 1'700'000'000)
+{
+        std::vector<Reading> readings;
+        for (std::size_t i = 0; i < count; ++i) {
+                readings.push_back({start_s + static_cast<int64_t>(i) * 60, static_cast<uint16_t>(12'600 - i % 100)});
+        }
+        return readings;
+}
+
+TEST(SensorsTest, Conversions)
+{
+        EXPECT_EQ(Sensors::battery_millivolts(2'510), 12'600);
+        EXPECT_EQ(Sensors::tmp235_centidegrees(750), 2'500);
+        EXPECT_EQ(Sensors::tmp235_centidegrees(400), -1'000);
+        EXPECT_EQ(Sensors::ADC_CHANNELS, (std::array<uint8_t, 2>{3, 4}));
+}
+
+TEST(SensorsTest, AppendStateOmitsEmptyAttributes)
+{
+        std::array<char, SENSOR_PAYLOAD_SIZE> buffer;
+        Payload::Writer writer{buffer};
+        Sensors::append_state(writer, Sensors::REGISTRY[3], 42);
+        EXPECT_EQ(writer.view(), R"({"state":"42","attributes":{"friendly_name":"Battery Monitor Wakes"}})");
+}
+
+// Models of the driver's calibration schemes at 11 dB, with the driver's integer truncation.
+// ESP32 line fitting: a line from the eFuse Vref that bends up above raw 2880, where the driver blends in its LUT.
+std::optional<int> esp32_line_fitting(int const raw)
+{
+        int64_t const bend = raw > 2'880 ? int64_t{raw - 2'880} * (raw - 2'880) * 64 : 0;
+        return static_cast<int>((int64_t{61'630} * raw + bend + 32'768) / 65'536) + 142;
+}
+
+// ESP32-C3 curve fitting: a line from the eFuse calibration point, minus a polynomial error term.
+std::optional<int> esp32c3_curve_fitting(int const raw)
+{
+        int64_t const linear = int64_t{raw} * 2'900 / 3'960;
+        int64_t const error = (-3'000'000'000 + linear * -3'964'000 + linear * linear * 1'234) / 1'000'000'000;
+        return static_cast<int>(linear - error);
+}
+
+template <typename Model> int max_table_error(Model model)
+{
+        auto const table = Calibration::build_table(model);
+        if (!table) {
+                return std::numeric_limits<int>::max();
+        }
+        int max_error{0};
+        for (int raw = 0; raw <= Calibration::AdcTable::MAX_RAW; ++raw) {
+                max_error = std::max(max_error, std::abs(Calibration::to_millivolts(*table, raw) - *model(raw)));
+        }
+        return max_error;
+}
+
+TEST(CalibrationTest, TableMatchesDriverWithinOneMillivolt)
+{
+        EXPECT_LE(max_table_error(esp32_line_fitting), 1);
+        EXPECT_LE(max_table_error(esp32c3_curve_fitting), 1);
+}
+
+TEST(CalibrationTest, ToRawInvertsToMillivolts)
+{
+        auto const table = *Calibration::build_table(esp32_line_fitting);
+        for (int32_t millivolts = 200; millivolts < 3'000; millivolts += 7) {
+                auto const raw = Calibration::to_raw(table, millivolts);
+                EXPECT_GE(Calibration::to_millivolts(table, raw), millivolts);
+                EXPECT_LT(Calibration::to_millivolts(table, raw - 1), millivolts);
+        }
+        EXPECT_EQ(Calibration::to_raw(table, 0), 0);
+        EXPECT_EQ(Calibration::to_raw(table, 10'000), Calibration::AdcTable::MAX_RAW);
+        // A driver failure leaves no table.
+        EXPECT_FALSE(Calibration::build_table([](int) -> std::optional<int> { return std::nullopt; }));
+}
+
+TEST(SensorsTest, FieldCalibratedDivider)
+{
+        // This unit reads 50 mV low at rest and 20 mV high while charging.
+        auto const resting_pin = Sensors::battery_pin_millivolts(12'450);
+        auto const charging_pin = Sensors::battery_pin_millivolts(14'220);
+        auto const divider = Sensors::field_calibrated_divider({14'220, 14'200}, {12'450, 12'500});
+        ASSERT_TRUE(divider.has_value());
+
+        // Pin voltages are whole millivolts, so a few millivolts of error remain at the battery.
+        Sensors::set_battery_divider(*divider);
+        EXPECT_NEAR(Sensors::battery_millivolts(resting_pin), 12'500, 3);
+        EXPECT_NEAR(Sensors::battery_millivolts(charging_pin), 14'200, 3);
+        EXPECT_NEAR(Sensors::battery_millivolts(Sensors::battery_pin_millivolts(13'000)), 13'000, 3);
+        Sensors::set_battery_divider(Sensors::NOMINAL_BATTERY_DIVIDER);
+
+        EXPECT_FALSE(Sensors::field_calibrated_divider({12'450, 12'500}, {12'600, 12'640}));
+}
+
+TEST(RawTraceTest, CalibrationAndSamplesRoundTrip)
+{
+        RawTrace::UnitCalibration const calibration{*Calibration::build_table(esp32_line_fitting), {330'000, -12}};
+        std::array<char, RawTrace::MAX_LINE_BYTES> buffer;
+        Payload::Writer calibration_writer{buffer};
+        auto const calibration_line = RawTrace::append_calibration(calibration_writer, calibration).view();
+        ASSERT_TRUE(calibration_line.has_value());
+        // A timestamp from the serial monitor is skipped.
+        auto const parsed = RawTrace::parse_calibration("12:00:01.123 > " + std::string{*calibration_line} + "\r\n");
+        ASSERT_TRUE(parsed.has_value());
+        EXPECT_EQ(parsed->table.millivolts, calibration.table.millivolts);
+        EXPECT_EQ(parsed->divider.gain_q16, 330'000);
+        EXPECT_EQ(parsed->divider.offset_millivolts, -12);
+
+        std::array<int, 1> const battery{2'480};
+        std::array<int, 1> const temperature{1'012};
+        std::array<std::span<int const>, Sensors::ADC_SENSOR_COUNT> const bursts{battery, temperature};
+        Payload::Writer sample_writer{buffer};
+        EXPECT_EQ(RawTrace::append_sample(sample_writer, 1'700'000'000, bursts).view(),
+                  "raw.sample=1700000000 2480 1012");
+        auto const sample = RawTrace::parse_sample("raw.sample=1700000000 2480 1012\n");
+        ASSERT_TRUE(sample.has_value());
+        EXPECT_EQ(sample->timestamp_s, 1'700'000'000);
+        EXPECT_EQ(sample->raw[0], 2'480);
+        EXPECT_EQ(sample->raw[1], 1'012);
+
+        EXPECT_FALSE(RawTrace::parse_sample("raw.sample=1700000000 2480"));
+        EXPECT_FALSE(RawTrace::parse_sample("raw.sample=1700000000 2480 1012 7"));
+        EXPECT_FALSE(RawTrace::parse_sample("raw.sample=1700000000 4096 1012"));
+        EXPECT_FALSE(RawTrace::parse_sample("raw.sample=1700000000 24x0 1012"));
+        EXPECT_FALSE(RawTrace::parse_calibration("raw.calibration=330000 0 1 2 3"));
+        EXPECT_FALSE(RawTrace::parse_sample("dlog.record=00000000 1 2 0"));
+}
+
+TEST(RawTraceTest, BurstsAreFilteredLikeTheBoard)
+{
+        // A full read with a few spikes, which the board's trim removes.
+        std::array<int, Filter::READ_SAMPLES> burst{};
+        for (std::size_t i = 0; i < burst.size(); ++i) {
+                burst[i] = 2'000 + static_cast<int>(i % 5);
+        }
+        burst[3] = 4'095;
+        burst[40] = 0;
+        std::array<int, 1> const temperature{1'012};
+        std::array<std::span<int const>, Sensors::ADC_SENSOR_COUNT> const bursts{burst, temperature};
+        std::array<char, RawTrace::MAX_LINE_BYTES> buffer;
+        Payload::Writer writer{buffer};
+        auto const line = RawTrace::append_sample(writer, 1'700'000'000, bursts).view();
+        ASSERT_TRUE(line.has_value());
+
+        auto const sample = RawTrace::parse_sample(*line);
+        ASSERT_TRUE(sample.has_value());
+        EXPECT_EQ(sample->raw[0], Filter::trimmed_mean(burst, Filter::READ_TRIM));
+        EXPECT_EQ(sample->raw[0], 2'002);
+        EXPECT_EQ(sample->raw[1], 1'012);
+}
+
+#ifdef PROJECTIO_NATIVE
+// A change to conversion, filtering or report decisions shows up as drift from the golden file. If the change is
+// intended, regenerate it with `pio run -e host -t exec -a "--replay test/data/replay_day.trace --write-golden
+// test/data/replay_day.golden"`.
+TEST(ReplayTest, DayTraceMatchesGolden)
+{
+        auto const data = std::filesystem::path{__FILE__}.parent_path() / "data";
+        EXPECT_TRUE(
+            Host::run_replay((data / "replay_day.trace").c_str(), (data / "replay_day.golden").c_str(), nullptr));
+}
+#endif
+
+TEST(ReadingLogTest, RoundTripAndRemount)
+{
+        FakeFlash flash;
+        LogCursor cursor{};
+        ReadingLog log{flash, cursor};
+        auto const written = make_readings(200);
+        ASSERT_TRUE(log.append(written));
+        EXPECT_EQ(log.pending(), 200u);
+        // Deltas of a minute and a millivolt take 4 bytes with the tag and CRC.
+        EXPECT_LT(cursor.write.offset, ReadingLog::HEADER_SIZE + 200 * 5);
+
+        std::array<Reading, 128> chunk;
+        LogPosition next;
+        ASSERT_EQ(log.read(chunk, next), 128u);
+        EXPECT_TRUE(std::equal(chunk.begin(), chunk.end(), written.begin()));
+        ASSERT_TRUE(log.mark_uploaded(next, 128));
+        EXPECT_EQ(log.pending(), 72u);
+
+        // After power-on the cursor is rebuilt from the flash, from the last uploaded marker.
+        LogCursor remounted{};
+        ReadingLog remounted_log{flash, remounted};
+        EXPECT_EQ(remounted_log.pending(), 72u);
+        ASSERT_EQ(remounted_log.read(chunk, next), 72u);
+        EXPECT_TRUE(std::equal(chunk.begin(), chunk.begin() + 72, written.begin() + 128));
+        ASSERT_TRUE(remounted_log.mark_uploaded(next, 72));
+        EXPECT_EQ(remounted_log.read(chunk, next), 0u);
+        EXPECT_EQ(remounted_log.pending(), 0u);
+}
+
+TEST(ReadingLogTest, FullLogDropsOldestSector)
+{
+        FakeFlash flash;
+        LogCursor cursor{};
+        ReadingLog log{flash, cursor};
+        // About three sectors' worth per pass, so every sector is erased as the log wraps.
+        auto const written = make_readings(10'000);
+        for (std::size_t i = 0; i < written.size(); i += 64) {
+                ASSERT_TRUE(log.append(std::span{written}.subspan(i, std::min<std::size_t>(64, written.size() - i))));
+        }
+        EXPECT_GT(cursor.dropped, 0u);
+        EXPECT_EQ(log.pending() + cursor.dropped, written.size());
+
+        std::vector<Reading> read_back;
+        std::array<Reading, 128> chunk;
+        LogPosition next;
+        while (auto const count = log.read(chunk, next)) {
+                read_back.insert(read_back.end(), chunk.begin(), chunk.begin() + static_cast<std::ptrdiff_t>(count));
+                log.mark_uploaded(next, count);
+        }
+        ASSERT_EQ(read_back.size(), written.size() - cursor.dropped);
+        EXPECT_TRUE(std::equal(read_back.begin(), read_back.end(),
+                               written.end() - static_cast<std::ptrdiff_t>(read_back.size())));
+}
+
+TEST(ReadingLogTest, TornRecordIsSkipped)
+{
+        FakeFlash flash;
+        LogCursor cursor{};
+        ReadingLog log{flash, cursor};
+        auto const written = make_readings(10);
+        ASSERT_TRUE(log.append(written));
+        // Power lost halfway through the next record.
+        flash.bytes[cursor.write_sector * Hal::Flash::SECTOR_SIZE + cursor.write.offset] = 0x22;
+
+        LogCursor remounted{};
+        ReadingLog remounted_log{flash, remounted};
+        EXPECT_EQ(remounted_log.pending(), 10u);
+        ASSERT_TRUE(remounted_log.append(make_readings(1, 1'800'000'000)));
+        std::array<Reading, 16> chunk;
+        LogPosition next;
+        ASSERT_EQ(remounted_log.read(chunk, next), 11u);
+        EXPECT_EQ(chunk[10].timestamp_s, 1'800'000'000);
+}
+
+TEST(MqttTest, Topics)
+{
+        std::array<char, Mqtt::TOPIC_SIZE> buffer;
+        Payload::Writer state_writer{buffer};
+        EXPECT_EQ(Mqtt::append_state_topic(state_writer, BATTERY_ENTITY_ID).view(), "batterymonitor/car_battery/state");
+        Payload::Writer discovery_writer{buffer};
+        EXPECT_EQ(Mqtt::append_discovery_topic(discovery_writer, BATTERY_ENTITY_ID).view(),
+                  "homeassistant/sensor/car_battery/config");
+        EXPECT_EQ(Mqtt::qos_for(BATTERY_ENTITY_ID), 1);
+        EXPECT_EQ(Mqtt::qos_for(WAKE_TRACE_ENTITY_ID), 0);
+}
+
+TEST(MqttTest, DiscoveryConfigsFit)
+{
+        std::array<char, Mqtt::DISCOVERY_CONFIG_SIZE> buffer;
+        for (auto const &entity : Mqtt::DISCOVERY_ENTITIES) {
+                Payload::Writer writer{buffer};
+                EXPECT_TRUE(Mqtt::append_discovery_config(writer, entity).view()) << entity.entity_id;
+        }
+
+        Payload::Writer writer{buffer};
+        auto const config = Mqtt::append_discovery_config(writer, Mqtt::DISCOVERY_ENTITIES[3]).view();
+        EXPECT_EQ(config, R"({"name":"Battery Monitor Wakes","object_id":"battery_monitor_wakes",)"
+                          R"("unique_id":"batterymonitor_battery_monitor_wakes",)"
+                          R"("state_topic":"batterymonitor/battery_monitor_wakes/state",)"
+                          R"("value_template":"{{ value_json.state }}",)"
+                          R"("json_attributes_topic":"batterymonitor/battery_monitor_wakes/state",)"
+                          R"("json_attributes_template":"{{ value_json.attributes | tojson }}",)"
+                          R"("device":{"identifiers":["batterymonitor"],"name":"Battery Monitor"}})");
+        EXPECT_EQ(Mqtt::discovery_hash(), Mqtt::discovery_hash());
+        EXPECT_NE(Mqtt::discovery_hash(), 0u);
+}
+
+// A device that has just powered on, with fakes behind its platform.
+class WakeCycleTest : public ::testing::Test
+{
+      protected:
+        FakeAdc adc;
+        FakeClock clock;
+        FakeNetwork network;
+        FakeUploader uploader;
+        FakeSleeper sleeper;
+        FakeFlash flash;
+        Hal::Platform platform{adc, clock, network, uploader, sleeper, flash};
+        WakeState state{};
+};
+
+TEST_F(WakeCycleTest, BuffersUntilReportThenUploads)
+{
+        auto decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_EQ(decision->reason, ReportReason::PowerOn);
+        EXPECT_EQ(decision->sleep_interval, WAKE_CONFIG.sleep_policy.base_interval);
+        EXPECT_EQ(adc.read_count, 1);
+        ASSERT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+        // Battery, temperature, RSSI, wake count, charge and wake trace, all on one connection.
+        ASSERT_EQ(uploader.posted.size(), 6);
+        EXPECT_EQ(uploader.posted[0].first, BATTERY_ENTITY_ID);
+        EXPECT_EQ(uploader.posted[0].second, R"({"state":"12.600","attributes":{"friendly_name":"Car Battery Voltage",)"
+                                             R"("unit_of_measurement":"Volts","readings":[[0,12.600]],)"
+                                             R"("report_reason":"power_on"}})");
+        EXPECT_EQ(uploader.posted[1].second, R"({"state":"25.00","attributes":{"friendly_name":)"
+                                             R"("Battery Monitor Temperature","unit_of_measurement":"°C",)"
+                                             R"("device_class":"temperature"}})");
+        EXPECT_EQ(uploader.posted[2].first, "sensor.battery_monitor_rssi");
+        EXPECT_TRUE(uploader.posted[2].second.starts_with(R"({"state":"-61",)"));
+        EXPECT_TRUE(uploader.posted[3].second.starts_with(R"({"state":"1",)"));
+        EXPECT_EQ(uploader.posted[4].first, CHARGE_ENTITY_ID);
+        EXPECT_TRUE(uploader.posted[4].second.starts_with(R"({"state":"88",)")) << uploader.posted[4].second;
+        EXPECT_TRUE(state.last_report.valid);
+        EXPECT_TRUE(state.readings.empty());
+        // The session is closed once every entity is posted, and its counters are kept for the next report.
+        EXPECT_EQ(uploader.close_count, 1);
+        EXPECT_EQ(state.last_upload_stats.posts, 6u);
+        EXPECT_EQ(state.last_upload_stats.bytes_sent, uploader.upload_stats.bytes_sent);
+
+        // An unchanged reading is only buffered.
+        clock.seconds += 60;
+        decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_EQ(decision->reason, ReportReason::None);
+        EXPECT_EQ(state.readings.size(), 1);
+
+        // A failed upload keeps the buffer for the next attempt.
+        clock.seconds += 60;
+        adc.battery_pin_millivolts = 2'470;
+        decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_EQ(decision->reason, ReportReason::Delta);
+        network.is_up = false;
+        EXPECT_FALSE(upload(state, WAKE_CONFIG, platform, *decision));
+        EXPECT_EQ(state.readings.size(), 2);
+        EXPECT_EQ(state.last_report.millivolts, 12'600);
+}
+
+TEST_F(WakeCycleTest, FullBatchFitsThePayloadBuffers)
+{
+        for (std::size_t i = 0; i < READING_RING_CAPACITY; ++i) {
+                state.readings.push({std::numeric_limits<int32_t>::min(), 65'535});
+        }
+        std::array<char, BATCH_PAYLOAD_SIZE> batch_buffer;
+        EXPECT_TRUE(encode_batch_state(batch_buffer, state, ReportReason::AlertCrossed, 0));
+        state.last_upload_stats = {UINT32_MAX, UINT32_MAX, UINT32_MAX, INT64_MAX, INT64_MAX, UINT32_MAX, INT64_MAX};
+        state.last_memory = {UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX};
+        std::array<char, WAKE_TRACE_PAYLOAD_SIZE> wake_trace_buffer;
+        EXPECT_TRUE(encode_wake_trace_state(wake_trace_buffer, state, WAKE_CONFIG));
+}
+
+TEST_F(WakeCycleTest, OfflineReadingsAreLoggedThenBackfilled)
+{
+        // Offline with a full buffer: the buffer moves to flash instead of losing its oldest reading.
+        network.is_up = false;
+        for (std::size_t i = 0; i + 1 < READING_RING_CAPACITY; ++i) {
+                state.readings.push({clock.seconds, 12'600});
+                clock.seconds += 60;
+        }
+        auto decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_NE(decision->reason, ReportReason::None);
+        EXPECT_FALSE(upload(state, WAKE_CONFIG, platform, *decision));
+        EXPECT_TRUE(state.readings.empty());
+        EXPECT_EQ(state.log.pending, READING_RING_CAPACITY);
+
+        // Back online: the logged readings go out as one event after the battery state.
+        network.is_up = true;
+        clock.seconds += 60;
+        decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        ASSERT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+        ASSERT_EQ(uploader.events.size(), 1u);
+        EXPECT_EQ(uploader.events[0].first, BACKFILL_EVENT_TYPE);
+        // Ages, like the battery state's readings.
+        EXPECT_TRUE(uploader.events[0].second.starts_with(R"({"entity_id":"sensor.car_battery","readings":[[)" +
+                                                          std::to_string(clock.seconds - 1'000) + ",12.600],[" +
+                                                          std::to_string(clock.seconds - 1'060) + ",12.600],"));
+        EXPECT_EQ(state.log.pending, 0u);
+}
+
+TEST_F(WakeCycleTest, ReadingsLoggedBeforePowerOnAreNotBackfilled)
+{
+        network.is_up = false;
+        auto const log_offline_readings = [&](int64_t const interval_s) {
+                for (std::size_t i = 0; i + 1 < READING_RING_CAPACITY; ++i) {
+                        state.readings.push({clock.seconds, 12'600});
+                        clock.seconds += interval_s;
+                }
+                auto const decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+                ASSERT_TRUE(decision);
+                EXPECT_FALSE(upload(state, WAKE_CONFIG, platform, *decision));
+        };
+
+        // Nothing sets the clock, so it starts at 0 on every power-on.
+        clock.seconds = 0;
+        log_offline_readings(600);
+        ASSERT_EQ(state.log.pending, READING_RING_CAPACITY);
+        state = WakeState{};
+        clock.seconds = 0;
+        log_offline_readings(60);
+        EXPECT_EQ(state.log.pending, 2 * READING_RING_CAPACITY);
+
+        // Only this power-on's readings go out. The others would have ages from the wrong clock.
+        network.is_up = true;
+        clock.seconds += 60;
+        auto const decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        ASSERT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+        ASSERT_EQ(uploader.events.size(), 1u);
+        auto const &body = uploader.events[0].second;
+        EXPECT_TRUE(body.starts_with(R"({"entity_id":"sensor.car_battery","readings":[[)" +
+                                     std::to_string(clock.seconds) + ",12.600],"));
+        EXPECT_EQ(std::ranges::count(body, '['), 1 + READING_RING_CAPACITY);
+        EXPECT_EQ(body.find("[-"), std::string::npos);
+        EXPECT_EQ(state.log.pending, 0u);
+        EXPECT_EQ(state.log.dropped, READING_RING_CAPACITY);
+}
+
+TEST_F(WakeCycleTest, RepeatedNetworkFailuresSkipTheRadio)
+{
+        // 3 failed wakes, then 1 skipped, then 1 more failed and 2 skipped.
+        network.is_up = false;
+        for (int wake = 0; wake < 7; ++wake) {
+                clock.seconds += 60;
+                auto const decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+                ASSERT_TRUE(decision);
+                EXPECT_FALSE(upload(state, WAKE_CONFIG, platform, *decision));
+        }
+        EXPECT_EQ(network.connect_count, 4);
+        EXPECT_EQ(state.connect.consecutive_failures, 4);
+        EXPECT_EQ(state.readings.size(), 7);
+
+        // Once the skips run out, a successful connection clears the history.
+        network.is_up = true;
+        clock.seconds += 60;
+        auto const decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+        EXPECT_EQ(network.connect_count, 5);
+        EXPECT_EQ(state.connect.consecutive_failures, 0);
+        EXPECT_TRUE(state.readings.empty());
+}
+
+TEST_F(WakeCycleTest, CaptureIsReported)
+{
+        // Power-on has no previous reading to compare with.
+        auto decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_FALSE(capture_event(WAKE_CONFIG, adc, *decision, false));
+        ASSERT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+
+        // An unchanged reading is still reported when the external trigger woke the device.
+        clock.seconds += 60;
+        uploader.posted.clear();
+        decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_EQ(decision->reason, ReportReason::None);
+        ASSERT_TRUE(capture_event(WAKE_CONFIG, adc, *decision, true));
+        EXPECT_EQ(adc.capture_count, 1);
+        EXPECT_EQ(decision->reason, ReportReason::Capture);
+        ASSERT_TRUE(decision->capture);
+        EXPECT_EQ(decision->capture->trigger, Capture::Trigger::External);
+        EXPECT_EQ(decision->capture->resting_millivolts, 12'600);
+        ASSERT_TRUE(upload(state, WAKE_CONFIG, platform, *decision));
+        auto const capture = std::find_if(uploader.posted.begin(), uploader.posted.end(),
+                                          [](auto const &post) { return post.first == CAPTURE_ENTITY_ID; });
+        ASSERT_NE(capture, uploader.posted.end());
+        EXPECT_TRUE(capture->second.starts_with(R"({"state":"9.503",)")) << capture->second;
+        EXPECT_NE(capture->second.find(R"("trigger":"external")"), std::string::npos);
+        EXPECT_NE(capture->second.find(R"("dip_ms":500)"), std::string::npos);
+
+        // A step since the last reading triggers on its own.
+        clock.seconds += 60;
+        adc.battery_pin_millivolts = 2'400;
+        decision = sample_and_decide(state, WAKE_CONFIG, adc, clock);
+        ASSERT_TRUE(decision);
+        EXPECT_EQ(decision->capture_trigger, Capture::Trigger::Drop);
+        EXPECT_TRUE(capture_event(WAKE_CONFIG, adc, *decision, false));
+}
+
+TEST_F(WakeCycleTest, FailedReadSkipsTheWake)
+{
+        adc.is_working = false;
+        EXPECT_FALSE(sample_and_decide(state, WAKE_CONFIG, adc, clock));
+        EXPECT_TRUE(state.readings.empty());
+}
+
+#ifndef PROJECTIO_NATIVE
+
 void init_gtest()
 {
         ::testing::InitGoogleTest();
@@ -39,22 +1388,43 @@ int app_main(int argc, char **argv)
                 esphalib::api::set_long_lived_access_token(Secrets::LONG_LIVED_ACCESS_TOKEN.data());
         }
 
-        // Setup WiFi
+        // Setup WiFi, timing both steps for the benchmarks.
+        Benchmarks::print_header();
         {
                 // Init non-volatile storage.
                 {
-                        auto const is_nvs_init_success = Nvs::init_nvs();
+                        auto is_nvs_init_success = false;
+                        std::array<Benchmarks::Sample, 1> nvs_init{
+                            Benchmarks::measure_once([&] { is_nvs_init_success = Nvs::init_nvs(); })};
+                        Benchmarks::print("nvs_init", nvs_init);
                         // Don't continue if NVS init failed because Wi-Fi won't work either
                         EXPECT_TRUE(is_nvs_init_success);
                 }
-                Wifi::wifi_init_station();
+                std::array<Benchmarks::Sample, 1> wifi_connect{Benchmarks::measure_once([] {
+                        Wifi::wifi_init_station();
+                        Wifi::connect_within(WAKE_CONFIG.connect_policy, std::chrono::seconds{30});
+                })};
+                Benchmarks::print("wifi_connect", wifi_connect);
         }
 
         init_gtest();
+        Benchmarks::run_target_benchmarks(Benchmarks::DEFAULT_RUNS);
         // Always return zero-code and allow PlatformIO to parse results.
         return 0;
 }
 }
 
+#endif
+
 } // namespace Testing
 } // namespace BatteryMonitor
+
+#ifdef PROJECTIO_NATIVE
+
+int main(int argc, char **argv)
+{
+        ::testing::InitGoogleTest(&argc, argv);
+        return RUN_ALL_TESTS();
+}
+
+#endif